@@ -0,0 +1,2 @@
+\set day random(0, :history_versions)
+SELECT count(*) FROM bench_history__as_of(timestamp with time zone '2020-01-01' - :day * interval '1 day');
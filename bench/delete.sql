@@ -0,0 +1,6 @@
+-- The row is put back in the same transaction to keep the table the same size
+\set id random(1, :scale)
+BEGIN;
+DELETE FROM :table WHERE id = :id;
+INSERT INTO :table (id, val) VALUES (:id, :id) ON CONFLICT (id) DO NOTHING;
+END;
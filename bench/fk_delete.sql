@@ -0,0 +1,7 @@
+-- Delete one of the parents that are not referenced, and put it back
+\set id random(:scale + 1, 2 * :scale)
+BEGIN;
+DELETE FROM bench_parent WHERE id = :id;
+INSERT INTO bench_parent (id, valid_from, valid_to) VALUES (:id, '2000-01-01', '2001-01-01')
+ON CONFLICT DO NOTHING;
+END;
@@ -0,0 +1,4 @@
+\set parent_id random(1, :scale)
+\set month random(1, 11)
+INSERT INTO bench_child (parent_id, valid_from, valid_to)
+VALUES (:parent_id, make_date(2000, :month, 1), make_date(2000, :month + 1, 1));
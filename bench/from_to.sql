@@ -0,0 +1,3 @@
+\set day random(0, :history_versions)
+SELECT count(*) FROM bench_history__from_to(timestamp with time zone '2020-01-01' - (:day + 7) * interval '1 day',
+                                            timestamp with time zone '2020-01-01' - :day * interval '1 day');
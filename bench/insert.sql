@@ -0,0 +1,2 @@
+\set val random(1, 1000000)
+INSERT INTO :table (val) VALUES (:val);
@@ -0,0 +1,118 @@
+#!/bin/sh
+#
+# Driver for "make bench".
+#
+# Loads bench/setup.sql into a database of its own and runs every workload
+# below with pgbench for each number of clients, appending one JSON object
+# per run to $BENCH_OUTPUT so that runs on different commits can be
+# compared.  The server is taken from the usual libpq environment variables.
+#
+# BENCH_DB          database to (re)create the tables in (periods_bench)
+# BENCH_SCALE       rows in each table (10000)
+# BENCH_HISTORY     past versions of each row of bench_history (100)
+# BENCH_CLIENTS     numbers of clients to run each workload with ("1 8 32")
+# BENCH_TIME        seconds to run each workload for (30)
+# BENCH_WORKLOADS   names of the workloads to run (all of them)
+# BENCH_OUTPUT      file to append the results to (bench/results.jsonl)
+# PSQL, PGBENCH     the programs to use
+
+set -e
+
+dir=$(cd "$(dirname "$0")" && pwd)
+
+BENCH_DB=${BENCH_DB:-periods_bench}
+BENCH_SCALE=${BENCH_SCALE:-10000}
+BENCH_HISTORY=${BENCH_HISTORY:-100}
+BENCH_CLIENTS=${BENCH_CLIENTS:-1 8 32}
+BENCH_TIME=${BENCH_TIME:-30}
+BENCH_OUTPUT=${BENCH_OUTPUT:-$dir/results.jsonl}
+PSQL=${PSQL:-psql}
+PGBENCH=${PGBENCH:-pgbench}
+
+# name, script and table (if the script takes one) of every workload
+workloads="
+insert_plain           insert.sql          bench_plain
+insert_system_time     insert.sql          bench_system_time
+insert_versioned       insert.sql          bench_versioned
+update_plain           update.sql          bench_plain
+update_system_time     update.sql          bench_system_time
+update_versioned       update.sql          bench_versioned
+delete_plain           delete.sql          bench_plain
+delete_system_time     delete.sql          bench_system_time
+delete_versioned       delete.sql          bench_versioned
+update_excluded        update_excluded.sql -
+update_portion         update_portion.sql  -
+fk_insert              fk_insert.sql       -
+fk_delete              fk_delete.sql       -
+as_of                  as_of.sql           -
+between                between.sql         -
+from_to                from_to.sql         -
+"
+
+commit=$(git -C "$dir" rev-parse HEAD 2>/dev/null || echo unknown)
+started=$(date -u +%Y-%m-%dT%H:%M:%SZ)
+
+if [ -z "$("$PSQL" -X -d postgres -tAc "SELECT 1 FROM pg_database WHERE datname = '$BENCH_DB'")" ]; then
+	"$PSQL" -X -q -d postgres -c "CREATE DATABASE \"$BENCH_DB\""
+fi
+server_version=$("$PSQL" -X -d "$BENCH_DB" -tAc "SHOW server_version_num")
+
+echo "loading $BENCH_SCALE rows with $BENCH_HISTORY past versions into $BENCH_DB"
+"$PSQL" -X -q -d "$BENCH_DB" -v scale="$BENCH_SCALE" -v history_versions="$BENCH_HISTORY" \
+	-f "$dir/setup.sql" >/dev/null
+
+logdir=$(mktemp -d)
+trap 'rm -rf "$logdir"' EXIT
+
+echo "$workloads" | while read -r name script table; do
+	[ -n "$name" ] || continue
+	if [ -n "$BENCH_WORKLOADS" ]; then
+		case " $BENCH_WORKLOADS " in
+			*" $name "*) ;;
+			*) continue ;;
+		esac
+	fi
+
+	for clients in $BENCH_CLIENTS; do
+		"$PSQL" -X -q -d "$BENCH_DB" -c "VACUUM ANALYZE" >/dev/null
+		rm -f "$logdir"/pgbench_log.*
+
+		# pgbench writes its per-transaction log in the current directory
+		out=$(cd "$logdir" && "$PGBENCH" -n -l -P 5 -T "$BENCH_TIME" -c "$clients" -j "$clients" \
+				-D scale="$BENCH_SCALE" -D history_versions="$BENCH_HISTORY" -D table="$table" \
+				-f "$dir/$script" "$BENCH_DB" 2>"$logdir/stderr") || {
+			cat "$logdir/stderr" >&2
+			exit 1
+		}
+
+		transactions=$(echo "$out" | sed -n 's/^number of transactions actually processed: \([0-9]*\).*/\1/p')
+		failed=$(echo "$out" | sed -n 's/^number of failed transactions: \([0-9]*\).*/\1/p')
+		latency_avg=$(echo "$out" | sed -n 's/^latency average = \([0-9.]*\) ms.*/\1/p')
+		latency_stddev=$(echo "$out" | sed -n 's/^latency stddev = \([0-9.]*\) ms.*/\1/p')
+		tps=$(echo "$out" | sed -n 's/^tps = \([0-9.]*\).*/\1/p' | tail -n 1)
+
+		# The third field of the log is the latency in microseconds
+		percentiles=$(cat "$logdir"/pgbench_log.* | awk '{ print $3 }' | sort -n | awk '
+			{ v[NR] = $1 }
+			END {
+				if (NR == 0) { print "null null null"; exit }
+				split("0.50 0.95 0.99", q, " ")
+				for (i = 1; i <= 3; i++) {
+					n = int(q[i] * NR + 0.5); if (n < 1) n = 1
+					printf "%.3f ", v[n] / 1000
+				}
+				print ""
+			}')
+		set -- $percentiles
+
+		printf '{"commit": "%s", "started": "%s", "server_version_num": %s, "workload": "%s", "clients": %s, "duration": %s, "scale": %s, "history_versions": %s, "transactions": %s, "failed": %s, "tps": %s, "latency_avg_ms": %s, "latency_stddev_ms": %s, "latency_p50_ms": %s, "latency_p95_ms": %s, "latency_p99_ms": %s}\n' \
+			"$commit" "$started" "$server_version" "$name" "$clients" "$BENCH_TIME" \
+			"$BENCH_SCALE" "$BENCH_HISTORY" "${transactions:-null}" "${failed:-0}" "${tps:-null}" \
+			"${latency_avg:-null}" "${latency_stddev:-null}" "$1" "$2" "$3" >>"$BENCH_OUTPUT"
+
+		printf '%-20s %3s clients %12s tps %10s ms avg %10s ms p99\n' \
+			"$name" "$clients" "${tps:-?}" "${latency_avg:-?}" "$3"
+	done
+done
+
+echo "results appended to $BENCH_OUTPUT"
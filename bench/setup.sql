@@ -0,0 +1,78 @@
+/*
+ * Tables for the benchmarks run by "make bench".
+ *
+ * This is run by bench/run.sh in a database of its own with the variables
+ * "scale" (the number of rows in each table) and "history_versions" (the
+ * number of past versions of each row of bench_history).
+ */
+\set ON_ERROR_STOP on
+SET client_min_messages TO warning;
+
+DROP EXTENSION IF EXISTS periods CASCADE;
+DROP TABLE IF EXISTS bench_plain, bench_system_time, bench_versioned,
+                     bench_portion, bench_child, bench_parent,
+                     bench_history, bench_history_history CASCADE;
+CREATE EXTENSION periods CASCADE;
+
+/* The same table without a period, with SYSTEM_TIME, and with SYSTEM VERSIONING */
+CREATE TABLE bench_plain (id bigserial PRIMARY KEY, val integer NOT NULL, hits integer NOT NULL DEFAULT 0);
+CREATE TABLE bench_system_time (id bigserial PRIMARY KEY, val integer NOT NULL, hits integer NOT NULL DEFAULT 0);
+CREATE TABLE bench_versioned (id bigserial PRIMARY KEY, val integer NOT NULL, hits integer NOT NULL DEFAULT 0);
+SELECT periods.add_system_time_period('bench_system_time');
+SELECT periods.add_system_time_period('bench_versioned', excluded_column_names => ARRAY['hits']);
+SELECT periods.add_system_versioning('bench_versioned', index_strategy => 'btree');
+
+INSERT INTO bench_plain (id, val) SELECT g, g FROM generate_series(1, :scale) AS g;
+INSERT INTO bench_system_time (id, val) SELECT g, g FROM generate_series(1, :scale) AS g;
+INSERT INTO bench_versioned (id, val) SELECT g, g FROM generate_series(1, :scale) AS g;
+SELECT setval(pg_get_serial_sequence(t, 'id'), :scale)
+FROM unnest(ARRAY['bench_plain', 'bench_system_time', 'bench_versioned']) AS t;
+
+/* A FOR PORTION OF view on a year long period */
+CREATE TABLE bench_portion (id bigint, valid_from date, valid_to date, val integer NOT NULL,
+                            PRIMARY KEY (id, valid_from));
+SELECT periods.add_period('bench_portion', 'validity', 'valid_from', 'valid_to');
+SELECT periods.add_for_portion_view('bench_portion', 'validity');
+INSERT INTO bench_portion (id, valid_from, valid_to, val)
+SELECT g, '2000-01-01', '2001-01-01', g FROM generate_series(1, :scale) AS g;
+
+/*
+ * A temporal foreign key.  Only the first half of the parents are
+ * referenced, the other half can be deleted.
+ */
+CREATE TABLE bench_parent (id bigint, valid_from date, valid_to date,
+                           PRIMARY KEY (id, valid_from, valid_to));
+SELECT periods.add_period('bench_parent', 'validity', 'valid_from', 'valid_to');
+SELECT periods.add_unique_key('bench_parent', ARRAY['id'], 'validity',
+                              key_name => 'bench_parent_id_validity',
+                              unique_constraint => 'bench_parent_pkey');
+CREATE TABLE bench_child (id bigserial PRIMARY KEY, parent_id bigint NOT NULL, valid_from date, valid_to date);
+CREATE INDEX ON bench_child (parent_id, valid_from, valid_to);
+SELECT periods.add_period('bench_child', 'validity', 'valid_from', 'valid_to');
+SELECT periods.add_foreign_key('bench_child', ARRAY['parent_id'], 'validity', 'bench_parent_id_validity');
+INSERT INTO bench_parent (id, valid_from, valid_to)
+SELECT g, '2000-01-01', '2001-01-01' FROM generate_series(1, 2 * :scale) AS g;
+INSERT INTO bench_child (parent_id, valid_from, valid_to)
+SELECT g, '2000-02-01', '2000-12-01' FROM generate_series(1, :scale) AS g;
+
+/*
+ * A large synthetic history, one version per day going back from
+ * 2020-01-01.  The SYSTEM_TIME columns and the history table are filled
+ * before the period is added so that they can be given past values.
+ */
+CREATE TABLE bench_history (id bigint PRIMARY KEY, val integer NOT NULL,
+                            system_time_start timestamp with time zone NOT NULL,
+                            system_time_end timestamp with time zone NOT NULL);
+CREATE TABLE bench_history_history (LIKE bench_history);
+INSERT INTO bench_history (id, val, system_time_start, system_time_end)
+SELECT g, g, '2020-01-01', 'infinity' FROM generate_series(1, :scale) AS g;
+INSERT INTO bench_history_history (id, val, system_time_start, system_time_end)
+SELECT g, v,
+       timestamp with time zone '2020-01-01' - (v + 1) * interval '1 day',
+       timestamp with time zone '2020-01-01' - v * interval '1 day'
+FROM generate_series(1, :scale) AS g,
+     generate_series(0, :history_versions - 1) AS v;
+SELECT periods.add_system_time_period('bench_history');
+SELECT periods.add_system_versioning('bench_history', index_strategy => 'btree');
+
+VACUUM ANALYZE;
@@ -0,0 +1,3 @@
+\set id random(1, :scale)
+\set val random(1, 1000000)
+UPDATE :table SET val = :val WHERE id = :id;
@@ -0,0 +1,3 @@
+-- Only an excluded column changes, so no history is written
+\set id random(1, :scale)
+UPDATE bench_versioned SET hits = hits + 1 WHERE id = :id;
@@ -0,0 +1,11 @@
+-- Update one month of the row's year, splitting it the first time
+\set id random(1, :scale)
+\set month random(1, 12)
+\set val random(1, 1000000)
+UPDATE bench_portion__for_portion_of_validity
+SET val = :val,
+    valid_from = make_date(2000, :month, 1),
+    valid_to = (make_date(2000, :month, 1) + interval '1 month')::date
+WHERE id = :id
+  AND valid_from < (make_date(2000, :month, 1) + interval '1 month')::date
+  AND valid_to > make_date(2000, :month, 1);
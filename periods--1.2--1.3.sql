@@ -0,0 +1,3904 @@
+/* Let the C triggers cache what they read from our catalogs */
+
+CREATE FUNCTION periods.invalidate_cache()
+ RETURNS trigger
+ LANGUAGE c
+ STRICT
+ SECURITY DEFINER
+AS 'MODULE_PATHNAME';
+
+/*
+ * The C triggers above cache what they read from these catalogs, so they need
+ * to be told when anything changes.
+ */
+CREATE TRIGGER invalidate_cache AFTER INSERT OR UPDATE OR DELETE ON periods.periods
+    FOR EACH ROW EXECUTE PROCEDURE periods.invalidate_cache();
+CREATE TRIGGER invalidate_cache AFTER INSERT OR UPDATE OR DELETE ON periods.system_time_periods
+    FOR EACH ROW EXECUTE PROCEDURE periods.invalidate_cache();
+CREATE TRIGGER invalidate_cache AFTER INSERT OR UPDATE OR DELETE ON periods.system_versioning
+    FOR EACH ROW EXECUTE PROCEDURE periods.invalidate_cache();
+CREATE TRIGGER invalidate_cache AFTER INSERT OR UPDATE OR DELETE ON periods.for_portion_views
+    FOR EACH ROW EXECUTE PROCEDURE periods.invalidate_cache();
+CREATE TRIGGER invalidate_cache AFTER INSERT OR UPDATE OR DELETE ON periods.unique_keys
+    FOR EACH ROW EXECUTE PROCEDURE periods.invalidate_cache();
+CREATE TRIGGER invalidate_cache AFTER INSERT OR UPDATE OR DELETE ON periods.foreign_keys
+    FOR EACH ROW EXECUTE PROCEDURE periods.invalidate_cache();
+
+
+/* Optionally write the history with statement level triggers */
+
+ALTER TABLE periods.system_versioning
+    ADD COLUMN history_update_trigger name,
+    ADD COLUMN history_delete_trigger name,
+    ADD CHECK ((history_update_trigger IS NULL) = (history_delete_trigger IS NULL))
+;
+
+CREATE FUNCTION periods.write_history_statement()
+ RETURNS trigger
+ LANGUAGE c
+ STRICT
+ SECURITY DEFINER
+AS 'MODULE_PATHNAME';
+
+/* This is needed here for add_system_versioning(), see the indexes section below */
+CREATE TYPE periods.history_index_strategy AS ENUM ('gist', 'brin', 'btree');
+
+DROP FUNCTION periods.add_system_versioning(regclass,name,name,name,name,name,name);
+CREATE FUNCTION periods.add_system_versioning(
+    table_class regclass,
+    history_table_name name DEFAULT NULL,
+    view_name name DEFAULT NULL,
+    function_as_of_name name DEFAULT NULL,
+    function_between_name name DEFAULT NULL,
+    function_between_symmetric_name name DEFAULT NULL,
+    function_from_to_name name DEFAULT NULL,
+    statement_level boolean DEFAULT false,
+    partition_interval interval DEFAULT NULL,
+    partition_premake integer DEFAULT 4,
+    index_strategy periods.history_index_strategy DEFAULT NULL,
+    function_as_of_series_name name DEFAULT NULL)
+ RETURNS void
+ LANGUAGE plpgsql
+ SECURITY DEFINER
+AS
+$function$
+#variable_conflict use_variable
+DECLARE
+    schema_name name;
+    table_name name;
+    table_owner regrole;
+    persistence "char";
+    kind "char";
+    period_row periods.periods;
+    history_table_id oid;
+    sql text;
+    grantees text;
+    history_update_trigger name;
+    history_delete_trigger name;
+    index_name name;
+    key_columns text;
+BEGIN
+    IF table_class IS NULL THEN
+        RAISE EXCEPTION 'no table name specified';
+    END IF;
+
+    /* Always serialize operations on our catalogs */
+    PERFORM periods._serialize(table_class);
+
+    /*
+     * REFERENCES:
+     *     SQL:2016 4.15.2.2
+     *     SQL:2016 11.3 SR 2.3
+     *     SQL:2016 11.3 GR 1.c
+     *     SQL:2016 11.29
+     */
+
+    /* Already registered? SQL:2016 11.29 SR 5 */
+    IF EXISTS (SELECT FROM periods.system_versioning AS r WHERE r.table_name = table_class) THEN
+        RAISE EXCEPTION 'table already has SYSTEM VERSIONING';
+    END IF;
+
+    /* Transition tables are needed for writing the history per statement */
+    IF statement_level AND pg_catalog.current_setting('server_version_num')::integer < 100000 THEN
+        RAISE EXCEPTION 'statement level history requires PostgreSQL 10 or later';
+    END IF;
+
+    /* Partitioned history tables need default partitions */
+    IF partition_interval IS NOT NULL THEN
+        IF pg_catalog.current_setting('server_version_num')::integer < 110000 THEN
+            RAISE EXCEPTION 'partitioned history tables require PostgreSQL 11 or later';
+        END IF;
+
+        IF partition_interval <= interval '0' THEN
+            RAISE EXCEPTION 'partition interval must be greater than zero';
+        END IF;
+
+        IF partition_premake IS NULL OR partition_premake < 0 THEN
+            RAISE EXCEPTION 'number of partitions to make ahead cannot be negative';
+        END IF;
+    END IF;
+
+    /* Must be a regular persistent base table. SQL:2016 11.29 SR 2 */
+
+    SELECT n.nspname, c.relname, c.relowner, c.relpersistence, c.relkind
+    INTO schema_name, table_name, table_owner, persistence, kind
+    FROM pg_catalog.pg_class AS c
+    JOIN pg_catalog.pg_namespace AS n ON n.oid = c.relnamespace
+    WHERE c.oid = table_class;
+
+    IF kind <> 'r' THEN
+        /*
+         * The main reason partitioned tables aren't supported yet is simply
+         * because I haven't put any thought into it.
+         * Maybe it's trivial, maybe not.
+         */
+        IF kind = 'p' THEN
+            RAISE EXCEPTION 'partitioned tables are not supported yet';
+        END IF;
+
+        RAISE EXCEPTION 'relation % is not a table', $1;
+    END IF;
+
+    IF persistence <> 'p' THEN
+        /*
+         * We could probably accept unlogged tables if the history table is
+         * also unlogged, but what's the point?
+         */
+        RAISE EXCEPTION 'table "%" must be persistent', table_class;
+    END IF;
+
+    /* We need a SYSTEM_TIME period. SQL:2016 11.29 SR 4 */
+    SELECT p.*
+    INTO period_row
+    FROM periods.periods AS p
+    WHERE (p.table_name, p.period_name) = (table_class, 'system_time');
+
+    IF NOT FOUND THEN
+        RAISE EXCEPTION 'no period for SYSTEM_TIME found for table %', table_class;
+    END IF;
+
+    /* The functions compare the range of the period with their arguments */
+    IF index_strategy = 'gist' AND period_row.range_type <> 'tstzrange'::regtype THEN
+        RAISE EXCEPTION 'index strategy "gist" requires a period for SYSTEM_TIME of type timestamp with time zone';
+    END IF;
+
+    /* Get all of our "fake" infrastructure ready */
+    history_table_name := coalesce(history_table_name, periods._choose_name(ARRAY[table_name], 'history'));
+    view_name := coalesce(view_name, periods._choose_name(ARRAY[table_name], 'with_history'));
+    function_as_of_name := coalesce(function_as_of_name, periods._choose_name(ARRAY[table_name], '_as_of'));
+    function_between_name := coalesce(function_between_name, periods._choose_name(ARRAY[table_name], '_between'));
+    function_between_symmetric_name := coalesce(function_between_symmetric_name, periods._choose_name(ARRAY[table_name], '_between_symmetric'));
+    function_from_to_name := coalesce(function_from_to_name, periods._choose_name(ARRAY[table_name], '_from_to'));
+    function_as_of_series_name := coalesce(function_as_of_series_name, periods._choose_name(ARRAY[table_name], '_as_of_series'));
+
+    /*
+     * Create the history table.  If it already exists we check that all the
+     * columns match but otherwise we trust the user.  Perhaps the history
+     * table was disconnected in order to change the schema (a case which is
+     * not defined by the SQL standard).  Or perhaps the user wanted to
+     * partition the history table.
+     *
+     * There shouldn't be any concurrency issues here because our main catalog
+     * is locked.
+     */
+    SELECT c.oid
+    INTO history_table_id
+    FROM pg_catalog.pg_class AS c
+    JOIN pg_catalog.pg_namespace AS n ON n.oid = c.relnamespace
+    WHERE (n.nspname, c.relname) = (schema_name, history_table_name);
+
+    IF FOUND THEN
+        /* Don't allow any periods on the history table (this might be relaxed later) */
+        IF EXISTS (SELECT FROM periods.periods AS p WHERE p.table_name = history_table_id) THEN
+            RAISE EXCEPTION 'history tables for SYSTEM VERSIONING cannot have periods';
+        END IF;
+
+        /*
+         * The query to the attributes is harder than one would think because
+         * we need to account for dropped columns.  Basically what we're
+         * looking for is that all columns have the same name, type, and
+         * collation.
+         */
+        IF EXISTS (
+            WITH
+            L (attname, atttypid, atttypmod, attcollation) AS (
+                SELECT a.attname, a.atttypid, a.atttypmod, a.attcollation
+                FROM pg_catalog.pg_attribute AS a
+                WHERE a.attrelid = table_class
+                  AND NOT a.attisdropped
+            ),
+            R (attname, atttypid, atttypmod, attcollation) AS (
+                SELECT a.attname, a.atttypid, a.atttypmod, a.attcollation
+                FROM pg_catalog.pg_attribute AS a
+                WHERE a.attrelid = history_table_id
+                  AND NOT a.attisdropped
+            )
+            SELECT FROM L NATURAL FULL JOIN R
+            WHERE L.attname IS NULL OR R.attname IS NULL)
+        THEN
+            RAISE EXCEPTION 'base table "%" and history table "%" are not compatible',
+                table_class, history_table_id::regclass;
+        END IF;
+
+        /* Make sure the owner is correct */
+        EXECUTE format('ALTER TABLE %s OWNER TO %I', history_table_id::regclass, table_owner);
+
+        /*
+         * Remove all privileges other than SELECT from everyone on the history
+         * table.  We do this without error because some privileges may have
+         * been added in order to do maintenance while we were disconnected.
+         *
+         * We start by doing the table owner because that will make sure we
+         * don't have NULL in pg_class.relacl.
+         */
+        --EXECUTE format('REVOKE INSERT, UPDATE, DELETE, TRUNCATE, REFERENCES, TRIGGER ON TABLE %s FROM %I',
+            --history_table_id::regclass, table_owner);
+
+        /* We can only maintain the partitions of an already partitioned table */
+        IF partition_interval IS NOT NULL AND NOT EXISTS (
+            SELECT FROM pg_catalog.pg_class AS c
+            WHERE c.oid = history_table_id
+              AND c.relkind = 'p')
+        THEN
+            RAISE EXCEPTION 'history table "%" is not partitioned', history_table_id::regclass;
+        END IF;
+    ELSE
+        IF partition_interval IS NULL THEN
+            EXECUTE format('CREATE TABLE %1$I.%2$I (LIKE %1$I.%3$I)', schema_name, history_table_name, table_name);
+        ELSE
+            /*
+             * Rows are archived with the end of their period set to when they
+             * were archived, so partitioning on it means that old partitions
+             * are never written to again, and that queries for a point in the
+             * past can skip the partitions that ended before it.
+             */
+            EXECUTE format('CREATE TABLE %1$I.%2$I (LIKE %1$I.%3$I) PARTITION BY RANGE (%4$I)',
+                schema_name, history_table_name, table_name, period_row.end_column_name);
+            EXECUTE format('CREATE TABLE %1$I.%2$I PARTITION OF %1$I.%3$I DEFAULT',
+                schema_name, periods._choose_name(ARRAY[history_table_name], 'default'), history_table_name);
+        END IF;
+        history_table_id := format('%I.%I', schema_name, history_table_name)::regclass;
+
+        EXECUTE format('ALTER TABLE %1$I.%2$I OWNER TO %3$I', schema_name, history_table_name, table_owner);
+
+        IF index_strategy IS NULL THEN
+            RAISE NOTICE 'history table "%" created for "%", be sure to index it properly',
+                history_table_id::regclass, table_class;
+        END IF;
+    END IF;
+
+    /*
+     * Index the history table for the functions below, if asked.  They all
+     * look for the rows that were current at some point or during some
+     * interval, usually along with a given primary key:
+     *
+     *     gist:   (primary key, range of SYSTEM_TIME), which the functions
+     *             then also compare with their arguments
+     *     brin:   (end of SYSTEM_TIME), the order in which rows are archived
+     *     btree:  (primary key, end of SYSTEM_TIME)
+     *
+     * An index with the name we would give it is assumed to be ours, left
+     * over from when SYSTEM VERSIONING was dropped.
+     */
+    IF index_strategy IS NOT NULL THEN
+        index_name := periods._choose_name(ARRAY[history_table_name], format('%s_idx', index_strategy));
+
+        SELECT string_agg(quote_ident(a.attname), ', ' ORDER BY u.ordinality)
+        INTO key_columns
+        FROM pg_catalog.pg_constraint AS c
+        CROSS JOIN LATERAL unnest(c.conkey) WITH ORDINALITY AS u (attnum, ordinality)
+        JOIN pg_catalog.pg_attribute AS a ON (a.attrelid, a.attnum) = (c.conrelid, u.attnum)
+        WHERE c.conrelid = table_class
+          AND c.contype = 'p'
+          AND a.attname NOT IN (period_row.start_column_name, period_row.end_column_name);
+
+        IF NOT EXISTS (
+            SELECT FROM pg_catalog.pg_index AS i
+            JOIN pg_catalog.pg_class AS c ON c.oid = i.indexrelid
+            WHERE i.indrelid = history_table_id
+              AND c.relname = index_name)
+        THEN
+            EXECUTE format('CREATE INDEX %I ON %s USING %s (%s)',
+                index_name, history_table_id::regclass, index_strategy,
+                CASE index_strategy
+                    WHEN 'gist' THEN concat_ws(', ', key_columns,
+                        format('tstzrange(%I, %I)', period_row.start_column_name, period_row.end_column_name))
+                    WHEN 'brin' THEN quote_ident(period_row.end_column_name)
+                    WHEN 'btree' THEN concat_ws(', ', key_columns, quote_ident(period_row.end_column_name))
+                END);
+        END IF;
+    END IF;
+
+    /* Create the "with history" view.  This one we do want to error out on if it exists. */
+    EXECUTE format(
+        /*
+         * The query we really want here is
+         *
+         *     CREATE VIEW view_name AS
+         *         TABLE table_name
+         *         UNION ALL CORRESPONDING
+         *         TABLE history_table_name
+         *
+         * but PostgreSQL doesn't support that syntax (yet), so we have to do
+         * it manually.
+         */
+        'CREATE VIEW %1$I.%2$I AS SELECT %5$s FROM %1$I.%3$I UNION ALL SELECT %5$s FROM %1$I.%4$I',
+        schema_name, view_name, table_name, history_table_name,
+        (SELECT string_agg(quote_ident(a.attname), ', ' ORDER BY a.attnum)
+         FROM pg_attribute AS a
+         WHERE a.attrelid = table_class
+           AND a.attnum > 0
+           AND NOT a.attisdropped
+        ));
+    EXECUTE format('ALTER VIEW %1$I.%2$I OWNER TO %3$I', schema_name, view_name, table_owner);
+
+    /*
+     * Create functions to simulate the system versioned grammar.  These must
+     * be inlinable for any kind of performance.
+     */
+    EXECUTE format(
+        $$
+        CREATE FUNCTION %1$I.%2$I(timestamp with time zone)
+         RETURNS SETOF %1$I.%3$I
+         LANGUAGE sql
+         STABLE
+        AS 'SELECT * FROM %1$I.%3$I WHERE %4$I <= $1 AND %5$I > $1%6$s'
+        $$, schema_name, function_as_of_name, view_name, period_row.start_column_name, period_row.end_column_name,
+        CASE WHEN index_strategy = 'gist' THEN
+            format(' AND tstzrange(%I, %I) @> $1', period_row.start_column_name, period_row.end_column_name)
+        ELSE '' END);
+    EXECUTE format('ALTER FUNCTION %1$I.%2$I(timestamp with time zone) OWNER TO %3$I',
+        schema_name, function_as_of_name, table_owner);
+
+    EXECUTE format(
+        $$
+        CREATE FUNCTION %1$I.%2$I(timestamp with time zone, timestamp with time zone)
+         RETURNS SETOF %1$I.%3$I
+         LANGUAGE sql
+         STABLE
+        AS 'SELECT * FROM %1$I.%3$I WHERE $1 <= $2 AND %5$I > $1 AND %4$I <= $2%6$s'
+        $$, schema_name, function_between_name, view_name, period_row.start_column_name, period_row.end_column_name,
+        CASE WHEN index_strategy = 'gist' THEN
+            format(' AND tstzrange(%I, %I) && tstzrange(least($1, $2), greatest($1, $2), ''''[]'''')',
+                period_row.start_column_name, period_row.end_column_name)
+        ELSE '' END);
+    EXECUTE format('ALTER FUNCTION %1$I.%2$I(timestamp with time zone, timestamp with time zone) OWNER TO %3$I',
+        schema_name, function_between_name, table_owner);
+
+    EXECUTE format(
+        $$
+        CREATE FUNCTION %1$I.%2$I(timestamp with time zone, timestamp with time zone)
+         RETURNS SETOF %1$I.%3$I
+         LANGUAGE sql
+         STABLE
+        AS 'SELECT * FROM %1$I.%3$I WHERE %5$I > least($1, $2) AND %4$I <= greatest($1, $2)%6$s'
+        $$, schema_name, function_between_symmetric_name, view_name, period_row.start_column_name, period_row.end_column_name,
+        CASE WHEN index_strategy = 'gist' THEN
+            format(' AND tstzrange(%I, %I) && tstzrange(least($1, $2), greatest($1, $2), ''''[]'''')',
+                period_row.start_column_name, period_row.end_column_name)
+        ELSE '' END);
+    EXECUTE format('ALTER FUNCTION %1$I.%2$I(timestamp with time zone, timestamp with time zone) OWNER TO %3$I',
+        schema_name, function_between_symmetric_name, table_owner);
+
+    EXECUTE format(
+        $$
+        CREATE FUNCTION %1$I.%2$I(timestamp with time zone, timestamp with time zone)
+         RETURNS SETOF %1$I.%3$I
+         LANGUAGE sql
+         STABLE
+        AS 'SELECT * FROM %1$I.%3$I WHERE $1 < $2 AND %5$I > $1 AND %4$I < $2%6$s'
+        $$, schema_name, function_from_to_name, view_name, period_row.start_column_name, period_row.end_column_name,
+        CASE WHEN index_strategy = 'gist' THEN
+            format(' AND tstzrange(%I, %I) && tstzrange(least($1, $2), greatest($1, $2), ''''[)'''')',
+                period_row.start_column_name, period_row.end_column_name)
+        ELSE '' END);
+    EXECUTE format('ALTER FUNCTION %1$I.%2$I(timestamp with time zone, timestamp with time zone) OWNER TO %3$I',
+        schema_name, function_from_to_name, table_owner);
+
+    /*
+     * The function for a series of times reads every version once and finds
+     * the times it covers among them with a binary search, which is what
+     * width_bucket() does on a sorted array.  The times at the bounds of the
+     * slice it gives still need to be checked.
+     */
+    EXECUTE format(
+        $$
+        CREATE FUNCTION %1$I.%2$I(timestamp with time zone[])
+         RETURNS TABLE (instant timestamp with time zone, version %1$I.%3$I)
+         LANGUAGE sql
+         STABLE
+        AS 'SELECT u.instant, v FROM (SELECT array_agg(DISTINCT i ORDER BY i) FROM unnest($1) AS i WHERE i IS NOT NULL) AS s (instants) CROSS JOIN %1$I.%3$I AS v CROSS JOIN LATERAL unnest(s.instants[width_bucket(v.%4$I::timestamp with time zone, s.instants):width_bucket(v.%5$I::timestamp with time zone, s.instants)]) AS u (instant) WHERE v.%4$I <= u.instant AND v.%5$I > u.instant'
+        $$, schema_name, function_as_of_series_name, view_name,
+        period_row.start_column_name, period_row.end_column_name);
+    EXECUTE format('ALTER FUNCTION %1$I.%2$I(timestamp with time zone[]) OWNER TO %3$I',
+        schema_name, function_as_of_series_name, table_owner);
+
+    /* Set privileges on history objects */
+    FOR sql IN
+        SELECT format('REVOKE ALL ON %s %s FROM %s',
+                      CASE object_type
+                          WHEN 'r' THEN 'TABLE'
+                          WHEN 'p' THEN 'TABLE'
+                          WHEN 'v' THEN 'TABLE'
+                          WHEN 'f' THEN 'FUNCTION'
+                      ELSE 'ERROR'
+                      END,
+                      string_agg(DISTINCT object_name, ', '),
+                      string_agg(DISTINCT quote_ident(COALESCE(a.rolname, 'public')), ', '))
+        FROM (
+            SELECT c.relkind AS object_type,
+                   c.oid::regclass::text AS object_name,
+                   acl.grantee AS grantee
+            FROM pg_class AS c
+            JOIN pg_namespace AS n ON n.oid = c.relnamespace
+            CROSS JOIN LATERAL aclexplode(COALESCE(c.relacl, acldefault('r', c.relowner))) AS acl
+            WHERE n.nspname = schema_name
+              AND c.relname IN (history_table_name, view_name)
+
+            UNION ALL
+
+            SELECT 'f',
+                   p.oid::regprocedure::text,
+                   acl.grantee
+            FROM pg_proc AS p
+            CROSS JOIN LATERAL aclexplode(COALESCE(p.proacl, acldefault('f', p.proowner))) AS acl
+            WHERE p.oid = ANY (ARRAY[
+                    format('%I.%I(timestamp with time zone)', schema_name, function_as_of_name)::regprocedure,
+                    format('%I.%I(timestamp with time zone,timestamp with time zone)', schema_name, function_between_name)::regprocedure,
+                    format('%I.%I(timestamp with time zone,timestamp with time zone)', schema_name, function_between_symmetric_name)::regprocedure,
+                    format('%I.%I(timestamp with time zone,timestamp with time zone)', schema_name, function_from_to_name)::regprocedure,
+                    format('%I.%I(timestamp with time zone[])', schema_name, function_as_of_series_name)::regprocedure
+                ])
+        ) AS objects
+        LEFT JOIN pg_authid AS a ON a.oid = objects.grantee
+        GROUP BY objects.object_type
+    LOOP
+        EXECUTE sql;
+    END LOOP;
+
+    FOR grantees IN
+        SELECT string_agg(acl.grantee::regrole::text, ', ')
+        FROM pg_class AS c
+        CROSS JOIN LATERAL aclexplode(COALESCE(c.relacl, acldefault('r', c.relowner))) AS acl
+        WHERE c.oid = table_class
+          AND acl.privilege_type = 'SELECT'
+    LOOP
+        EXECUTE format('GRANT SELECT ON TABLE %1$I.%2$I, %1$I.%3$I TO %4$s',
+                       schema_name, history_table_name, view_name, grantees);
+        EXECUTE format('GRANT EXECUTE ON FUNCTION %s, %s, %s, %s, %s TO %s',
+                       format('%I.%I(timestamp with time zone)', schema_name, function_as_of_name)::regprocedure,
+                       format('%I.%I(timestamp with time zone,timestamp with time zone)', schema_name, function_between_name)::regprocedure,
+                       format('%I.%I(timestamp with time zone,timestamp with time zone)', schema_name, function_between_symmetric_name)::regprocedure,
+                       format('%I.%I(timestamp with time zone,timestamp with time zone)', schema_name, function_from_to_name)::regprocedure,
+                       format('%I.%I(timestamp with time zone[])', schema_name, function_as_of_series_name)::regprocedure,
+                       grantees);
+    END LOOP;
+
+    /*
+     * Write the history once per statement instead of once per row, if asked.
+     * This needs transition tables, and PostgreSQL doesn't allow them on a
+     * trigger for more than one event so we need two.
+     */
+    IF statement_level THEN
+        history_update_trigger := periods._choose_name(ARRAY[table_name], 'system_time_write_history_update');
+        EXECUTE format('CREATE TRIGGER %I AFTER UPDATE ON %s REFERENCING OLD TABLE AS old_table NEW TABLE AS new_table FOR EACH STATEMENT EXECUTE PROCEDURE periods.write_history_statement()', history_update_trigger, table_class);
+        history_delete_trigger := periods._choose_name(ARRAY[table_name], 'system_time_write_history_delete');
+        EXECUTE format('CREATE TRIGGER %I AFTER DELETE ON %s REFERENCING OLD TABLE AS old_table FOR EACH STATEMENT EXECUTE PROCEDURE periods.write_history_statement()', history_delete_trigger, table_class);
+    END IF;
+
+    /* Register it */
+    INSERT INTO periods.system_versioning (table_name, period_name, history_table_name, view_name,
+                                           func_as_of, func_between, func_between_symmetric, func_from_to,
+                                           history_update_trigger, history_delete_trigger, func_as_of_series)
+    VALUES (
+        table_class,
+        'system_time',
+        format('%I.%I', schema_name, history_table_name),
+        format('%I.%I', schema_name, view_name),
+        format('%I.%I(timestamp with time zone)', schema_name, function_as_of_name),
+        format('%I.%I(timestamp with time zone,timestamp with time zone)', schema_name, function_between_name),
+        format('%I.%I(timestamp with time zone,timestamp with time zone)', schema_name, function_between_symmetric_name),
+        format('%I.%I(timestamp with time zone,timestamp with time zone)', schema_name, function_from_to_name),
+        history_update_trigger,
+        history_delete_trigger,
+        format('%I.%I(timestamp with time zone[])', schema_name, function_as_of_series_name)
+    );
+
+    IF index_strategy IS NOT NULL THEN
+        INSERT INTO periods.history_indexes (table_name, index_strategy, index_name)
+        VALUES (table_class, index_strategy, format('%I.%I', schema_name, index_name));
+    END IF;
+
+    /*
+     * Register the partitioning of the history table and make its first
+     * partitions.  An existing partitioned table is continued from the end of
+     * its last partition.
+     */
+    IF partition_interval IS NOT NULL THEN
+        INSERT INTO periods.history_partitioning (table_name, partition_interval, premake, partitioned_until)
+        VALUES (
+            table_class,
+            partition_interval,
+            partition_premake,
+            coalesce(
+                (SELECT max(substring(pg_catalog.pg_get_expr(c.relpartbound, c.oid) FROM 'TO \(''(.*)''\)$')::timestamp with time zone)
+                 FROM pg_catalog.pg_inherits AS i
+                 JOIN pg_catalog.pg_class AS c ON c.oid = i.inhrelid
+                 WHERE i.inhparent = history_table_id),
+                pg_catalog.date_trunc(
+                    CASE WHEN partition_interval >= interval '1 month' THEN 'month'
+                         WHEN partition_interval >= interval '1 day' THEN 'day'
+                         WHEN partition_interval >= interval '1 hour' THEN 'hour'
+                         ELSE 'minute'
+                    END,
+                    now())));
+
+        PERFORM periods.maintain_history_partitions(table_class);
+    END IF;
+END;
+$function$;
+
+CREATE OR REPLACE FUNCTION periods.drop_system_versioning(table_name regclass, drop_behavior periods.drop_behavior DEFAULT 'RESTRICT', purge boolean DEFAULT false)
+ RETURNS boolean
+ LANGUAGE plpgsql
+ SECURITY DEFINER
+AS $function$
+#variable_conflict use_variable
+DECLARE
+    system_versioning_row periods.system_versioning;
+    is_dropped boolean;
+BEGIN
+    IF table_name IS NULL THEN
+        RAISE EXCEPTION 'no table name specified';
+    END IF;
+
+    /* Always serialize operations on our catalogs */
+    PERFORM periods._serialize(table_name);
+
+    /*
+     * REFERENCES:
+     *     SQL:2016 4.15.2.2
+     *     SQL:2016 11.3 SR 2.3
+     *     SQL:2016 11.3 GR 1.c
+     *     SQL:2016 11.30
+     */
+
+    /*
+     * We need to delete our row first so that the DROP protection doesn't
+     * block us.
+     */
+    DELETE FROM periods.system_versioning AS sv
+    WHERE sv.table_name = table_name
+    RETURNING * INTO system_versioning_row;
+
+    IF NOT FOUND THEN
+        RAISE NOTICE 'table % does not have SYSTEM VERSIONING', table_name;
+        RETURN false;
+    END IF;
+
+    /*
+     * Has the table been dropped?  If so, everything else is also dropped
+     * except for the history table.
+     */
+    is_dropped := NOT EXISTS (SELECT FROM pg_catalog.pg_class AS c WHERE c.oid = table_name);
+
+    IF NOT is_dropped THEN
+        /* Drop the functions. */
+        EXECUTE format('DROP FUNCTION %s %s', system_versioning_row.func_as_of::regprocedure, drop_behavior);
+        EXECUTE format('DROP FUNCTION %s %s', system_versioning_row.func_between::regprocedure, drop_behavior);
+        EXECUTE format('DROP FUNCTION %s %s', system_versioning_row.func_between_symmetric::regprocedure, drop_behavior);
+        EXECUTE format('DROP FUNCTION %s %s', system_versioning_row.func_from_to::regprocedure, drop_behavior);
+        IF system_versioning_row.func_as_of_series IS NOT NULL THEN
+            EXECUTE format('DROP FUNCTION %s %s', system_versioning_row.func_as_of_series::regprocedure, drop_behavior);
+        END IF;
+
+        /* Drop the "with_history" view. */
+        EXECUTE format('DROP VIEW %s %s', system_versioning_row.view_name, drop_behavior);
+
+        /* Drop the statement level history triggers, if any. */
+        IF system_versioning_row.history_update_trigger IS NOT NULL THEN
+            EXECUTE format('DROP TRIGGER %I ON %s', system_versioning_row.history_update_trigger, table_name);
+            EXECUTE format('DROP TRIGGER %I ON %s', system_versioning_row.history_delete_trigger, table_name);
+        END IF;
+    END IF;
+
+    /*
+     * SQL:2016 11.30 GR 2 says "Every row of T that corresponds to a
+     * historical system row is effectively deleted at the end of the SQL-
+     * statement." but we leave the history table intact in case the user
+     * merely wants to make some DDL changes and hook things back up again.
+     *
+     * The purge parameter tells us that the user really wants to get rid of it
+     * all.
+     */
+    IF NOT is_dropped AND purge THEN
+        PERFORM periods.drop_period(table_name, 'system_time', drop_behavior, purge);
+        EXECUTE format('DROP TABLE %s %s', system_versioning_row.history_table_name, drop_behavior);
+    END IF;
+
+    RETURN true;
+END;
+$function$;
+
+CREATE OR REPLACE FUNCTION periods.drop_protection()
+ RETURNS event_trigger
+ LANGUAGE plpgsql
+ SECURITY DEFINER
+AS
+$function$
+#variable_conflict use_variable
+DECLARE
+    r record;
+    table_name regclass;
+    period_name name;
+BEGIN
+    /* Most drops have nothing to do with us */
+    IF NOT periods._dropped_objects_touch_periods() THEN
+        RETURN;
+    END IF;
+
+    /*
+     * This function is called after the fact, so we have to just look to see
+     * if anything is missing in the catalogs if we just store the name and not
+     * a reg* type.
+     */
+
+    ---
+    --- periods
+    ---
+
+    /* If one of our tables is being dropped, remove references to it */
+    FOR table_name, period_name IN
+        SELECT p.table_name, p.period_name
+        FROM periods.periods AS p
+        JOIN pg_catalog.pg_event_trigger_dropped_objects() WITH ORDINALITY AS dobj
+                ON dobj.objid = p.table_name
+        WHERE dobj.object_type = 'table'
+        ORDER BY dobj.ordinality
+    LOOP
+        PERFORM periods.drop_period(table_name, period_name, 'CASCADE', true);
+    END LOOP;
+
+    /*
+     * If a column belonging to one of our periods is dropped, we need to reject that.
+     * SQL:2016 11.23 SR 6
+     */
+    FOR r IN
+        SELECT dobj.object_identity, p.period_name
+        FROM periods.periods AS p
+        JOIN pg_catalog.pg_attribute AS sa ON (sa.attrelid, sa.attname) = (p.table_name, p.start_column_name)
+        JOIN pg_catalog.pg_attribute AS ea ON (ea.attrelid, ea.attname) = (p.table_name, p.end_column_name)
+        JOIN pg_catalog.pg_event_trigger_dropped_objects() WITH ORDINALITY AS dobj
+                ON dobj.objid = p.table_name AND dobj.objsubid IN (sa.attnum, ea.attnum)
+        WHERE dobj.object_type = 'table column'
+        ORDER BY dobj.ordinality
+    LOOP
+        RAISE EXCEPTION 'cannot drop column "%" because it is part of the period "%"',
+            r.object_identity, r.period_name;
+    END LOOP;
+
+    /* Also reject dropping the rangetype */
+    FOR r IN
+        SELECT dobj.object_identity, p.table_name, p.period_name
+        FROM periods.periods AS p
+        JOIN pg_catalog.pg_event_trigger_dropped_objects() WITH ORDINALITY AS dobj
+                ON dobj.objid = p.range_type
+        ORDER BY dobj.ordinality
+    LOOP
+        RAISE EXCEPTION 'cannot drop rangetype "%" because it is used in period "%" on table "%"',
+            r.object_identity, r.period_name, r.table_name;
+    END LOOP;
+
+    ---
+    --- system_time_periods
+    ---
+
+    /* Complain if the infinity CHECK constraint is missing. */
+    FOR r IN
+        SELECT p.table_name, p.infinity_check_constraint
+        FROM periods.system_time_periods AS p
+        WHERE NOT EXISTS (
+            SELECT FROM pg_catalog.pg_constraint AS c
+            WHERE (c.conrelid, c.conname) = (p.table_name, p.infinity_check_constraint))
+    LOOP
+        RAISE EXCEPTION 'cannot drop constraint "%" on table "%" because it is used in SYSTEM_TIME period',
+            r.infinity_check_constraint, r.table_name;
+    END LOOP;
+
+    /* Complain if the GENERATED ALWAYS AS ROW START/END trigger is missing. */
+    FOR r IN
+        SELECT p.table_name, p.generated_always_trigger
+        FROM periods.system_time_periods AS p
+        WHERE NOT EXISTS (
+            SELECT FROM pg_catalog.pg_trigger AS t
+            WHERE (t.tgrelid, t.tgname) = (p.table_name, p.generated_always_trigger))
+    LOOP
+        RAISE EXCEPTION 'cannot drop trigger "%" on table "%" because it is used in SYSTEM_TIME period',
+            r.generated_always_trigger, r.table_name;
+    END LOOP;
+
+    /* Complain if the write_history trigger is missing. */
+    FOR r IN
+        SELECT p.table_name, p.write_history_trigger
+        FROM periods.system_time_periods AS p
+        WHERE NOT EXISTS (
+            SELECT FROM pg_catalog.pg_trigger AS t
+            WHERE (t.tgrelid, t.tgname) = (p.table_name, p.write_history_trigger))
+    LOOP
+        RAISE EXCEPTION 'cannot drop trigger "%" on table "%" because it is used in SYSTEM_TIME period',
+            r.write_history_trigger, r.table_name;
+    END LOOP;
+
+    /* Complain if the TRUNCATE trigger is missing. */
+    FOR r IN
+        SELECT p.table_name, p.truncate_trigger
+        FROM periods.system_time_periods AS p
+        WHERE NOT EXISTS (
+            SELECT FROM pg_catalog.pg_trigger AS t
+            WHERE (t.tgrelid, t.tgname) = (p.table_name, p.truncate_trigger))
+    LOOP
+        RAISE EXCEPTION 'cannot drop trigger "%" on table "%" because it is used in SYSTEM_TIME period',
+            r.truncate_trigger, r.table_name;
+    END LOOP;
+
+    /*
+     * We can't reliably find out what a column was renamed to, so just error
+     * out in this case.
+     */
+    FOR r IN
+        SELECT stp.table_name, u.column_name
+        FROM periods.system_time_periods AS stp
+        CROSS JOIN LATERAL unnest(stp.excluded_column_names) AS u (column_name)
+        WHERE NOT EXISTS (
+            SELECT FROM pg_catalog.pg_attribute AS a
+            WHERE (a.attrelid, a.attname) = (stp.table_name, u.column_name))
+    LOOP
+        RAISE EXCEPTION 'cannot drop or rename column "%" on table "%" because it is excluded from SYSTEM VERSIONING',
+            r.column_name, r.table_name;
+    END LOOP;
+
+    ---
+    --- for_portion_views
+    ---
+
+    /* Reject dropping the FOR PORTION OF view. */
+    FOR r IN
+        SELECT dobj.object_identity
+        FROM periods.for_portion_views AS fpv
+        JOIN pg_catalog.pg_event_trigger_dropped_objects() WITH ORDINALITY AS dobj
+                ON dobj.objid = fpv.view_name
+        WHERE dobj.object_type = 'view'
+        ORDER BY dobj.ordinality
+    LOOP
+        RAISE EXCEPTION 'cannot drop view "%", call "periods.drop_for_portion_view()" instead',
+            r.object_identity;
+    END LOOP;
+
+    /* Complain if the FOR PORTION OF trigger is missing. */
+    FOR r IN
+        SELECT fpv.table_name, fpv.period_name, fpv.view_name, fpv.trigger_name
+        FROM periods.for_portion_views AS fpv
+        WHERE NOT EXISTS (
+            SELECT FROM pg_catalog.pg_trigger AS t
+            WHERE (t.tgrelid, t.tgname) = (fpv.view_name, fpv.trigger_name))
+    LOOP
+        RAISE EXCEPTION 'cannot drop trigger "%" on view "%" because it is used in FOR PORTION OF view for period "%" on table "%"',
+            r.trigger_name, r.view_name, r.period_name, r.table_name;
+    END LOOP;
+
+    /* Complain if the table's primary key has been dropped. */
+    FOR r IN
+        SELECT fpv.table_name, fpv.period_name
+        FROM periods.for_portion_views AS fpv
+        WHERE NOT EXISTS (
+            SELECT FROM pg_catalog.pg_constraint AS c
+            WHERE (c.conrelid, c.contype) = (fpv.table_name, 'p'))
+    LOOP
+        RAISE EXCEPTION 'cannot drop primary key on table "%" because it has a FOR PORTION OF view for period "%"',
+            r.table_name, r.period_name;
+    END LOOP;
+
+    ---
+    --- unique_keys
+    ---
+
+    /*
+     * We don't need to protect the individual columns as long as we protect
+     * the indexes.  PostgreSQL will make sure they stick around.
+     */
+
+    /* Complain if the indexes implementing our unique indexes are missing. */
+    FOR r IN
+        SELECT uk.key_name, uk.table_name, uk.unique_constraint
+        FROM periods.unique_keys AS uk
+        WHERE NOT EXISTS (
+            SELECT FROM pg_catalog.pg_constraint AS c
+            WHERE (c.conrelid, c.conname) = (uk.table_name, uk.unique_constraint))
+    LOOP
+        RAISE EXCEPTION 'cannot drop constraint "%" on table "%" because it is used in period unique key "%"',
+            r.unique_constraint, r.table_name, r.key_name;
+    END LOOP;
+
+    FOR r IN
+        SELECT uk.key_name, uk.table_name, uk.exclude_constraint
+        FROM periods.unique_keys AS uk
+        WHERE NOT EXISTS (
+            SELECT FROM pg_catalog.pg_constraint AS c
+            WHERE (c.conrelid, c.conname) = (uk.table_name, uk.exclude_constraint))
+    LOOP
+        RAISE EXCEPTION 'cannot drop constraint "%" on table "%" because it is used in period unique key "%"',
+            r.exclude_constraint, r.table_name, r.key_name;
+    END LOOP;
+
+    ---
+    --- foreign_keys
+    ---
+
+    /* Complain if any of the triggers are missing */
+    FOR r IN
+        SELECT fk.key_name, fk.table_name, fk.fk_insert_trigger
+        FROM periods.foreign_keys AS fk
+        WHERE NOT EXISTS (
+            SELECT FROM pg_catalog.pg_trigger AS t
+            WHERE (t.tgrelid, t.tgname) = (fk.table_name, fk.fk_insert_trigger))
+    LOOP
+        RAISE EXCEPTION 'cannot drop trigger "%" on table "%" because it is used in period foreign key "%"',
+            r.fk_insert_trigger, r.table_name, r.key_name;
+    END LOOP;
+
+    FOR r IN
+        SELECT fk.key_name, fk.table_name, fk.fk_update_trigger
+        FROM periods.foreign_keys AS fk
+        WHERE NOT EXISTS (
+            SELECT FROM pg_catalog.pg_trigger AS t
+            WHERE (t.tgrelid, t.tgname) = (fk.table_name, fk.fk_update_trigger))
+    LOOP
+        RAISE EXCEPTION 'cannot drop trigger "%" on table "%" because it is used in period foreign key "%"',
+            r.fk_update_trigger, r.table_name, r.key_name;
+    END LOOP;
+
+    FOR r IN
+        SELECT fk.key_name, uk.table_name, fk.uk_update_trigger
+        FROM periods.foreign_keys AS fk
+        JOIN periods.unique_keys AS uk ON uk.key_name = fk.unique_key
+        WHERE NOT EXISTS (
+            SELECT FROM pg_catalog.pg_trigger AS t
+            WHERE (t.tgrelid, t.tgname) = (uk.table_name, fk.uk_update_trigger))
+    LOOP
+        RAISE EXCEPTION 'cannot drop trigger "%" on table "%" because it is used in period foreign key "%"',
+            r.uk_update_trigger, r.table_name, r.key_name;
+    END LOOP;
+
+    FOR r IN
+        SELECT fk.key_name, uk.table_name, fk.uk_delete_trigger
+        FROM periods.foreign_keys AS fk
+        JOIN periods.unique_keys AS uk ON uk.key_name = fk.unique_key
+        WHERE NOT EXISTS (
+            SELECT FROM pg_catalog.pg_trigger AS t
+            WHERE (t.tgrelid, t.tgname) = (uk.table_name, fk.uk_delete_trigger))
+    LOOP
+        RAISE EXCEPTION 'cannot drop trigger "%" on table "%" because it is used in period foreign key "%"',
+            r.uk_delete_trigger, r.table_name, r.key_name;
+    END LOOP;
+
+    ---
+    --- system_versioning
+    ---
+
+    FOR r IN
+        SELECT dobj.object_identity, sv.table_name
+        FROM periods.system_versioning AS sv
+        JOIN pg_catalog.pg_event_trigger_dropped_objects() WITH ORDINALITY AS dobj
+                ON dobj.objid = sv.history_table_name
+        WHERE dobj.object_type = 'table'
+        ORDER BY dobj.ordinality
+    LOOP
+        RAISE EXCEPTION 'cannot drop table "%" because it is used in SYSTEM VERSIONING for table "%"',
+            r.object_identity, r.table_name;
+    END LOOP;
+
+    FOR r IN
+        SELECT dobj.object_identity, sv.table_name
+        FROM periods.system_versioning AS sv
+        JOIN pg_catalog.pg_event_trigger_dropped_objects() WITH ORDINALITY AS dobj
+                ON dobj.objid = sv.view_name
+        WHERE dobj.object_type = 'view'
+        ORDER BY dobj.ordinality
+    LOOP
+        RAISE EXCEPTION 'cannot drop view "%" because it is used in SYSTEM VERSIONING for table "%"',
+            r.object_identity, r.table_name;
+    END LOOP;
+
+    FOR r IN
+        SELECT dobj.object_identity, sv.table_name
+        FROM periods.system_versioning AS sv
+        JOIN pg_catalog.pg_event_trigger_dropped_objects() WITH ORDINALITY AS dobj
+                ON dobj.object_identity = ANY (ARRAY[sv.func_as_of, sv.func_between, sv.func_between_symmetric, sv.func_from_to, sv.func_as_of_series])
+        WHERE dobj.object_type = 'function'
+        ORDER BY dobj.ordinality
+    LOOP
+        RAISE EXCEPTION 'cannot drop function "%" because it is used in SYSTEM VERSIONING for table "%"',
+            r.object_identity, r.table_name;
+    END LOOP;
+
+    /* Complain if a statement level history trigger is missing. */
+    FOR r IN
+        SELECT sv.table_name, tg.trigger_name
+        FROM periods.system_versioning AS sv
+        CROSS JOIN LATERAL (VALUES (sv.history_update_trigger), (sv.history_delete_trigger)) AS tg (trigger_name)
+        WHERE tg.trigger_name IS NOT NULL
+          AND NOT EXISTS (
+            SELECT FROM pg_catalog.pg_trigger AS t
+            WHERE (t.tgrelid, t.tgname) = (sv.table_name, tg.trigger_name))
+    LOOP
+        RAISE EXCEPTION 'cannot drop trigger "%" on table "%" because it is used in SYSTEM VERSIONING',
+            r.trigger_name, r.table_name;
+    END LOOP;
+
+    /* Complain if an index we made on a history table is dropped. */
+    FOR r IN
+        SELECT dobj.object_identity, hi.table_name
+        FROM periods.history_indexes AS hi
+        JOIN pg_catalog.pg_event_trigger_dropped_objects() WITH ORDINALITY AS dobj
+                ON dobj.objid = hi.index_name
+        WHERE dobj.object_type = 'index'
+        ORDER BY dobj.ordinality
+    LOOP
+        RAISE EXCEPTION 'cannot drop index "%" because it is used in SYSTEM VERSIONING for table "%"',
+            r.object_identity, r.table_name;
+    END LOOP;
+END;
+$function$;
+
+CREATE OR REPLACE FUNCTION periods.rename_following()
+ RETURNS event_trigger
+ LANGUAGE plpgsql
+ SECURITY DEFINER
+AS
+$function$
+#variable_conflict use_variable
+DECLARE
+    r record;
+    sql text;
+BEGIN
+    /* Most commands have nothing to do with us */
+    IF NOT periods._ddl_commands_touch_periods() THEN
+        RETURN;
+    END IF;
+
+    /*
+     * Anything that is stored by reg* type will auto-adjust, but anything we
+     * store by name will need to be updated after a rename. One way to do this
+     * is to recreate the constraints we have and pull new names out that way.
+     * If we are unable to do something like that, we must raise an exception.
+     */
+
+    ---
+    --- periods
+    ---
+
+    /*
+     * Start and end columns of a period can be found by the bounds check
+     * constraint.
+     */
+    FOR sql IN
+        SELECT pg_catalog.format('UPDATE periods.periods SET start_column_name = %L, end_column_name = %L WHERE (table_name, period_name) = (%L::regclass, %L)',
+            sa.attname, ea.attname, p.table_name, p.period_name)
+        FROM periods.periods AS p
+        JOIN pg_catalog.pg_constraint AS c ON (c.conrelid, c.conname) = (p.table_name, p.bounds_check_constraint)
+        JOIN pg_catalog.pg_attribute AS sa ON sa.attrelid = p.table_name
+        JOIN pg_catalog.pg_attribute AS ea ON ea.attrelid = p.table_name
+        WHERE (p.start_column_name, p.end_column_name) <> (sa.attname, ea.attname)
+          AND pg_catalog.pg_get_constraintdef(c.oid) = format('CHECK ((%I < %I))', sa.attname, ea.attname)
+    LOOP
+        EXECUTE sql;
+    END LOOP;
+
+    /*
+     * Inversely, the bounds check constraint can be retrieved via the start
+     * and end columns.
+     */
+    FOR sql IN
+        SELECT pg_catalog.format('UPDATE periods.periods SET bounds_check_constraint = %L WHERE (table_name, period_name) = (%L::regclass, %L)',
+            c.conname, p.table_name, p.period_name)
+        FROM periods.periods AS p
+        JOIN pg_catalog.pg_constraint AS c ON c.conrelid = p.table_name
+        JOIN pg_catalog.pg_attribute AS sa ON sa.attrelid = p.table_name
+        JOIN pg_catalog.pg_attribute AS ea ON ea.attrelid = p.table_name
+        WHERE p.bounds_check_constraint <> c.conname
+          AND pg_catalog.pg_get_constraintdef(c.oid) = format('CHECK ((%I < %I))', sa.attname, ea.attname)
+          AND (p.start_column_name, p.end_column_name) = (sa.attname, ea.attname)
+          AND NOT EXISTS (SELECT FROM pg_catalog.pg_constraint AS _c WHERE (_c.conrelid, _c.conname) = (p.table_name, p.bounds_check_constraint))
+    LOOP
+        EXECUTE sql;
+    END LOOP;
+
+    ---
+    --- system_time_periods
+    ---
+
+    FOR sql IN
+        SELECT pg_catalog.format('UPDATE periods.system_time_periods SET infinity_check_constraint = %L WHERE table_name = %L::regclass',
+            c.conname, p.table_name)
+        FROM periods.periods AS p
+        JOIN periods.system_time_periods AS stp ON (stp.table_name, stp.period_name) = (p.table_name, p.period_name)
+        JOIN pg_catalog.pg_constraint AS c ON c.conrelid = p.table_name
+        JOIN pg_catalog.pg_attribute AS ea ON ea.attrelid = p.table_name
+        WHERE stp.infinity_check_constraint <> c.conname
+          AND pg_catalog.pg_get_constraintdef(c.oid) = format('CHECK ((%I = ''infinity''::%s))', ea.attname, format_type(ea.atttypid, ea.atttypmod))
+          AND p.end_column_name = ea.attname
+          AND NOT EXISTS (SELECT FROM pg_catalog.pg_constraint AS _c WHERE (_c.conrelid, _c.conname) = (stp.table_name, stp.infinity_check_constraint))
+    LOOP
+        EXECUTE sql;
+    END LOOP;
+
+    FOR sql IN
+        SELECT pg_catalog.format('UPDATE periods.system_time_periods SET generated_always_trigger = %L WHERE table_name = %L::regclass',
+            t.tgname, stp.table_name)
+        FROM periods.system_time_periods AS stp
+        JOIN pg_catalog.pg_trigger AS t ON t.tgrelid = stp.table_name
+        WHERE t.tgname <> stp.generated_always_trigger
+          AND t.tgfoid = 'periods.generated_always_as_row_start_end()'::regprocedure
+          AND NOT EXISTS (SELECT FROM pg_catalog.pg_trigger AS _t WHERE (_t.tgrelid, _t.tgname) = (stp.table_name, stp.generated_always_trigger))
+    LOOP
+        EXECUTE sql;
+    END LOOP;
+
+    FOR sql IN
+        SELECT pg_catalog.format('UPDATE periods.system_time_periods SET write_history_trigger = %L WHERE table_name = %L::regclass',
+            t.tgname, stp.table_name)
+        FROM periods.system_time_periods AS stp
+        JOIN pg_catalog.pg_trigger AS t ON t.tgrelid = stp.table_name
+        WHERE t.tgname <> stp.write_history_trigger
+          AND t.tgfoid = 'periods.write_history()'::regprocedure
+          AND NOT EXISTS (SELECT FROM pg_catalog.pg_trigger AS _t WHERE (_t.tgrelid, _t.tgname) = (stp.table_name, stp.write_history_trigger))
+    LOOP
+        EXECUTE sql;
+    END LOOP;
+
+    FOR sql IN
+        SELECT pg_catalog.format('UPDATE periods.system_time_periods SET truncate_trigger = %L WHERE table_name = %L::regclass',
+            t.tgname, stp.table_name)
+        FROM periods.system_time_periods AS stp
+        JOIN pg_catalog.pg_trigger AS t ON t.tgrelid = stp.table_name
+        WHERE t.tgname <> stp.truncate_trigger
+          AND t.tgfoid = 'periods.truncate_system_versioning()'::regprocedure
+          AND NOT EXISTS (SELECT FROM pg_catalog.pg_trigger AS _t WHERE (_t.tgrelid, _t.tgname) = (stp.table_name, stp.truncate_trigger))
+    LOOP
+        EXECUTE sql;
+    END LOOP;
+
+    /*
+     * We can't reliably find out what a column was renamed to, so just error
+     * out in this case.
+     */
+    FOR r IN
+        SELECT stp.table_name, u.column_name
+        FROM periods.system_time_periods AS stp
+        CROSS JOIN LATERAL unnest(stp.excluded_column_names) AS u (column_name)
+        WHERE NOT EXISTS (
+            SELECT FROM pg_catalog.pg_attribute AS a
+            WHERE (a.attrelid, a.attname) = (stp.table_name, u.column_name))
+    LOOP
+        RAISE EXCEPTION 'cannot drop or rename column "%" on table "%" because it is excluded from SYSTEM VERSIONING',
+            r.column_name, r.table_name;
+    END LOOP;
+
+    ---
+    --- for_portion_views
+    ---
+
+    FOR sql IN
+        SELECT pg_catalog.format('UPDATE periods.for_portion_views SET trigger_name = %L WHERE (table_name, period_name) = (%L::regclass, %L)',
+            t.tgname, fpv.table_name, fpv.period_name)
+        FROM periods.for_portion_views AS fpv
+        JOIN pg_catalog.pg_trigger AS t ON t.tgrelid = fpv.view_name
+        WHERE t.tgname <> fpv.trigger_name
+          AND t.tgfoid = 'periods.update_portion_of()'::regprocedure
+          AND NOT EXISTS (SELECT FROM pg_catalog.pg_trigger AS _t WHERE (_t.tgrelid, _t.tgname) = (fpv.table_name, fpv.trigger_name))
+    LOOP
+        EXECUTE sql;
+    END LOOP;
+
+    ---
+    --- unique_keys
+    ---
+
+    FOR sql IN
+        SELECT format('UPDATE periods.unique_keys SET column_names = %L WHERE key_name = %L',
+            a.column_names, uk.key_name)
+        FROM periods.unique_keys AS uk
+        JOIN periods.periods AS p ON (p.table_name, p.period_name) = (uk.table_name, uk.period_name)
+        JOIN pg_catalog.pg_constraint AS c ON (c.conrelid, c.conname) = (uk.table_name, uk.unique_constraint)
+        JOIN LATERAL (
+            SELECT array_agg(a.attname ORDER BY u.ordinality) AS column_names
+            FROM unnest(c.conkey) WITH ORDINALITY AS u (attnum, ordinality)
+            JOIN pg_catalog.pg_attribute AS a ON (a.attrelid, a.attnum) = (uk.table_name, u.attnum)
+            WHERE a.attname NOT IN (p.start_column_name, p.end_column_name)
+            ) AS a ON true
+        WHERE uk.column_names <> a.column_names
+    LOOP
+        EXECUTE sql;
+    END LOOP;
+
+    FOR sql IN
+        SELECT format('UPDATE periods.unique_keys SET unique_constraint = %L WHERE key_name = %L',
+            c.conname, uk.key_name)
+        FROM periods.unique_keys AS uk
+        JOIN periods.periods AS p ON (p.table_name, p.period_name) = (uk.table_name, uk.period_name)
+        CROSS JOIN LATERAL unnest(uk.column_names || ARRAY[p.start_column_name, p.end_column_name]) WITH ORDINALITY AS u (column_name, ordinality)
+        JOIN pg_catalog.pg_constraint AS c ON c.conrelid = uk.table_name
+        WHERE NOT EXISTS (SELECT FROM pg_constraint AS _c WHERE (_c.conrelid, _c.conname) = (uk.table_name, uk.unique_constraint))
+        GROUP BY uk.key_name, c.oid, c.conname
+        HAVING format('UNIQUE (%s)', string_agg(quote_ident(u.column_name), ', ' ORDER BY u.ordinality)) = pg_catalog.pg_get_constraintdef(c.oid)
+    LOOP
+        EXECUTE sql;
+    END LOOP;
+
+    FOR sql IN
+        SELECT format('UPDATE periods.unique_keys SET exclude_constraint = %L WHERE key_name = %L',
+            c.conname, uk.key_name)
+        FROM periods.unique_keys AS uk
+        JOIN periods.periods AS p ON (p.table_name, p.period_name) = (uk.table_name, uk.period_name)
+        CROSS JOIN LATERAL unnest(uk.column_names) WITH ORDINALITY AS u (column_name, ordinality)
+        JOIN pg_catalog.pg_constraint AS c ON c.conrelid = uk.table_name
+        WHERE NOT EXISTS (SELECT FROM pg_catalog.pg_constraint AS _c WHERE (_c.conrelid, _c.conname) = (uk.table_name, uk.exclude_constraint))
+        GROUP BY uk.key_name, c.oid, c.conname, p.range_type, p.start_column_name, p.end_column_name
+        HAVING format('EXCLUDE USING gist (%s, %I(%I, %I, ''[)''::text) WITH &&)',
+                      string_agg(quote_ident(u.column_name) || ' WITH =', ', ' ORDER BY u.ordinality),
+                      p.range_type,
+                      p.start_column_name,
+                      p.end_column_name) = pg_catalog.pg_get_constraintdef(c.oid)
+    LOOP
+        EXECUTE sql;
+    END LOOP;
+
+    ---
+    --- foreign_keys
+    ---
+
+    /*
+     * We can't reliably find out what a column was renamed to, so just error
+     * out in this case.
+     */
+    FOR r IN
+        SELECT fk.key_name, fk.table_name, u.column_name
+        FROM periods.foreign_keys AS fk
+        CROSS JOIN LATERAL unnest(fk.column_names) AS u (column_name)
+        WHERE NOT EXISTS (
+            SELECT FROM pg_catalog.pg_attribute AS a
+            WHERE (a.attrelid, a.attname) = (fk.table_name, u.column_name))
+    LOOP
+        RAISE EXCEPTION 'cannot drop or rename column "%" on table "%" because it is used in period foreign key "%"',
+            r.column_name, r.table_name, r.key_name;
+    END LOOP;
+
+    /*
+     * Since there can be multiple foreign keys, there is no reliable way to
+     * know which trigger might belong to what, so just error out.
+     */
+    FOR r IN
+        SELECT fk.key_name, fk.table_name, fk.fk_insert_trigger AS trigger_name
+        FROM periods.foreign_keys AS fk
+        WHERE NOT EXISTS (
+            SELECT FROM pg_catalog.pg_trigger AS t
+            WHERE (t.tgrelid, t.tgname) = (fk.table_name, fk.fk_insert_trigger))
+        UNION ALL
+        SELECT fk.key_name, fk.table_name, fk.fk_update_trigger AS trigger_name
+        FROM periods.foreign_keys AS fk
+        WHERE NOT EXISTS (
+            SELECT FROM pg_catalog.pg_trigger AS t
+            WHERE (t.tgrelid, t.tgname) = (fk.table_name, fk.fk_update_trigger))
+        UNION ALL
+        SELECT fk.key_name, uk.table_name, fk.uk_update_trigger AS trigger_name
+        FROM periods.foreign_keys AS fk
+        JOIN periods.unique_keys AS uk ON uk.key_name = fk.unique_key
+        WHERE NOT EXISTS (
+            SELECT FROM pg_catalog.pg_trigger AS t
+            WHERE (t.tgrelid, t.tgname) = (uk.table_name, fk.uk_update_trigger))
+        UNION ALL
+        SELECT fk.key_name, uk.table_name, fk.uk_delete_trigger AS trigger_name
+        FROM periods.foreign_keys AS fk
+        JOIN periods.unique_keys AS uk ON uk.key_name = fk.unique_key
+        WHERE NOT EXISTS (
+            SELECT FROM pg_catalog.pg_trigger AS t
+            WHERE (t.tgrelid, t.tgname) = (uk.table_name, fk.uk_delete_trigger))
+    LOOP
+        RAISE EXCEPTION 'cannot drop or rename trigger "%" on table "%" because it is used in period foreign key "%"',
+            r.trigger_name, r.table_name, r.key_name;
+    END LOOP;
+
+    ---
+    --- system_versioning
+    ---
+
+    /* The statement level history triggers are told apart by their event */
+    FOR sql IN
+        SELECT pg_catalog.format('UPDATE periods.system_versioning SET history_update_trigger = %L WHERE table_name = %L::regclass',
+            t.tgname, sv.table_name)
+        FROM periods.system_versioning AS sv
+        JOIN pg_catalog.pg_trigger AS t ON t.tgrelid = sv.table_name
+        WHERE t.tgname <> sv.history_update_trigger
+          AND t.tgfoid = 'periods.write_history_statement()'::regprocedure
+          AND t.tgtype & 16 <> 0 /* TRIGGER_TYPE_UPDATE */
+          AND NOT EXISTS (SELECT FROM pg_catalog.pg_trigger AS _t WHERE (_t.tgrelid, _t.tgname) = (sv.table_name, sv.history_update_trigger))
+    LOOP
+        EXECUTE sql;
+    END LOOP;
+
+    FOR sql IN
+        SELECT pg_catalog.format('UPDATE periods.system_versioning SET history_delete_trigger = %L WHERE table_name = %L::regclass',
+            t.tgname, sv.table_name)
+        FROM periods.system_versioning AS sv
+        JOIN pg_catalog.pg_trigger AS t ON t.tgrelid = sv.table_name
+        WHERE t.tgname <> sv.history_delete_trigger
+          AND t.tgfoid = 'periods.write_history_statement()'::regprocedure
+          AND t.tgtype & 8 <> 0 /* TRIGGER_TYPE_DELETE */
+          AND NOT EXISTS (SELECT FROM pg_catalog.pg_trigger AS _t WHERE (_t.tgrelid, _t.tgname) = (sv.table_name, sv.history_delete_trigger))
+    LOOP
+        EXECUTE sql;
+    END LOOP;
+END;
+$function$;
+
+
+/* The FOR PORTION OF trigger is now written in C */
+
+CREATE OR REPLACE FUNCTION periods.update_portion_of()
+ RETURNS trigger
+ LANGUAGE c
+ STRICT
+AS 'MODULE_PATHNAME';
+
+
+/* The foreign key triggers are now written in C */
+
+CREATE OR REPLACE FUNCTION periods.uk_update_check()
+ RETURNS trigger
+ LANGUAGE c
+ STRICT
+AS 'MODULE_PATHNAME';
+
+CREATE OR REPLACE FUNCTION periods.uk_delete_check()
+ RETURNS trigger
+ LANGUAGE c
+ STRICT
+AS 'MODULE_PATHNAME';
+
+CREATE OR REPLACE FUNCTION periods.fk_insert_check()
+ RETURNS trigger
+ LANGUAGE c
+ STRICT
+AS 'MODULE_PATHNAME';
+
+CREATE OR REPLACE FUNCTION periods.fk_update_check()
+ RETURNS trigger
+ LANGUAGE c
+ STRICT
+AS 'MODULE_PATHNAME';
+
+
+/* Foreign keys can be checked once per statement */
+
+CREATE FUNCTION periods.fk_statement_check()
+ RETURNS trigger
+ LANGUAGE c
+ STRICT
+AS 'MODULE_PATHNAME';
+
+DROP FUNCTION periods.add_foreign_key(regclass,name[],name,name,periods.fk_match_types,periods.fk_actions,periods.fk_actions,name,name,name,name,name);
+CREATE FUNCTION periods.add_foreign_key(
+        table_name regclass,
+        column_names name[],
+        period_name name,
+        ref_unique_name name,
+        match_type periods.fk_match_types DEFAULT 'SIMPLE',
+        update_action periods.fk_actions DEFAULT 'NO ACTION',
+        delete_action periods.fk_actions DEFAULT 'NO ACTION',
+        key_name name DEFAULT NULL,
+        fk_insert_trigger name DEFAULT NULL,
+        fk_update_trigger name DEFAULT NULL,
+        uk_update_trigger name DEFAULT NULL,
+        uk_delete_trigger name DEFAULT NULL,
+        statement_level boolean DEFAULT false,
+        not_valid boolean DEFAULT false)
+ RETURNS name
+ LANGUAGE plpgsql
+ SECURITY DEFINER
+AS
+$function$
+#variable_conflict use_variable
+DECLARE
+    period_row periods.periods;
+    ref_period_row periods.periods;
+    unique_row periods.unique_keys;
+    column_attnums smallint[];
+    idx integer;
+    pass integer;
+    upd_action text DEFAULT '';
+    del_action text DEFAULT '';
+    foreign_columns text;
+    unique_columns text;
+BEGIN
+    IF table_name IS NULL THEN
+        RAISE EXCEPTION 'no table name specified';
+    END IF;
+
+    /* Always serialize operations on our catalogs */
+    PERFORM periods._serialize(table_name);
+
+    /* Get the period involved */
+    SELECT p.*
+    INTO period_row
+    FROM periods.periods AS p
+    WHERE (p.table_name, p.period_name) = (table_name, period_name);
+
+    IF NOT FOUND THEN
+        RAISE EXCEPTION 'period "%" does not exist', period_name;
+    END IF;
+
+    /* SYSTEM_TIME is not allowed in referential constraints. SQL:2016 11.8 SR 10 */
+    IF period_row.period_name = 'system_time' THEN
+        RAISE EXCEPTION 'periods for SYSTEM_TIME are not allowed in foreign keys';
+    END IF;
+
+    /*
+     * Columns belonging to a SYSTEM_TIME period are not allowed in a foreign
+     * key. SQL:2016 11.8 SR 10
+     */
+    IF EXISTS (
+        SELECT FROM periods.periods AS p
+        WHERE (p.table_name, p.period_name) = (period_row.table_name, 'system_time')
+          AND ARRAY[p.start_column_name, p.end_column_name] && column_names)
+    THEN
+        RAISE EXCEPTION 'columns in period for SYSTEM_TIME are not allowed in UNIQUE keys';
+    END IF;
+
+    /* Get column attnums from column names */
+    SELECT array_agg(a.attnum ORDER BY n.ordinality)
+    INTO column_attnums
+    FROM unnest(column_names) WITH ORDINALITY AS n (name, ordinality)
+    LEFT JOIN pg_catalog.pg_attribute AS a ON (a.attrelid, a.attname) = (table_name, n.name);
+
+    /* System columns are not allowed */
+    IF 0 > ANY (column_attnums) THEN
+        RAISE EXCEPTION 'index creation on system columns is not supported';
+    END IF;
+
+    /* Report if any columns weren't found */
+    idx := array_position(column_attnums, NULL);
+    IF idx IS NOT NULL THEN
+        RAISE EXCEPTION 'column "%" does not exist', column_names[idx];
+    END IF;
+
+    /* Make sure the period columns aren't also in the normal columns */
+    IF period_row.start_column_name = ANY (column_names) THEN
+        RAISE EXCEPTION 'column "%" specified twice', period_row.start_column_name;
+    END IF;
+    IF period_row.end_column_name = ANY (column_names) THEN
+        RAISE EXCEPTION 'column "%" specified twice', period_row.end_column_name;
+    END IF;
+
+    /* Columns can't be part of any SYSTEM_TIME period */
+    IF EXISTS (
+        SELECT FROM periods.periods AS p
+        WHERE (p.table_name, p.period_name) = (table_name, 'system_time')
+          AND ARRAY[p.start_column_name, p.end_column_name] && column_names)
+    THEN
+        RAISE EXCEPTION 'columns for SYSTEM_TIME must not be part of foreign keys';
+    END IF;
+
+    /* Get the unique key we're linking to */
+    SELECT uk.*
+    INTO unique_row
+    FROM periods.unique_keys AS uk
+    WHERE uk.key_name = ref_unique_name;
+
+    IF NOT FOUND THEN
+        RAISE EXCEPTION 'unique key "%" does not exist', ref_unique_name;
+    END IF;
+
+    /* Get the unique key's period */
+    SELECT p.*
+    INTO ref_period_row
+    FROM periods.periods AS p
+    WHERE (p.table_name, p.period_name) = (unique_row.table_name, unique_row.period_name);
+
+    IF period_row.range_type <> ref_period_row.range_type THEN
+        RAISE EXCEPTION 'period types "%" and "%" are incompatible',
+            period_row.period_name, ref_period_row.period_name;
+    END IF;
+
+    /* Check that all the columns match */
+    IF EXISTS (
+        SELECT FROM unnest(column_names, unique_row.column_names) AS u (fk_attname, uk_attname)
+        JOIN pg_catalog.pg_attribute AS fa ON (fa.attrelid, fa.attname) = (table_name, u.fk_attname)
+        JOIN pg_catalog.pg_attribute AS ua ON (ua.attrelid, ua.attname) = (unique_row.table_name, u.uk_attname)
+        WHERE (fa.atttypid, fa.atttypmod, fa.attcollation) <> (ua.atttypid, ua.atttypmod, ua.attcollation))
+    THEN
+        RAISE EXCEPTION 'column types do not match';
+    END IF;
+
+    /* The range types must match, too */
+    IF period_row.range_type <> ref_period_row.range_type THEN
+        RAISE EXCEPTION 'period types do not match';
+    END IF;
+
+    /*
+     * Generate a name for the foreign constraint.  We don't have to worry about
+     * concurrency here because all period ddl commands lock the periods table.
+     */
+    IF key_name IS NULL THEN
+        key_name := periods._choose_name(
+            ARRAY[(SELECT c.relname FROM pg_catalog.pg_class AS c WHERE c.oid = table_name)]
+               || column_names
+               || ARRAY[period_name]);
+    END IF;
+    pass := 0;
+    WHILE EXISTS (
+       SELECT FROM periods.foreign_keys AS fk
+       WHERE fk.key_name = key_name || CASE WHEN pass > 0 THEN '_' || pass::text ELSE '' END)
+    LOOP
+       pass := pass + 1;
+    END LOOP;
+    key_name := key_name || CASE WHEN pass > 0 THEN '_' || pass::text ELSE '' END;
+
+    /* See if we're deferring the constraints or not */
+    IF update_action = 'NO ACTION' THEN
+        upd_action := ' DEFERRABLE INITIALLY DEFERRED';
+    END IF;
+    IF delete_action = 'NO ACTION' THEN
+        del_action := ' DEFERRABLE INITIALLY DEFERRED';
+    END IF;
+
+    /* Get the columns that require checking the constraint */
+    SELECT string_agg(quote_ident(u.column_name), ', ' ORDER BY u.ordinality)
+    INTO foreign_columns
+    FROM unnest(column_names || period_row.start_column_name || period_row.end_column_name) WITH ORDINALITY AS u (column_name, ordinality);
+
+    SELECT string_agg(quote_ident(u.column_name), ', ' ORDER BY u.ordinality)
+    INTO unique_columns
+    FROM unnest(unique_row.column_names || ref_period_row.start_column_name || ref_period_row.end_column_name) WITH ORDINALITY AS u (column_name, ordinality);
+
+    /* Statement level checks need transition tables */
+    IF statement_level AND pg_catalog.current_setting('server_version_num')::integer < 100000 THEN
+        RAISE EXCEPTION 'statement level foreign keys require PostgreSQL 10 or later';
+    END IF;
+
+    /* Time to make the underlying triggers */
+    fk_insert_trigger := coalesce(fk_insert_trigger, periods._choose_name(ARRAY[key_name], 'fk_insert'));
+    fk_update_trigger := coalesce(fk_update_trigger, periods._choose_name(ARRAY[key_name], 'fk_update'));
+    IF statement_level THEN
+        /*
+         * These check all the new rows of a statement at once when it ends,
+         * so unlike the row level ones, they cannot be deferred.
+         */
+        EXECUTE format('CREATE TRIGGER %I AFTER INSERT ON %s REFERENCING NEW TABLE AS new_rows FOR EACH STATEMENT EXECUTE PROCEDURE periods.fk_statement_check(%L)',
+            fk_insert_trigger, table_name, key_name);
+        EXECUTE format('CREATE TRIGGER %I AFTER UPDATE ON %s REFERENCING OLD TABLE AS old_rows NEW TABLE AS new_rows FOR EACH STATEMENT EXECUTE PROCEDURE periods.fk_statement_check(%L)',
+            fk_update_trigger, table_name, key_name);
+    ELSE
+        EXECUTE format('CREATE CONSTRAINT TRIGGER %I AFTER INSERT ON %s FROM %s DEFERRABLE INITIALLY DEFERRED FOR EACH ROW EXECUTE PROCEDURE periods.fk_insert_check(%L)',
+            fk_insert_trigger, table_name, unique_row.table_name, key_name);
+        EXECUTE format('CREATE CONSTRAINT TRIGGER %I AFTER UPDATE OF %s ON %s FROM %s DEFERRABLE INITIALLY DEFERRED FOR EACH ROW EXECUTE PROCEDURE periods.fk_update_check(%L)',
+            fk_update_trigger, foreign_columns, table_name, unique_row.table_name, key_name);
+    END IF;
+    uk_update_trigger := coalesce(uk_update_trigger, periods._choose_name(ARRAY[key_name], 'uk_update'));
+    EXECUTE format('CREATE CONSTRAINT TRIGGER %I AFTER UPDATE OF %s ON %s FROM %s%s FOR EACH ROW EXECUTE PROCEDURE periods.uk_update_check(%L)',
+        uk_update_trigger, unique_columns, unique_row.table_name, table_name, upd_action, key_name);
+    uk_delete_trigger := coalesce(uk_delete_trigger, periods._choose_name(ARRAY[key_name], 'uk_delete'));
+    EXECUTE format('CREATE CONSTRAINT TRIGGER %I AFTER DELETE ON %s FROM %s%s FOR EACH ROW EXECUTE PROCEDURE periods.uk_delete_check(%L)',
+        uk_delete_trigger, unique_row.table_name, table_name, del_action, key_name);
+
+    INSERT INTO periods.foreign_keys (key_name, table_name, column_names, period_name, unique_key, match_type, update_action, delete_action,
+                                      fk_insert_trigger, fk_update_trigger, uk_update_trigger, uk_delete_trigger)
+    VALUES (key_name, table_name, column_names, period_name, unique_row.key_name, match_type, update_action, delete_action,
+            fk_insert_trigger, fk_update_trigger, uk_update_trigger, uk_delete_trigger);
+
+    /*
+     * Validate the constraint on existing data, unless we were asked to leave
+     * that for periods.validate_foreign_key() to do later.  The triggers are
+     * already in place so new rows are checked in the meantime.
+     */
+    IF not_valid THEN
+        INSERT INTO periods.foreign_key_validations (key_name)
+        VALUES (key_name);
+    ELSE
+        PERFORM periods.validate_foreign_key_new_row(key_name, NULL);
+    END IF;
+
+    RETURN key_name;
+END;
+$function$;
+
+
+/* Foreign keys can be added NOT VALID and validated later, in chunks */
+
+CREATE TABLE periods.foreign_key_validations (
+    key_name name NOT NULL,
+    last_row text[],
+    rows_validated bigint NOT NULL DEFAULT 0,
+
+    PRIMARY KEY (key_name),
+
+    FOREIGN KEY (key_name) REFERENCES periods.foreign_keys ON DELETE CASCADE
+);
+GRANT SELECT ON TABLE periods.foreign_key_validations TO PUBLIC;
+SELECT pg_catalog.pg_extension_config_dump('periods.foreign_key_validations', '');
+
+COMMENT ON TABLE periods.foreign_key_validations IS 'The progress of validating foreign keys that were added as NOT VALID';
+
+/*
+ * Validate the existing rows of a foreign key that was added with not_valid.
+ *
+ * The rows are checked in chunks of chunk_size rows, in the order of the key
+ * columns and the period, and the position reached is saved after each chunk.
+ * Calling this with max_chunks, in separate transactions, therefore keeps each
+ * transaction short and lets the validation pick up where the last committed
+ * call left off.  Returns true once the whole table has been validated.
+ *
+ * Unlike validate_foreign_key_new_row(), the referenced rows are not locked.
+ * They can't go away from under us because the triggers of the foreign key
+ * are already in place, and leaving the locks out lets the planner use
+ * parallel workers for each chunk.  An index on the key columns and the
+ * period of the referencing table makes finding each chunk cheap.
+ */
+CREATE FUNCTION periods.validate_foreign_key(
+        key_name name,
+        chunk_size integer DEFAULT 100000,
+        max_chunks integer DEFAULT NULL)
+ RETURNS boolean
+ LANGUAGE plpgsql
+ SECURITY DEFINER
+AS
+$function$
+#variable_conflict use_variable
+DECLARE
+    foreign_key_info record;
+    validation_row periods.foreign_key_validations;
+    column_name name;
+    idx integer;
+    column_names text[] DEFAULT '{}';
+    column_types text[] DEFAULT '{}';
+    fk_columns text[] DEFAULT '{}';
+    fk_values text[] DEFAULT '{}';
+    n_columns text[] DEFAULT '{}';
+    n_values text[] DEFAULT '{}';
+    u_columns text[] DEFAULT '{}';
+    g_matches text[] DEFAULT '{}';
+    uk_matches text DEFAULT '';
+    not_nulls text[] DEFAULT '{}';
+    all_nulls text[] DEFAULT '{}';
+    chunk_clause text;
+    upper_row text[];
+    violation text[];
+    chunk_rows bigint;
+    chunks integer DEFAULT 0;
+
+    QSQL CONSTANT text :=
+        'SELECT ARRAY[%1$s] '
+        'FROM (SELECT DISTINCT %2$s FROM %3$I.%4$I AS fk WHERE %5$s) AS n '
+        'WHERE NOT EXISTS ( '
+        '    SELECT FROM (SELECT %6$s '
+        '                 FROM (SELECT %7$s, '
+        '                              uk.%8$I AS uk_start_value, '
+        '                              uk.%9$I AS uk_end_value '
+        '                       FROM (SELECT DISTINCT %2$s FROM %3$I.%4$I AS fk WHERE %5$s) AS n '
+        '                       JOIN %10$I.%11$I AS uk '
+        '                         ON %12$s uk.%8$I <= n.%13$I AND uk.%9$I >= n.%14$I '
+        '                      ) AS u '
+        '                 GROUP BY %6$s '
+        '                 HAVING periods.covers(u.uk_start_value, u.uk_end_value, u.%14$I, u.%13$I '
+        '                                       ORDER BY u.uk_start_value) '
+        '                ) AS g '
+        '    WHERE %15$s '
+        ') '
+        'LIMIT 1';
+
+BEGIN
+    IF key_name IS NULL THEN
+        RAISE EXCEPTION 'no key name specified';
+    END IF;
+
+    IF chunk_size IS NULL OR chunk_size <= 0 THEN
+        RAISE EXCEPTION 'chunk size must be greater than zero';
+    END IF;
+
+    SELECT fc.oid AS fk_table_oid,
+           fn.nspname AS fk_schema_name,
+           fc.relname AS fk_table_name,
+           fk.column_names AS fk_column_names,
+           fp.start_column_name AS fk_start_column_name,
+           fp.end_column_name AS fk_end_column_name,
+
+           uc.oid AS uk_table_oid,
+           un.nspname AS uk_schema_name,
+           uc.relname AS uk_table_name,
+           uk.column_names AS uk_column_names,
+           up.start_column_name AS uk_start_column_name,
+           up.end_column_name AS uk_end_column_name,
+
+           fk.match_type
+    INTO foreign_key_info
+    FROM periods.foreign_keys AS fk
+    JOIN periods.periods AS fp ON (fp.table_name, fp.period_name) = (fk.table_name, fk.period_name)
+    JOIN pg_catalog.pg_class AS fc ON fc.oid = fk.table_name
+    JOIN pg_catalog.pg_namespace AS fn ON fn.oid = fc.relnamespace
+    JOIN periods.unique_keys AS uk ON uk.key_name = fk.unique_key
+    JOIN periods.periods AS up ON (up.table_name, up.period_name) = (uk.table_name, uk.period_name)
+    JOIN pg_catalog.pg_class AS uc ON uc.oid = uk.table_name
+    JOIN pg_catalog.pg_namespace AS un ON un.oid = uc.relnamespace
+    WHERE fk.key_name = key_name;
+
+    IF NOT FOUND THEN
+        RAISE EXCEPTION 'foreign key "%" not found', key_name;
+    END IF;
+
+    /* Always serialize operations on our catalogs */
+    PERFORM periods._serialize(foreign_key_info.fk_table_oid);
+
+    SELECT v.*
+    INTO validation_row
+    FROM periods.foreign_key_validations AS v
+    WHERE v.key_name = key_name
+    FOR UPDATE;
+
+    IF NOT FOUND THEN
+        /* Either it was never NOT VALID, or it has been validated already */
+        RETURN true;
+    END IF;
+
+    /*
+     * The chunks are ranges of the key columns followed by the period, which
+     * is also how the rows are reported when they don't match.
+     */
+    FOREACH column_name IN ARRAY foreign_key_info.fk_column_names
+                                 || foreign_key_info.fk_start_column_name
+                                 || foreign_key_info.fk_end_column_name
+    LOOP
+        column_names := column_names || quote_ident(column_name);
+        column_types := column_types || (
+            SELECT pg_catalog.format_type(a.atttypid, a.atttypmod)
+            FROM pg_catalog.pg_attribute AS a
+            WHERE (a.attrelid, a.attname) = (foreign_key_info.fk_table_oid, column_name));
+        fk_columns := fk_columns || format('fk.%I', column_name);
+        fk_values := fk_values || format('fk.%I::text', column_name);
+        n_columns := n_columns || format('n.%I', column_name);
+        n_values := n_values || format('n.%I::text', column_name);
+        u_columns := u_columns || format('u.%I', column_name);
+        g_matches := g_matches || format('g.%I = n.%I', column_name, column_name);
+    END LOOP;
+
+    FOR idx IN 1 .. array_length(foreign_key_info.fk_column_names, 1) LOOP
+        uk_matches := uk_matches || format('uk.%I = n.%I AND ',
+            foreign_key_info.uk_column_names[idx], foreign_key_info.fk_column_names[idx]);
+        not_nulls := not_nulls || format('fk.%I IS NOT NULL', foreign_key_info.fk_column_names[idx]);
+        all_nulls := all_nulls || format('fk.%I IS NULL', foreign_key_info.fk_column_names[idx]);
+    END LOOP;
+
+    /*
+     * Rows with nulls in the key are fine for MATCH SIMPLE and are left out
+     * of the chunks.  For the other match types, look for them up front.
+     */
+    IF validation_row.last_row IS NULL AND foreign_key_info.match_type <> 'SIMPLE' THEN
+        EXECUTE format('SELECT ARRAY[%s] FROM %I.%I AS fk WHERE NOT (%s) AND NOT (%s) LIMIT 1',
+            array_to_string(fk_values, ', '),
+            foreign_key_info.fk_schema_name, foreign_key_info.fk_table_name,
+            array_to_string(not_nulls, ' AND '), array_to_string(all_nulls, ' AND '))
+        INTO violation;
+
+        IF violation IS NOT NULL THEN
+            IF foreign_key_info.match_type = 'PARTIAL' THEN
+                RAISE EXCEPTION 'partial not implemented';
+            END IF;
+
+            RAISE EXCEPTION 'foreign key violated (nulls in FULL)'
+                USING ERRCODE = 'foreign_key_violation',
+                      DETAIL = format('Key (%s)=(%s) has nulls.',
+                                      array_to_string(column_names, ', '),
+                                      array_to_string(violation, ', ', 'null'));
+        END IF;
+    END IF;
+
+    LOOP
+        EXIT WHEN chunks = max_chunks;
+
+        /* Each chunk starts after the last row of the previous one... */
+        chunk_clause := array_to_string(not_nulls, ' AND ');
+        IF validation_row.last_row IS NOT NULL THEN
+            chunk_clause := chunk_clause || format(' AND (%s) > (%s)',
+                array_to_string(fk_columns, ', '),
+                (SELECT string_agg(format('CAST(%L AS %s)', v.value, v.type), ', ' ORDER BY v.ordinality)
+                 FROM unnest(validation_row.last_row, column_types) WITH ORDINALITY AS v (value, type, ordinality)));
+        END IF;
+
+        /* ...and ends chunk_size rows later, unless it is the last one */
+        EXECUTE format('SELECT ARRAY[%s] FROM %I.%I AS fk WHERE %s ORDER BY %s OFFSET %s LIMIT 1',
+            array_to_string(fk_values, ', '),
+            foreign_key_info.fk_schema_name, foreign_key_info.fk_table_name,
+            chunk_clause, array_to_string(fk_columns, ', '), chunk_size - 1)
+        INTO upper_row;
+
+        IF upper_row IS NOT NULL THEN
+            chunk_clause := chunk_clause || format(' AND (%s) <= (%s)',
+                array_to_string(fk_columns, ', '),
+                (SELECT string_agg(format('CAST(%L AS %s)', v.value, v.type), ', ' ORDER BY v.ordinality)
+                 FROM unnest(upper_row, column_types) WITH ORDINALITY AS v (value, type, ordinality)));
+        END IF;
+
+        EXECUTE format('SELECT count(*) FROM %I.%I AS fk WHERE %s',
+            foreign_key_info.fk_schema_name, foreign_key_info.fk_table_name, chunk_clause)
+        INTO chunk_rows;
+
+        EXECUTE format(QSQL,
+            array_to_string(n_values, ', '),
+            array_to_string(fk_columns, ', '),
+            foreign_key_info.fk_schema_name,
+            foreign_key_info.fk_table_name,
+            chunk_clause,
+            array_to_string(u_columns, ', '),
+            array_to_string(n_columns, ', '),
+            foreign_key_info.uk_start_column_name,
+            foreign_key_info.uk_end_column_name,
+            foreign_key_info.uk_schema_name,
+            foreign_key_info.uk_table_name,
+            uk_matches,
+            foreign_key_info.fk_end_column_name,
+            foreign_key_info.fk_start_column_name,
+            array_to_string(g_matches, ' AND '))
+        INTO violation;
+
+        IF violation IS NOT NULL THEN
+            RAISE EXCEPTION 'insert or update on table "%" violates foreign key constraint "%"',
+                foreign_key_info.fk_table_oid::regclass,
+                key_name
+                USING ERRCODE = 'foreign_key_violation',
+                      DETAIL = format('Key (%s)=(%s) is not present in table "%s".',
+                                      array_to_string(column_names, ', '),
+                                      array_to_string(violation, ', '),
+                                      foreign_key_info.uk_table_oid::regclass);
+        END IF;
+
+        chunks := chunks + 1;
+        validation_row.last_row := upper_row;
+        validation_row.rows_validated := validation_row.rows_validated + chunk_rows;
+
+        IF chunk_rows > 0 THEN
+            RAISE NOTICE 'foreign key "%": % rows validated', key_name, validation_row.rows_validated;
+        END IF;
+
+        IF upper_row IS NULL THEN
+            DELETE FROM periods.foreign_key_validations AS v
+            WHERE v.key_name = key_name;
+
+            RETURN true;
+        END IF;
+
+        UPDATE periods.foreign_key_validations AS v
+        SET last_row = validation_row.last_row,
+            rows_validated = validation_row.rows_validated
+        WHERE v.key_name = key_name;
+    END LOOP;
+
+    RETURN false;
+END;
+$function$;
+
+
+/* History tables can be partitioned on the end of SYSTEM_TIME */
+
+CREATE TABLE periods.history_partitioning (
+    table_name regclass NOT NULL,
+    partition_interval interval NOT NULL,
+    premake integer NOT NULL,
+    partitioned_until timestamp with time zone NOT NULL,
+
+    PRIMARY KEY (table_name),
+
+    FOREIGN KEY (table_name) REFERENCES periods.system_versioning ON DELETE CASCADE,
+
+    CHECK (partition_interval > interval '0'),
+    CHECK (premake >= 0)
+);
+GRANT SELECT ON TABLE periods.history_partitioning TO PUBLIC;
+SELECT pg_catalog.pg_extension_config_dump('periods.history_partitioning', '');
+
+COMMENT ON TABLE periods.history_partitioning IS 'A registry of history tables partitioned on the end of SYSTEM_TIME';
+
+/*
+ * Record in our catalog how far the partitions of a history table go.  This
+ * is for maintain_history_partitions(), which runs with the privileges of its
+ * caller.  The value is read from the partitions themselves and only ever
+ * moves forward, so it doesn't matter who calls us.
+ */
+CREATE FUNCTION periods._update_partitioned_until(table_name regclass)
+ RETURNS void
+ LANGUAGE plpgsql
+ SECURITY DEFINER
+AS
+$function$
+#variable_conflict use_variable
+BEGIN
+    UPDATE periods.history_partitioning AS hp
+    SET partitioned_until = p.partitioned_until
+    FROM (
+        SELECT max(substring(pg_catalog.pg_get_expr(c.relpartbound, c.oid) FROM 'TO \(''(.*)''\)$')::timestamp with time zone) AS partitioned_until
+        FROM periods.system_versioning AS sv
+        JOIN pg_catalog.pg_inherits AS i ON i.inhparent = sv.history_table_name
+        JOIN pg_catalog.pg_class AS c ON c.oid = i.inhrelid
+        WHERE sv.table_name = table_name
+    ) AS p
+    WHERE hp.table_name = table_name
+      AND p.partitioned_until > hp.partitioned_until;
+END;
+$function$;
+
+/*
+ * Create the partitions of the partitioned history tables ahead of the rows
+ * that will go into them, for the given table or for all of those the caller
+ * owns.  This is meant to be called periodically, and returns how many
+ * partitions were created.
+ *
+ * If we weren't called in time, the rows archived since then went into the
+ * default partition, where they would keep the partitions for them from being
+ * created.  The default partition is detached while we create them, and those
+ * rows are moved into them before it is attached again.
+ *
+ * This is not SECURITY DEFINER, only the owner of a table can create the
+ * partitions of its history.
+ */
+CREATE FUNCTION periods.maintain_history_partitions(table_name regclass DEFAULT NULL)
+ RETURNS integer
+ LANGUAGE plpgsql
+AS
+$function$
+#variable_conflict use_variable
+DECLARE
+    r record;
+    partitioned_until timestamp with time zone;
+    partition_name name;
+    partition_start timestamp with time zone;
+    partition_end timestamp with time zone;
+    default_id regclass;
+    has_late_rows boolean;
+    column_list text;
+    cmd text;
+    created integer DEFAULT 0;
+BEGIN
+    IF table_name IS NOT NULL AND NOT EXISTS (
+        SELECT FROM pg_catalog.pg_class AS c
+        WHERE c.oid = table_name
+          AND pg_catalog.pg_has_role(current_user, c.relowner, 'USAGE'))
+    THEN
+        RAISE EXCEPTION 'must be owner of table %', table_name;
+    END IF;
+
+    FOR r IN
+        SELECT hp.table_name, hp.partition_interval, hp.premake,
+               sv.history_table_name AS history_table_id,
+               n.nspname AS schema_name,
+               c.relname AS history_table_name,
+               p.end_column_name
+        FROM periods.history_partitioning AS hp
+        JOIN periods.system_versioning AS sv ON sv.table_name = hp.table_name
+        JOIN periods.periods AS p ON (p.table_name, p.period_name) = (sv.table_name, sv.period_name)
+        JOIN pg_catalog.pg_class AS tc ON tc.oid = hp.table_name
+        JOIN pg_catalog.pg_class AS c ON c.oid = sv.history_table_name
+        JOIN pg_catalog.pg_namespace AS n ON n.oid = c.relnamespace
+        WHERE (hp.table_name = table_name OR table_name IS NULL)
+          AND pg_catalog.pg_has_role(current_user, tc.relowner, 'USAGE')
+        ORDER BY hp.table_name
+    LOOP
+        /* Always serialize operations on our catalogs */
+        PERFORM periods._serialize(r.table_name);
+
+        /* Someone else might have made partitions while we waited */
+        SELECT hp.partitioned_until
+        INTO partitioned_until
+        FROM periods.history_partitioning AS hp
+        WHERE hp.table_name = r.table_name;
+
+        /*
+         * Archived rows end when they are archived, so we need partitions up
+         * to now and then some, in case we aren't called again for a while.
+         */
+        partition_end := partitioned_until;
+        WHILE partition_end <= now() + r.premake * r.partition_interval LOOP
+            partition_end := partition_end + r.partition_interval;
+        END LOOP;
+
+        CONTINUE WHEN partition_end = partitioned_until;
+
+        default_id := NULL;
+        SELECT pt.partdefid
+        INTO default_id
+        FROM pg_catalog.pg_partitioned_table AS pt
+        WHERE pt.partrelid = r.history_table_id
+          AND pt.partdefid <> 0;
+
+        IF default_id IS NOT NULL THEN
+            EXECUTE format('SELECT EXISTS (SELECT FROM %1$s WHERE %2$I >= %3$L AND %2$I < %4$L)',
+                default_id, r.end_column_name, partitioned_until, partition_end)
+            INTO has_late_rows;
+
+            IF has_late_rows THEN
+                EXECUTE format('ALTER TABLE %1$I.%2$I DETACH PARTITION %3$s',
+                    r.schema_name, r.history_table_name, default_id);
+            ELSE
+                default_id := NULL;
+            END IF;
+        END IF;
+
+        partition_start := partitioned_until;
+        WHILE partition_start < partition_end LOOP
+            partition_name := periods._choose_name(ARRAY[r.history_table_name],
+                to_char(partition_start, CASE WHEN r.partition_interval >= interval '1 day' THEN 'YYYYMMDD' ELSE 'YYYYMMDD_HH24MI' END));
+
+            EXECUTE format('CREATE TABLE %1$I.%2$I PARTITION OF %1$I.%3$I FOR VALUES FROM (%4$L) TO (%5$L)',
+                r.schema_name, partition_name, r.history_table_name, partition_start, partition_start + r.partition_interval);
+            partition_start := partition_start + r.partition_interval;
+            created := created + 1;
+        END LOOP;
+
+        /* Move the late rows to their partitions and put the default back */
+        IF default_id IS NOT NULL THEN
+            SELECT string_agg(quote_ident(a.attname), ', ' ORDER BY a.attnum)
+            INTO column_list
+            FROM pg_catalog.pg_attribute AS a
+            WHERE a.attrelid = r.history_table_id
+              AND a.attnum > 0
+              AND NOT a.attisdropped;
+
+            EXECUTE format('WITH moved AS (DELETE FROM %1$s WHERE %2$I >= %3$L AND %2$I < %4$L RETURNING %5$s) '
+                           'INSERT INTO %6$I.%7$I (%5$s) SELECT %5$s FROM moved',
+                default_id, r.end_column_name, partitioned_until, partition_end,
+                column_list, r.schema_name, r.history_table_name);
+            EXECUTE format('ALTER TABLE %1$I.%2$I ATTACH PARTITION %3$s DEFAULT',
+                r.schema_name, r.history_table_name, default_id);
+        END IF;
+
+        PERFORM periods._update_partitioned_until(r.table_name);
+
+        /* We might be running as the extension owner, so fix up the partitions' ownership */
+        FOR cmd IN
+            SELECT format('ALTER TABLE %s OWNER TO %s', pc.oid::regclass, hc.relowner::regrole)
+            FROM pg_catalog.pg_inherits AS i
+            JOIN pg_catalog.pg_class AS hc ON hc.oid = i.inhparent
+            JOIN pg_catalog.pg_class AS pc ON pc.oid = i.inhrelid
+            WHERE i.inhparent = r.history_table_id
+              AND pc.relowner <> hc.relowner
+        LOOP
+            EXECUTE cmd;
+        END LOOP;
+    END LOOP;
+
+    RETURN created;
+END;
+$function$;
+
+CREATE OR REPLACE FUNCTION periods.health_checks()
+ RETURNS event_trigger
+ LANGUAGE plpgsql
+ SECURITY DEFINER
+AS
+$function$
+#variable_conflict use_variable
+DECLARE
+    cmd text;
+    r record;
+    save_search_path text;
+BEGIN
+    /* Most commands have nothing to do with us */
+    IF NOT periods._ddl_commands_touch_periods() THEN
+        RETURN;
+    END IF;
+
+    /* Make sure that all of our tables are still persistent */
+    FOR r IN
+        SELECT p.table_name
+        FROM periods.periods AS p
+        JOIN pg_catalog.pg_class AS c ON c.oid = p.table_name
+        WHERE c.relpersistence <> 'p'
+    LOOP
+        RAISE EXCEPTION 'table "%" must remain persistent because it has periods',
+            r.table_name;
+    END LOOP;
+
+    /* And the history tables, too */
+    FOR r IN
+        SELECT sv.table_name
+        FROM periods.system_versioning AS sv
+        JOIN pg_catalog.pg_class AS c ON c.oid = sv.history_table_name
+        WHERE c.relpersistence <> 'p'
+    LOOP
+        RAISE EXCEPTION 'history table "%" must remain persistent because it has periods',
+            r.table_name;
+    END LOOP;
+
+    /* Check that our system versioning functions are still here */
+    save_search_path := pg_catalog.current_setting('search_path');
+    PERFORM pg_catalog.set_config('search_path', 'pg_catalog, pg_temp', true);
+    FOR r IN
+        SELECT *
+        FROM periods.system_versioning AS sv
+        CROSS JOIN LATERAL UNNEST(ARRAY[sv.func_as_of, sv.func_between, sv.func_between_symmetric, sv.func_from_to, sv.func_as_of_series]) AS u (fn)
+        WHERE u.fn IS NOT NULL
+          AND NOT EXISTS (
+            SELECT FROM pg_catalog.pg_proc AS p
+            WHERE p.oid::regprocedure::text = u.fn
+        )
+    LOOP
+        RAISE EXCEPTION 'cannot drop or rename function "%" because it is used in SYSTEM VERSIONING for table "%"',
+            r.fn, r.table_name;
+    END LOOP;
+    PERFORM pg_catalog.set_config('search_path', save_search_path, true);
+
+    /* Fix up history and for-portion objects ownership */
+    FOR cmd IN
+        SELECT format('ALTER %s %s OWNER TO %I',
+            CASE ht.relkind
+                WHEN 'v' THEN 'VIEW'
+                ELSE 'TABLE'
+            END,
+            ht.oid::regclass, t.relowner::regrole)
+        FROM periods.system_versioning AS sv
+        JOIN pg_class AS t ON t.oid = sv.table_name
+        JOIN pg_class AS ht ON ht.oid IN (sv.history_table_name, sv.view_name)
+        WHERE t.relowner <> ht.relowner
+
+        UNION ALL
+
+        SELECT format('ALTER VIEW %s OWNER TO %I', fpt.oid::regclass, t.relowner::regrole)
+        FROM periods.for_portion_views AS fpv
+        JOIN pg_class AS t ON t.oid = fpv.table_name
+        JOIN pg_class AS fpt ON fpt.oid = fpv.view_name
+        WHERE t.relowner <> fpt.relowner
+
+        UNION ALL
+
+        SELECT format('ALTER FUNCTION %s OWNER TO %I', p.oid::regprocedure, t.relowner::regrole)
+        FROM periods.system_versioning AS sv
+        JOIN pg_class AS t ON t.oid = sv.table_name
+        JOIN pg_proc AS p ON p.oid = ANY (ARRAY[sv.func_as_of, sv.func_between, sv.func_between_symmetric, sv.func_from_to, sv.func_as_of_series]::regprocedure[])
+        WHERE t.relowner <> p.proowner
+    LOOP
+        EXECUTE cmd;
+    END LOOP;
+
+    /* Check GRANTs */
+    IF EXISTS (
+        SELECT FROM pg_event_trigger_ddl_commands() AS ev_ddl
+        WHERE ev_ddl.command_tag = 'GRANT')
+    THEN
+        FOR r IN
+            SELECT *,
+                   EXISTS (
+                       SELECT
+                       FROM pg_class AS _c
+                       CROSS JOIN LATERAL aclexplode(COALESCE(_c.relacl, acldefault('r', _c.relowner))) AS _acl
+                       WHERE _c.oid = objects.table_name
+                         AND _acl.grantee = objects.grantee
+                         AND _acl.privilege_type = 'SELECT'
+                   ) AS on_base_table
+            FROM (
+                SELECT sv.table_name,
+                       c.oid::regclass::text AS object_name,
+                       c.relkind AS object_type,
+                       acl.privilege_type,
+                       acl.privilege_type AS base_privilege_type,
+                       acl.grantee,
+                       'h' AS history_or_portion
+                FROM periods.system_versioning AS sv
+                JOIN pg_class AS c ON c.oid IN (sv.history_table_name, sv.view_name)
+                CROSS JOIN LATERAL aclexplode(COALESCE(c.relacl, acldefault('r', c.relowner))) AS acl
+
+                UNION ALL
+
+                SELECT fpv.table_name,
+                       c.oid::regclass::text,
+                       c.relkind,
+                       acl.privilege_type,
+                       acl.privilege_type,
+                       acl.grantee,
+                       'p' AS history_or_portion
+                FROM periods.for_portion_views AS fpv
+                JOIN pg_class AS c ON c.oid = fpv.view_name
+                CROSS JOIN LATERAL aclexplode(COALESCE(c.relacl, acldefault('r', c.relowner))) AS acl
+
+                UNION ALL
+
+                SELECT sv.table_name,
+                       p.oid::regprocedure::text,
+                       'f',
+                       acl.privilege_type,
+                       'SELECT',
+                       acl.grantee,
+                       'h'
+                FROM periods.system_versioning AS sv
+                JOIN pg_proc AS p ON p.oid = ANY (ARRAY[sv.func_as_of, sv.func_between, sv.func_between_symmetric, sv.func_from_to, sv.func_as_of_series]::regprocedure[])
+                CROSS JOIN LATERAL aclexplode(COALESCE(p.proacl, acldefault('f', p.proowner))) AS acl
+            ) AS objects
+            ORDER BY object_name, object_type, privilege_type
+        LOOP
+            IF
+                r.history_or_portion = 'h' AND
+                (r.object_type, r.privilege_type) NOT IN (('r', 'SELECT'), ('p', 'SELECT'), ('v', 'SELECT'), ('f', 'EXECUTE'))
+            THEN
+                RAISE EXCEPTION 'cannot grant % to "%"; history objects are read-only',
+                    r.privilege_type, r.object_name;
+            END IF;
+
+            IF NOT r.on_base_table THEN
+                RAISE EXCEPTION 'cannot grant % directly to "%"; grant % to "%" instead',
+                    r.privilege_type, r.object_name, r.base_privilege_type, r.table_name;
+            END IF;
+        END LOOP;
+
+        /* Propagate GRANTs */
+        FOR cmd IN
+            SELECT format('GRANT %s ON %s %s TO %s',
+                          string_agg(DISTINCT privilege_type, ', '),
+                          object_type,
+                          string_agg(DISTINCT object_name, ', '),
+                          string_agg(DISTINCT COALESCE(a.rolname, 'public'), ', '))
+            FROM (
+                SELECT 'TABLE' AS object_type,
+                       hc.oid::regclass::text AS object_name,
+                       'SELECT' AS privilege_type,
+                       acl.grantee
+                FROM periods.system_versioning AS sv
+                JOIN pg_class AS c ON c.oid = sv.table_name
+                CROSS JOIN LATERAL aclexplode(COALESCE(c.relacl, acldefault('r', c.relowner))) AS acl
+                JOIN pg_class AS hc ON hc.oid IN (sv.history_table_name, sv.view_name)
+                WHERE acl.privilege_type = 'SELECT'
+                  AND NOT has_table_privilege(acl.grantee, hc.oid, 'SELECT')
+
+                UNION ALL
+
+                SELECT 'TABLE',
+                       fpc.oid::regclass::text,
+                       acl.privilege_type,
+                       acl.grantee
+                FROM periods.for_portion_views AS fpv
+                JOIN pg_class AS c ON c.oid = fpv.table_name
+                CROSS JOIN LATERAL aclexplode(COALESCE(c.relacl, acldefault('r', c.relowner))) AS acl
+                JOIN pg_class AS fpc ON fpc.oid = fpv.view_name
+                WHERE NOT has_table_privilege(acl.grantee, fpc.oid, acl.privilege_type)
+
+                UNION ALL
+
+                SELECT 'FUNCTION',
+                       hp.oid::regprocedure::text,
+                       'EXECUTE',
+                       acl.grantee
+                FROM periods.system_versioning AS sv
+                JOIN pg_class AS c ON c.oid = sv.table_name
+                CROSS JOIN LATERAL aclexplode(COALESCE(c.relacl, acldefault('r', c.relowner))) AS acl
+                JOIN pg_proc AS hp ON hp.oid = ANY (ARRAY[sv.func_as_of, sv.func_between, sv.func_between_symmetric, sv.func_from_to, sv.func_as_of_series]::regprocedure[])
+                WHERE acl.privilege_type = 'SELECT'
+                  AND NOT has_function_privilege(acl.grantee, hp.oid, 'EXECUTE')
+            ) AS objects
+            LEFT JOIN pg_authid AS a ON a.oid = objects.grantee
+            GROUP BY object_type
+        LOOP
+            EXECUTE cmd;
+        END LOOP;
+    END IF;
+
+    /* Check REVOKEs */
+    IF EXISTS (
+        SELECT FROM pg_event_trigger_ddl_commands() AS ev_ddl
+        WHERE ev_ddl.command_tag = 'REVOKE')
+    THEN
+        FOR r IN
+            SELECT sv.table_name,
+                   hc.oid::regclass::text AS object_name,
+                   acl.privilege_type,
+                   acl.privilege_type AS base_privilege_type
+            FROM periods.system_versioning AS sv
+            JOIN pg_class AS c ON c.oid = sv.table_name
+            CROSS JOIN LATERAL aclexplode(COALESCE(c.relacl, acldefault('r', c.relowner))) AS acl
+            JOIN pg_class AS hc ON hc.oid IN (sv.history_table_name, sv.view_name)
+            WHERE acl.privilege_type = 'SELECT'
+              AND NOT EXISTS (
+                SELECT
+                FROM aclexplode(COALESCE(hc.relacl, acldefault('r', hc.relowner))) AS _acl
+                WHERE _acl.privilege_type = 'SELECT'
+                  AND _acl.grantee = acl.grantee)
+
+            UNION ALL
+
+            SELECT fpv.table_name,
+                   hc.oid::regclass::text,
+                   acl.privilege_type,
+                   acl.privilege_type
+            FROM periods.for_portion_views AS fpv
+            JOIN pg_class AS c ON c.oid = fpv.table_name
+            CROSS JOIN LATERAL aclexplode(COALESCE(c.relacl, acldefault('r', c.relowner))) AS acl
+            JOIN pg_class AS hc ON hc.oid = fpv.view_name
+            WHERE NOT EXISTS (
+                SELECT
+                FROM aclexplode(COALESCE(hc.relacl, acldefault('r', hc.relowner))) AS _acl
+                WHERE _acl.privilege_type = acl.privilege_type
+                  AND _acl.grantee = acl.grantee)
+
+            UNION ALL
+
+            SELECT sv.table_name,
+                   hp.oid::regprocedure::text,
+                   'EXECUTE',
+                   'SELECT'
+            FROM periods.system_versioning AS sv
+            JOIN pg_class AS c ON c.oid = sv.table_name
+            CROSS JOIN LATERAL aclexplode(COALESCE(c.relacl, acldefault('r', c.relowner))) AS acl
+            JOIN pg_proc AS hp ON hp.oid = ANY (ARRAY[sv.func_as_of, sv.func_between, sv.func_between_symmetric, sv.func_from_to, sv.func_as_of_series]::regprocedure[])
+            WHERE acl.privilege_type = 'SELECT'
+              AND NOT EXISTS (
+                SELECT
+                FROM aclexplode(COALESCE(hp.proacl, acldefault('f', hp.proowner))) AS _acl
+                WHERE _acl.privilege_type = 'EXECUTE'
+                  AND _acl.grantee = acl.grantee)
+
+            ORDER BY table_name, object_name
+        LOOP
+            RAISE EXCEPTION 'cannot revoke % directly from "%", revoke % from "%" instead',
+                r.privilege_type, r.object_name, r.base_privilege_type, r.table_name;
+        END LOOP;
+
+        /* Propagate REVOKEs */
+        FOR cmd IN
+            SELECT format('REVOKE %s ON %s %s FROM %s',
+                          string_agg(DISTINCT privilege_type, ', '),
+                          object_type,
+                          string_agg(DISTINCT object_name, ', '),
+                          string_agg(DISTINCT COALESCE(a.rolname, 'public'), ', '))
+            FROM (
+                SELECT 'TABLE' AS object_type,
+                       hc.oid::regclass::text AS object_name,
+                       'SELECT' AS privilege_type,
+                       hacl.grantee
+                FROM periods.system_versioning AS sv
+                JOIN pg_class AS hc ON hc.oid IN (sv.history_table_name, sv.view_name)
+                CROSS JOIN LATERAL aclexplode(COALESCE(hc.relacl, acldefault('r', hc.relowner))) AS hacl
+                WHERE hacl.privilege_type = 'SELECT'
+                  AND NOT has_table_privilege(hacl.grantee, sv.table_name, 'SELECT')
+
+                UNION ALL
+
+                SELECT 'TABLE' AS object_type,
+                       hc.oid::regclass::text AS object_name,
+                       hacl.privilege_type,
+                       hacl.grantee
+                FROM periods.for_portion_views AS fpv
+                JOIN pg_class AS hc ON hc.oid = fpv.view_name
+                CROSS JOIN LATERAL aclexplode(COALESCE(hc.relacl, acldefault('r', hc.relowner))) AS hacl
+                WHERE NOT has_table_privilege(hacl.grantee, fpv.table_name, hacl.privilege_type)
+
+                UNION ALL
+
+                SELECT 'FUNCTION' AS object_type,
+                       hp.oid::regprocedure::text AS object_name,
+                       'EXECUTE' AS privilege_type,
+                       hacl.grantee
+                FROM periods.system_versioning AS sv
+                JOIN pg_proc AS hp ON hp.oid = ANY (ARRAY[sv.func_as_of, sv.func_between, sv.func_between_symmetric, sv.func_from_to, sv.func_as_of_series]::regprocedure[])
+                CROSS JOIN LATERAL aclexplode(COALESCE(hp.proacl, acldefault('f', hp.proowner))) AS hacl
+                WHERE hacl.privilege_type = 'EXECUTE'
+                  AND NOT has_table_privilege(hacl.grantee, sv.table_name, 'SELECT')
+            ) AS objects
+            LEFT JOIN pg_authid AS a ON a.oid = objects.grantee
+            GROUP BY object_type
+        LOOP
+            EXECUTE cmd;
+        END LOOP;
+    END IF;
+END;
+$function$;
+
+/* History can be purged in batches */
+
+CREATE FUNCTION periods._purge_history_batch(table_name regclass, older_than timestamp with time zone, batch_size integer)
+ RETURNS bigint
+ LANGUAGE c
+ STRICT
+AS 'MODULE_PATHNAME', 'purge_history_batch';
+
+/*
+ * Delete the history of a table that ended before the given time, in batches
+ * of batch_size rows so that each one stays cheap.  Partitions of a
+ * partitioned history table that only hold such rows are dropped instead.
+ *
+ * If max_batches is given, we stop after that many batches so that the caller
+ * can commit and call us again until we return zero.  The return value is the
+ * number of rows deleted, not counting the partitions dropped.
+ *
+ * This is not SECURITY DEFINER, only the owner of the table can purge its
+ * history.
+ */
+CREATE FUNCTION periods.purge_history(table_name regclass, older_than timestamp with time zone, batch_size integer DEFAULT 10000, max_batches integer DEFAULT NULL)
+ RETURNS bigint
+ LANGUAGE plpgsql
+AS
+$function$
+#variable_conflict use_variable
+DECLARE
+    history_table_id oid;
+    partition_id regclass;
+    batches integer DEFAULT 0;
+    deleted bigint;
+    total bigint DEFAULT 0;
+BEGIN
+    IF table_name IS NULL THEN
+        RAISE EXCEPTION 'no table name specified';
+    END IF;
+
+    IF NOT EXISTS (
+        SELECT FROM pg_catalog.pg_class AS c
+        WHERE c.oid = table_name
+          AND pg_catalog.pg_has_role(current_user, c.relowner, 'USAGE'))
+    THEN
+        RAISE EXCEPTION 'must be owner of table %', table_name;
+    END IF;
+
+    IF batch_size IS NULL OR batch_size <= 0 THEN
+        RAISE EXCEPTION 'batch size must be greater than zero';
+    END IF;
+
+    /* Always serialize operations on our catalogs */
+    PERFORM periods._serialize(table_name);
+
+    SELECT sv.history_table_name
+    INTO history_table_id
+    FROM periods.system_versioning AS sv
+    WHERE sv.table_name = table_name;
+
+    IF NOT FOUND THEN
+        RAISE EXCEPTION 'table % does not have SYSTEM VERSIONING', table_name;
+    END IF;
+
+    /*
+     * The partitions we made are on the end of SYSTEM_TIME, so the ones that
+     * end before the cutoff can just be dropped.  The default partition is
+     * never dropped.
+     */
+    IF EXISTS (SELECT FROM periods.history_partitioning AS hp WHERE hp.table_name = table_name) THEN
+        FOR partition_id IN
+            SELECT p.partition_id
+            FROM (
+                SELECT c.oid::regclass AS partition_id,
+                       substring(pg_catalog.pg_get_expr(c.relpartbound, c.oid) FROM 'TO \(''(.*)''\)$')::timestamp with time zone AS partition_end
+                FROM pg_catalog.pg_inherits AS i
+                JOIN pg_catalog.pg_class AS c ON c.oid = i.inhrelid
+                WHERE i.inhparent = history_table_id
+            ) AS p
+            WHERE p.partition_end <= older_than
+            ORDER BY p.partition_end
+        LOOP
+            EXECUTE format('DROP TABLE %s', partition_id);
+            RAISE NOTICE 'partition % of history table % dropped', partition_id, history_table_id::regclass;
+        END LOOP;
+    END IF;
+
+    LOOP
+        EXIT WHEN batches = max_batches;
+
+        deleted := periods._purge_history_batch(table_name, older_than, batch_size);
+        total := total + deleted;
+        batches := batches + 1;
+
+        EXIT WHEN deleted < batch_size;
+    END LOOP;
+
+    RETURN total;
+END;
+$function$;
+
+/* History tables can be indexed by add_system_versioning() */
+
+CREATE TABLE periods.history_indexes (
+    table_name regclass NOT NULL,
+    index_strategy periods.history_index_strategy NOT NULL,
+    index_name regclass NOT NULL,
+
+    PRIMARY KEY (table_name),
+
+    FOREIGN KEY (table_name) REFERENCES periods.system_versioning ON DELETE CASCADE,
+
+    UNIQUE (index_name)
+);
+GRANT SELECT ON TABLE periods.history_indexes TO PUBLIC;
+SELECT pg_catalog.pg_extension_config_dump('periods.history_indexes', '');
+
+COMMENT ON TABLE periods.history_indexes IS 'A registry of the indexes made on history tables by add_system_versioning()';
+
+/* The predicates can use the GiST indexes on periods */
+
+/*
+ * Let the planner use the GiST indexes on periods for the predicates above.
+ * Support functions only exist since PostgreSQL 12; before that, the
+ * predicates are just inlined.
+ */
+CREATE FUNCTION periods._predicate_support(internal)
+ RETURNS internal
+ LANGUAGE c
+ STRICT
+AS 'MODULE_PATHNAME', 'predicate_support';
+
+DO $$
+DECLARE
+    func regprocedure;
+BEGIN
+    IF pg_catalog.current_setting('server_version_num')::integer >= 120000 THEN
+        FOREACH func IN ARRAY ARRAY[
+            'periods.contains(anyelement,anyelement,anyelement)',
+            'periods.contains(anyelement,anyelement,anyelement,anyelement)',
+            'periods.equals(anyelement,anyelement,anyelement,anyelement)',
+            'periods.overlaps(anyelement,anyelement,anyelement,anyelement)',
+            'periods.precedes(anyelement,anyelement,anyelement,anyelement)',
+            'periods.succeeds(anyelement,anyelement,anyelement,anyelement)'
+        ]::regprocedure[]
+        LOOP
+            EXECUTE format('ALTER FUNCTION %s SUPPORT periods._predicate_support', func);
+        END LOOP;
+    END IF;
+END;
+$$;
+
+/* System-versioned tables can be loaded without the row triggers */
+
+CREATE FUNCTION periods.load_versioned(table_name regclass, source_query text, column_names name[] DEFAULT NULL)
+ RETURNS bigint
+ LANGUAGE plpgsql
+AS
+$function$
+#variable_conflict use_variable
+DECLARE
+    period_row periods.periods;
+    system_time_period_row periods.system_time_periods;
+    column_name name;
+    column_type text;
+    bypass_triggers boolean;
+    loaded bigint;
+    generated_condition text;
+BEGIN
+    IF table_name IS NULL THEN
+        RAISE EXCEPTION 'no table name specified';
+    END IF;
+
+    IF source_query IS NULL THEN
+        RAISE EXCEPTION 'no source query specified';
+    END IF;
+
+    IF NOT EXISTS (
+        SELECT FROM pg_catalog.pg_class AS c
+        WHERE c.oid = table_name
+          AND pg_catalog.pg_has_role(current_user, c.relowner, 'USAGE'))
+    THEN
+        RAISE EXCEPTION 'must be owner of table %', table_name;
+    END IF;
+
+    /* Always serialize operations on our catalogs */
+    PERFORM periods._serialize(table_name);
+
+    SELECT p.*
+    INTO period_row
+    FROM periods.periods AS p
+    WHERE (p.table_name, p.period_name) = (table_name, 'system_time');
+
+    IF NOT FOUND THEN
+        RAISE EXCEPTION 'table % does not have a SYSTEM_TIME period', table_name;
+    END IF;
+
+    SELECT stp.*
+    INTO system_time_period_row
+    FROM periods.system_time_periods AS stp
+    WHERE stp.table_name = table_name;
+
+    /* The period's columns are ours to fill */
+    FOR column_name IN
+        SELECT u.name
+        FROM unnest(column_names) AS u (name)
+        WHERE u.name IN (period_row.start_column_name, period_row.end_column_name)
+    LOOP
+        RAISE EXCEPTION 'cannot load column "%" of the SYSTEM_TIME period', column_name;
+    END LOOP;
+
+    /*
+     * By default, the query returns the same columns as the FOR PORTION OF
+     * views take: not the ones the database generates, nor the primary key if
+     * it has a default.
+     */
+    IF column_names IS NULL THEN
+        generated_condition := 'pg_catalog.pg_get_serial_sequence(a.attrelid::regclass::text, a.attname) IS NOT NULL';
+        IF pg_catalog.current_setting('server_version_num')::integer >= 100000 THEN
+            generated_condition := generated_condition || ' OR a.attidentity <> ''''';
+        END IF;
+        IF pg_catalog.current_setting('server_version_num')::integer >= 120000 THEN
+            generated_condition := generated_condition || ' OR a.attgenerated <> ''''';
+        END IF;
+
+        EXECUTE format($$
+            SELECT pg_catalog.array_agg(a.attname ORDER BY a.attnum)
+            FROM pg_catalog.pg_attribute AS a
+            WHERE a.attrelid = $1
+              AND a.attnum > 0
+              AND NOT a.attisdropped
+              AND a.attname NOT IN ($2, $3)
+              AND NOT (%s
+                       OR (a.atthasdef
+                           AND EXISTS (SELECT FROM pg_catalog.pg_constraint AS _c
+                                       WHERE (_c.conrelid, _c.contype) = (a.attrelid, 'p')
+                                         AND _c.conkey @> ARRAY[a.attnum])))
+            $$, generated_condition)
+        INTO column_names
+        USING table_name, period_row.start_column_name, period_row.end_column_name;
+    END IF;
+
+    SELECT pg_catalog.format_type(a.atttypid, a.atttypmod)
+    INTO column_type
+    FROM pg_catalog.pg_attribute AS a
+    WHERE (a.attrelid, a.attname) = (table_name, period_row.start_column_name);
+
+    /*
+     * The row triggers have nothing to do for a plain INSERT other than stamp
+     * the period's columns, which we do ourselves for the whole set here, and
+     * make sure nothing else changed them afterwards.  So if there are no
+     * other row triggers on INSERT that could do that (or change the table in
+     * a way that needs history), we can turn ours off for the duration of the
+     * load.  This locks out other writers until the end of the transaction.
+     * We leave the triggers alone if they have been fiddled with.
+     */
+    bypass_triggers := NOT EXISTS (
+        SELECT FROM pg_catalog.pg_trigger AS t
+        WHERE t.tgrelid = table_name
+          AND NOT t.tgisinternal
+          AND t.tgtype::integer & 5 = 5 -- ROW and INSERT
+          AND t.tgenabled <> 'D'
+          AND t.tgname NOT IN (system_time_period_row.generated_always_trigger,
+                               system_time_period_row.write_history_trigger))
+      AND (
+        SELECT count(*)
+        FROM pg_catalog.pg_trigger AS t
+        WHERE t.tgrelid = table_name
+          AND t.tgname IN (system_time_period_row.generated_always_trigger,
+                           system_time_period_row.write_history_trigger)
+          AND t.tgenabled = 'O'
+      ) = 2;
+
+    IF bypass_triggers THEN
+        EXECUTE format('ALTER TABLE %s DISABLE TRIGGER %I, DISABLE TRIGGER %I',
+            table_name,
+            system_time_period_row.generated_always_trigger,
+            system_time_period_row.write_history_trigger);
+    END IF;
+
+    /* The end column is checked by the infinity check constraint */
+    EXECUTE format('INSERT INTO %1$s (%2$s) SELECT q.*, transaction_timestamp()::%3$s, ''infinity''::%3$s FROM (%4$s) AS q',
+        table_name,
+        (SELECT string_agg(quote_ident(u.name), ', ' ORDER BY u.ordinality)
+         FROM unnest(column_names || period_row.start_column_name || period_row.end_column_name) WITH ORDINALITY AS u (name, ordinality)),
+        column_type,
+        source_query);
+    GET DIAGNOSTICS loaded = ROW_COUNT;
+
+    IF bypass_triggers THEN
+        EXECUTE format('ALTER TABLE %s ENABLE TRIGGER %I, ENABLE TRIGGER %I',
+            table_name,
+            system_time_period_row.generated_always_trigger,
+            system_time_period_row.write_history_trigger);
+    END IF;
+
+    RETURN loaded;
+END;
+$function$;
+
+/* Updates that don't change anything can be left out of the history */
+
+ALTER TABLE periods.system_time_periods
+    ADD COLUMN skip_unchanged boolean NOT NULL DEFAULT false;
+
+DROP FUNCTION periods.add_system_time_period(regclass,name,name,name,name,name,name,name,name[]);
+CREATE FUNCTION periods.add_system_time_period(
+    table_class regclass,
+    start_column_name name DEFAULT 'system_time_start',
+    end_column_name name DEFAULT 'system_time_end',
+    bounds_check_constraint name DEFAULT NULL,
+    infinity_check_constraint name DEFAULT NULL,
+    generated_always_trigger name DEFAULT NULL,
+    write_history_trigger name DEFAULT NULL,
+    truncate_trigger name DEFAULT NULL,
+    excluded_column_names name[] DEFAULT '{}',
+    skip_unchanged boolean DEFAULT false)
+ RETURNS boolean
+ LANGUAGE plpgsql
+ SECURITY DEFINER
+AS
+$function$
+#variable_conflict use_variable
+DECLARE
+    period_name CONSTANT name := 'system_time';
+
+    schema_name name;
+    table_name name;
+    kind "char";
+    persistence "char";
+    alter_commands text[] DEFAULT '{}';
+
+    start_attnum smallint;
+    start_type oid;
+    start_collation oid;
+    start_notnull boolean;
+
+    end_attnum smallint;
+    end_type oid;
+    end_collation oid;
+    end_notnull boolean;
+
+    excluded_column_name name;
+
+    DATE_OID CONSTANT integer := 1082;
+    TIMESTAMP_OID CONSTANT integer := 1114;
+    TIMESTAMPTZ_OID CONSTANT integer := 1184;
+    range_type regtype;
+BEGIN
+    IF table_class IS NULL THEN
+        RAISE EXCEPTION 'no table name specified';
+    END IF;
+
+    /* Always serialize operations on our catalogs */
+    PERFORM periods._serialize(table_class);
+
+    /*
+     * REFERENCES:
+     *     SQL:2016 4.15.2.2
+     *     SQL:2016 11.7
+     *     SQL:2016 11.27
+     */
+
+    /* The columns must not be part of UNIQUE keys. SQL:2016 11.7 SR 5)b) */
+    IF EXISTS (
+        SELECT FROM periods.unique_keys AS uk
+        WHERE uk.column_names && ARRAY[start_column_name, end_column_name])
+    THEN
+        RAISE EXCEPTION 'columns in period for SYSTEM_TIME are not allowed in UNIQUE keys';
+    END IF;
+
+    /* Must be a regular persistent base table. SQL:2016 11.27 SR 2 */
+
+    SELECT n.nspname, c.relname, c.relpersistence, c.relkind
+    INTO schema_name, table_name, persistence, kind
+    FROM pg_catalog.pg_class AS c
+    JOIN pg_catalog.pg_namespace AS n ON n.oid = c.relnamespace
+    WHERE c.oid = table_class;
+
+    IF kind <> 'r' THEN
+        /*
+         * The main reason partitioned tables aren't supported yet is simply
+         * beceuase I haven't put any thought into it.
+         * Maybe it's trivial, maybe not.
+         */
+        IF kind = 'p' THEN
+            RAISE EXCEPTION 'partitioned tables are not supported yet';
+        END IF;
+
+        RAISE EXCEPTION 'relation % is not a table', $1;
+    END IF;
+
+    IF persistence <> 'p' THEN
+        /* We could probably accept unlogged tables but what's the point? */
+        RAISE EXCEPTION 'table "%" must be persistent', table_class;
+    END IF;
+
+    /*
+     * Check if period already exists.
+     *
+     * SQL:2016 11.27 SR 4.a
+     */
+    IF EXISTS (SELECT FROM periods.periods AS p WHERE (p.table_name, p.period_name) = (table_class, period_name)) THEN
+        RAISE EXCEPTION 'period for SYSTEM_TIME already exists on table "%"', table_class;
+    END IF;
+
+    /*
+     * Although we are not creating a new object, the SQL standard says that
+     * periods are in the same namespace as columns, so prevent that.
+     *
+     * SQL:2016 11.27 SR 4.b
+     */
+    IF EXISTS (SELECT FROM pg_catalog.pg_attribute AS a WHERE (a.attrelid, a.attname) = (table_class, period_name)) THEN
+        RAISE EXCEPTION 'a column named system_time already exists for table "%"', table_class;
+    END IF;
+
+    /* The standard says that the columns must not exist already, but we don't obey that rule for now. */
+
+    /* Get start column information */
+    SELECT a.attnum, a.atttypid, a.attnotnull
+    INTO start_attnum, start_type, start_notnull
+    FROM pg_catalog.pg_attribute AS a
+    WHERE (a.attrelid, a.attname) = (table_class, start_column_name);
+
+    IF NOT FOUND THEN
+       /*
+        * First add the column with DEFAULT of -infinity to fill the
+        * current rows, then replace the DEFAULT with transaction_timestamp() for future
+        * rows.
+        *
+        * The default value is just for self-documentation anyway because
+        * the trigger will enforce the value.
+        */
+        alter_commands := alter_commands || format('ADD COLUMN %I timestamp with time zone NOT NULL DEFAULT ''-infinity''', start_column_name);
+
+        start_attnum := 0;
+        start_type := 'timestamp with time zone'::regtype;
+        start_notnull := true;
+    END IF;
+    alter_commands := alter_commands || format('ALTER COLUMN %I SET DEFAULT transaction_timestamp()', start_column_name);
+
+    IF start_attnum < 0 THEN
+        RAISE EXCEPTION 'system columns cannot be used in periods';
+    END IF;
+
+    /* Get end column information */
+    SELECT a.attnum, a.atttypid, a.attnotnull
+    INTO end_attnum, end_type, end_notnull
+    FROM pg_catalog.pg_attribute AS a
+    WHERE (a.attrelid, a.attname) = (table_class, end_column_name);
+
+    IF NOT FOUND THEN
+        alter_commands := alter_commands || format('ADD COLUMN %I timestamp with time zone NOT NULL DEFAULT ''infinity''', end_column_name);
+
+        end_attnum := 0;
+        end_type := 'timestamp with time zone'::regtype;
+        end_notnull := true;
+    ELSE
+        alter_commands := alter_commands || format('ALTER COLUMN %I SET DEFAULT ''infinity''', end_column_name);
+    END IF;
+
+    IF end_attnum < 0 THEN
+        RAISE EXCEPTION 'system columns cannot be used in periods';
+    END IF;
+
+    /* Verify compatibility of start/end columns */
+    IF start_type::regtype NOT IN ('date', 'timestamp without time zone', 'timestamp with time zone') THEN
+        RAISE EXCEPTION 'SYSTEM_TIME periods must be of type "date", "timestamp without time zone", or "timestamp with time zone"';
+    END IF;
+    IF start_type <> end_type THEN
+        RAISE EXCEPTION 'start and end columns must be of same type';
+    END IF;
+
+    /* Get appropriate range type */
+    CASE start_type
+        WHEN DATE_OID THEN range_type := 'daterange';
+        WHEN TIMESTAMP_OID THEN range_type := 'tsrange';
+        WHEN TIMESTAMPTZ_OID THEN range_type := 'tstzrange';
+    ELSE
+        RAISE EXCEPTION 'unexpected data type: "%"', start_type::regtype;
+    END CASE;
+
+    /* can't be part of a foreign key */
+    IF EXISTS (
+        SELECT FROM periods.foreign_keys AS fk
+        WHERE fk.table_name = table_class
+          AND fk.column_names && ARRAY[start_column_name, end_column_name])
+    THEN
+        RAISE EXCEPTION 'columns for SYSTEM_TIME must not be part of foreign keys';
+    END IF;
+
+    /*
+     * Period columns must not be nullable.
+     */
+    IF NOT start_notnull THEN
+        alter_commands := alter_commands || format('ALTER COLUMN %I SET NOT NULL', start_column_name);
+    END IF;
+    IF NOT end_notnull THEN
+        alter_commands := alter_commands || format('ALTER COLUMN %I SET NOT NULL', end_column_name);
+    END IF;
+
+    /*
+     * Find and appropriate a CHECK constraint to make sure that start < end.
+     * Create one if necessary.
+     *
+     * SQL:2016 11.27 GR 2.b
+     */
+    DECLARE
+        condef CONSTANT text := format('CHECK ((%I < %I))', start_column_name, end_column_name);
+        context text;
+    BEGIN
+        IF bounds_check_constraint IS NOT NULL THEN
+            /* We were given a name, does it exist? */
+            SELECT pg_catalog.pg_get_constraintdef(c.oid)
+            INTO context
+            FROM pg_catalog.pg_constraint AS c
+            WHERE (c.conrelid, c.conname) = (table_class, bounds_check_constraint)
+              AND c.contype = 'c';
+
+            IF FOUND THEN
+                /* Does it match? */
+                IF context <> condef THEN
+                    RAISE EXCEPTION 'constraint "%" on table "%" does not match', bounds_check_constraint, table_class;
+                END IF;
+            ELSE
+                /* If it doesn't exist, we'll use the name for the one we create. */
+                alter_commands := alter_commands || format('ADD CONSTRAINT %I %s', bounds_check_constraint, condef);
+            END IF;
+        ELSE
+            /* No name given, can we appropriate one? */
+            SELECT c.conname
+            INTO bounds_check_constraint
+            FROM pg_catalog.pg_constraint AS c
+            WHERE c.conrelid = table_class
+              AND c.contype = 'c'
+              AND pg_catalog.pg_get_constraintdef(c.oid) = condef;
+
+            /* Make our own then */
+            IF NOT FOUND THEN
+                SELECT c.relname
+                INTO table_name
+                FROM pg_catalog.pg_class AS c
+                WHERE c.oid = table_class;
+
+                bounds_check_constraint := periods._choose_name(ARRAY[table_name, period_name], 'check');
+                alter_commands := alter_commands || format('ADD CONSTRAINT %I %s', bounds_check_constraint, condef);
+            END IF;
+        END IF;
+    END;
+
+    /*
+     * Find and appropriate a CHECK constraint to make sure that end = 'infinity'.
+     * Create one if necessary.
+     *
+     * SQL:2016 4.15.2.2
+     */
+    DECLARE
+        condef CONSTANT text := format('CHECK ((%I = ''infinity''::timestamp with time zone))', end_column_name);
+        context text;
+    BEGIN
+        IF infinity_check_constraint IS NOT NULL THEN
+            /* We were given a name, does it exist? */
+            SELECT pg_catalog.pg_get_constraintdef(c.oid)
+            INTO context
+            FROM pg_catalog.pg_constraint AS c
+            WHERE (c.conrelid, c.conname) = (table_class, infinity_check_constraint)
+              AND c.contype = 'c';
+
+            IF FOUND THEN
+                /* Does it match? */
+                IF context <> condef THEN
+                    RAISE EXCEPTION 'constraint "%" on table "%" does not match', infinity_check_constraint, table_class;
+                END IF;
+            ELSE
+                /* If it doesn't exist, we'll use the name for the one we create. */
+                alter_commands := alter_commands || format('ADD CONSTRAINT %I %s', infinity_check_constraint, condef);
+            END IF;
+        ELSE
+            /* No name given, can we appropriate one? */
+            SELECT c.conname
+            INTO infinity_check_constraint
+            FROM pg_catalog.pg_constraint AS c
+            WHERE c.conrelid = table_class
+              AND c.contype = 'c'
+              AND pg_catalog.pg_get_constraintdef(c.oid) = condef;
+
+            /* Make our own then */
+            IF NOT FOUND THEN
+                SELECT c.relname
+                INTO table_name
+                FROM pg_catalog.pg_class AS c
+                WHERE c.oid = table_class;
+
+                infinity_check_constraint := periods._choose_name(ARRAY[table_name, end_column_name], 'infinity_check');
+                alter_commands := alter_commands || format('ADD CONSTRAINT %I %s', infinity_check_constraint, condef);
+            END IF;
+        END IF;
+    END;
+
+    /* If we've created any work for ourselves, do it now */
+    IF alter_commands <> '{}' THEN
+        EXECUTE format('ALTER TABLE %I.%I %s', schema_name, table_name, array_to_string(alter_commands, ', '));
+
+        IF start_attnum = 0 THEN
+            SELECT a.attnum
+            INTO start_attnum
+            FROM pg_catalog.pg_attribute AS a
+            WHERE (a.attrelid, a.attname) = (table_class, start_column_name);
+        END IF;
+
+        IF end_attnum = 0 THEN
+            SELECT a.attnum
+            INTO end_attnum
+            FROM pg_catalog.pg_attribute AS a
+            WHERE (a.attrelid, a.attname) = (table_class, end_column_name);
+        END IF;
+    END IF;
+
+    /* Make sure all the excluded columns exist */
+    FOR excluded_column_name IN
+        SELECT u.name
+        FROM unnest(excluded_column_names) AS u (name)
+        WHERE NOT EXISTS (
+            SELECT FROM pg_catalog.pg_attribute AS a
+            WHERE (a.attrelid, a.attname) = (table_class, u.name))
+    LOOP
+        RAISE EXCEPTION 'column "%" does not exist', excluded_column_name;
+    END LOOP;
+
+    /* Don't allow system columns to be excluded either */
+    FOR excluded_column_name IN
+        SELECT u.name
+        FROM unnest(excluded_column_names) AS u (name)
+        JOIN pg_catalog.pg_attribute AS a ON (a.attrelid, a.attname) = (table_class, u.name)
+        WHERE a.attnum < 0
+    LOOP
+        RAISE EXCEPTION 'cannot exclude system column "%"', excluded_column_name;
+    END LOOP;
+
+    generated_always_trigger := coalesce(
+        generated_always_trigger,
+        periods._choose_name(ARRAY[table_name], 'system_time_generated_always'));
+    EXECUTE format('CREATE TRIGGER %I BEFORE INSERT OR UPDATE ON %s FOR EACH ROW EXECUTE PROCEDURE periods.generated_always_as_row_start_end()', generated_always_trigger, table_class);
+
+    write_history_trigger := coalesce(
+        write_history_trigger,
+        periods._choose_name(ARRAY[table_name], 'system_time_write_history'));
+    EXECUTE format('CREATE TRIGGER %I AFTER INSERT OR UPDATE OR DELETE ON %s FOR EACH ROW EXECUTE PROCEDURE periods.write_history()', write_history_trigger, table_class);
+
+    truncate_trigger := coalesce(
+        truncate_trigger,
+        periods._choose_name(ARRAY[table_name], 'truncate'));
+    EXECUTE format('CREATE TRIGGER %I AFTER TRUNCATE ON %s FOR EACH STATEMENT EXECUTE PROCEDURE periods.truncate_system_versioning()', truncate_trigger, table_class);
+
+    INSERT INTO periods.periods (table_name, period_name, start_column_name, end_column_name, range_type, bounds_check_constraint)
+    VALUES (table_class, period_name, start_column_name, end_column_name, range_type, bounds_check_constraint);
+
+    INSERT INTO periods.system_time_periods (
+        table_name, period_name, infinity_check_constraint,
+        generated_always_trigger, write_history_trigger, truncate_trigger,
+        excluded_column_names, skip_unchanged)
+    VALUES (
+        table_class, period_name, infinity_check_constraint,
+        generated_always_trigger, write_history_trigger, truncate_trigger,
+        excluded_column_names, coalesce(skip_unchanged, false));
+
+    RETURN true;
+END;
+$function$;
+
+DROP FUNCTION periods.set_system_time_period_excluded_columns(regclass,name[]);
+CREATE FUNCTION periods.set_system_time_period_excluded_columns(
+    table_name regclass,
+    excluded_column_names name[],
+    skip_unchanged boolean DEFAULT NULL)
+ RETURNS void
+ LANGUAGE plpgsql
+ SECURITY DEFINER
+AS
+$function$
+#variable_conflict use_variable
+DECLARE
+    excluded_column_name name;
+BEGIN
+    /* Always serialize operations on our catalogs */
+    PERFORM periods._serialize(table_name);
+
+    /* Make sure all the excluded columns exist */
+    FOR excluded_column_name IN
+        SELECT u.name
+        FROM unnest(excluded_column_names) AS u (name)
+        WHERE NOT EXISTS (
+            SELECT FROM pg_catalog.pg_attribute AS a
+            WHERE (a.attrelid, a.attname) = (table_name, u.name))
+    LOOP
+        RAISE EXCEPTION 'column "%" does not exist', excluded_column_name;
+    END LOOP;
+
+    /* Don't allow system columns to be excluded either */
+    FOR excluded_column_name IN
+        SELECT u.name
+        FROM unnest(excluded_column_names) AS u (name)
+        JOIN pg_catalog.pg_attribute AS a ON (a.attrelid, a.attname) = (table_name, u.name)
+        WHERE a.attnum < 0
+    LOOP
+        RAISE EXCEPTION 'cannot exclude system column "%"', excluded_column_name;
+    END LOOP;
+
+    /* Do it. */
+    UPDATE periods.system_time_periods AS stp SET
+        excluded_column_names = excluded_column_names,
+        skip_unchanged = coalesce(skip_unchanged, stp.skip_unchanged)
+    WHERE stp.table_name = table_name;
+END;
+$function$;
+
+/* Runs of identical versions in the history can be merged */
+
+CREATE FUNCTION periods._coalesce_history(table_name regclass, before timestamp with time zone, key_column_names name[], batch_size integer, max_batches integer)
+ RETURNS bigint
+ LANGUAGE c
+AS 'MODULE_PATHNAME', 'coalesce_history';
+
+/*
+ * Merge the versions of each row in the history of a table that ended before
+ * the given time and that only differ from the version before them by their
+ * SYSTEM_TIME, such as the ones left by updates that didn't change anything or
+ * only changed excluded columns.  Each run of them becomes one version.
+ *
+ * The versions of a row are found with the primary key of the table, or with
+ * a unique key if it doesn't have one.  The work is done in batches of
+ * batch_size runs and, like for purge_history(), max_batches lets the caller
+ * commit and call us again until we return zero.  The return value is the
+ * number of versions removed.
+ *
+ * This is not SECURITY DEFINER, only the owner of the table can coalesce its
+ * history.
+ */
+CREATE FUNCTION periods.coalesce_history(table_name regclass, before timestamp with time zone, batch_size integer DEFAULT 10000, max_batches integer DEFAULT NULL)
+ RETURNS bigint
+ LANGUAGE plpgsql
+AS
+$function$
+#variable_conflict use_variable
+DECLARE
+    key_column_names name[];
+BEGIN
+    IF table_name IS NULL THEN
+        RAISE EXCEPTION 'no table name specified';
+    END IF;
+
+    IF NOT EXISTS (
+        SELECT FROM pg_catalog.pg_class AS c
+        WHERE c.oid = table_name
+          AND pg_catalog.pg_has_role(current_user, c.relowner, 'USAGE'))
+    THEN
+        RAISE EXCEPTION 'must be owner of table %', table_name;
+    END IF;
+
+    IF before IS NULL THEN
+        RAISE EXCEPTION 'no cutoff time specified';
+    END IF;
+
+    IF batch_size IS NULL OR batch_size <= 0 THEN
+        RAISE EXCEPTION 'batch size must be greater than zero';
+    END IF;
+
+    /* Always serialize operations on our catalogs */
+    PERFORM periods._serialize(table_name);
+
+    IF NOT EXISTS (SELECT FROM periods.system_versioning AS sv WHERE sv.table_name = table_name) THEN
+        RAISE EXCEPTION 'table % does not have SYSTEM VERSIONING', table_name;
+    END IF;
+
+    key_column_names := periods._history_key(table_name);
+    IF key_column_names IS NULL THEN
+        RAISE EXCEPTION 'table % has no primary key or unique key to tell its rows apart', table_name;
+    END IF;
+
+    RETURN periods._coalesce_history(table_name, before, key_column_names, batch_size, max_batches);
+END;
+$function$;
+
+/* AS OF a series of times in one pass over the history */
+
+ALTER TABLE periods.system_versioning
+    ADD COLUMN func_as_of_series text,
+    ADD UNIQUE (func_as_of_series)
+;
+
+/* Changes between two times, in pages */
+
+CREATE TYPE periods.change_type AS ENUM ('INSERT', 'UPDATE', 'DELETE');
+
+/*
+ * The columns that tell the rows of a table with SYSTEM VERSIONING apart in
+ * its history: those of its primary key, or of one of its unique keys if it
+ * doesn't have one.  A primary key could include the SYSTEM_TIME columns, but
+ * those change with every version.
+ */
+CREATE FUNCTION periods._history_key(table_name regclass)
+ RETURNS name[]
+ LANGUAGE sql
+ STABLE
+AS
+$function$
+SELECT coalesce(
+    (SELECT array_agg(a.attname ORDER BY k.ordinality)
+     FROM pg_catalog.pg_constraint AS c
+     CROSS JOIN LATERAL unnest(c.conkey) WITH ORDINALITY AS k (attnum, ordinality)
+     JOIN pg_catalog.pg_attribute AS a ON (a.attrelid, a.attnum) = (c.conrelid, k.attnum)
+     JOIN periods.periods AS p ON (p.table_name, p.period_name) = (c.conrelid, 'system_time')
+     WHERE (c.conrelid, c.contype) = ($1, 'p')
+       AND a.attname NOT IN (p.start_column_name, p.end_column_name)),
+    (SELECT uk.column_names
+     FROM periods.unique_keys AS uk
+     WHERE uk.table_name = $1
+     ORDER BY uk.key_name
+     LIMIT 1));
+$function$;
+
+/*
+ * Return what happened to the rows of a table after one time and up to and
+ * including another, as one event per row and point in time.  A version that
+ * started when another version of the same row ended is an UPDATE, otherwise
+ * it is an INSERT, and a version that ended without another one starting is a
+ * DELETE.  The rows are told apart like in coalesce_history().
+ *
+ * The events come in order of their time and then of their key so that they
+ * can be read in pages of max_rows events, each one starting after the time
+ * and key of the last event of the page before it.  Only the versions that
+ * started or ended in the interval are read, so indexes on the start and end
+ * of SYSTEM_TIME of the table and of its history keep every page cheap.
+ */
+CREATE FUNCTION periods.changes_between(
+    table_name regclass,
+    from_time timestamp with time zone,
+    to_time timestamp with time zone,
+    after_time timestamp with time zone DEFAULT NULL,
+    after_key jsonb DEFAULT NULL,
+    max_rows integer DEFAULT NULL)
+ RETURNS TABLE (change_time timestamp with time zone, change_type periods.change_type, key jsonb, old_row jsonb, new_row jsonb)
+ LANGUAGE plpgsql
+ STABLE
+AS
+$function$
+#variable_conflict use_variable
+DECLARE
+    period_row periods.periods;
+    history_table regclass;
+    history_view regclass;
+    key_column_names name[];
+    key_sql text;
+BEGIN
+    IF table_name IS NULL THEN
+        RAISE EXCEPTION 'no table name specified';
+    END IF;
+
+    IF from_time IS NULL OR to_time IS NULL THEN
+        RAISE EXCEPTION 'no interval specified';
+    END IF;
+
+    IF (after_time IS NULL) <> (after_key IS NULL) THEN
+        RAISE EXCEPTION 'after_time and after_key must be given together';
+    END IF;
+
+    IF max_rows <= 0 THEN
+        RAISE EXCEPTION 'maximum number of rows must be greater than zero';
+    END IF;
+
+    SELECT sv.history_table_name, sv.view_name
+    INTO history_table, history_view
+    FROM periods.system_versioning AS sv
+    WHERE sv.table_name = table_name;
+
+    IF NOT FOUND THEN
+        RAISE EXCEPTION 'table % does not have SYSTEM VERSIONING', table_name;
+    END IF;
+
+    SELECT p.*
+    INTO period_row
+    FROM periods.periods AS p
+    WHERE (p.table_name, p.period_name) = (table_name, 'system_time');
+
+    key_column_names := periods._history_key(table_name);
+    IF key_column_names IS NULL THEN
+        RAISE EXCEPTION 'table % has no primary key or unique key to tell its rows apart', table_name;
+    END IF;
+
+    SELECT format('jsonb_build_object(%s)', string_agg(format('%L, r.%I', u.column_name, u.column_name), ', ' ORDER BY u.ordinality))
+    INTO key_sql
+    FROM unnest(key_column_names) WITH ORDINALITY AS u (column_name, ordinality);
+
+    /*
+     * The versions that ended are only in the history, but the ones that
+     * started can be in either table.  An old and a new version of the same
+     * row at the same time make an UPDATE.
+     */
+    RETURN QUERY EXECUTE format(
+        'SELECT coalesce(o.change_time, n.change_time), '
+        '       CASE WHEN o.key IS NULL THEN ''INSERT'' '
+        '            WHEN n.key IS NULL THEN ''DELETE'' '
+        '            ELSE ''UPDATE'' '
+        '       END::periods.change_type, '
+        '       coalesce(o.key, n.key), o.row_data, n.row_data '
+        'FROM (SELECT r.%3$I::timestamp with time zone AS change_time, %5$s AS key, to_jsonb(r) AS row_data '
+        '      FROM %1$s AS r '
+        '      WHERE r.%3$I > $1 AND r.%3$I <= $2 AND r.%3$I >= $3) AS o '
+        'FULL JOIN (SELECT r.%4$I::timestamp with time zone AS change_time, %5$s AS key, to_jsonb(r) AS row_data '
+        '           FROM %2$s AS r '
+        '           WHERE r.%4$I > $1 AND r.%4$I <= $2 AND r.%4$I >= $3) AS n '
+        '      ON (o.change_time, o.key) = (n.change_time, n.key) '
+        'WHERE $4 IS NULL OR (coalesce(o.change_time, n.change_time), coalesce(o.key, n.key)) > ($3, $4) '
+        'ORDER BY 1, 3 '
+        'LIMIT $5',
+        history_table, history_view, period_row.end_column_name, period_row.start_column_name, key_sql)
+    USING from_time, to_time, coalesce(after_time, '-infinity'), after_key, max_rows;
+END;
+$function$;
+
+/*
+ * Statistics about what the triggers do, per table.  They are only kept when
+ * the library is in shared_preload_libraries, and are added up when each
+ * transaction ends.  The times are in milliseconds.
+ */
+CREATE FUNCTION periods._stat_tables(
+    OUT table_name regclass,
+    OUT rows_archived bigint,
+    OUT history_bytes bigint,
+    OUT excluded_skips bigint,
+    OUT unchanged_skips bigint,
+    OUT invalid_row_versions bigint,
+    OUT fk_checks bigint,
+    OUT plan_hits bigint,
+    OUT plan_misses bigint,
+    OUT generated_always_calls bigint,
+    OUT generated_always_time double precision,
+    OUT write_history_calls bigint,
+    OUT write_history_time double precision,
+    OUT fk_trigger_calls bigint,
+    OUT fk_trigger_time double precision,
+    OUT uk_trigger_calls bigint,
+    OUT uk_trigger_time double precision)
+ RETURNS SETOF record
+ LANGUAGE c
+ STRICT
+AS 'MODULE_PATHNAME', 'stat_tables';
+
+CREATE VIEW periods.stat_tables AS
+    SELECT s.*
+    FROM periods._stat_tables() AS s;
+GRANT SELECT ON TABLE periods.stat_tables TO PUBLIC;
+
+/* Like pg_stat_statements_reset(), only superusers can call this by default */
+CREATE FUNCTION periods.stat_tables_reset(table_name regclass DEFAULT NULL)
+ RETURNS void
+ LANGUAGE c
+AS 'MODULE_PATHNAME', 'stat_tables_reset';
+REVOKE ALL ON FUNCTION periods.stat_tables_reset(regclass) FROM PUBLIC;
+
+
+/*
+ * Does a set of periods cover a period with no gaps?  This is how the foreign
+ * keys check the referenced rows, and covers() must be given the periods
+ * sorted by their start.
+ */
+CREATE FUNCTION periods._covers_transfn(internal, anyelement, anyelement, anyelement, anyelement)
+ RETURNS internal
+ LANGUAGE c
+AS 'MODULE_PATHNAME', 'covers_transfn';
+
+CREATE FUNCTION periods._covers_finalfn(internal)
+ RETURNS boolean
+ LANGUAGE c
+AS 'MODULE_PATHNAME', 'covers_finalfn';
+
+CREATE AGGREGATE periods.covers(start_value anyelement, end_value anyelement, target_start anyelement, target_end anyelement) (
+    SFUNC = periods._covers_transfn,
+    STYPE = internal,
+    FINALFUNC = periods._covers_finalfn
+);
+
+/* The fewest periods covering the same values, with no overlaps */
+CREATE FUNCTION periods.normalize(start_values anyarray, end_values anyarray)
+ RETURNS TABLE (start_value anyelement, end_value anyelement)
+ LANGUAGE c
+ IMMUTABLE STRICT
+AS 'MODULE_PATHNAME', 'normalize_periods';
+
+
+CREATE OR REPLACE FUNCTION periods.validate_foreign_key_new_row(foreign_key_name name, row_data jsonb)
+ RETURNS boolean
+ LANGUAGE plpgsql
+AS
+$function$
+#variable_conflict use_variable
+DECLARE
+    foreign_key_info record;
+    row_clause text DEFAULT 'true';
+    violation boolean;
+
+	QSQL CONSTANT text :=
+        'SELECT EXISTS ( '
+        '    SELECT FROM %5$I.%6$I AS fk '
+        '    WHERE NOT (SELECT periods.covers(uk.uk_start_value, uk.uk_end_value, fk.%7$I, fk.%8$I '
+        '                                     ORDER BY uk.uk_start_value) '
+        '               FROM (SELECT uk.%3$I AS uk_start_value, '
+        '                            uk.%4$I AS uk_end_value '
+        '                     FROM %1$I.%2$I AS uk '
+        '                     WHERE %9$s '
+        '                       AND uk.%3$I <= fk.%8$I '
+        '                       AND uk.%4$I >= fk.%7$I '
+        '                     FOR KEY SHARE '
+        '                    ) AS uk '
+        '              ) AND %10$s '
+        ')';
+
+BEGIN
+    SELECT fc.oid AS fk_table_oid,
+           fn.nspname AS fk_schema_name,
+           fc.relname AS fk_table_name,
+           fk.column_names AS fk_column_names,
+           fp.period_name AS fk_period_name,
+           fp.start_column_name AS fk_start_column_name,
+           fp.end_column_name AS fk_end_column_name,
+
+           un.nspname AS uk_schema_name,
+           uc.relname AS uk_table_name,
+           uk.column_names AS uk_column_names,
+           up.period_name AS uk_period_name,
+           up.start_column_name AS uk_start_column_name,
+           up.end_column_name AS uk_end_column_name,
+
+           fk.match_type,
+           fk.update_action,
+           fk.delete_action
+    INTO foreign_key_info
+    FROM periods.foreign_keys AS fk
+    JOIN periods.periods AS fp ON (fp.table_name, fp.period_name) = (fk.table_name, fk.period_name)
+    JOIN pg_catalog.pg_class AS fc ON fc.oid = fk.table_name
+    JOIN pg_catalog.pg_namespace AS fn ON fn.oid = fc.relnamespace
+    JOIN periods.unique_keys AS uk ON uk.key_name = fk.unique_key
+    JOIN periods.periods AS up ON (up.table_name, up.period_name) = (uk.table_name, uk.period_name)
+    JOIN pg_catalog.pg_class AS uc ON uc.oid = uk.table_name
+    JOIN pg_catalog.pg_namespace AS un ON un.oid = uc.relnamespace
+    WHERE fk.key_name = foreign_key_name;
+
+    IF NOT FOUND THEN
+        RAISE EXCEPTION 'foreign key "%" not found', foreign_key_name;
+    END IF;
+
+    /*
+     * Now that we have all of our names, we can see if there are any nulls in
+     * the row we were given (if we were given one).
+     */
+    IF row_data IS NOT NULL THEN
+        DECLARE
+            column_name name;
+            has_nulls boolean;
+            all_nulls boolean;
+            cols text[] DEFAULT '{}';
+            vals text[] DEFAULT '{}';
+        BEGIN
+            FOREACH column_name IN ARRAY foreign_key_info.fk_column_names LOOP
+                has_nulls := has_nulls OR row_data->>column_name IS NULL;
+                all_nulls := all_nulls IS NOT false AND row_data->>column_name IS NULL;
+                cols := cols || ('fk.' || quote_ident(column_name));
+                vals := vals || quote_literal(row_data->>column_name);
+            END LOOP;
+
+            IF all_nulls THEN
+                /*
+                 * If there are no values at all, all three types pass.
+                 *
+                 * Period columns are by definition NOT NULL so the FULL MATCH
+                 * type is only concerned with the non-period columns of the
+                 * constraint.  SQL:2016 4.23.3.3
+                 */
+                RETURN true;
+            END IF;
+
+            IF has_nulls THEN
+                CASE foreign_key_info.match_type
+                    WHEN 'SIMPLE' THEN
+                        RETURN true;
+                    WHEN 'PARTIAL' THEN
+                        RAISE EXCEPTION 'partial not implemented';
+                    WHEN 'FULL' THEN
+                        RAISE EXCEPTION 'foreign key violated (nulls in FULL)';
+                END CASE;
+            END IF;
+
+            row_clause := format(' (%s) = (%s)', array_to_string(cols, ', '), array_to_string(vals, ', '));
+        END;
+    END IF;
+
+    EXECUTE format(QSQL, foreign_key_info.uk_schema_name,
+                         foreign_key_info.uk_table_name,
+                         foreign_key_info.uk_start_column_name,
+                         foreign_key_info.uk_end_column_name,
+                         foreign_key_info.fk_schema_name,
+                         foreign_key_info.fk_table_name,
+                         foreign_key_info.fk_start_column_name,
+                         foreign_key_info.fk_end_column_name,
+                         (SELECT string_agg(format('%I = %I', ukc, fkc), ' AND ')
+                          FROM unnest(foreign_key_info.uk_column_names,
+                                      foreign_key_info.fk_column_names) AS u (ukc, fkc)
+                         ),
+                         row_clause)
+    INTO violation;
+
+    IF violation THEN
+        IF row_data IS NULL THEN
+            RAISE EXCEPTION 'foreign key violated by some row';
+        ELSE
+            RAISE EXCEPTION 'insert or update on table "%" violates foreign key constraint "%"',
+                foreign_key_info.fk_table_oid::regclass,
+                foreign_key_name;
+        END IF;
+    END IF;
+
+    RETURN true;
+END;
+$function$;
+
+
+/*
+ * The event triggers below only have work to do when a command touches one of
+ * the objects in our catalogs, so they first check for that with these
+ * functions.  They look up the objects reported by the command instead of
+ * scanning all of our catalogs against the system catalogs.
+ */
+CREATE FUNCTION periods._object_relation(classid oid, objid oid)
+ RETURNS oid
+ LANGUAGE c
+ STRICT STABLE
+AS 'MODULE_PATHNAME', 'object_relation';
+
+CREATE FUNCTION periods._is_tracked_relation(relation oid)
+ RETURNS boolean
+ LANGUAGE sql
+ STABLE
+AS
+$function$
+SELECT EXISTS (SELECT FROM periods.periods AS p WHERE p.table_name = $1)
+    OR EXISTS (SELECT FROM periods.system_versioning AS sv WHERE $1 IN (sv.history_table_name, sv.view_name))
+    OR EXISTS (SELECT FROM periods.for_portion_views AS fpv WHERE fpv.view_name = $1);
+$function$;
+
+CREATE FUNCTION periods._ddl_commands_touch_periods()
+ RETURNS boolean
+ LANGUAGE sql
+ STABLE
+AS
+$function$
+SELECT EXISTS (
+    SELECT
+    FROM pg_catalog.pg_event_trigger_ddl_commands() AS cmd
+    WHERE cmd.objid IS NULL /* GRANT, REVOKE */
+       OR cmd.command_tag IN ('ALTER FUNCTION', 'ALTER ROUTINE', 'ALTER SCHEMA')
+       OR periods._is_tracked_relation(periods._object_relation(cmd.classid, cmd.objid)));
+$function$;
+
+CREATE FUNCTION periods._dropped_objects_touch_periods()
+ RETURNS boolean
+ LANGUAGE sql
+ STABLE
+AS
+$function$
+SELECT EXISTS (
+    SELECT
+    FROM pg_catalog.pg_event_trigger_dropped_objects() AS dobj
+    WHERE CASE
+          WHEN dobj.object_type IN ('table', 'view', 'table column') THEN
+              periods._is_tracked_relation(dobj.objid)
+
+          /* The table of a trigger or a constraint can only be found by its name */
+          WHEN dobj.object_type IN ('trigger', 'table constraint') THEN
+              periods._is_tracked_relation((
+                  SELECT c.oid
+                  FROM pg_catalog.pg_class AS c
+                  JOIN pg_catalog.pg_namespace AS n ON n.oid = c.relnamespace
+                  WHERE (n.nspname, c.relname) = (dobj.address_names[1], dobj.address_names[2])))
+
+          WHEN dobj.object_type = 'index' THEN
+              EXISTS (SELECT FROM periods.history_indexes AS hi WHERE hi.index_name = dobj.objid)
+
+          WHEN dobj.object_type = 'type' THEN
+              EXISTS (SELECT FROM periods.periods AS p WHERE p.range_type = dobj.objid)
+
+          WHEN dobj.object_type = 'function' THEN
+              EXISTS (SELECT FROM periods.system_versioning AS sv
+                      WHERE dobj.object_identity = ANY (ARRAY[sv.func_as_of, sv.func_between, sv.func_between_symmetric, sv.func_from_to, sv.func_as_of_series]))
+
+          ELSE false
+          END);
+$function$;
+
+/*
+ * UPDATE and DELETE FOR PORTION OF as functions, for when a view per period
+ * is too much or a portion has to be deleted.  The rows are taken care of
+ * all at once: one statement modifies the part of each row within the
+ * portion and inserts what was outside of it back as new rows.
+ */
+CREATE FUNCTION periods._for_portion_of(table_name regclass, period_name name, from_value anyelement, to_value anyelement, set_clause text, where_clause text)
+ RETURNS bigint
+ LANGUAGE plpgsql
+AS
+$function$
+#variable_conflict use_variable
+DECLARE
+    start_column_name name;
+    end_column_name name;
+    column_type text;
+    generated_condition text;
+    generated_column_names name[];
+    insert_columns text;
+    remnant_values text;
+    key_columns text;
+    old_key_columns text;
+    modify_sql text;
+    portion_is_valid boolean;
+    result bigint;
+BEGIN
+    IF table_name IS NULL THEN
+        RAISE EXCEPTION 'no table name specified';
+    END IF;
+
+    IF period_name IS NULL THEN
+        RAISE EXCEPTION 'no period name specified';
+    END IF;
+
+    /* Can't use FOR PORTION OF on SYSTEM_TIME columns */
+    IF period_name = 'system_time' THEN
+        RAISE EXCEPTION 'cannot use FOR PORTION OF on SYSTEM_TIME periods';
+    END IF;
+
+    IF where_clause IS NULL THEN
+        RAISE EXCEPTION 'no WHERE clause specified';
+    END IF;
+
+    IF from_value IS NULL OR to_value IS NULL THEN
+        RAISE EXCEPTION 'the portion must not be null';
+    END IF;
+
+    SELECT p.start_column_name, p.end_column_name, pg_catalog.format_type(a.atttypid, a.atttypmod)
+    INTO start_column_name, end_column_name, column_type
+    FROM periods.periods AS p
+    JOIN pg_catalog.pg_attribute AS a ON (a.attrelid, a.attname) = (p.table_name, p.start_column_name)
+    WHERE (p.table_name, p.period_name) = (table_name, period_name);
+
+    IF NOT FOUND THEN
+        RAISE EXCEPTION 'period "%" does not exist', period_name;
+    END IF;
+
+    /*
+     * Compare the portion as the type of the period, the arguments could be
+     * of any type that casts to it.  Unknown literals are taken as text, for
+     * one, and '9' isn't less than '10' as text.
+     */
+    EXECUTE format('SELECT CAST($1 AS %1$s) < CAST($2 AS %1$s)', column_type)
+    INTO portion_is_valid
+    USING from_value, to_value;
+
+    IF NOT portion_is_valid THEN
+        RAISE EXCEPTION 'the start of the portion must be less than its end';
+    END IF;
+
+    /*
+     * The rows inserted for what is outside of the portion leave out the same
+     * columns as the FOR PORTION OF views do: the ones the database generates
+     * and the SYSTEM_TIME period.  The primary key is left out too if it has a
+     * default, otherwise it is copied like everything else.
+     */
+    generated_condition := 'pg_catalog.pg_get_serial_sequence(a.attrelid::regclass::text, a.attname) IS NOT NULL';
+    IF pg_catalog.current_setting('server_version_num')::integer >= 100000 THEN
+        generated_condition := generated_condition || ' OR a.attidentity <> ''''';
+    END IF;
+    IF pg_catalog.current_setting('server_version_num')::integer >= 120000 THEN
+        generated_condition := generated_condition || ' OR a.attgenerated <> ''''';
+    END IF;
+
+    EXECUTE format($$
+        SELECT pg_catalog.array_agg(a.attname)
+        FROM pg_catalog.pg_attribute AS a
+        WHERE a.attrelid = $1
+          AND a.attnum > 0
+          AND NOT a.attisdropped
+          AND a.attname NOT IN ($2, $3)
+          AND (%s
+               OR EXISTS (SELECT FROM periods.periods AS _p
+                          WHERE (_p.table_name, _p.period_name) = (a.attrelid, 'system_time')
+                            AND a.attname IN (_p.start_column_name, _p.end_column_name))
+               OR (a.atthasdef
+                   AND EXISTS (SELECT FROM pg_catalog.pg_constraint AS _c
+                               WHERE (_c.conrelid, _c.contype) = (a.attrelid, 'p')
+                                 AND _c.conkey @> ARRAY[a.attnum])))
+        $$, generated_condition)
+    INTO generated_column_names
+    USING table_name, start_column_name, end_column_name;
+
+    SELECT pg_catalog.string_agg(pg_catalog.quote_ident(a.attname), ', ' ORDER BY a.attnum),
+           pg_catalog.string_agg(CASE a.attname
+                                     WHEN start_column_name THEN 'p.portion_start'
+                                     WHEN end_column_name THEN 'p.portion_end'
+                                     ELSE pg_catalog.format('(r.old_row).%I', a.attname)
+                                 END, ', ' ORDER BY a.attnum)
+    INTO insert_columns, remnant_values
+    FROM pg_catalog.pg_attribute AS a
+    WHERE a.attrelid = table_name
+      AND a.attnum > 0
+      AND NOT a.attisdropped
+      AND a.attname <> ALL (COALESCE(generated_column_names, '{}'));
+
+    /*
+     * Modify the rows first so that the remnants don't overlap them when they
+     * get inserted, otherwise the exclusion constraint of a UNIQUE key on the
+     * period would reject them.  Deleted rows are returned as they were, but
+     * updated rows have to be looked up before the update to get that.  They
+     * are locked as they are looked up, so that a row changed concurrently is
+     * looked at again in its latest version rather than split by the old one.
+     */
+    IF set_clause IS NULL THEN
+        modify_sql := format($$
+            DELETE FROM %1$s
+            WHERE (%2$s)
+              AND %3$I > CAST($1 AS %5$s)
+              AND %4$I < CAST($2 AS %5$s)
+            RETURNING CAST(ROW(%1$s.*) AS %1$s) AS old_row
+            $$,
+            table_name,             /* 1 */
+            where_clause,           /* 2 */
+            start_column_name,      /* 3 */
+            end_column_name,        /* 4 */
+            column_type);           /* 5 */
+    ELSE
+        SELECT pg_catalog.string_agg(pg_catalog.format('%s.%I', table_name, a.attname), ', ' ORDER BY a.attnum),
+               pg_catalog.string_agg(pg_catalog.format('(original.old_row).%I', a.attname), ', ' ORDER BY a.attnum)
+        INTO key_columns, old_key_columns
+        FROM pg_catalog.pg_constraint AS c
+        JOIN pg_catalog.pg_attribute AS a ON a.attrelid = c.conrelid AND a.attnum = ANY (c.conkey)
+        WHERE (c.conrelid, c.contype) = (table_name, 'p');
+
+        IF key_columns IS NULL THEN
+            RAISE EXCEPTION 'table "%" must have a primary key', table_name;
+        END IF;
+
+        modify_sql := format($$
+            WITH original AS (
+                SELECT CAST(ROW(%1$s.*) AS %1$s) AS old_row
+                FROM %1$s
+                WHERE (%2$s)
+                  AND %3$I > CAST($1 AS %5$s)
+                  AND %4$I < CAST($2 AS %5$s)
+                FOR UPDATE
+            )
+            UPDATE %1$s
+            SET %6$s,
+                %3$I = greatest(%3$I, CAST($1 AS %5$s)),
+                %4$I = least(%4$I, CAST($2 AS %5$s))
+            FROM original
+            WHERE (%7$s) = (%8$s)
+            RETURNING original.old_row
+            $$,
+            table_name,             /* 1 */
+            where_clause,           /* 2 */
+            start_column_name,      /* 3 */
+            end_column_name,        /* 4 */
+            column_type,            /* 5 */
+            set_clause,             /* 6 */
+            key_columns,            /* 7 */
+            old_key_columns);       /* 8 */
+    END IF;
+
+    /*
+     * The remnants are inserted once all the rows have been modified, because
+     * a data-modifying WITH query that isn't read runs after the main query.
+     */
+    EXECUTE format($$
+        WITH modified AS (%1$s),
+        remnants AS (
+            INSERT INTO %2$s (%3$s)
+            SELECT %4$s
+            FROM modified AS r
+            CROSS JOIN LATERAL (VALUES ((r.old_row).%5$I, CAST($1 AS %7$s)),
+                                       (CAST($2 AS %7$s), (r.old_row).%6$I)) AS p (portion_start, portion_end)
+            WHERE p.portion_start < p.portion_end
+        )
+        SELECT pg_catalog.count(*) FROM modified
+        $$,
+        modify_sql,             /* 1 */
+        table_name,             /* 2 */
+        insert_columns,         /* 3 */
+        remnant_values,         /* 4 */
+        start_column_name,      /* 5 */
+        end_column_name,        /* 6 */
+        column_type)            /* 7 */
+    INTO result
+    USING from_value, to_value;
+
+    RETURN result;
+END;
+$function$;
+
+/*
+ * UPDATE table FOR PORTION OF period FROM from_value TO to_value
+ * SET set_clause WHERE where_clause
+ *
+ * The clauses are pasted into the statement as they are and refer to the
+ * columns of the table.  The return value is the number of rows updated.
+ *
+ * This is not SECURITY DEFINER, the caller needs the same privileges as for
+ * the statement itself.
+ */
+CREATE FUNCTION periods.update_for_portion_of(table_name regclass, period_name name, from_value anyelement, to_value anyelement, set_clause text, where_clause text DEFAULT 'true')
+ RETURNS bigint
+ LANGUAGE plpgsql
+AS
+$function$
+#variable_conflict use_variable
+BEGIN
+    IF set_clause IS NULL THEN
+        RAISE EXCEPTION 'no SET clause specified';
+    END IF;
+
+    RETURN periods._for_portion_of(table_name, period_name, from_value, to_value, set_clause, where_clause);
+END;
+$function$;
+
+/*
+ * DELETE FROM table FOR PORTION OF period FROM from_value TO to_value
+ * WHERE where_clause
+ *
+ * Like update_for_portion_of(), but the part of the rows within the portion
+ * is removed.  The return value is the number of rows deleted.
+ */
+CREATE FUNCTION periods.delete_for_portion_of(table_name regclass, period_name name, from_value anyelement, to_value anyelement, where_clause text DEFAULT 'true')
+ RETURNS bigint
+ LANGUAGE sql
+AS
+$function$
+    SELECT periods._for_portion_of(table_name, period_name, from_value, to_value, NULL, where_clause);
+$function$;
+
+/*
+ * Rewrite one history table, or one partition of a partitioned history table,
+ * in the order of the end of SYSTEM_TIME and then the key of the rows, and
+ * report the correlation of the end column with the physical order of the
+ * rows afterwards.  This does the work of compact_history() below for each
+ * table it rewrites.
+ *
+ * The rewrite is done by CLUSTER, which copies the rows and swaps the new
+ * files in under the same table, so its privileges, its indexes and our
+ * catalogs are left as they were.
+ *
+ * This is not SECURITY DEFINER, only the owner of the table can compact its
+ * history.
+ */
+CREATE FUNCTION periods._compact_history(table_name regclass, partition_name regclass)
+ RETURNS void
+ LANGUAGE plpgsql
+AS
+$function$
+#variable_conflict use_variable
+DECLARE
+    history_table_id regclass;
+    end_column_name name;
+    key_column_names name[];
+    target_id regclass;
+    target_name name;
+    target_schema name;
+    index_name name;
+    clustered_index_name name;
+    correlation real;
+BEGIN
+    IF table_name IS NULL THEN
+        RAISE EXCEPTION 'no table name specified';
+    END IF;
+
+    IF NOT EXISTS (
+        SELECT FROM pg_catalog.pg_class AS c
+        WHERE c.oid = table_name
+          AND pg_catalog.pg_has_role(current_user, c.relowner, 'USAGE'))
+    THEN
+        RAISE EXCEPTION 'must be owner of table %', table_name;
+    END IF;
+
+    /* Always serialize operations on our catalogs */
+    PERFORM periods._serialize(table_name);
+
+    SELECT sv.history_table_name, p.end_column_name
+    INTO history_table_id, end_column_name
+    FROM periods.system_versioning AS sv
+    JOIN periods.periods AS p ON (p.table_name, p.period_name) = (sv.table_name, sv.period_name)
+    WHERE sv.table_name = table_name;
+
+    IF NOT FOUND THEN
+        RAISE EXCEPTION 'table % does not have SYSTEM VERSIONING', table_name;
+    END IF;
+
+    IF partition_name IS NOT NULL AND NOT EXISTS (
+        SELECT FROM pg_catalog.pg_inherits AS i
+        WHERE (i.inhrelid, i.inhparent) = (partition_name, history_table_id))
+    THEN
+        RAISE EXCEPTION 'table % is not a partition of history table %', partition_name, history_table_id;
+    END IF;
+
+    target_id := coalesce(partition_name, history_table_id);
+
+    SELECT c.relname, n.nspname
+    INTO target_name, target_schema
+    FROM pg_catalog.pg_class AS c
+    JOIN pg_catalog.pg_namespace AS n ON n.oid = c.relnamespace
+    WHERE c.oid = target_id
+      AND c.relkind = 'r';
+
+    IF NOT FOUND THEN
+        RAISE EXCEPTION 'history table % is partitioned, compact its partitions', target_id;
+    END IF;
+
+    /* Without a key, the rows that ended at the same time stay in any order */
+    key_column_names := periods._history_key(table_name);
+
+    /*
+     * CLUSTER needs an index in the order we want.  It marks the table as
+     * clustered on it, so put back whatever the table was clustered on before.
+     */
+    SELECT ic.relname
+    INTO clustered_index_name
+    FROM pg_catalog.pg_index AS i
+    JOIN pg_catalog.pg_class AS ic ON ic.oid = i.indexrelid
+    WHERE i.indrelid = target_id
+      AND i.indisclustered;
+
+    index_name := periods._choose_name(ARRAY[target_name], 'compact_idx');
+    EXECUTE format('CREATE INDEX %I ON %s (%s)',
+        index_name, target_id,
+        (SELECT string_agg(quote_ident(u.column_name), ', ' ORDER BY u.ordinality)
+         FROM unnest(end_column_name || key_column_names) WITH ORDINALITY AS u (column_name, ordinality)));
+    EXECUTE format('CLUSTER %s USING %I', target_id, index_name);
+    EXECUTE format('DROP INDEX %I.%I', target_schema, index_name);
+    IF clustered_index_name IS NOT NULL THEN
+        EXECUTE format('ALTER TABLE %s CLUSTER ON %I', target_id, clustered_index_name);
+    END IF;
+
+    EXECUTE format('ANALYZE %s', target_id);
+
+    SELECT s.correlation
+    INTO correlation
+    FROM pg_catalog.pg_stats AS s
+    WHERE (s.schemaname, s.tablename, s.attname) = (target_schema, target_name, end_column_name);
+
+    RAISE NOTICE 'history table % compacted, correlation %', target_id, correlation;
+END;
+$function$;
+
+/*
+ * Rewrite the history of a table in the order of the end of SYSTEM_TIME and
+ * then the key of the rows, so that the rows a query for a point in time
+ * needs are next to each other and BRIN indexes on the end column are useful
+ * again.  Purging and coalescing leave the history in no particular order.
+ *
+ * CLUSTER takes an ACCESS EXCLUSIVE lock on the table it rewrites, so nothing
+ * can read the history or write to it, and no row of the base table can be
+ * updated or deleted, until the transaction that did the rewrite commits.
+ * This is therefore a procedure that commits after each partition of a
+ * partitioned history table, and only one of them is locked at a time; it
+ * cannot be called in a transaction block.  The correlation of the end column
+ * with the physical order is reported for each table rewritten.
+ *
+ * Procedures only exist since PostgreSQL 11.
+ */
+DO $do$
+BEGIN
+    IF pg_catalog.current_setting('server_version_num')::integer >= 110000 THEN
+        EXECUTE $create$
+CREATE PROCEDURE periods.compact_history(table_name regclass, partition_name regclass DEFAULT NULL)
+ LANGUAGE plpgsql
+AS
+$procedure$
+#variable_conflict use_variable
+DECLARE
+    table_ids regclass[];
+    table_id regclass;
+BEGIN
+    /*
+     * Find the partitions to compact before committing anything.  Everything
+     * else is checked again by _compact_history() in each transaction.
+     */
+    IF partition_name IS NULL THEN
+        SELECT array_agg(i.inhrelid::regclass ORDER BY c.relname)
+        INTO table_ids
+        FROM periods.system_versioning AS sv
+        JOIN pg_catalog.pg_inherits AS i ON i.inhparent = sv.history_table_name
+        JOIN pg_catalog.pg_class AS c ON c.oid = i.inhrelid
+        WHERE sv.table_name = table_name
+          AND c.relkind = 'r';
+    END IF;
+
+    FOREACH table_id IN ARRAY coalesce(table_ids, ARRAY[partition_name])
+    LOOP
+        PERFORM periods._compact_history(table_name, table_id);
+        COMMIT;
+    END LOOP;
+END;
+$procedure$;
+$create$;
+    END IF;
+END;
+$do$;
@@ -1,6 +1,7 @@
 #include "postgres.h"
 #include "fmgr.h"
 
+#include "access/genam.h"
 #include "access/htup_details.h"
 #include "access/heapam.h"
 #if (PG_VERSION_NUM < 120000)
@@ -9,15 +10,47 @@
 #else
 #include "access/table.h"
 #endif
-#include "access/tupconvert.h"
+#if (PG_VERSION_NUM >= 120000)
+#include "access/tableam.h"
+#endif
 #include "access/xact.h"
+#if (PG_VERSION_NUM >= 120000)
+#include "catalog/namespace.h"
+#include "catalog/pg_am.h"
+#endif
+#include "catalog/index.h"
+#include "catalog/objectaddress.h"
+#include "catalog/pg_class.h"
+#include "catalog/pg_constraint.h"
+#include "catalog/pg_proc.h"
+#include "catalog/pg_trigger.h"
 #include "catalog/pg_type.h"
 #include "commands/trigger.h"
 #include "datatype/timestamp.h"
+#include "executor/executor.h"
 #include "executor/spi.h"
 #include "funcapi.h"
 #include "lib/stringinfo.h"
+#include "miscadmin.h"
 #include "nodes/bitmapset.h"
+#include "nodes/makefuncs.h"
+#if (PG_VERSION_NUM >= 120000)
+#include "nodes/nodeFuncs.h"
+#include "nodes/supportnodes.h"
+#include "optimizer/optimizer.h"
+#endif
+#if (PG_VERSION_NUM >= 160000)
+#include "parser/parse_relation.h"
+#endif
+#include "parser/parsetree.h"
+#include "pgtime.h"
+#include "portability/instr_time.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+#include "utils/acl.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
 #include "utils/date.h"
 #include "utils/datum.h"
@@ -26,19 +59,64 @@
 #else
 #include "utils/fmgrprotos.h"
 #endif
+#include "utils/guc.h"
 #include "utils/hsearch.h"
+#include "utils/inval.h"
 #include "utils/lsyscache.h"
 #include "utils/memutils.h"
 #include "utils/rel.h"
+#include "utils/resowner.h"
+#include "utils/snapmgr.h"
+#include "utils/syscache.h"
 #include "utils/timestamp.h"
+#include "utils/tuplestore.h"
+#include "utils/typcache.h"
 
 PG_MODULE_MAGIC;
 
 PGDLLEXPORT Datum generated_always_as_row_start_end(PG_FUNCTION_ARGS);
 PGDLLEXPORT Datum write_history(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum write_history_statement(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum update_portion_of(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum fk_insert_check(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum fk_update_check(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum uk_update_check(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum uk_delete_check(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum fk_statement_check(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum purge_history_batch(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum coalesce_history(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum predicate_support(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum invalidate_cache(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum object_relation(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum covers_transfn(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum covers_finalfn(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum normalize_periods(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum stat_tables(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum stat_tables_reset(PG_FUNCTION_ARGS);
 
 PG_FUNCTION_INFO_V1(generated_always_as_row_start_end);
 PG_FUNCTION_INFO_V1(write_history);
+PG_FUNCTION_INFO_V1(write_history_statement);
+PG_FUNCTION_INFO_V1(update_portion_of);
+PG_FUNCTION_INFO_V1(fk_insert_check);
+PG_FUNCTION_INFO_V1(fk_update_check);
+PG_FUNCTION_INFO_V1(uk_update_check);
+PG_FUNCTION_INFO_V1(uk_delete_check);
+PG_FUNCTION_INFO_V1(fk_statement_check);
+PG_FUNCTION_INFO_V1(purge_history_batch);
+PG_FUNCTION_INFO_V1(coalesce_history);
+PG_FUNCTION_INFO_V1(predicate_support);
+PG_FUNCTION_INFO_V1(invalidate_cache);
+PG_FUNCTION_INFO_V1(object_relation);
+PG_FUNCTION_INFO_V1(covers_transfn);
+PG_FUNCTION_INFO_V1(covers_finalfn);
+PG_FUNCTION_INFO_V1(normalize_periods);
+PG_FUNCTION_INFO_V1(stat_tables);
+PG_FUNCTION_INFO_V1(stat_tables_reset);
+
+#if (PG_VERSION_NUM < 160000)
+void _PG_init(void);
+#endif
 
 /* Define some SQLSTATEs that might not exist */
 #if (PG_VERSION_NUM < 100000)
@@ -61,6 +139,211 @@ PG_FUNCTION_INFO_V1(write_history);
 #define INFINITE_TS			TimestampGetDatum(DT_NOEND)
 #define INFINITE_DATE		DateADTGetDatum(DATEVAL_NOEND)
 
+/*
+ * Statistics about what our triggers do, per table, for the
+ * periods.stat_tables view.  They are only kept when the library is in
+ * shared_preload_libraries, otherwise PeriodsStatHash stays NULL and nothing
+ * is counted.
+ *
+ * Each backend counts in local memory during the transaction and adds that
+ * to the shared hash table when the transaction ends, whether it commits or
+ * not, so that the triggers only ever touch shared memory once per table per
+ * transaction.
+ */
+typedef enum PeriodsStatCounter
+{
+	PERIODS_STAT_ROWS_ARCHIVED,
+	PERIODS_STAT_HISTORY_BYTES,
+	PERIODS_STAT_EXCLUDED_SKIPS,	/* only excluded columns changed */
+	PERIODS_STAT_UNCHANGED_SKIPS,	/* nothing at all changed */
+	PERIODS_STAT_INVALID_ROW_VERSIONS,
+	PERIODS_STAT_FK_CHECKS,
+	PERIODS_STAT_PLAN_HITS,			/* of InsertHistoryPlanHash */
+	PERIODS_STAT_PLAN_MISSES,
+	PERIODS_STAT_NCOUNTERS
+} PeriodsStatCounter;
+
+/* The triggers we time */
+typedef enum PeriodsStatTimer
+{
+	PERIODS_STAT_GENERATED_ALWAYS,
+	PERIODS_STAT_WRITE_HISTORY,
+	PERIODS_STAT_FK_TRIGGER,
+	PERIODS_STAT_UK_TRIGGER,
+	PERIODS_STAT_NTIMERS
+} PeriodsStatTimer;
+
+typedef struct PeriodsStatCounts
+{
+	int64		counters[PERIODS_STAT_NCOUNTERS];
+	int64		calls[PERIODS_STAT_NTIMERS];
+	double		time[PERIODS_STAT_NTIMERS];	/* in milliseconds */
+} PeriodsStatCounts;
+
+typedef struct PeriodsStatKey
+{
+	Oid			dbid;
+	Oid			relid;
+} PeriodsStatKey;
+
+typedef struct PeriodsStatEntry
+{
+	PeriodsStatKey	key;		/* the hash key; must be first */
+	slock_t			mutex;		/* protects counts */
+	PeriodsStatCounts counts;
+} PeriodsStatEntry;
+
+/* The lock protects the hash table itself, not the counts in the entries */
+typedef struct PeriodsStatState
+{
+	LWLock	   *lock;
+} PeriodsStatState;
+
+static int	periods_stat_max = 1000;
+static PeriodsStatState *PeriodsStatShared = NULL;
+static HTAB *PeriodsStatHash = NULL;
+
+/* What this backend has counted in the current transaction */
+static HTAB *PendingStatHash = NULL;
+
+typedef struct PendingStatEntry
+{
+	Oid			relid;			/* the hash key; must be first */
+	PeriodsStatCounts counts;
+} PendingStatEntry;
+
+/*
+ * Add what was counted locally to the shared counts.  Tables that don't fit
+ * in the shared hash table any more are not counted.
+ */
+static void
+FlushPendingStats(void)
+{
+	HASH_SEQ_STATUS		status;
+	PendingStatEntry   *pending;
+
+	hash_seq_init(&status, PendingStatHash);
+	while ((pending = (PendingStatEntry *) hash_seq_search(&status)) != NULL)
+	{
+		PeriodsStatKey		key;
+		PeriodsStatEntry   *entry;
+		int					i;
+
+		key.dbid = MyDatabaseId;
+		key.relid = pending->relid;
+
+		LWLockAcquire(PeriodsStatShared->lock, LW_SHARED);
+		entry = (PeriodsStatEntry *) hash_search(PeriodsStatHash, &key, HASH_FIND, NULL);
+		if (entry == NULL)
+		{
+			bool	found;
+
+			/* Need an exclusive lock to make a new entry */
+			LWLockRelease(PeriodsStatShared->lock);
+			LWLockAcquire(PeriodsStatShared->lock, LW_EXCLUSIVE);
+
+			entry = (PeriodsStatEntry *) hash_search(PeriodsStatHash, &key, HASH_ENTER_NULL, &found);
+			if (entry != NULL && !found)
+			{
+				SpinLockInit(&entry->mutex);
+				memset(&entry->counts, 0, sizeof(PeriodsStatCounts));
+			}
+		}
+
+		if (entry != NULL)
+		{
+			SpinLockAcquire(&entry->mutex);
+			for (i = 0; i < PERIODS_STAT_NCOUNTERS; i++)
+				entry->counts.counters[i] += pending->counts.counters[i];
+			for (i = 0; i < PERIODS_STAT_NTIMERS; i++)
+			{
+				entry->counts.calls[i] += pending->counts.calls[i];
+				entry->counts.time[i] += pending->counts.time[i];
+			}
+			SpinLockRelease(&entry->mutex);
+		}
+
+		LWLockRelease(PeriodsStatShared->lock);
+
+		hash_search(PendingStatHash, &pending->relid, HASH_REMOVE, NULL);
+	}
+}
+
+static void
+PeriodsStatXactCallback(XactEvent event, void *arg)
+{
+	switch (event)
+	{
+		case XACT_EVENT_COMMIT:
+		case XACT_EVENT_ABORT:
+		case XACT_EVENT_PREPARE:
+			FlushPendingStats();
+			break;
+		default:
+			break;
+	}
+}
+
+static PendingStatEntry *
+GetPendingStatEntry(Oid relid)
+{
+	PendingStatEntry   *pending;
+	bool				found;
+
+	if (!PendingStatHash)
+	{
+		HASHCTL	ctl;
+
+		ctl.keysize = sizeof(Oid);
+		ctl.entrysize = sizeof(PendingStatEntry);
+
+		PendingStatHash = hash_create("Periods Pending Stat Hash", 16, &ctl, HASH_ELEM | HASH_BLOBS);
+		RegisterXactCallback(PeriodsStatXactCallback, NULL);
+	}
+
+	pending = (PendingStatEntry *) hash_search(PendingStatHash, &relid, HASH_ENTER, &found);
+	if (!found)
+		memset(&pending->counts, 0, sizeof(PeriodsStatCounts));
+
+	return pending;
+}
+
+static void
+CountPeriodsStat(Oid relid, PeriodsStatCounter counter, int64 n)
+{
+	if (PeriodsStatHash == NULL)
+		return;
+
+	GetPendingStatEntry(relid)->counts.counters[counter] += n;
+}
+
+/*
+ * Call one of our triggers, timing it if we are keeping statistics.  If it
+ * returns at all, it was called as a trigger.
+ */
+static Datum
+CallTimedTrigger(PGFunction func, FunctionCallInfo fcinfo, PeriodsStatTimer timer)
+{
+	instr_time			start;
+	instr_time			duration;
+	Datum				result;
+	PendingStatEntry   *pending;
+
+	if (PeriodsStatHash == NULL)
+		return func(fcinfo);
+
+	INSTR_TIME_SET_CURRENT(start);
+	result = func(fcinfo);
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start);
+
+	pending = GetPendingStatEntry(RelationGetRelid(((TriggerData *) fcinfo->context)->tg_relation));
+	pending->counts.calls[timer]++;
+	pending->counts.time[timer] += INSTR_TIME_GET_MILLISEC(duration);
+
+	return result;
+}
+
 /* Plan caches for inserting into history tables */
 static HTAB *InsertHistoryPlanHash = NULL;
 
@@ -69,6 +352,7 @@ typedef struct InsertHistoryPlanEntry
 	Oid			history_relid;	/* the hash key; must be first */
 	char		schemaname[NAMEDATALEN];
 	char		tablename[NAMEDATALEN];
+	Oid			type;			/* the row type the plan was made for */
 	SPIPlanPtr	qplan;
 } InsertHistoryPlanEntry;
 
@@ -83,107 +367,290 @@ CreateInsertHistoryPlanHash(void)
 	return hash_create("Insert History Hash", 16, &ctl, HASH_ELEM | HASH_BLOBS);
 }
 
-static void
-GetPeriodColumnNames(Relation rel, char *period_name, char **start_name, char **end_name)
+/*
+ * The transaction start time, in all the types a period for SYSTEM_TIME can
+ * use.  This is what goes in the ROW START and what the old rows are compared
+ * against, so we only compute it again when the transaction or the session's
+ * time zone changes instead of for every row.
+ */
+typedef struct TransactionStartValues
 {
-	int				ret;
-	Datum			values[2];
-	SPITupleTable  *tuptable;
-	bool			is_null;
-	Datum			dat;
-	MemoryContext	mcxt = CurrentMemoryContext; /* The context outside of SPI */
+	TimestampTz	xact_start;		/* what the others were computed from */
+	pg_tz	   *timezone;		/* and in which time zone */
+	TimestampTz	tstz;
+	Timestamp	ts;
+	DateADT		date;
+} TransactionStartValues;
 
-	const char *sql =
-		"SELECT p.start_column_name, p.end_column_name "
-		"FROM periods.periods AS p "
-		"WHERE (p.table_name, p.period_name) = ($1, $2)";
-	static SPIPlanPtr qplan = NULL;
+static TransactionStartValues xact_start_values;
 
-	if (SPI_connect() != SPI_OK_CONNECT)
-		elog(ERROR, "SPI_connect failed");
+static TransactionStartValues *
+GetTransactionStartValues(void)
+{
+	TimestampTz	xact_start = GetCurrentTransactionStartTimestamp();
 
-	/*
-	 * Query the periods table to get the start and end columns.
-	 * Cache the plan if we haven't already.
-	 */
-	if (qplan == NULL)
+	if (xact_start_values.timezone == NULL ||
+		xact_start_values.xact_start != xact_start ||
+		xact_start_values.timezone != session_timezone)
 	{
-		Oid	types[2] = {OIDOID, NAMEOID};
+		xact_start_values.xact_start = xact_start;
+		xact_start_values.timezone = session_timezone;
+		xact_start_values.tstz = xact_start;
+		xact_start_values.ts = DatumGetTimestamp(TRANSACTION_TS);
+		xact_start_values.date = DatumGetDateADT(TRANSACTION_DATE);
+	}
 
-		qplan = SPI_prepare(sql, 2, types);
-		if (qplan == NULL)
-			elog(ERROR, "SPI_prepare returned %s for %s",
-				 SPI_result_code_string(SPI_result), sql);
+	return &xact_start_values;
+}
 
-		ret = SPI_keepplan(qplan);
-		if (ret != 0)
-			elog(ERROR, "SPI_keepplan returned %s", SPI_result_code_string(ret));
+/*
+ * Everything that depends on the type of the period's columns.  This is looked
+ * up once per table so that we don't have to switch on the type and go
+ * through the fmgr for every row.
+ */
+typedef struct SystemTimeTypeOps
+{
+	Datum	(*row_start) (void);
+	Datum	(*row_end) (void);
+	int		(*compare_current) (Datum value);
+	int		(*compare_infinite) (Datum value);
+} SystemTimeTypeOps;
+
+static Datum
+tstz_row_start(void)
+{
+	return TimestampTzGetDatum(GetTransactionStartValues()->tstz);
+}
+
+static Datum
+ts_row_start(void)
+{
+	return TimestampGetDatum(GetTransactionStartValues()->ts);
+}
+
+static Datum
+date_row_start(void)
+{
+	return DateADTGetDatum(GetTransactionStartValues()->date);
+}
+
+static Datum
+timestamp_row_end(void)
+{
+	/* Same for timestamp and timestamptz */
+	return INFINITE_TS;
+}
+
+static Datum
+date_row_end(void)
+{
+	return INFINITE_DATE;
+}
+
+static int
+tstz_compare_current(Datum value)
+{
+	return timestamp_cmp_internal(DatumGetTimestampTz(value),
+								  GetTransactionStartValues()->tstz);
+}
+
+static int
+ts_compare_current(Datum value)
+{
+	return timestamp_cmp_internal(DatumGetTimestamp(value),
+								  GetTransactionStartValues()->ts);
+}
+
+static int
+date_compare_current(Datum value)
+{
+	DateADT		date = DatumGetDateADT(value);
+	DateADT		current = GetTransactionStartValues()->date;
+
+	return (date < current) ? -1 : ((date > current) ? 1 : 0);
+}
+
+static int
+timestamp_compare_infinite(Datum value)
+{
+	/* Same for timestamp and timestamptz */
+	return timestamp_cmp_internal(DatumGetTimestamp(value), DT_NOEND);
+}
+
+static int
+date_compare_infinite(Datum value)
+{
+	DateADT		date = DatumGetDateADT(value);
+
+	return (date < DATEVAL_NOEND) ? -1 : ((date > DATEVAL_NOEND) ? 1 : 0);
+}
+
+static const SystemTimeTypeOps TimestampTzOps = {
+	tstz_row_start, timestamp_row_end, tstz_compare_current, timestamp_compare_infinite
+};
+
+static const SystemTimeTypeOps TimestampOps = {
+	ts_row_start, timestamp_row_end, ts_compare_current, timestamp_compare_infinite
+};
+
+static const SystemTimeTypeOps DateOps = {
+	date_row_start, date_row_end, date_compare_current, date_compare_infinite
+};
+
+static const SystemTimeTypeOps *
+GetSystemTimeTypeOps(Oid typeid)
+{
+	switch (typeid)
+	{
+		case TIMESTAMPTZOID:
+			return &TimestampTzOps;
+		case TIMESTAMPOID:
+			return &TimestampOps;
+		case DATEOID:
+			return &DateOps;
+		default:
+			elog(ERROR, "unexpected type: %d", typeid);
+			return NULL;	/* keep compiler quiet */
 	}
+}
 
-	values[0] = ObjectIdGetDatum(rel->rd_id);
-	values[1] = CStringGetDatum(period_name);
-	ret = SPI_execute_plan(qplan, values, NULL, true, 0);
-	if (ret != SPI_OK_SELECT)
-		elog(ERROR, "SPI_execute returned %s", SPI_result_code_string(ret));
+/*
+ * Everything the system_time triggers need to know about a table, so that we
+ * don't have to go look it up in our catalogs for every single row.
+ *
+ * Entries are built on first use and marked invalid whenever the table's
+ * relcache entry is invalidated.  That covers renaming and dropping columns,
+ * and our catalogs have a trigger that forces such an invalidation whenever
+ * they are changed, so we don't have to track anything else.
+ */
+static HTAB *SystemTimeCacheHash = NULL;
 
-	/* Make sure we got one */
-	if (SPI_processed == 0)
-		ereport(ERROR,
-				(errmsg("period \"%s\" not found on table \"%s\"",
-						period_name,
-						RelationGetRelationName(rel))));
+/*
+ * Bumped by every invalidation, so that an entry can tell whether one arrived
+ * while it was being built.  Reading our catalogs can process invalidations,
+ * and the one for the table being built must not be lost.
+ */
+static uint64 SystemTimeCacheInvalCount = 0;
 
-	/* There is a unique constraint so there shouldn't be more than 1 row */
-	Assert(SPI_processed == 1);
+typedef struct SystemTimeCacheEntry
+{
+	Oid			relid;			/* the hash key; must be first */
+	bool		valid;
+	NameData	start_name;
+	NameData	end_name;
+	int16		start_num;
+	int16		end_num;
+	Oid			typeid;
+	const SystemTimeTypeOps *ops;
+	Bitmapset  *excluded_attnums;	/* allocated in TopMemoryContext */
+	bool		skip_unchanged;	/* also compare rows without excluded columns */
+	int			ncompare;		/* see OnlyExcludedColumnsChanged() */
+	AttrNumber *compare_attnums;	/* allocated in TopMemoryContext, or NULL */
+	Oid			history_relid;	/* InvalidOid if no SYSTEM VERSIONING */
+	bool		statement_level;	/* history written by statement triggers */
 
 	/*
-	 * Get the names from the result tuple.  We copy them into the original
-	 * context so they don't get wiped out by SPI_finish().
+	 * How to turn an old row into a history row, see GetHistoryRowBuilder().
+	 * This also depends on the history table so it is invalidated separately.
 	 */
-	tuptable = SPI_tuptable;
+	bool		builder_valid;
+	MemoryContext builder_context;	/* everything below lives here */
+	int			history_natts;
+	AttrNumber *history_attmap;	/* history attnum -> our attnum, or 0 */
+	int16		history_end_num;
+	Datum	   *row_values;		/* scratch space for deforming old rows */
+	bool	   *row_nulls;
+	Datum	   *history_values;	/* and for building history rows */
+	bool	   *history_nulls;
+	MemoryContext row_context;	/* reset after every history row */
+} SystemTimeCacheEntry;
 
-	dat = SPI_getbinval(tuptable->vals[0], tuptable->tupdesc, 1, &is_null);
-	*start_name = MemoryContextStrdup(mcxt, NameStr(*(DatumGetName(dat))));
+static void
+SystemTimeCacheInvalCallback(Datum arg, Oid relid)
+{
+	HASH_SEQ_STATUS			status;
+	SystemTimeCacheEntry   *entry;
 
-	dat = SPI_getbinval(tuptable->vals[0], tuptable->tupdesc, 2, &is_null);
-	*end_name = MemoryContextStrdup(mcxt, NameStr(*(DatumGetName(dat))));
+	SystemTimeCacheInvalCount++;
 
-	/* All done with SPI */
-	if (SPI_finish() != SPI_OK_FINISH)
-		elog(ERROR, "SPI_finish failed");
+	/* A specific table, which we might not even have */
+	if (OidIsValid(relid))
+	{
+		entry = (SystemTimeCacheEntry *) hash_search(SystemTimeCacheHash,
+				&relid, HASH_FIND, NULL);
+		if (entry != NULL)
+			entry->valid = false;
+
+		/* It might also be somebody's history table */
+		hash_seq_init(&status, SystemTimeCacheHash);
+		while ((entry = (SystemTimeCacheEntry *) hash_seq_search(&status)) != NULL)
+		{
+			if (entry->history_relid == relid)
+				entry->builder_valid = false;
+		}
+		return;
+	}
+
+	/* Everything */
+	hash_seq_init(&status, SystemTimeCacheHash);
+	while ((entry = (SystemTimeCacheEntry *) hash_seq_search(&status)) != NULL)
+	{
+		entry->valid = false;
+		entry->builder_valid = false;
+	}
+}
+
+static HTAB *
+CreateSystemTimeCacheHash(void)
+{
+	HASHCTL	ctl;
+	HTAB   *result;
+
+	ctl.keysize = sizeof(Oid);
+	ctl.entrysize = sizeof(SystemTimeCacheEntry);
+
+	result = hash_create("System Time Cache Hash", 16, &ctl, HASH_ELEM | HASH_BLOBS);
+
+	CacheRegisterRelcacheCallback(SystemTimeCacheInvalCallback, (Datum) 0);
+
+	return result;
 }
 
 /*
- * Check if the only columns changed in an UPDATE are columns that the user is
- * excluding from SYSTEM VERSIONING. One possible use case for this is a
- * "last_login timestamptz" column on a user table.  Arguably, this column
- * should be in another table, but users have requested the feature so let's do
- * it.
+ * Fill in a cache entry from our catalogs.  This is the only place the
+ * system_time triggers use SPI to read them.
  */
-static bool
-OnlyExcludedColumnsChanged(Relation rel, HeapTuple old_row, HeapTuple new_row)
+static void
+BuildSystemTimeCacheEntry(Relation rel, SystemTimeCacheEntry *entry)
 {
 	int				ret;
-	int				i;
 	Datum			values[1];
 	TupleDesc		tupdesc = RelationGetDescr(rel);
+	SPITupleTable  *tuptable;
+	HeapTuple		tuple;
+	bool			is_null;
+	Datum			dat;
 	Bitmapset	   *excluded_attnums = NULL;
-	MemoryContext	mcxt = CurrentMemoryContext; /* The context outside of SPI */
+	MemoryContext	oldcontext;
+	int				i;
 
 	const char *sql =
-		"SELECT u.name "
-		"FROM periods.system_time_periods AS stp "
-		"CROSS JOIN unnest(stp.excluded_column_names) AS u (name) "
-		"WHERE stp.table_name = $1";
+		"SELECT p.start_column_name, p.end_column_name, "
+		"       stp.excluded_column_names, sv.history_table_name::oid, "
+		"       sv.history_update_trigger IS NOT NULL, "
+		"       coalesce(stp.skip_unchanged, false) "
+		"FROM periods.periods AS p "
+		"LEFT JOIN periods.system_time_periods AS stp "
+		"       ON (stp.table_name, stp.period_name) = (p.table_name, p.period_name) "
+		"LEFT JOIN periods.system_versioning AS sv "
+		"       ON (sv.table_name, sv.period_name) = (p.table_name, p.period_name) "
+		"WHERE (p.table_name, p.period_name) = ($1, 'system_time')";
 	static SPIPlanPtr qplan = NULL;
 
 	if (SPI_connect() != SPI_OK_CONNECT)
 		elog(ERROR, "SPI_connect failed");
 
-	/*
-	 * Get the excluded column names.
-	 * Cache the plan if we haven't already.
-	 */
+	/* Cache the plan if we haven't already */
 	if (qplan == NULL)
 	{
 		Oid	types[1] = {OIDOID};
@@ -198,28 +665,44 @@ OnlyExcludedColumnsChanged(Relation rel, HeapTuple old_row, HeapTuple new_row)
 			elog(ERROR, "SPI_keepplan returned %s", SPI_result_code_string(ret));
 	}
 
-	values[0] = ObjectIdGetDatum(rel->rd_id);
+	values[0] = ObjectIdGetDatum(RelationGetRelid(rel));
 	ret = SPI_execute_plan(qplan, values, NULL, true, 0);
 	if (ret != SPI_OK_SELECT)
 		elog(ERROR, "SPI_execute returned %s", SPI_result_code_string(ret));
 
+	/* Make sure we got one */
+	if (SPI_processed == 0)
+		ereport(ERROR,
+				(errmsg("period \"%s\" not found on table \"%s\"",
+						"system_time",
+						RelationGetRelationName(rel))));
+
+	/* There is a unique constraint so there shouldn't be more than 1 row */
+	Assert(SPI_processed == 1);
+
+	tuptable = SPI_tuptable;
+	tuple = tuptable->vals[0];
+
+	/* The period columns */
+	dat = SPI_getbinval(tuple, tuptable->tupdesc, 1, &is_null);
+	namestrcpy(&entry->start_name, NameStr(*(DatumGetName(dat))));
+	dat = SPI_getbinval(tuple, tuptable->tupdesc, 2, &is_null);
+	namestrcpy(&entry->end_name, NameStr(*(DatumGetName(dat))));
+
 	/* Construct a bitmap of excluded attnums */
-	if (SPI_processed > 0 && SPI_tuptable != NULL)
+	dat = SPI_getbinval(tuple, tuptable->tupdesc, 3, &is_null);
+	if (!is_null)
 	{
-		TupleDesc	spitupdesc = SPI_tuptable->tupdesc;
-		bool		isnull;
+		Datum  *elems;
+		int		nelems;
 
-		for (i = 0; i < SPI_processed; i++)
-		{
-			HeapTuple	tuple = SPI_tuptable->vals[i];
-			Datum		attdatum;
-			char	   *attname;
-			int16		attnum;
+		deconstruct_array(DatumGetArrayTypeP(dat), NAMEOID, NAMEDATALEN, false, 'c',
+						  &elems, NULL, &nelems);
 
-			/* Get the attnum from the column name */
-			attdatum = SPI_getbinval(tuple, spitupdesc, 1, &isnull);
-			attname = NameStr(*(DatumGetName(attdatum)));
-			attnum = SPI_fnumber(tupdesc, attname);
+		for (i = 0; i < nelems; i++)
+		{
+			char   *attname = NameStr(*(DatumGetName(elems[i])));
+			int16	attnum = SPI_fnumber(tupdesc, attname);
 
 			/* Make sure it's valid (should always be) */
 			if (attnum == SPI_ERROR_NOATTRIBUTE)
@@ -231,212 +714,185 @@ OnlyExcludedColumnsChanged(Relation rel, HeapTuple old_row, HeapTuple new_row)
 			if (attnum < 0)
 				continue;
 
-			/* Add it to the bitmap set */
 			excluded_attnums = bms_add_member(excluded_attnums, attnum);
 		}
-
-		/*
-		 * If we have excluded columns, move the bitmapset out of the SPI
-		 * context.
-		 */
-		if (excluded_attnums != NULL)
-		{
-			MemoryContext spicontext = MemoryContextSwitchTo(mcxt);
-			excluded_attnums = bms_copy(excluded_attnums);
-			MemoryContextSwitchTo(spicontext);
-		}
 	}
 
-	/* Don't need SPI anymore */
+	/* The history table, if there is one */
+	dat = SPI_getbinval(tuple, tuptable->tupdesc, 4, &is_null);
+	entry->history_relid = is_null ? InvalidOid : DatumGetObjectId(dat);
+	dat = SPI_getbinval(tuple, tuptable->tupdesc, 5, &is_null);
+	entry->statement_level = !is_null && DatumGetBool(dat);
+	dat = SPI_getbinval(tuple, tuptable->tupdesc, 6, &is_null);
+	entry->skip_unchanged = !is_null && DatumGetBool(dat);
+
+	/* Move the bitmapset out of the SPI context before it goes away */
+	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+	excluded_attnums = bms_copy(excluded_attnums);
+	MemoryContextSwitchTo(oldcontext);
+	bms_free(entry->excluded_attnums);
+	entry->excluded_attnums = excluded_attnums;
+
+	/* All done with SPI */
 	if (SPI_finish() != SPI_OK_FINISH)
 		elog(ERROR, "SPI_finish failed");
 
-	/* If there are no excluded columns, then we're done */
-	if (excluded_attnums == NULL)
-		return false;
+	/* Get the column numbers and type */
+	entry->start_num = SPI_fnumber(tupdesc, NameStr(entry->start_name));
+	entry->end_num = SPI_fnumber(tupdesc, NameStr(entry->end_name));
+	entry->typeid = SPI_gettypeid(tupdesc, entry->start_num);
+	entry->ops = GetSystemTimeTypeOps(entry->typeid);
+
+	/*
+	 * Work out which columns to compare between the old and new rows of an
+	 * UPDATE, if we need to compare them at all.
+	 */
+	if (entry->compare_attnums != NULL)
+		pfree(entry->compare_attnums);
+	entry->compare_attnums = NULL;
+	entry->ncompare = 0;
 
-	for (i = 1; i <= tupdesc->natts; i++)
+	if (entry->excluded_attnums != NULL || entry->skip_unchanged)
 	{
-		Datum	old_datum, new_datum;
-		bool	old_isnull, new_isnull;
-		int16	typlen;
-		bool	typbyval;
+		entry->compare_attnums = (AttrNumber *)
+			MemoryContextAlloc(TopMemoryContext, tupdesc->natts * sizeof(AttrNumber));
 
-		/* Ignore if deleted column */
-		if (TupleDescAttr(tupdesc, i-1)->attisdropped)
-			continue;
+		for (i = 1; i <= tupdesc->natts; i++)
+		{
+			if (TupleDescAttr(tupdesc, i-1)->attisdropped ||
+				bms_is_member(i, entry->excluded_attnums))
+				continue;
 
-		/* Ignore if excluded column */
-		if (bms_is_member(i, excluded_attnums))
-			continue;
+			entry->compare_attnums[entry->ncompare++] = i;
+		}
+	}
 
-		old_datum = SPI_getbinval(old_row, tupdesc, i, &old_isnull);
-		new_datum = SPI_getbinval(new_row, tupdesc, i, &new_isnull);
+	/* The table or the history table might have changed */
+	entry->builder_valid = false;
+}
 
-		/*
-		 * If one value is NULL and other is not, then they are certainly not
-		 * equal.
-		 */
-		if (old_isnull != new_isnull)
-			return false;
+static SystemTimeCacheEntry *
+GetSystemTimeCacheEntry(Relation rel)
+{
+	Oid						relid = RelationGetRelid(rel);
+	SystemTimeCacheEntry   *entry;
+	bool					found;
 
-		/* If both are NULL, they can be considered equal. */
-		if (old_isnull)
-			continue;
+	if (!SystemTimeCacheHash)
+		SystemTimeCacheHash = CreateSystemTimeCacheHash();
 
-		/* Do a fairly strict binary comparison of the values */
-		typlen = TupleDescAttr(tupdesc, i-1)->attlen;
-		typbyval = TupleDescAttr(tupdesc, i-1)->attbyval;
-		if (!datumIsEqual(old_datum, new_datum, typbyval, typlen))
-			return false;
-	}
+	entry = (SystemTimeCacheEntry *) hash_search(SystemTimeCacheHash,
+			&relid, HASH_ENTER, &found);
 
-	return true;
-}
-
-/*
- * Get the oid of the history table.  If this table does not have a system_time
- * period an error is raised.  If it doesn't have SYSTEM VERSIONING, then
- * InvalidOid is returned.
- */
-static Oid
-GetHistoryTable(Relation rel)
-{
-	int		ret;
-	Datum	values[1];
-	Oid		result;
-	SPITupleTable  *tuptable;
-	bool			is_null;
-
-	const char *sql =
-		"SELECT history_table_name::oid "
-		"FROM periods.system_versioning AS sv "
-		"WHERE sv.table_name = $1";
-	static SPIPlanPtr qplan = NULL;
-
-	if (SPI_connect() != SPI_OK_CONNECT)
-		elog(ERROR, "SPI_connect failed");
+	if (!found)
+	{
+		entry->valid = false;
+		entry->excluded_attnums = NULL;
+		entry->compare_attnums = NULL;
+		entry->builder_valid = false;
+		entry->builder_context = NULL;
+		entry->row_context = NULL;
+	}
 
-	/*
-	 * Check existence in system_versioning table.
-	 * Cache the plan if we haven't already.
-	 */
-	if (qplan == NULL)
+	while (!entry->valid)
 	{
-		Oid	types[1] = {OIDOID};
+		uint64	inval_count = SystemTimeCacheInvalCount;
 
-		qplan = SPI_prepare(sql, 1, types);
-		if (qplan == NULL)
-			elog(ERROR, "SPI_prepare returned %s for %s",
-				 SPI_result_code_string(SPI_result), sql);
+		BuildSystemTimeCacheEntry(rel, entry);
 
-		ret = SPI_keepplan(qplan);
-		if (ret != 0)
-			elog(ERROR, "SPI_keepplan returned %s", SPI_result_code_string(ret));
+		/* Build it again if it was invalidated in the meantime */
+		entry->valid = (inval_count == SystemTimeCacheInvalCount);
 	}
 
-	values[0] = ObjectIdGetDatum(rel->rd_id);
-	ret = SPI_execute_plan(qplan, values, NULL, true, 0);
-	if (ret != SPI_OK_SELECT)
-		elog(ERROR, "SPI_execute returned %s", SPI_result_code_string(ret));
+	return entry;
+}
 
-	/* Did we get one? */
-	if (SPI_processed == 0)
-	{
-		if (SPI_finish() != SPI_OK_FINISH)
-			elog(ERROR, "SPI_finish failed");
-		return InvalidOid;
-	}
+/*
+ * Is a column the same in the old and new versions of a row?
+ */
+static bool
+ColumnUnchanged(TupleDesc tupdesc, AttrNumber attnum,
+				HeapTuple old_row, HeapTuple new_row)
+{
+	Form_pg_attribute att = TupleDescAttr(tupdesc, attnum - 1);
+	Datum	old_datum, new_datum;
+	bool	old_isnull, new_isnull;
 
-	/* There is a unique constraint so there shouldn't be more than 1 row */
-	Assert(SPI_processed == 1);
+	old_datum = heap_getattr(old_row, attnum, tupdesc, &old_isnull);
+	new_datum = heap_getattr(new_row, attnum, tupdesc, &new_isnull);
 
-	/* Get oid from results */
-	tuptable = SPI_tuptable;
-	result = DatumGetObjectId(SPI_getbinval(tuptable->vals[0], tuptable->tupdesc, 1, &is_null));
+	/*
+	 * If one value is NULL and other is not, then they are certainly not
+	 * equal.
+	 */
+	if (old_isnull != new_isnull)
+		return false;
 
-	if (SPI_finish() != SPI_OK_FINISH)
-		elog(ERROR, "SPI_finish failed");
+	/* If both are NULL, they can be considered equal. */
+	if (old_isnull)
+		return true;
 
-	return result;
+	/* Do a fairly strict binary comparison of the values */
+	return datumIsEqual(old_datum, new_datum, att->attbyval, att->attlen);
 }
 
-static Datum
-GetRowStart(Oid typeid)
+/*
+ * Check if the only columns changed in an UPDATE are columns that the user is
+ * excluding from SYSTEM VERSIONING. One possible use case for this is a
+ * "last_login timestamptz" column on a user table.  Arguably, this column
+ * should be in another table, but users have requested the feature so let's do
+ * it.
+ *
+ * Tables can also ask for this check without excluding any columns, so that
+ * updates that don't change anything at all are not versioned either.  The
+ * columns to compare are worked out when the cache entry is built.
+ */
+static bool
+OnlyExcludedColumnsChanged(SystemTimeCacheEntry *entry, TupleDesc tupdesc,
+						   HeapTuple old_row, HeapTuple new_row)
 {
-	switch (typeid)
-	{
-		case TIMESTAMPTZOID:
-			return TRANSACTION_TSTZ;
-		case TIMESTAMPOID:
-			return TRANSACTION_TS;
-		case DATEOID:
-			return TRANSACTION_DATE;
-		default:
-			elog(ERROR, "unexpected type: %d", typeid);
-			return 0;	/* keep compiler quiet */
-	}
-}
+	int				i;
 
-static Datum
-GetRowEnd(Oid typeid)
-{
-	switch (typeid)
-	{
-		case TIMESTAMPTZOID:
-			return INFINITE_TSTZ;
-		case TIMESTAMPOID:
-			return INFINITE_TS;
-		case DATEOID:
-			return INFINITE_DATE;
-		default:
-			elog(ERROR, "unexpected type: %d", typeid);
-			return 0;	/* keep compiler quiet */
-	}
-}
+	/* If there is nothing to compare, then we're done */
+	if (entry->compare_attnums == NULL)
+		return false;
 
-static int
-CompareWithCurrentDatum(Oid typeid, Datum value)
-{
-	switch (typeid)
+	for (i = 0; i < entry->ncompare; i++)
 	{
-		case TIMESTAMPTZOID:
-			return DatumGetInt32(DirectFunctionCall2(timestamp_cmp, value, TRANSACTION_TSTZ));
-
-		case TIMESTAMPOID:
-			return DatumGetInt32(DirectFunctionCall2(timestamp_cmp, value, TRANSACTION_TS));
-
-		case DATEOID:
-			return DatumGetInt32(DirectFunctionCall2(date_cmp, value, TRANSACTION_DATE));
-
-		default:
-			elog(ERROR, "unexpected type: %d", typeid);
-			return 0;	/* keep compiler quiet */
+		if (!ColumnUnchanged(tupdesc, entry->compare_attnums[i], old_row, new_row))
+			return false;
 	}
+
+	return true;
 }
 
-static int
-CompareWithInfiniteDatum(Oid typeid, Datum value)
+/*
+ * Once OnlyExcludedColumnsChanged() has said yes, tell the statistics whether
+ * the excluded columns changed or whether nothing changed at all.
+ */
+static void
+CountSkippedUpdate(SystemTimeCacheEntry *entry, TupleDesc tupdesc,
+				   HeapTuple old_row, HeapTuple new_row)
 {
-	switch (typeid)
-	{
-		case TIMESTAMPTZOID:
-			return DatumGetInt32(DirectFunctionCall2(timestamp_cmp, value, INFINITE_TSTZ));
+	int		attnum = -1;
 
-		case TIMESTAMPOID:
-			return DatumGetInt32(DirectFunctionCall2(timestamp_cmp, value, INFINITE_TS));
-
-		case DATEOID:
-			return DatumGetInt32(DirectFunctionCall2(date_cmp, value, INFINITE_DATE));
+	if (PeriodsStatHash == NULL)
+		return;
 
-		default:
-			elog(ERROR, "unexpected type: %d", typeid);
-			return 0;	/* keep compiler quiet */
+	while ((attnum = bms_next_member(entry->excluded_attnums, attnum)) >= 0)
+	{
+		if (!ColumnUnchanged(tupdesc, attnum, old_row, new_row))
+		{
+			CountPeriodsStat(entry->relid, PERIODS_STAT_EXCLUDED_SKIPS, 1);
+			return;
+		}
 	}
+
+	CountPeriodsStat(entry->relid, PERIODS_STAT_UNCHANGED_SKIPS, 1);
 }
 
-Datum
-generated_always_as_row_start_end(PG_FUNCTION_ARGS)
+static Datum
+generated_always_as_row_start_end_internal(PG_FUNCTION_ARGS)
 {
 	TriggerData	   *trigdata = castNode(TriggerData, fcinfo->context);
 	const char	   *funcname = "generated_always_as_row_start_end";
@@ -446,9 +902,7 @@ generated_always_as_row_start_end(PG_FUNCTION_ARGS)
 	Datum			values[2];
 	bool			nulls[2];
 	int				columns[2];
-	char		   *start_name, *end_name;
-	int16			start_num, end_num;
-	Oid				typeid;
+	SystemTimeCacheEntry   *entry;
 
 	/*
 	 * Make sure this is being called as an BEFORE ROW trigger.  Note:
@@ -471,6 +925,7 @@ generated_always_as_row_start_end(PG_FUNCTION_ARGS)
 	/* Get Relation information */
 	rel = trigdata->tg_relation;
 	new_tupdesc = RelationGetDescr(rel);
+	entry = GetSystemTimeCacheEntry(rel);
 
 	/* Get the new data that was inserted/updated */
 	if (TRIGGER_FIRED_BY_INSERT(trigdata->tg_event))
@@ -483,7 +938,7 @@ generated_always_as_row_start_end(PG_FUNCTION_ARGS)
 		new_row = trigdata->tg_newtuple;
 
 		/* Don't change anything if only excluded columns are being updated. */
-		if (OnlyExcludedColumnsChanged(rel, old_row, new_row))
+		if (OnlyExcludedColumnsChanged(entry, new_tupdesc, old_row, new_row))
 			return PointerGetDatum(new_row);
 	}
 	else
@@ -495,18 +950,11 @@ generated_always_as_row_start_end(PG_FUNCTION_ARGS)
 		new_row = NULL;			/* keep compiler quiet */
 	}
 
-	GetPeriodColumnNames(rel, "system_time", &start_name, &end_name);
-
-	/* Get the column numbers and type */
-	start_num = SPI_fnumber(new_tupdesc, start_name);
-	end_num = SPI_fnumber(new_tupdesc, end_name);
-	typeid = SPI_gettypeid(new_tupdesc, start_num);
-
-	columns[0] = start_num;
-	values[0] = GetRowStart(typeid);
+	columns[0] = entry->start_num;
+	values[0] = entry->ops->row_start();
 	nulls[0] = false;
-	columns[1] = end_num;
-	values[1] = GetRowEnd(typeid);
+	columns[1] = entry->end_num;
+	values[1] = entry->ops->row_end();
 	nulls[1] = false;
 #if (PG_VERSION_NUM < 100000)
 	new_row = SPI_modifytuple(rel, new_row, 2, columns, values, nulls);
@@ -517,14 +965,27 @@ generated_always_as_row_start_end(PG_FUNCTION_ARGS)
 	return PointerGetDatum(new_row);
 }
 
+Datum
+generated_always_as_row_start_end(PG_FUNCTION_ARGS)
+{
+	return CallTimedTrigger(generated_always_as_row_start_end_internal, fcinfo,
+							PERIODS_STAT_GENERATED_ALWAYS);
+}
+
+/*
+ * Insert a row into the history table with SPI.  This is what we do when we
+ * can't insert into it directly, see GetHistoryInsertState().  The plan cache
+ * statistics go to relid, the table the history is for.
+ */
 static void
-insert_into_history(Relation history_rel, HeapTuple history_tuple)
+insert_into_history_spi(Oid relid, Relation history_rel, HeapTuple history_tuple)
 {
 	InsertHistoryPlanEntry   *hentry;
 	bool		found;
 	char	   *schemaname = SPI_getnspname(history_rel);
 	char	   *tablename = SPI_getrelname(history_rel);
 	Oid			history_relid = history_rel->rd_id;
+	Oid			type = HeapTupleHeaderGetTypeId(history_tuple->t_data);
 	Datum		value;
 	int			ret;
 
@@ -541,20 +1002,24 @@ insert_into_history(Relation history_rel, HeapTuple history_tuple)
 			HASH_ENTER,
 			&found);
 
-	/* If we didn't find it or the name changed, re-plan it */
+	/* If we didn't find it or the name or row type changed, re-plan it */
 	if (!found ||
-		!strcmp(hentry->schemaname, schemaname) ||
-		!strcmp(hentry->tablename, tablename))
+		strcmp(hentry->schemaname, schemaname) != 0 ||
+		strcmp(hentry->tablename, tablename) != 0 ||
+		hentry->type != type)
 	{
 		StringInfo	buf = makeStringInfo();
-		Oid			type = HeapTupleHeaderGetTypeId(history_tuple->t_data);
 
 		appendStringInfo(buf, "INSERT INTO %s VALUES (($1).*)",
 				quote_qualified_identifier(schemaname, tablename));
 
+		if (found && hentry->qplan != NULL)
+			SPI_freeplan(hentry->qplan);
+
 		hentry->history_relid = history_relid;
 		strlcpy(hentry->schemaname, schemaname, sizeof(hentry->schemaname));
 		strlcpy(hentry->tablename, tablename, sizeof(hentry->tablename));
+		hentry->type = type;
 		hentry->qplan = SPI_prepare(buf->data, 1, &type);
 		if (hentry->qplan == NULL)
 			elog(ERROR, "SPI_prepare returned %s for %s",
@@ -563,7 +1028,11 @@ insert_into_history(Relation history_rel, HeapTuple history_tuple)
 		ret = SPI_keepplan(hentry->qplan);
 		if (ret != 0)
 			elog(ERROR, "SPI_keepplan returned %s", SPI_result_code_string(ret));
+
+		CountPeriodsStat(relid, PERIODS_STAT_PLAN_MISSES, 1);
 	}
+	else
+		CountPeriodsStat(relid, PERIODS_STAT_PLAN_HITS, 1);
 
 	/* Do the INSERT */
 	value = HeapTupleGetDatum(history_tuple);
@@ -575,215 +1044,3974 @@ insert_into_history(Relation history_rel, HeapTuple history_tuple)
 		elog(ERROR, "SPI_finish failed");
 }
 
-Datum
-write_history(PG_FUNCTION_ARGS)
+/*
+ * Everything we need to insert into a history table, kept so that we only
+ * open the table and its indexes once per command.  It is thrown away when
+ * the table is next written to by a different command, when the
+ * subtransaction that built it commits, or at the end of the transaction.
+ *
+ * That outlives the portal that was running when we built it, so everything
+ * is opened under the resource owner of the (sub)transaction instead of the
+ * portal's, which is released with the portal at the end of the statement.
+ *
+ * Where possible, we insert the rows ourselves through the table access
+ * method and then insert the index entries, which is what the executor would
+ * do for an INSERT, without the overhead of going through SPI for every row.
+ * Not skipping the indexes is important, see the notes for version 1.2 in the
+ * CHANGELOG.
+ *
+ * If the history table is anything other than a plain table, has triggers or
+ * row level security, or has deferrable unique indexes, we fall back to using
+ * SPI so that all of those are handled properly.
+ */
+static HTAB *HistoryInsertStateHash = NULL;
+
+typedef struct HistoryInsertState
 {
-	TriggerData	   *trigdata = castNode(TriggerData, fcinfo->context);
-	const char	   *funcname = "write_history";
-	Relation		rel;
-	HeapTuple		old_row, new_row;
-	TupleDesc		tupledesc;
-	char		   *start_name, *end_name;
-	int16			start_num, end_num;
-	Oid				typeid;
-	bool			is_null;
-	Oid				history_id;
-	int				cmp;
-	bool			only_excluded_changed = false;
+	Oid					history_relid;	/* the hash key; must be first */
+	SubTransactionId	subid;			/* subtransaction that opened rel */
+	ResourceOwner		owner;			/* and its CurTransactionResourceOwner */
+	CommandId			cid;			/* command we were built for */
+	Relation			rel;
+	bool				use_spi;
+#if (PG_VERSION_NUM >= 120000)
+	EState			   *estate;
+	ResultRelInfo	   *resultRelInfo;
+	TupleTableSlot	   *slot;
 
-	/*
-	 * Make sure this is being called as an AFTER ROW trigger.  Note:
-	 * translatable error strings are shared with ri_triggers.c, so resist the
-	 * temptation to fold the function name into them.
-	 */
-	if (!CALLED_AS_TRIGGER(fcinfo))
-		ereport(ERROR,
-				(errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
-				 errmsg("function \"%s\" was not called by trigger manager",
-						funcname)));
+	/* Rows waiting to be inserted together, see insert_history_slot() */
+	TupleTableSlot	  **batch_slots;
+	int					nbatch;
+	int					maxbatch;
+	BulkInsertState		bistate;
+#endif
+} HistoryInsertState;
 
-	if (!TRIGGER_FIRED_AFTER(trigdata->tg_event) ||
-		!TRIGGER_FIRED_FOR_ROW(trigdata->tg_event))
-		ereport(ERROR,
-				(errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
-				 errmsg("function \"%s\" must be fired AFTER ROW",
-						funcname)));
+/* How many rows we insert into the history table at once */
+#define HISTORY_BATCH_SIZE	1000
 
-	/* Get Relation information */
-	rel = trigdata->tg_relation;
-	tupledesc = RelationGetDescr(rel);
+static void
+ReleaseHistoryInsertState(HistoryInsertState *hstate)
+{
+	ResourceOwner	save_owner = CurrentResourceOwner;
 
-	/* Get the old data that was updated/deleted */
-	if (TRIGGER_FIRED_BY_INSERT(trigdata->tg_event))
-	{
-		old_row = NULL;			/* keep compiler quiet */
-		new_row = trigdata->tg_trigtuple;
-	}
-	else if (TRIGGER_FIRED_BY_UPDATE(trigdata->tg_event))
+	/* We might be in a subtransaction of the one that opened everything */
+	CurrentResourceOwner = hstate->owner;
+
+#if (PG_VERSION_NUM >= 120000)
+	if (!hstate->use_spi)
 	{
-		old_row = trigdata->tg_trigtuple;
-		new_row = trigdata->tg_newtuple;
+		int		i;
 
-		/* Did only excluded columns change? */
-		only_excluded_changed = OnlyExcludedColumnsChanged(rel, old_row, new_row);
+		/*
+		 * Every statement flushes what it buffered, and the rows of one that
+		 * failed are thrown away when its subtransaction aborts, so there
+		 * should be nothing left that we would lose here.
+		 */
+		Assert(hstate->nbatch == 0);
+
+		for (i = 0; i < hstate->maxbatch; i++)
+			ExecDropSingleTupleTableSlot(hstate->batch_slots[i]);
+		if (hstate->bistate != NULL)
+			FreeBulkInsertState(hstate->bistate);
+
+		ExecDropSingleTupleTableSlot(hstate->slot);
+		ExecCloseIndices(hstate->resultRelInfo);
+		FreeExecutorState(hstate->estate);
 	}
-	else if (TRIGGER_FIRED_BY_DELETE(trigdata->tg_event))
+#endif
+
+	/* Keep the lock until end of transaction */
+	table_close(hstate->rel, NoLock);
+
+	CurrentResourceOwner = save_owner;
+}
+
+/*
+ * At the end of the transaction, close everything that's still open.  If the
+ * transaction is aborting, the resource owner has already taken care of that
+ * and our executor state is gone with TopTransactionContext, so just forget
+ * about it all.
+ */
+static void
+HistoryInsertXactCallback(XactEvent event, void *arg)
+{
+	HASH_SEQ_STATUS		status;
+	HistoryInsertState *hstate;
+	bool				release;
+
+	switch (event)
 	{
-		old_row = trigdata->tg_trigtuple;
-		new_row = NULL;			/* keep compiler quiet */
+		case XACT_EVENT_PRE_COMMIT:
+		case XACT_EVENT_PRE_PREPARE:
+			release = true;
+			break;
+		case XACT_EVENT_ABORT:
+			release = false;
+			break;
+		default:
+			return;
 	}
-	else
+
+	hash_seq_init(&status, HistoryInsertStateHash);
+	while ((hstate = (HistoryInsertState *) hash_seq_search(&status)) != NULL)
 	{
-		ereport(ERROR,
-				(errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
-				 errmsg("function \"%s\" must be fired for INSERT or UPDATE or DELETE",
-						funcname)));
-		old_row = NULL;			/* keep compiler quiet */
-		new_row = NULL;			/* keep compiler quiet */
+		if (release)
+			ReleaseHistoryInsertState(hstate);
+		hash_search(HistoryInsertStateHash, &hstate->history_relid, HASH_REMOVE, NULL);
 	}
+}
 
-	GetPeriodColumnNames(rel, "system_time", &start_name, &end_name);
+static void
+HistoryInsertSubXactCallback(SubXactEvent event, SubTransactionId mySubid,
+							 SubTransactionId parentSubid, void *arg)
+{
+	HASH_SEQ_STATUS		status;
+	HistoryInsertState *hstate;
 
-	/* Get the column numbers and type */
-	start_num = SPI_fnumber(tupledesc, start_name);
-	end_num = SPI_fnumber(tupledesc, end_name);
-	typeid = SPI_gettypeid(tupledesc, start_num);
+	if (event != SUBXACT_EVENT_PRE_COMMIT_SUB && event != SUBXACT_EVENT_ABORT_SUB)
+		return;
 
 	/*
-	 * Validate that the period columns haven't been modified.  This can happen
-	 * with a trigger executed after generated_always_as_row_start_end().
+	 * The subtransaction's resource owner doesn't hand its relation
+	 * references to its parent, so close what we opened in it.  What was
+	 * opened before it might still hold rows buffered by the statement that
+	 * failed, and those must not be inserted.
 	 */
-	if (TRIGGER_FIRED_BY_INSERT(trigdata->tg_event) ||
-		(TRIGGER_FIRED_BY_UPDATE(trigdata->tg_event) && !only_excluded_changed))
+	hash_seq_init(&status, HistoryInsertStateHash);
+	while ((hstate = (HistoryInsertState *) hash_seq_search(&status)) != NULL)
 	{
-		Datum	start_datum = SPI_getbinval(new_row, tupledesc, start_num, &is_null);
-		Datum	end_datum = SPI_getbinval(new_row, tupledesc, end_num, &is_null);
-
-		if (CompareWithCurrentDatum(typeid, start_datum) != 0)
-			ereport(ERROR,
-					(errcode(ERRCODE_GENERATED_ALWAYS),
-					 errmsg("cannot insert or update column \"%s\"", start_name),
-					 errdetail("Column \"%s\" is GENERATED ALWAYS AS ROW START", start_name)));
+		if (hstate->subid != mySubid)
+		{
+#if (PG_VERSION_NUM >= 120000)
+			if (event == SUBXACT_EVENT_ABORT_SUB && !hstate->use_spi)
+			{
+				int		i;
 
-		if (CompareWithInfiniteDatum(typeid, end_datum) != 0)
-			ereport(ERROR,
-					(errcode(ERRCODE_GENERATED_ALWAYS),
-					 errmsg("cannot insert or update column \"%s\"", end_name),
-					 errdetail("Column \"%s\" is GENERATED ALWAYS AS ROW END", end_name)));
+				for (i = 0; i < hstate->nbatch; i++)
+					ExecClearTuple(hstate->batch_slots[i]);
+				hstate->nbatch = 0;
+			}
+#endif
+			continue;
+		}
 
-		/*
-		 * If this is an INSERT, then we're done because there is no history to
-		 * write.
-		 */
-		if (TRIGGER_FIRED_BY_INSERT(trigdata->tg_event))
-			return PointerGetDatum(NULL);
+		if (event == SUBXACT_EVENT_PRE_COMMIT_SUB)
+			ReleaseHistoryInsertState(hstate);
+		hash_search(HistoryInsertStateHash, &hstate->history_relid, HASH_REMOVE, NULL);
 	}
+}
 
-	/* If only excluded columns have changed, don't write history. */
-	if (only_excluded_changed)
-		return PointerGetDatum(NULL);
+static HTAB *
+CreateHistoryInsertStateHash(void)
+{
+	HASHCTL	ctl;
+	HTAB   *result;
 
-	/* Compare the OLD row's start with the transaction start */
-	cmp = CompareWithCurrentDatum(typeid,
-			SPI_getbinval(old_row, tupledesc, start_num, &is_null));
+	ctl.keysize = sizeof(Oid);
+	ctl.entrysize = sizeof(HistoryInsertState);
 
-	/*
-	 * Don't do anything more if the start time is still the same.
-	 *
-	 * DELETE: SQL:2016 13.4 GR 15)a)iii)2)
-	 * UPDATE: SQL:2016 15.13 GR 9)a)iii)2)
-	 */
-	if (cmp == 0)
-		return PointerGetDatum(NULL);
+	result = hash_create("History Insert State Hash", 16, &ctl, HASH_ELEM | HASH_BLOBS);
 
-	/*
-	 * There is a weird case in READ UNCOMMITTED and READ COMMITTED where a
-	 * transaction can UPDATE/DELETE a row created by a transaction that
-	 * started later.  In effect, system-versioned tables must be run at the
-	 * SERIALIZABLE level and so if we come across such an anomaly, we give an
-	 * invalid row version error, per spec.
-	 *
-	 * DELETE: SQL:2016 13.4 GR 15)a)iii)1)
-	 * UPDATE: SQL:2016 15.13 GR 9)a)iii)1)
-	 */
+	RegisterXactCallback(HistoryInsertXactCallback, NULL);
+	RegisterSubXactCallback(HistoryInsertSubXactCallback, NULL);
+
+	return result;
+}
+
+#if (PG_VERSION_NUM >= 120000)
+/*
+ * Set up an executor state to insert into the history table like an INSERT
+ * would, unless it is something we should leave to SPI.
+ */
+static void
+BuildHistoryInsertExecutorState(HistoryInsertState *hstate)
+{
+	Relation		rel = hstate->rel;
+	EState		   *estate;
+	ResultRelInfo  *resultRelInfo;
+	RangeTblEntry  *rte;
+#if (PG_VERSION_NUM >= 160000)
+	List		   *perminfos = NIL;
+#endif
+	MemoryContext	oldcontext;
+	int				i;
+
+	hstate->use_spi = true;
+	if (rel->rd_rel->relkind != RELKIND_RELATION ||
+		rel->trigdesc != NULL ||
+		rel->rd_rel->relrowsecurity)
+		return;
+
+	/* This all has to live as long as the HistoryInsertState */
+	oldcontext = MemoryContextSwitchTo(TopTransactionContext);
+
+	estate = CreateExecutorState();
+	MemoryContextSwitchTo(estate->es_query_cxt);
+
+	/* Error messages from constraint checks want a range table */
+	rte = makeNode(RangeTblEntry);
+	rte->rtekind = RTE_RELATION;
+	rte->relid = RelationGetRelid(rel);
+	rte->relkind = rel->rd_rel->relkind;
+	rte->rellockmode = RowExclusiveLock;
+#if (PG_VERSION_NUM >= 180000)
+	addRTEPermissionInfo(&perminfos, rte);
+	ExecInitRangeTable(estate, list_make1(rte), perminfos, bms_make_singleton(1));
+#elif (PG_VERSION_NUM >= 160000)
+	addRTEPermissionInfo(&perminfos, rte);
+	ExecInitRangeTable(estate, list_make1(rte), perminfos);
+#else
+	ExecInitRangeTable(estate, list_make1(rte));
+#endif
+
+	resultRelInfo = makeNode(ResultRelInfo);
+	InitResultRelInfo(resultRelInfo, rel, 1, NULL, 0);
+#if (PG_VERSION_NUM < 140000)
+	estate->es_result_relations = resultRelInfo;
+	estate->es_num_result_relations = 1;
+	estate->es_result_relation_info = resultRelInfo;
+#endif
+	estate->es_output_cid = GetCurrentCommandId(true);
+
+	ExecOpenIndices(resultRelInfo, false);
+
+	/* Deferred uniqueness checks need the after trigger machinery */
+	for (i = 0; i < resultRelInfo->ri_NumIndices; i++)
+	{
+		if (!resultRelInfo->ri_IndexRelationDescs[i]->rd_index->indimmediate)
+		{
+			MemoryContextSwitchTo(oldcontext);
+			ExecCloseIndices(resultRelInfo);
+			FreeExecutorState(estate);
+			return;
+		}
+	}
+
+	hstate->estate = estate;
+	hstate->resultRelInfo = resultRelInfo;
+	hstate->slot = MakeSingleTupleTableSlot(RelationGetDescr(rel), &TTSOpsVirtual);
+	hstate->use_spi = false;
+
+	MemoryContextSwitchTo(oldcontext);
+}
+#endif
+
+/*
+ * Get the state for inserting into the given history table, opening it if
+ * this is the first row of the statement.
+ */
+static HistoryInsertState *
+GetHistoryInsertState(Oid history_relid)
+{
+	HistoryInsertState *hstate;
+	HistoryInsertState	newstate;
+	CommandId			cid = GetCurrentCommandId(false);
+	ResourceOwner		save_owner;
+
+	if (!HistoryInsertStateHash)
+		HistoryInsertStateHash = CreateHistoryInsertStateHash();
+
+	hstate = (HistoryInsertState *) hash_search(HistoryInsertStateHash,
+			&history_relid, HASH_FIND, NULL);
+
+	if (hstate != NULL)
+	{
+		if (hstate->cid == cid)
+			return hstate;
+
+		/*
+		 * Anything could have happened to the history table between two
+		 * commands of the same transaction, including new indexes, so start
+		 * over.
+		 */
+		ReleaseHistoryInsertState(hstate);
+		hash_search(HistoryInsertStateHash, &history_relid, HASH_REMOVE, NULL);
+	}
+
+	/*
+	 * Build the new state before entering it in the hash table so that we
+	 * don't leave a half-built entry behind if something goes wrong.  The
+	 * resource owner will close anything we opened in that case.
+	 */
+	MemSet(&newstate, 0, sizeof(newstate));
+	newstate.history_relid = history_relid;
+	newstate.subid = GetCurrentSubTransactionId();
+	newstate.owner = CurTransactionResourceOwner;
+	newstate.cid = cid;
+
+	save_owner = CurrentResourceOwner;
+	CurrentResourceOwner = newstate.owner;
+	newstate.rel = table_open(history_relid, RowExclusiveLock);
+	newstate.use_spi = true;
+#if (PG_VERSION_NUM >= 120000)
+	BuildHistoryInsertExecutorState(&newstate);
+#endif
+	CurrentResourceOwner = save_owner;
+
+	hstate = (HistoryInsertState *) hash_search(HistoryInsertStateHash,
+			&history_relid, HASH_ENTER, NULL);
+	*hstate = newstate;
+
+	return hstate;
+}
+
+#if (PG_VERSION_NUM >= 120000)
+/*
+ * Insert the index entries for a row that was just put in the history table.
+ * This is the reason we don't just call heap_insert() and be done with it.
+ */
+static void
+insert_history_index_entries(HistoryInsertState *hstate, TupleTableSlot *slot)
+{
+	EState		   *estate = hstate->estate;
+	ResultRelInfo  *resultRelInfo = hstate->resultRelInfo;
+	List		   *recheckIndexes;
+
+	if (resultRelInfo->ri_NumIndices > 0)
+	{
+#if (PG_VERSION_NUM < 140000)
+		recheckIndexes = ExecInsertIndexTuples(slot, estate, false, NULL, NIL);
+#elif (PG_VERSION_NUM < 160000)
+		recheckIndexes = ExecInsertIndexTuples(resultRelInfo, slot, estate,
+											   false, false, NULL, NIL);
+#else
+		recheckIndexes = ExecInsertIndexTuples(resultRelInfo, slot, estate,
+											   false, false, NULL, NIL, false);
+#endif
+		/* We don't allow deferrable indexes here so this should be empty */
+		Assert(recheckIndexes == NIL);
+		list_free(recheckIndexes);
+	}
+
+	ResetPerTupleExprContext(estate);
+}
+
+/*
+ * Get the slot the next history row should be built in.  Without batch, this
+ * is always the same one; with it, the next free one in the batch.
+ */
+static TupleTableSlot *
+next_history_slot(HistoryInsertState *hstate, bool batch)
+{
+	MemoryContext	oldcontext;
+	ResourceOwner	save_owner;
+
+	if (!batch)
+		return hstate->slot;
+
+	/*
+	 * The slots and the bulk insert state live as long as the estate, and the
+	 * slots pin the tuple descriptor with the current resource owner.
+	 */
+	oldcontext = MemoryContextSwitchTo(hstate->estate->es_query_cxt);
+	save_owner = CurrentResourceOwner;
+	CurrentResourceOwner = hstate->owner;
+
+	if (hstate->batch_slots == NULL)
+	{
+		hstate->batch_slots = (TupleTableSlot **)
+			palloc0(HISTORY_BATCH_SIZE * sizeof(TupleTableSlot *));
+		hstate->bistate = GetBulkInsertState();
+	}
+
+	if (hstate->nbatch == hstate->maxbatch)
+		hstate->batch_slots[hstate->maxbatch++] = table_slot_create(hstate->rel, NULL);
+
+	CurrentResourceOwner = save_owner;
+	MemoryContextSwitchTo(oldcontext);
+
+	return hstate->batch_slots[hstate->nbatch];
+}
+#endif
+
+/*
+ * Insert all the rows buffered by insert_history_slot() in one go, and then
+ * their index entries.
+ */
+static void
+flush_history_rows(HistoryInsertState *hstate)
+{
+#if (PG_VERSION_NUM >= 120000)
+	int		i;
+
+	if (hstate->use_spi || hstate->nbatch == 0)
+		return;
+
+	table_multi_insert(hstate->rel, hstate->batch_slots, hstate->nbatch,
+					   hstate->estate->es_output_cid, 0, hstate->bistate);
+
+	/* Don't hold on to the buffer past a possible subtransaction boundary */
+	ReleaseBulkInsertStatePin(hstate->bistate);
+
+	for (i = 0; i < hstate->nbatch; i++)
+	{
+		insert_history_index_entries(hstate, hstate->batch_slots[i]);
+		ExecClearTuple(hstate->batch_slots[i]);
+	}
+
+	hstate->nbatch = 0;
+#endif
+}
+
+#if (PG_VERSION_NUM >= 120000)
+/*
+ * Insert a row that was built in a slot from next_history_slot().  With
+ * batch, the row might not be inserted until the next call to
+ * flush_history_rows().
+ */
+static void
+insert_history_slot(HistoryInsertState *hstate, TupleTableSlot *slot,
+					bool batch)
+{
+	/* NOT NULL and CHECK constraints */
+	if (hstate->rel->rd_att->constr)
+		ExecConstraints(hstate->resultRelInfo, slot, hstate->estate);
+
+	if (batch)
+	{
+		/* Make it independent of the memory of the row it came from */
+		ExecMaterializeSlot(slot);
+		hstate->nbatch++;
+
+		if (hstate->nbatch == HISTORY_BATCH_SIZE)
+			flush_history_rows(hstate);
+		return;
+	}
+
+	table_tuple_insert(hstate->rel, slot, hstate->estate->es_output_cid, 0, NULL);
+	insert_history_index_entries(hstate, slot);
+	ExecClearTuple(slot);
+}
+#endif
+
+/*
+ * Work out how to turn a row of the table into a row of its history table,
+ * unless we already know.  The columns are matched by name because the history
+ * table can have a different physical layout, see
+ * https://github.com/xocolatl/periods/issues/5
+ */
+static void
+GetHistoryRowBuilder(SystemTimeCacheEntry *entry, TupleDesc tupledesc,
+					 TupleDesc history_tupledesc)
+{
+	MemoryContext	oldcontext;
+	int				i, j;
+
+	if (entry->builder_valid)
+		return;
+
+	if (entry->builder_context == NULL)
+	{
+		entry->builder_context = AllocSetContextCreate(TopMemoryContext,
+													   "periods history row builder",
+													   ALLOCSET_SMALL_MINSIZE,
+													   ALLOCSET_SMALL_INITSIZE,
+													   ALLOCSET_SMALL_MAXSIZE);
+		entry->row_context = AllocSetContextCreate(TopMemoryContext,
+												   "periods history row",
+												   ALLOCSET_DEFAULT_MINSIZE,
+												   ALLOCSET_DEFAULT_INITSIZE,
+												   ALLOCSET_DEFAULT_MAXSIZE);
+	}
+	else
+		MemoryContextReset(entry->builder_context);
+
+	oldcontext = MemoryContextSwitchTo(entry->builder_context);
+
+	entry->history_natts = history_tupledesc->natts;
+	entry->history_attmap = (AttrNumber *) palloc0(history_tupledesc->natts * sizeof(AttrNumber));
+	entry->history_end_num = 0;
+
+	for (i = 0; i < history_tupledesc->natts; i++)
+	{
+		Form_pg_attribute	hatt = TupleDescAttr(history_tupledesc, i);
+
+		if (hatt->attisdropped)
+			continue;
+
+		for (j = 0; j < tupledesc->natts; j++)
+		{
+			Form_pg_attribute	att = TupleDescAttr(tupledesc, j);
+
+			if (att->attisdropped || namestrcmp(&att->attname, NameStr(hatt->attname)) != 0)
+				continue;
+
+			if (att->atttypid != hatt->atttypid || att->atttypmod != hatt->atttypmod)
+				ereport(ERROR,
+						(errcode(ERRCODE_DATATYPE_MISMATCH),
+						 errmsg("could not convert row type"),
+						 errdetail("Attribute \"%s\" of type %s does not match corresponding attribute of type %s.",
+								   NameStr(hatt->attname),
+								   format_type_be(tupledesc->tdtypeid),
+								   format_type_be(history_tupledesc->tdtypeid))));
+
+			entry->history_attmap[i] = j + 1;
+			break;
+		}
+
+		if (entry->history_attmap[i] == 0)
+			ereport(ERROR,
+					(errcode(ERRCODE_DATATYPE_MISMATCH),
+					 errmsg("could not convert row type"),
+					 errdetail("Attribute \"%s\" of type %s does not exist in type %s.",
+							   NameStr(hatt->attname),
+							   format_type_be(history_tupledesc->tdtypeid),
+							   format_type_be(tupledesc->tdtypeid))));
+
+		if (entry->history_attmap[i] == entry->end_num)
+			entry->history_end_num = i + 1;
+	}
+
+	/* We can't have matched every column without this one, but be sure */
+	if (entry->history_end_num == 0)
+		elog(ERROR, "column \"%s\" not found in history table", NameStr(entry->end_name));
+
+	entry->row_values = (Datum *) palloc(tupledesc->natts * sizeof(Datum));
+	entry->row_nulls = (bool *) palloc(tupledesc->natts * sizeof(bool));
+	entry->history_values = (Datum *) palloc(history_tupledesc->natts * sizeof(Datum));
+	entry->history_nulls = (bool *) palloc(history_tupledesc->natts * sizeof(bool));
+
+	MemoryContextSwitchTo(oldcontext);
+
+	entry->builder_valid = true;
+}
+
+/*
+ * Build the history version of an old row, with its ROW END set to the start
+ * of this transaction, in one pass.
+ */
+static void
+build_history_row(SystemTimeCacheEntry *entry, TupleDesc tupledesc,
+				  HeapTuple old_row, Datum *values, bool *nulls)
+{
+	int		i;
+
+	/*
+	 * Always deform with the table's tupledesc so that missing attributes are
+	 * filled in.  This corrects for bug #16242 which was found by this very
+	 * problem.
+	 */
+	heap_deform_tuple(old_row, tupledesc, entry->row_values, entry->row_nulls);
+
+	for (i = 0; i < entry->history_natts; i++)
+	{
+		AttrNumber	attnum = entry->history_attmap[i];
+
+		if (attnum == 0)
+		{
+			/* Dropped column */
+			values[i] = (Datum) 0;
+			nulls[i] = true;
+			continue;
+		}
+
+		values[i] = entry->row_values[attnum - 1];
+		nulls[i] = entry->row_nulls[attnum - 1];
+	}
+
+	values[entry->history_end_num - 1] = entry->ops->row_start();
+	nulls[entry->history_end_num - 1] = false;
+}
+
+/*
+ * Put the old version of a row into the history table.  With batch, the row
+ * is only buffered and the caller must call flush_history_rows() at some
+ * point.
+ */
+static void
+archive_row(SystemTimeCacheEntry *entry, HistoryInsertState *hstate,
+			TupleDesc tupledesc, HeapTuple old_row, bool batch)
+{
+	MemoryContext	oldcontext;
+	Size			bytes = 0;
+
+	GetHistoryRowBuilder(entry, tupledesc, RelationGetDescr(hstate->rel));
+
+	/* Keep memory flat no matter how many rows a statement archives */
+	oldcontext = MemoryContextSwitchTo(entry->row_context);
+
+#if (PG_VERSION_NUM >= 120000)
+	if (!hstate->use_spi)
+	{
+		TupleTableSlot *slot = next_history_slot(hstate, batch);
+
+		ExecClearTuple(slot);
+		build_history_row(entry, tupledesc, old_row, slot->tts_values, slot->tts_isnull);
+		ExecStoreVirtualTuple(slot);
+		if (PeriodsStatHash != NULL)
+			bytes = heap_compute_data_size(RelationGetDescr(hstate->rel),
+										   slot->tts_values, slot->tts_isnull);
+		insert_history_slot(hstate, slot, batch);
+	}
+	else
+#endif
+	{
+		HeapTuple	history_tuple;
+
+		build_history_row(entry, tupledesc, old_row,
+						  entry->history_values, entry->history_nulls);
+		history_tuple = heap_form_tuple(RelationGetDescr(hstate->rel),
+										entry->history_values,
+										entry->history_nulls);
+		insert_into_history_spi(entry->relid, hstate->rel, history_tuple);
+
+		bytes = history_tuple->t_len - SizeofHeapTupleHeader;
+	}
+
+	CountPeriodsStat(entry->relid, PERIODS_STAT_ROWS_ARCHIVED, 1);
+	CountPeriodsStat(entry->relid, PERIODS_STAT_HISTORY_BYTES, bytes);
+
+	MemoryContextSwitchTo(oldcontext);
+	MemoryContextReset(entry->row_context);
+}
+
+static Datum
+write_history_internal(PG_FUNCTION_ARGS)
+{
+	TriggerData	   *trigdata = castNode(TriggerData, fcinfo->context);
+	const char	   *funcname = "write_history";
+	Relation		rel;
+	HeapTuple		old_row, new_row;
+	TupleDesc		tupledesc;
+	SystemTimeCacheEntry   *entry;
+	char		   *start_name, *end_name;
+	int16			start_num, end_num;
+	bool			is_null;
+	Oid				history_id;
+	int				cmp;
+	bool			only_excluded_changed = false;
+
+	/*
+	 * Make sure this is being called as an AFTER ROW trigger.  Note:
+	 * translatable error strings are shared with ri_triggers.c, so resist the
+	 * temptation to fold the function name into them.
+	 */
+	if (!CALLED_AS_TRIGGER(fcinfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+				 errmsg("function \"%s\" was not called by trigger manager",
+						funcname)));
+
+	if (!TRIGGER_FIRED_AFTER(trigdata->tg_event) ||
+		!TRIGGER_FIRED_FOR_ROW(trigdata->tg_event))
+		ereport(ERROR,
+				(errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+				 errmsg("function \"%s\" must be fired AFTER ROW",
+						funcname)));
+
+	/* Get Relation information */
+	rel = trigdata->tg_relation;
+	tupledesc = RelationGetDescr(rel);
+	entry = GetSystemTimeCacheEntry(rel);
+
+	/* Get the old data that was updated/deleted */
+	if (TRIGGER_FIRED_BY_INSERT(trigdata->tg_event))
+	{
+		old_row = NULL;			/* keep compiler quiet */
+		new_row = trigdata->tg_trigtuple;
+	}
+	else if (TRIGGER_FIRED_BY_UPDATE(trigdata->tg_event))
+	{
+		old_row = trigdata->tg_trigtuple;
+		new_row = trigdata->tg_newtuple;
+
+		/* Did only excluded columns change? */
+		only_excluded_changed = OnlyExcludedColumnsChanged(entry, tupledesc,
+														   old_row, new_row);
+	}
+	else if (TRIGGER_FIRED_BY_DELETE(trigdata->tg_event))
+	{
+		old_row = trigdata->tg_trigtuple;
+		new_row = NULL;			/* keep compiler quiet */
+	}
+	else
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+				 errmsg("function \"%s\" must be fired for INSERT or UPDATE or DELETE",
+						funcname)));
+		old_row = NULL;			/* keep compiler quiet */
+		new_row = NULL;			/* keep compiler quiet */
+	}
+
+	/* Get the column names and numbers */
+	start_name = NameStr(entry->start_name);
+	end_name = NameStr(entry->end_name);
+	start_num = entry->start_num;
+	end_num = entry->end_num;
+
+	/*
+	 * Validate that the period columns haven't been modified.  This can happen
+	 * with a trigger executed after generated_always_as_row_start_end().
+	 */
+	if (TRIGGER_FIRED_BY_INSERT(trigdata->tg_event) ||
+		(TRIGGER_FIRED_BY_UPDATE(trigdata->tg_event) && !only_excluded_changed))
+	{
+		Datum	start_datum = heap_getattr(new_row, start_num, tupledesc, &is_null);
+		Datum	end_datum = heap_getattr(new_row, end_num, tupledesc, &is_null);
+
+		if (entry->ops->compare_current(start_datum) != 0)
+			ereport(ERROR,
+					(errcode(ERRCODE_GENERATED_ALWAYS),
+					 errmsg("cannot insert or update column \"%s\"", start_name),
+					 errdetail("Column \"%s\" is GENERATED ALWAYS AS ROW START", start_name)));
+
+		if (entry->ops->compare_infinite(end_datum) != 0)
+			ereport(ERROR,
+					(errcode(ERRCODE_GENERATED_ALWAYS),
+					 errmsg("cannot insert or update column \"%s\"", end_name),
+					 errdetail("Column \"%s\" is GENERATED ALWAYS AS ROW END", end_name)));
+
+		/*
+		 * If this is an INSERT, then we're done because there is no history to
+		 * write.
+		 */
+		if (TRIGGER_FIRED_BY_INSERT(trigdata->tg_event))
+			return PointerGetDatum(NULL);
+	}
+
+	/* If only excluded columns have changed, don't write history. */
+	if (only_excluded_changed)
+	{
+		CountSkippedUpdate(entry, tupledesc, old_row, new_row);
+		return PointerGetDatum(NULL);
+	}
+
+	/* Compare the OLD row's start with the transaction start */
+	cmp = entry->ops->compare_current(heap_getattr(old_row, start_num, tupledesc, &is_null));
+
+	/*
+	 * Don't do anything more if the start time is still the same.
+	 *
+	 * DELETE: SQL:2016 13.4 GR 15)a)iii)2)
+	 * UPDATE: SQL:2016 15.13 GR 9)a)iii)2)
+	 */
+	if (cmp == 0)
+		return PointerGetDatum(NULL);
+
+	/*
+	 * There is a weird case in READ UNCOMMITTED and READ COMMITTED where a
+	 * transaction can UPDATE/DELETE a row created by a transaction that
+	 * started later.  In effect, system-versioned tables must be run at the
+	 * SERIALIZABLE level and so if we come across such an anomaly, we give an
+	 * invalid row version error, per spec.
+	 *
+	 * DELETE: SQL:2016 13.4 GR 15)a)iii)1)
+	 * UPDATE: SQL:2016 15.13 GR 9)a)iii)1)
+	 */
 	if (cmp > 0)
+	{
+		CountPeriodsStat(entry->relid, PERIODS_STAT_INVALID_ROW_VERSIONS, 1);
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_ROW_VERSION),
+				 errmsg("invalid row version"),
+				 errdetail("The row being updated or deleted was created after this transaction started."),
+				 errhint("The transaction might succeed if retried.")));
+	}
+
+	/*
+	 * If this table does not have SYSTEM VERSIONING, there is nothing else to
+	 * be done.  The same goes if the history is written by the statement
+	 * level trigger, which relies on us for the checks above.
+	 */
+	history_id = entry->history_relid;
+	if (OidIsValid(history_id) && !entry->statement_level)
+		archive_row(entry, GetHistoryInsertState(history_id), tupledesc, old_row, false);
+
+	return PointerGetDatum(NULL);
+}
+
+Datum
+write_history(PG_FUNCTION_ARGS)
+{
+	return CallTimedTrigger(write_history_internal, fcinfo, PERIODS_STAT_WRITE_HISTORY);
+}
+
+/*
+ * The statement level version of write_history(), for tables that asked for
+ * it in add_system_versioning().  It is fired AFTER UPDATE and AFTER DELETE
+ * with transition tables, and writes all of the history for the statement in
+ * batches.
+ *
+ * The row level trigger is still there to make the GENERATED ALWAYS and row
+ * version checks, so all we have to do is figure out which old rows need to
+ * go into the history.
+ */
+static Datum
+write_history_statement_internal(PG_FUNCTION_ARGS)
+{
+	TriggerData	   *trigdata = castNode(TriggerData, fcinfo->context);
+	const char	   *funcname = "write_history_statement";
+#if (PG_VERSION_NUM >= 100000)
+	Relation		rel;
+	TupleDesc		tupledesc;
+	SystemTimeCacheEntry   *entry;
+	HistoryInsertState	   *hstate;
+	Tuplestorestate		   *oldtable;
+	Tuplestorestate		   *newtable = NULL;
+	TupleTableSlot		   *old_slot;
+	TupleTableSlot		   *new_slot = NULL;
+	MemoryContext			rowcontext;
+	MemoryContext			oldcontext;
+#endif
+
+	/*
+	 * Make sure this is being called as an AFTER STATEMENT trigger.  Note:
+	 * translatable error strings are shared with ri_triggers.c, so resist the
+	 * temptation to fold the function name into them.
+	 */
+	if (!CALLED_AS_TRIGGER(fcinfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+				 errmsg("function \"%s\" was not called by trigger manager",
+						funcname)));
+
+	if (!TRIGGER_FIRED_AFTER(trigdata->tg_event) ||
+		!TRIGGER_FIRED_FOR_STATEMENT(trigdata->tg_event))
+		ereport(ERROR,
+				(errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+				 errmsg("function \"%s\" must be fired AFTER STATEMENT",
+						funcname)));
+
+	if (!TRIGGER_FIRED_BY_UPDATE(trigdata->tg_event) &&
+		!TRIGGER_FIRED_BY_DELETE(trigdata->tg_event))
+		ereport(ERROR,
+				(errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+				 errmsg("function \"%s\" must be fired for UPDATE or DELETE",
+						funcname)));
+
+#if (PG_VERSION_NUM < 100000)
+	ereport(ERROR,
+			(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+			 errmsg("function \"%s\" requires transition tables", funcname)));
+#else
+	oldtable = trigdata->tg_oldtable;
+	if (TRIGGER_FIRED_BY_UPDATE(trigdata->tg_event))
+		newtable = trigdata->tg_newtable;
+
+	if (oldtable == NULL ||
+		(TRIGGER_FIRED_BY_UPDATE(trigdata->tg_event) && newtable == NULL))
+		ereport(ERROR,
+				(errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+				 errmsg("function \"%s\" must be fired with transition tables",
+						funcname)));
+
+	/* Get Relation information */
+	rel = trigdata->tg_relation;
+	tupledesc = RelationGetDescr(rel);
+	entry = GetSystemTimeCacheEntry(rel);
+
+	/* Nothing to do if SYSTEM VERSIONING has gone away */
+	if (!OidIsValid(entry->history_relid))
+		return PointerGetDatum(NULL);
+
+	/* Get the history table ready for inserting */
+	hstate = GetHistoryInsertState(entry->history_relid);
+
+#if (PG_VERSION_NUM < 120000)
+	old_slot = MakeSingleTupleTableSlot(tupledesc);
+	if (newtable != NULL)
+		new_slot = MakeSingleTupleTableSlot(tupledesc);
+#else
+	old_slot = MakeSingleTupleTableSlot(tupledesc, &TTSOpsMinimalTuple);
+	if (newtable != NULL)
+		new_slot = MakeSingleTupleTableSlot(tupledesc, &TTSOpsMinimalTuple);
+#endif
+
+	/* Someone else might have read the transition tables already */
+	tuplestore_rescan(oldtable);
+	if (newtable != NULL)
+		tuplestore_rescan(newtable);
+
+	/* Don't let memory pile up over millions of rows */
+	rowcontext = AllocSetContextCreate(CurrentMemoryContext,
+									   "write_history_statement row context",
+									   ALLOCSET_DEFAULT_SIZES);
+
+	/*
+	 * For an UPDATE, the old and new transition tables are filled in lockstep
+	 * so we can read them side by side to pair each old row with its new
+	 * version.
+	 */
+	while (tuplestore_gettupleslot(oldtable, true, false, old_slot))
+	{
+		HeapTuple	old_row;
+		bool		is_null;
+
+		oldcontext = MemoryContextSwitchTo(rowcontext);
+
+#if (PG_VERSION_NUM < 120000)
+		old_row = ExecFetchSlotTuple(old_slot);
+#else
+		old_row = ExecFetchSlotHeapTuple(old_slot, false, NULL);
+#endif
+
+		if (newtable != NULL)
+		{
+			HeapTuple	new_row;
+
+			if (!tuplestore_gettupleslot(newtable, true, false, new_slot))
+				elog(ERROR, "transition tables for UPDATE are out of step");
+
+#if (PG_VERSION_NUM < 120000)
+			new_row = ExecFetchSlotTuple(new_slot);
+#else
+			new_row = ExecFetchSlotHeapTuple(new_slot, false, NULL);
+#endif
+
+			/* If only excluded columns have changed, don't write history. */
+			if (OnlyExcludedColumnsChanged(entry, tupledesc, old_row, new_row))
+			{
+				MemoryContextSwitchTo(oldcontext);
+				MemoryContextReset(rowcontext);
+				continue;
+			}
+		}
+
+		/*
+		 * Only rows that were created before this transaction get archived.
+		 * The row level trigger already complained about rows created after.
+		 */
+		if (entry->ops->compare_current(heap_getattr(old_row, entry->start_num, tupledesc, &is_null)) < 0)
+			archive_row(entry, hstate, tupledesc, old_row, true);
+
+		MemoryContextSwitchTo(oldcontext);
+		MemoryContextReset(rowcontext);
+	}
+
+	/* Insert whatever is left over */
+	flush_history_rows(hstate);
+
+	MemoryContextDelete(rowcontext);
+	ExecDropSingleTupleTableSlot(old_slot);
+	if (new_slot != NULL)
+		ExecDropSingleTupleTableSlot(new_slot);
+#endif
+
+	return PointerGetDatum(NULL);
+}
+
+Datum
+write_history_statement(PG_FUNCTION_ARGS)
+{
+	return CallTimedTrigger(write_history_statement_internal, fcinfo, PERIODS_STAT_WRITE_HISTORY);
+}
+
+/*
+ * Everything update_portion_of() needs to know about one of our FOR PORTION
+ * OF views, keyed by the view.  The column numbers are the view's, which are
+ * not necessarily the same as the table's.
+ *
+ * Entries are marked invalid whenever the relcache entry of the view or of its
+ * table is invalidated, which our catalogs force when they are changed.  The
+ * UPDATE depends on which columns are being changed so there can be several
+ * plans for it; they are only freed when the entry is rebuilt.
+ */
+static HTAB *PortionViewCacheHash = NULL;
+
+/* See SystemTimeCacheInvalCount */
+static uint64 PortionViewCacheInvalCount = 0;
+
+typedef struct PortionUpdatePlan
+{
+	Bitmapset  *columns;		/* the columns in the SET clause */
+	SPIPlanPtr	qplan;
+} PortionUpdatePlan;
+
+typedef struct PortionViewCacheEntry
+{
+	Oid			view_relid;		/* the hash key; must be first */
+	bool		valid;
+	Oid			table_relid;
+	MemoryContext context;		/* everything below lives here */
+	char	   *table_name;		/* qualified and quoted */
+	int16		start_num;
+	int16		end_num;
+	Oid			collation;
+	FmgrInfo	cmp_proc;		/* btree comparison function of the period */
+	Bitmapset  *generated;		/* columns left out of the new rows */
+	int			nkeys;
+	int16	   *key_nums;		/* columns identifying the row to update */
+	SPIPlanPtr	insert_plan;	/* built when first needed */
+	List	   *update_plans;	/* of PortionUpdatePlan */
+} PortionViewCacheEntry;
+
+static void
+PortionViewCacheInvalCallback(Datum arg, Oid relid)
+{
+	HASH_SEQ_STATUS			status;
+	PortionViewCacheEntry  *entry;
+
+	PortionViewCacheInvalCount++;
+
+	hash_seq_init(&status, PortionViewCacheHash);
+	while ((entry = (PortionViewCacheEntry *) hash_seq_search(&status)) != NULL)
+	{
+		if (!OidIsValid(relid) ||
+			entry->view_relid == relid ||
+			entry->table_relid == relid)
+			entry->valid = false;
+	}
+}
+
+static HTAB *
+CreatePortionViewCacheHash(void)
+{
+	HASHCTL	ctl;
+	HTAB   *result;
+
+	ctl.keysize = sizeof(Oid);
+	ctl.entrysize = sizeof(PortionViewCacheEntry);
+
+	result = hash_create("Portion View Cache Hash", 16, &ctl, HASH_ELEM | HASH_BLOBS);
+
+	CacheRegisterRelcacheCallback(PortionViewCacheInvalCallback, (Datum) 0);
+
+	return result;
+}
+
+/*
+ * Fill in a cache entry from our catalogs and the table's.
+ *
+ * The generated columns are those the standard calls for (SQL:2016 15.13 GR
+ * 10)b)i)), columns that own a sequence as those are a form of generated
+ * column, and the columns of a SYSTEM_TIME period.  In addition to what the
+ * standard calls for, we also count the columns of the primary key.  We do
+ * not, however, count columns that default to nextval() without owning the
+ * underlying sequence.
+ *
+ * The row to update is found with its primary key, or if there isn't one, with
+ * all of the columns that have a constraint on them.
+ */
+static void
+BuildPortionViewCacheEntry(Relation view, PortionViewCacheEntry *entry)
+{
+	int				ret;
+	Datum			values[1];
+	TupleDesc		tupdesc = RelationGetDescr(view);
+	SPITupleTable  *tuptable;
+	HeapTuple		tuple;
+	bool			is_null;
+	Datum			dat;
+	Form_pg_attribute	attr;
+	TypeCacheEntry *typentry;
+	Bitmapset	   *primary_key = NULL;
+	Bitmapset	   *constrained = NULL;
+	Bitmapset	   *keys;
+	MemoryContext	oldcontext;
+	ListCell	   *lc;
+	uint64			i;
+	int				attnum;
+
+	const char *sql =
+		"SELECT p.table_name::oid, p.start_column_name, p.end_column_name "
+		"FROM periods.for_portion_views AS fpv "
+		"JOIN periods.periods AS p "
+		"  ON (p.table_name, p.period_name) = (fpv.table_name, fpv.period_name) "
+		"WHERE fpv.view_name = $1";
+	static SPIPlanPtr qplan = NULL;
+
+	const char *columns_sql =
+		"SELECT a.attname, "
+		"       pg_catalog.pg_get_serial_sequence(a.attrelid::regclass::text, a.attname) IS NOT NULL "
+#if (PG_VERSION_NUM >= 100000)
+		"    OR a.attidentity <> '' "
+#endif
+#if (PG_VERSION_NUM >= 120000)
+		"    OR a.attgenerated <> '' "
+#endif
+		"    OR EXISTS (SELECT FROM periods.periods AS _p "
+		"               WHERE (_p.table_name, _p.period_name) = (a.attrelid, 'system_time') "
+		"                 AND a.attname IN (_p.start_column_name, _p.end_column_name)), "
+		"       EXISTS (SELECT FROM pg_catalog.pg_constraint AS _c "
+		"               WHERE _c.conrelid = a.attrelid "
+		"                 AND _c.contype = 'p' "
+		"                 AND _c.conkey @> ARRAY[a.attnum]), "
+		"       EXISTS (SELECT FROM pg_catalog.pg_constraint AS _c "
+		"               WHERE _c.conrelid = a.attrelid "
+		"                 AND _c.conkey @> ARRAY[a.attnum]) "
+		"FROM pg_catalog.pg_attribute AS a "
+		"WHERE a.attrelid = $1 "
+		"  AND a.attnum > 0 "
+		"  AND NOT a.attisdropped";
+	static SPIPlanPtr columns_qplan = NULL;
+
+	/* Throw away whatever we had before */
+	if (entry->context == NULL)
+		entry->context = AllocSetContextCreate(TopMemoryContext,
+											   "periods portion view cache",
+											   ALLOCSET_SMALL_MINSIZE,
+											   ALLOCSET_SMALL_INITSIZE,
+											   ALLOCSET_SMALL_MAXSIZE);
+	else
+	{
+		if (entry->insert_plan != NULL)
+			SPI_freeplan(entry->insert_plan);
+		foreach (lc, entry->update_plans)
+			SPI_freeplan(((PortionUpdatePlan *) lfirst(lc))->qplan);
+		MemoryContextReset(entry->context);
+	}
+	entry->table_relid = InvalidOid;
+	entry->insert_plan = NULL;
+	entry->update_plans = NIL;
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "SPI_connect failed");
+
+	/* Cache the plans if we haven't already */
+	if (qplan == NULL)
+	{
+		Oid	types[1] = {OIDOID};
+
+		qplan = SPI_prepare(sql, 1, types);
+		if (qplan == NULL)
+			elog(ERROR, "SPI_prepare returned %s for %s",
+				 SPI_result_code_string(SPI_result), sql);
+
+		ret = SPI_keepplan(qplan);
+		if (ret != 0)
+			elog(ERROR, "SPI_keepplan returned %s", SPI_result_code_string(ret));
+	}
+
+	if (columns_qplan == NULL)
+	{
+		Oid	types[1] = {OIDOID};
+
+		columns_qplan = SPI_prepare(columns_sql, 1, types);
+		if (columns_qplan == NULL)
+			elog(ERROR, "SPI_prepare returned %s for %s",
+				 SPI_result_code_string(SPI_result), columns_sql);
+
+		ret = SPI_keepplan(columns_qplan);
+		if (ret != 0)
+			elog(ERROR, "SPI_keepplan returned %s", SPI_result_code_string(ret));
+	}
+
+	/* Get the table information from this view */
+	values[0] = ObjectIdGetDatum(RelationGetRelid(view));
+	ret = SPI_execute_plan(qplan, values, NULL, true, 0);
+	if (ret != SPI_OK_SELECT)
+		elog(ERROR, "SPI_execute returned %s", SPI_result_code_string(ret));
+
+	if (SPI_processed == 0)
+		ereport(ERROR,
+				(errmsg("table and period information not found for view \"%s\"",
+						RelationGetRelationName(view))));
+
+	tuptable = SPI_tuptable;
+	tuple = tuptable->vals[0];
+
+	dat = SPI_getbinval(tuple, tuptable->tupdesc, 1, &is_null);
+	entry->table_relid = DatumGetObjectId(dat);
+
+	dat = SPI_getbinval(tuple, tuptable->tupdesc, 2, &is_null);
+	entry->start_num = SPI_fnumber(tupdesc, NameStr(*(DatumGetName(dat))));
+	if (entry->start_num <= 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_COLUMN),
+				 errmsg("column \"%s\" does not exist", NameStr(*(DatumGetName(dat))))));
+
+	dat = SPI_getbinval(tuple, tuptable->tupdesc, 3, &is_null);
+	entry->end_num = SPI_fnumber(tupdesc, NameStr(*(DatumGetName(dat))));
+	if (entry->end_num <= 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_COLUMN),
+				 errmsg("column \"%s\" does not exist", NameStr(*(DatumGetName(dat))))));
+
+	/* Now the table's columns */
+	values[0] = ObjectIdGetDatum(entry->table_relid);
+	ret = SPI_execute_plan(columns_qplan, values, NULL, true, 0);
+	if (ret != SPI_OK_SELECT)
+		elog(ERROR, "SPI_execute returned %s", SPI_result_code_string(ret));
+
+	tuptable = SPI_tuptable;
+	oldcontext = MemoryContextSwitchTo(entry->context);
+	entry->generated = NULL;
+	for (i = 0; i < SPI_processed; i++)
+	{
+		tuple = tuptable->vals[i];
+
+		/* The view doesn't have columns added to the table after it */
+		dat = SPI_getbinval(tuple, tuptable->tupdesc, 1, &is_null);
+		attnum = SPI_fnumber(tupdesc, NameStr(*(DatumGetName(dat))));
+		if (attnum <= 0)
+			continue;
+
+		dat = SPI_getbinval(tuple, tuptable->tupdesc, 3, &is_null);
+		if (DatumGetBool(dat))
+		{
+			primary_key = bms_add_member(primary_key, attnum);
+			entry->generated = bms_add_member(entry->generated, attnum);
+		}
+
+		dat = SPI_getbinval(tuple, tuptable->tupdesc, 2, &is_null);
+		if (DatumGetBool(dat))
+			entry->generated = bms_add_member(entry->generated, attnum);
+
+		dat = SPI_getbinval(tuple, tuptable->tupdesc, 4, &is_null);
+		if (DatumGetBool(dat))
+			constrained = bms_add_member(constrained, attnum);
+	}
+
+	keys = (primary_key != NULL) ? primary_key : constrained;
+	entry->nkeys = bms_num_members(keys);
+	entry->key_nums = (int16 *) palloc(Max(entry->nkeys, 1) * sizeof(int16));
+	attnum = -1;
+	i = 0;
+	while ((attnum = bms_next_member(keys, attnum)) >= 0)
+		entry->key_nums[i++] = attnum;
+
+	entry->table_name = quote_qualified_identifier(
+			get_namespace_name(get_rel_namespace(entry->table_relid)),
+			get_rel_name(entry->table_relid));
+	MemoryContextSwitchTo(oldcontext);
+
+	/* All done with SPI */
+	if (SPI_finish() != SPI_OK_FINISH)
+		elog(ERROR, "SPI_finish failed");
+
+	if (entry->nkeys == 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("table \"%s\" has no primary key or constraints to find the rows to update",
+						get_rel_name(entry->table_relid))));
+
+	/* How to compare the period's values */
+	attr = TupleDescAttr(tupdesc, entry->start_num - 1);
+	entry->collation = attr->attcollation;
+	typentry = lookup_type_cache(attr->atttypid, TYPECACHE_CMP_PROC);
+	if (!OidIsValid(typentry->cmp_proc))
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_FUNCTION),
+				 errmsg("could not identify a comparison function for type %s",
+						format_type_be(attr->atttypid))));
+	fmgr_info_cxt(typentry->cmp_proc, &entry->cmp_proc, entry->context);
+}
+
+static PortionViewCacheEntry *
+GetPortionViewCacheEntry(Relation view)
+{
+	Oid						relid = RelationGetRelid(view);
+	PortionViewCacheEntry  *entry;
+	bool					found;
+
+	if (!PortionViewCacheHash)
+		PortionViewCacheHash = CreatePortionViewCacheHash();
+
+	entry = (PortionViewCacheEntry *) hash_search(PortionViewCacheHash,
+			&relid, HASH_ENTER, &found);
+
+	if (!found)
+	{
+		entry->valid = false;
+		entry->table_relid = InvalidOid;
+		entry->context = NULL;
+		entry->insert_plan = NULL;
+		entry->update_plans = NIL;
+	}
+
+	while (!entry->valid)
+	{
+		uint64	inval_count = PortionViewCacheInvalCount;
+
+		BuildPortionViewCacheEntry(view, entry);
+
+		/* Build it again if it was invalidated in the meantime */
+		entry->valid = (inval_count == PortionViewCacheInvalCount);
+	}
+
+	return entry;
+}
+
+/*
+ * Is value strictly between lower and upper?  If any of them is NULL, it
+ * isn't.
+ */
+static bool
+portion_value_between(PortionViewCacheEntry *entry,
+					  Datum lower, bool lower_isnull,
+					  Datum value, bool value_isnull,
+					  Datum upper, bool upper_isnull)
+{
+	if (lower_isnull || value_isnull || upper_isnull)
+		return false;
+
+	return DatumGetInt32(FunctionCall2Coll(&entry->cmp_proc, entry->collation, lower, value)) < 0 &&
+		   DatumGetInt32(FunctionCall2Coll(&entry->cmp_proc, entry->collation, value, upper)) < 0;
+}
+
+/*
+ * Prepare a plan that we are going to hang on to in one of our caches.
+ */
+static SPIPlanPtr
+prepare_kept_plan(const char *sql, int nargs, Oid *argtypes)
+{
+	SPIPlanPtr	qplan;
+	int			ret;
+
+	qplan = SPI_prepare(sql, nargs, argtypes);
+	if (qplan == NULL)
+		elog(ERROR, "SPI_prepare returned %s for %s",
+			 SPI_result_code_string(SPI_result), sql);
+
+	ret = SPI_keepplan(qplan);
+	if (ret != 0)
+		elog(ERROR, "SPI_keepplan returned %s", SPI_result_code_string(ret));
+
+	return qplan;
+}
+
+static void
+execute_portion_plan(SPIPlanPtr qplan, int nargs, Datum *values, bool *isnull,
+					 int expected)
+{
+	char   *nulls = (char *) palloc(Max(nargs, 1) * sizeof(char));
+	int		ret;
+	int		i;
+
+	for (i = 0; i < nargs; i++)
+		nulls[i] = isnull[i] ? 'n' : ' ';
+
+	ret = SPI_execute_plan(qplan, values, nulls, false, 0);
+	if (ret != expected)
+		elog(ERROR, "SPI_execute returned %s", SPI_result_code_string(ret));
+
+	pfree(nulls);
+}
+
+/*
+ * Insert a leading or trailing portion of the old row, leaving out the
+ * generated columns.
+ */
+static void
+insert_portion_row(PortionViewCacheEntry *entry, TupleDesc tupdesc,
+				   Datum *values, bool *nulls)
+{
+	Datum  *args = (Datum *) palloc(tupdesc->natts * sizeof(Datum));
+	bool   *argnulls = (bool *) palloc(tupdesc->natts * sizeof(bool));
+	int		nargs = 0;
+	int		i;
+
+	if (entry->insert_plan == NULL)
+	{
+		StringInfo	buf = makeStringInfo();
+		StringInfo	params = makeStringInfo();
+		Oid		   *argtypes = (Oid *) palloc(tupdesc->natts * sizeof(Oid));
+
+		appendStringInfo(buf, "INSERT INTO %s (", entry->table_name);
+		for (i = 0; i < tupdesc->natts; i++)
+		{
+			Form_pg_attribute	attr = TupleDescAttr(tupdesc, i);
+
+			if (attr->attisdropped || bms_is_member(i + 1, entry->generated))
+				continue;
+
+			argtypes[nargs++] = attr->atttypid;
+			appendStringInfo(buf, "%s%s", nargs > 1 ? ", " : "",
+							 quote_identifier(NameStr(attr->attname)));
+			appendStringInfo(params, "%s$%d", nargs > 1 ? ", " : "", nargs);
+		}
+		appendStringInfo(buf, ") VALUES (%s)", params->data);
+
+		entry->insert_plan = prepare_kept_plan(buf->data, nargs, argtypes);
+		nargs = 0;
+	}
+
+	for (i = 0; i < tupdesc->natts; i++)
+	{
+		if (TupleDescAttr(tupdesc, i)->attisdropped ||
+			bms_is_member(i + 1, entry->generated))
+			continue;
+
+		args[nargs] = values[i];
+		argnulls[nargs] = nulls[i];
+		nargs++;
+	}
+
+	execute_portion_plan(entry->insert_plan, nargs, args, argnulls, SPI_OK_INSERT);
+}
+
+/*
+ * Find or make the plan for updating the given columns of the row that was
+ * updated through the view.
+ *
+ * The parameters are the new values of the columns, in order, then the old
+ * values of the key columns, and then the bounds of the portion.
+ */
+static SPIPlanPtr
+GetPortionUpdatePlan(PortionViewCacheEntry *entry, TupleDesc tupdesc,
+					 Bitmapset *columns)
+{
+	PortionUpdatePlan  *plan;
+	StringInfo			buf;
+	Oid				   *argtypes;
+	MemoryContext		oldcontext;
+	ListCell		   *lc;
+	int					nargs = 0;
+	int					attnum;
+	int					i;
+
+	foreach (lc, entry->update_plans)
+	{
+		plan = (PortionUpdatePlan *) lfirst(lc);
+		if (bms_equal(plan->columns, columns))
+			return plan->qplan;
+	}
+
+	buf = makeStringInfo();
+	argtypes = (Oid *) palloc((bms_num_members(columns) + entry->nkeys + 2) * sizeof(Oid));
+
+	appendStringInfo(buf, "UPDATE %s SET ", entry->table_name);
+	attnum = -1;
+	while ((attnum = bms_next_member(columns, attnum)) >= 0)
+	{
+		Form_pg_attribute	attr = TupleDescAttr(tupdesc, attnum - 1);
+
+		argtypes[nargs++] = attr->atttypid;
+		appendStringInfo(buf, "%s%s = $%d", nargs > 1 ? ", " : "",
+						 quote_identifier(NameStr(attr->attname)), nargs);
+	}
+
+	appendStringInfoString(buf, " WHERE ");
+	for (i = 0; i < entry->nkeys; i++)
+	{
+		Form_pg_attribute	attr = TupleDescAttr(tupdesc, entry->key_nums[i] - 1);
+
+		argtypes[nargs++] = attr->atttypid;
+		appendStringInfo(buf, "%s = $%d AND ",
+						 quote_identifier(NameStr(attr->attname)), nargs);
+	}
+
+	argtypes[nargs++] = TupleDescAttr(tupdesc, entry->start_num - 1)->atttypid;
+	argtypes[nargs++] = TupleDescAttr(tupdesc, entry->end_num - 1)->atttypid;
+	appendStringInfo(buf, "%s > $%d AND %s < $%d",
+					 quote_identifier(NameStr(TupleDescAttr(tupdesc, entry->end_num - 1)->attname)),
+					 nargs - 1,
+					 quote_identifier(NameStr(TupleDescAttr(tupdesc, entry->start_num - 1)->attname)),
+					 nargs);
+
+	oldcontext = MemoryContextSwitchTo(entry->context);
+	plan = (PortionUpdatePlan *) palloc(sizeof(PortionUpdatePlan));
+	plan->columns = bms_copy(columns);
+	plan->qplan = prepare_kept_plan(buf->data, nargs, argtypes);
+	entry->update_plans = lappend(entry->update_plans, plan);
+	MemoryContextSwitchTo(oldcontext);
+
+	return plan->qplan;
+}
+
+/*
+ * The INSTEAD OF UPDATE trigger on our FOR PORTION OF views.  The new values
+ * of the period columns say which portion of the row the other new values are
+ * for, and the parts of the old row outside of that portion are kept by
+ * inserting them as new rows.
+ *
+ * REFERENCES:
+ *     SQL:2016 15.13 GR 10
+ */
+Datum
+update_portion_of(PG_FUNCTION_ARGS)
+{
+	TriggerData	   *trigdata = castNode(TriggerData, fcinfo->context);
+	const char	   *funcname = "update_portion_of";
+	Relation		view;
+	TupleDesc		tupdesc;
+	PortionViewCacheEntry  *entry;
+	Datum		   *old_values;
+	bool		   *old_nulls;
+	Datum		   *new_values;
+	bool		   *new_nulls;
+	Datum		   *args;
+	bool		   *argnulls;
+	Bitmapset	   *changed = NULL;
+	bool			pre_assigned;
+	bool			post_assigned;
+	int				start, end;
+	int				nargs = 0;
+	int				attnum;
+	int				i;
+
+	/*
+	 * Make sure this is being called as an INSTEAD OF UPDATE trigger.  Note:
+	 * translatable error strings are shared with ri_triggers.c, so resist the
+	 * temptation to fold the function name into them.
+	 */
+	if (!CALLED_AS_TRIGGER(fcinfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+				 errmsg("function \"%s\" was not called by trigger manager",
+						funcname)));
+
+	if (!TRIGGER_FIRED_INSTEAD(trigdata->tg_event) ||
+		!TRIGGER_FIRED_FOR_ROW(trigdata->tg_event))
+		ereport(ERROR,
+				(errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+				 errmsg("function \"%s\" must be fired INSTEAD OF ROW",
+						funcname)));
+
+	if (!TRIGGER_FIRED_BY_UPDATE(trigdata->tg_event))
+		ereport(ERROR,
+				(errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+				 errmsg("function \"%s\" must be fired for UPDATE",
+						funcname)));
+
+	/* Get Relation information */
+	view = trigdata->tg_relation;
+	tupdesc = RelationGetDescr(view);
+	entry = GetPortionViewCacheEntry(view);
+
+	old_values = (Datum *) palloc(tupdesc->natts * sizeof(Datum));
+	old_nulls = (bool *) palloc(tupdesc->natts * sizeof(bool));
+	new_values = (Datum *) palloc(tupdesc->natts * sizeof(Datum));
+	new_nulls = (bool *) palloc(tupdesc->natts * sizeof(bool));
+	heap_deform_tuple(trigdata->tg_trigtuple, tupdesc, old_values, old_nulls);
+	heap_deform_tuple(trigdata->tg_newtuple, tupdesc, new_values, new_nulls);
+
+	start = entry->start_num - 1;
+	end = entry->end_num - 1;
+
+	/* Which columns are changed, apart from the period */
+	for (i = 0; i < tupdesc->natts; i++)
+	{
+		Form_pg_attribute	attr = TupleDescAttr(tupdesc, i);
+
+		if (attr->attisdropped || i == start || i == end)
+			continue;
+
+		if (old_nulls[i] != new_nulls[i] ||
+			(!old_nulls[i] &&
+			 !datumIsEqual(old_values[i], new_values[i], attr->attbyval, attr->attlen)))
+			changed = bms_add_member(changed, i + 1);
+	}
+
+	/* If the period is the only thing changed, do nothing */
+	if (changed == NULL)
+		return PointerGetDatum(NULL);
+
+	/* Does the portion start or end inside the old row? */
+	pre_assigned = portion_value_between(entry,
+										 old_values[start], old_nulls[start],
+										 new_values[start], new_nulls[start],
+										 old_values[end], old_nulls[end]);
+	post_assigned = portion_value_between(entry,
+										  old_values[start], old_nulls[start],
+										  new_values[end], new_nulls[end],
+										  old_values[end], old_nulls[end]);
+
+	if (pre_assigned)
+		changed = bms_add_member(changed, entry->start_num);
+	if (post_assigned)
+		changed = bms_add_member(changed, entry->end_num);
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "SPI_connect failed");
+
+	if (pre_assigned || post_assigned)
+	{
+		ConstraintsSetStmt *stmt = makeNode(ConstraintsSetStmt);
+
+		/* Don't validate foreign keys until all this is done */
+		stmt->constraints = NIL;
+		stmt->deferred = true;
+		AfterTriggerSetState(stmt);
+	}
+
+	if (pre_assigned)
+	{
+		Datum	end_value = old_values[end];
+		bool	end_null = old_nulls[end];
+
+		/* The old row, up to where the portion starts */
+		old_values[end] = new_values[start];
+		old_nulls[end] = new_nulls[start];
+		insert_portion_row(entry, tupdesc, old_values, old_nulls);
+		old_values[end] = end_value;
+		old_nulls[end] = end_null;
+	}
+
+	/* The portion itself */
+	args = (Datum *) palloc((bms_num_members(changed) + entry->nkeys + 2) * sizeof(Datum));
+	argnulls = (bool *) palloc((bms_num_members(changed) + entry->nkeys + 2) * sizeof(bool));
+
+	attnum = -1;
+	while ((attnum = bms_next_member(changed, attnum)) >= 0)
+	{
+		args[nargs] = new_values[attnum - 1];
+		argnulls[nargs] = new_nulls[attnum - 1];
+		nargs++;
+	}
+	for (i = 0; i < entry->nkeys; i++)
+	{
+		args[nargs] = old_values[entry->key_nums[i] - 1];
+		argnulls[nargs] = old_nulls[entry->key_nums[i] - 1];
+		nargs++;
+	}
+	args[nargs] = new_values[start];
+	argnulls[nargs] = new_nulls[start];
+	nargs++;
+	args[nargs] = new_values[end];
+	argnulls[nargs] = new_nulls[end];
+	nargs++;
+
+	execute_portion_plan(GetPortionUpdatePlan(entry, tupdesc, changed),
+						 nargs, args, argnulls, SPI_OK_UPDATE);
+
+	if (post_assigned)
+	{
+		/* The old row, from where the portion ends */
+		old_values[start] = new_values[end];
+		old_nulls[start] = new_nulls[end];
+		insert_portion_row(entry, tupdesc, old_values, old_nulls);
+	}
+
+	if (SPI_finish() != SPI_OK_FINISH)
+		elog(ERROR, "SPI_finish failed");
+
+	return PointerGetDatum(trigdata->tg_newtuple);
+}
+
+/*
+ * Everything the foreign key triggers need to know about one of our foreign
+ * keys, keyed by its name in our catalogs.  The columns are the key columns
+ * followed by the start and end columns of the period, on each side.
+ *
+ * Entries are marked invalid whenever the relcache entry of either table is
+ * invalidated, which our catalogs force when they are changed.
+ */
+static HTAB *ForeignKeyCacheHash = NULL;
+
+/*
+ * See SystemTimeCacheInvalCount.  Until an entry is built we don't know which
+ * tables it is for, so any invalidation during the build counts.
+ */
+static uint64 ForeignKeyCacheInvalCount = 0;
+
+typedef struct ForeignKeyCacheEntry
+{
+	NameData	key_name;		/* the hash key; must be first */
+	bool		valid;
+	Oid			fk_relid;
+	Oid			uk_relid;
+	MemoryContext context;		/* everything below lives here */
+	char		match_type;		/* FKCONSTR_MATCH_xxx */
+	bool		update_no_action;
+	int			nkeys;			/* not counting the period */
+	char	   *fk_table_name;	/* qualified and quoted */
+	char	   *uk_table_name;
+	char	  **fk_columns;		/* quoted */
+	char	  **uk_columns;
+	int16	   *fk_attnums;
+	int16	   *uk_attnums;
+	Oid		   *fk_types;
+	Oid		   *uk_types;
+	FmgrInfo	uk_cmp_proc;	/* how to compare the referenced period */
+	Oid			uk_collation;
+	SPIPlanPtr	new_row_plan;	/* the plans are built when first needed */
+	SPIPlanPtr	old_row_match_plan;
+	SPIPlanPtr	old_row_violation_plan;
+	SPIPlanPtr	insert_statement_plan;
+	SPIPlanPtr	update_statement_plan;
+} ForeignKeyCacheEntry;
+
+static void
+ForeignKeyCacheInvalCallback(Datum arg, Oid relid)
+{
+	HASH_SEQ_STATUS			status;
+	ForeignKeyCacheEntry   *entry;
+
+	ForeignKeyCacheInvalCount++;
+
+	hash_seq_init(&status, ForeignKeyCacheHash);
+	while ((entry = (ForeignKeyCacheEntry *) hash_seq_search(&status)) != NULL)
+	{
+		if (!OidIsValid(relid) ||
+			entry->fk_relid == relid ||
+			entry->uk_relid == relid)
+			entry->valid = false;
+	}
+}
+
+static HTAB *
+CreateForeignKeyCacheHash(void)
+{
+	HASHCTL	ctl;
+	HTAB   *result;
+
+	ctl.keysize = sizeof(NameData);
+	ctl.entrysize = sizeof(ForeignKeyCacheEntry);
+
+	result = hash_create("Foreign Key Cache Hash", 16, &ctl, HASH_ELEM | HASH_BLOBS);
+
+	CacheRegisterRelcacheCallback(ForeignKeyCacheInvalCallback, (Datum) 0);
+
+	return result;
+}
+
+/*
+ * Look up the columns of one side of the foreign key, given their names.
+ */
+static void
+GetForeignKeyColumns(Oid relid, Datum *names, int nnames,
+					 char **columns, int16 *attnums, Oid *types)
+{
+	int		i;
+
+	for (i = 0; i < nnames; i++)
+	{
+		char   *attname = NameStr(*(DatumGetName(names[i])));
+
+		attnums[i] = get_attnum(relid, attname);
+		if (attnums[i] == InvalidAttrNumber)
+			ereport(ERROR,
+					(errcode(ERRCODE_UNDEFINED_COLUMN),
+					 errmsg("column \"%s\" does not exist", attname)));
+
+		columns[i] = pstrdup(quote_identifier(attname));
+		types[i] = get_atttype(relid, attnums[i]);
+	}
+}
+
+/*
+ * Fill in a cache entry from our catalogs.  Nothing else in here needs to
+ * look at them, the plans only use what we find now.
+ */
+static void
+BuildForeignKeyCacheEntry(ForeignKeyCacheEntry *entry)
+{
+	int				ret;
+	Datum			values[1];
+	SPITupleTable  *tuptable;
+	HeapTuple		tuple;
+	bool			is_null;
+	Datum			dat;
+	Datum		   *fk_names;
+	Datum		   *uk_names;
+	int				nfk_names;
+	int				nuk_names;
+	char		   *match_type;
+	MemoryContext	oldcontext;
+
+	const char *sql =
+		"SELECT fk.table_name::oid, fk.column_names, "
+		"       fp.start_column_name, fp.end_column_name, "
+		"       uk.table_name::oid, uk.column_names, "
+		"       up.start_column_name, up.end_column_name, "
+		"       fk.match_type::text, fk.update_action = 'NO ACTION' "
+		"FROM periods.foreign_keys AS fk "
+		"JOIN periods.periods AS fp "
+		"  ON (fp.table_name, fp.period_name) = (fk.table_name, fk.period_name) "
+		"JOIN periods.unique_keys AS uk ON uk.key_name = fk.unique_key "
+		"JOIN periods.periods AS up "
+		"  ON (up.table_name, up.period_name) = (uk.table_name, uk.period_name) "
+		"WHERE fk.key_name = $1";
+	static SPIPlanPtr qplan = NULL;
+
+	/* Throw away whatever we had before */
+	if (entry->context == NULL)
+		entry->context = AllocSetContextCreate(TopMemoryContext,
+											   "periods foreign key cache",
+											   ALLOCSET_SMALL_MINSIZE,
+											   ALLOCSET_SMALL_INITSIZE,
+											   ALLOCSET_SMALL_MAXSIZE);
+	else
+	{
+		if (entry->new_row_plan != NULL)
+			SPI_freeplan(entry->new_row_plan);
+		if (entry->old_row_match_plan != NULL)
+			SPI_freeplan(entry->old_row_match_plan);
+		if (entry->old_row_violation_plan != NULL)
+			SPI_freeplan(entry->old_row_violation_plan);
+		if (entry->insert_statement_plan != NULL)
+			SPI_freeplan(entry->insert_statement_plan);
+		if (entry->update_statement_plan != NULL)
+			SPI_freeplan(entry->update_statement_plan);
+		MemoryContextReset(entry->context);
+	}
+	entry->fk_relid = InvalidOid;
+	entry->uk_relid = InvalidOid;
+	entry->new_row_plan = NULL;
+	entry->old_row_match_plan = NULL;
+	entry->old_row_violation_plan = NULL;
+	entry->insert_statement_plan = NULL;
+	entry->update_statement_plan = NULL;
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "SPI_connect failed");
+
+	/* Cache the plan if we haven't already */
+	if (qplan == NULL)
+	{
+		Oid	types[1] = {NAMEOID};
+
+		qplan = SPI_prepare(sql, 1, types);
+		if (qplan == NULL)
+			elog(ERROR, "SPI_prepare returned %s for %s",
+				 SPI_result_code_string(SPI_result), sql);
+
+		ret = SPI_keepplan(qplan);
+		if (ret != 0)
+			elog(ERROR, "SPI_keepplan returned %s", SPI_result_code_string(ret));
+	}
+
+	values[0] = NameGetDatum(&entry->key_name);
+	ret = SPI_execute_plan(qplan, values, NULL, true, 0);
+	if (ret != SPI_OK_SELECT)
+		elog(ERROR, "SPI_execute returned %s", SPI_result_code_string(ret));
+
+	if (SPI_processed == 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_OBJECT),
+				 errmsg("foreign key \"%s\" not found",
+						NameStr(entry->key_name))));
+
+	tuptable = SPI_tuptable;
+	tuple = tuptable->vals[0];
+
+	/* The key columns and then the period columns, on both sides */
+	dat = SPI_getbinval(tuple, tuptable->tupdesc, 2, &is_null);
+	deconstruct_array(DatumGetArrayTypeP(dat), NAMEOID, NAMEDATALEN, false, 'c',
+					  &fk_names, NULL, &nfk_names);
+	fk_names = (Datum *) repalloc(fk_names, (nfk_names + 2) * sizeof(Datum));
+	fk_names[nfk_names] = SPI_getbinval(tuple, tuptable->tupdesc, 3, &is_null);
+	fk_names[nfk_names + 1] = SPI_getbinval(tuple, tuptable->tupdesc, 4, &is_null);
+
+	dat = SPI_getbinval(tuple, tuptable->tupdesc, 6, &is_null);
+	deconstruct_array(DatumGetArrayTypeP(dat), NAMEOID, NAMEDATALEN, false, 'c',
+					  &uk_names, NULL, &nuk_names);
+	uk_names = (Datum *) repalloc(uk_names, (nuk_names + 2) * sizeof(Datum));
+	uk_names[nuk_names] = SPI_getbinval(tuple, tuptable->tupdesc, 7, &is_null);
+	uk_names[nuk_names + 1] = SPI_getbinval(tuple, tuptable->tupdesc, 8, &is_null);
+
+	/* add_foreign_key() made sure of this */
+	if (nfk_names != nuk_names)
+		elog(ERROR, "foreign key \"%s\" does not have as many columns as its unique key",
+			 NameStr(entry->key_name));
+
+	oldcontext = MemoryContextSwitchTo(entry->context);
+
+	entry->nkeys = nfk_names;
+	entry->fk_columns = (char **) palloc((nfk_names + 2) * sizeof(char *));
+	entry->uk_columns = (char **) palloc((nfk_names + 2) * sizeof(char *));
+	entry->fk_attnums = (int16 *) palloc((nfk_names + 2) * sizeof(int16));
+	entry->uk_attnums = (int16 *) palloc((nfk_names + 2) * sizeof(int16));
+	entry->fk_types = (Oid *) palloc((nfk_names + 2) * sizeof(Oid));
+	entry->uk_types = (Oid *) palloc((nfk_names + 2) * sizeof(Oid));
+
+	dat = SPI_getbinval(tuple, tuptable->tupdesc, 1, &is_null);
+	entry->fk_relid = DatumGetObjectId(dat);
+	entry->fk_table_name = quote_qualified_identifier(
+			get_namespace_name(get_rel_namespace(entry->fk_relid)),
+			get_rel_name(entry->fk_relid));
+	GetForeignKeyColumns(entry->fk_relid, fk_names, nfk_names + 2,
+						 entry->fk_columns, entry->fk_attnums, entry->fk_types);
+
+	dat = SPI_getbinval(tuple, tuptable->tupdesc, 5, &is_null);
+	entry->uk_relid = DatumGetObjectId(dat);
+	entry->uk_table_name = quote_qualified_identifier(
+			get_namespace_name(get_rel_namespace(entry->uk_relid)),
+			get_rel_name(entry->uk_relid));
+	GetForeignKeyColumns(entry->uk_relid, uk_names, nuk_names + 2,
+						 entry->uk_columns, entry->uk_attnums, entry->uk_types);
+
+	MemoryContextSwitchTo(oldcontext);
+
+	/* How to compare the values of the referenced period */
+	{
+		Oid				typid;
+		int32			typmod;
+		TypeCacheEntry *typentry;
+
+		get_atttypetypmodcoll(entry->uk_relid, entry->uk_attnums[entry->nkeys],
+							  &typid, &typmod, &entry->uk_collation);
+		typentry = lookup_type_cache(typid, TYPECACHE_CMP_PROC);
+		if (!OidIsValid(typentry->cmp_proc))
+			ereport(ERROR,
+					(errcode(ERRCODE_UNDEFINED_FUNCTION),
+					 errmsg("could not identify a comparison function for type %s",
+							format_type_be(typid))));
+		fmgr_info_cxt(typentry->cmp_proc, &entry->uk_cmp_proc, entry->context);
+	}
+
+	dat = SPI_getbinval(tuple, tuptable->tupdesc, 9, &is_null);
+	match_type = TextDatumGetCString(dat);
+	if (strcmp(match_type, "FULL") == 0)
+		entry->match_type = FKCONSTR_MATCH_FULL;
+	else if (strcmp(match_type, "PARTIAL") == 0)
+		entry->match_type = FKCONSTR_MATCH_PARTIAL;
+	else
+		entry->match_type = FKCONSTR_MATCH_SIMPLE;
+
+	dat = SPI_getbinval(tuple, tuptable->tupdesc, 10, &is_null);
+	entry->update_no_action = DatumGetBool(dat);
+
+	/* All done with SPI */
+	if (SPI_finish() != SPI_OK_FINISH)
+		elog(ERROR, "SPI_finish failed");
+}
+
+static ForeignKeyCacheEntry *
+GetForeignKeyCacheEntry(const char *key_name)
+{
+	NameData				key;
+	ForeignKeyCacheEntry   *entry;
+	bool					found;
+
+	if (!ForeignKeyCacheHash)
+		ForeignKeyCacheHash = CreateForeignKeyCacheHash();
+
+	/* The whole key gets hashed so don't leave garbage after the name */
+	MemSet(&key, 0, sizeof(key));
+	strlcpy(NameStr(key), key_name, NAMEDATALEN);
+
+	entry = (ForeignKeyCacheEntry *) hash_search(ForeignKeyCacheHash,
+			&key, HASH_ENTER, &found);
+
+	if (!found)
+	{
+		entry->valid = false;
+		entry->fk_relid = InvalidOid;
+		entry->uk_relid = InvalidOid;
+		entry->context = NULL;
+		entry->new_row_plan = NULL;
+		entry->old_row_match_plan = NULL;
+		entry->old_row_violation_plan = NULL;
+		entry->insert_statement_plan = NULL;
+		entry->update_statement_plan = NULL;
+	}
+
+	while (!entry->valid)
+	{
+		uint64	inval_count = ForeignKeyCacheInvalCount;
+
+		BuildForeignKeyCacheEntry(entry);
+
+		/* Build it again if it was invalidated in the meantime */
+		entry->valid = (inval_count == ForeignKeyCacheInvalCount);
+	}
+
+	return entry;
+}
+
+/*
+ * Run one of our EXISTS queries.
+ */
+static bool
+execute_foreign_key_plan(SPIPlanPtr qplan, Datum *values, bool read_only)
+{
+	int		ret;
+	bool	is_null;
+	Datum	dat;
+
+	ret = SPI_execute_plan(qplan, values, NULL, read_only, 1);
+	if (ret != SPI_OK_SELECT)
+		elog(ERROR, "SPI_execute returned %s", SPI_result_code_string(ret));
+
+	dat = SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &is_null);
+
+	return !is_null && DatumGetBool(dat);
+}
+
+/*
+ * Check that all of the rows of the referencing table with the same key as a
+ * new or updated row are covered by rows of the referenced table, with no
+ * gaps.  The parameters are the key values of the new row.
+ */
+static SPIPlanPtr
+GetNewRowPlan(ForeignKeyCacheEntry *entry)
+{
+	StringInfo	buf;
+	const char *fs, *fe, *us, *ue;
+	int			i;
+
+	if (entry->new_row_plan != NULL)
+		return entry->new_row_plan;
+
+	fs = entry->fk_columns[entry->nkeys];
+	fe = entry->fk_columns[entry->nkeys + 1];
+	us = entry->uk_columns[entry->nkeys];
+	ue = entry->uk_columns[entry->nkeys + 1];
+
+	buf = makeStringInfo();
+	appendStringInfo(buf,
+		"SELECT EXISTS ( "
+		"    SELECT FROM %s AS fk "
+		"    WHERE NOT (SELECT periods.covers(uk.uk_start_value, uk.uk_end_value, fk.%s, fk.%s "
+		"                                     ORDER BY uk.uk_start_value) "
+		"               FROM (SELECT uk.%s AS uk_start_value, "
+		"                            uk.%s AS uk_end_value "
+		"                     FROM %s AS uk "
+		"                     WHERE ",
+		entry->fk_table_name, fs, fe, us, ue, entry->uk_table_name);
+
+	for (i = 0; i < entry->nkeys; i++)
+		appendStringInfo(buf, "uk.%s = fk.%s AND ",
+						 entry->uk_columns[i], entry->fk_columns[i]);
+
+	appendStringInfo(buf,
+		"                       uk.%s <= fk.%s "
+		"                       AND uk.%s >= fk.%s "
+		"                     FOR KEY SHARE "
+		"                    ) AS uk "
+		"              )",
+		us, fe, ue, fs);
+
+	for (i = 0; i < entry->nkeys; i++)
+		appendStringInfo(buf, " AND fk.%s = $%d", entry->fk_columns[i], i + 1);
+
+	appendStringInfoString(buf, ")");
+
+	entry->new_row_plan = prepare_kept_plan(buf->data, entry->nkeys, entry->fk_types);
+
+	return entry->new_row_plan;
+}
+
+/*
+ * The plans for a referenced row that was updated or deleted.  The parameters
+ * are the key values and a period that the old row no longer covers.  The
+ * first plan checks if that period is still covered by a row with the same
+ * key, and the second if any referencing row overlaps it.
+ */
+static SPIPlanPtr
+GetOldRowPlan(ForeignKeyCacheEntry *entry, bool match)
+{
+	StringInfo	buf;
+	const char *table_name;
+	char	  **columns;
+	int			i;
+
+	if (match && entry->old_row_match_plan != NULL)
+		return entry->old_row_match_plan;
+	if (!match && entry->old_row_violation_plan != NULL)
+		return entry->old_row_violation_plan;
+
+	table_name = match ? entry->uk_table_name : entry->fk_table_name;
+	columns = match ? entry->uk_columns : entry->fk_columns;
+
+	buf = makeStringInfo();
+	appendStringInfo(buf, "SELECT EXISTS (SELECT FROM %s AS t WHERE ", table_name);
+
+	for (i = 0; i < entry->nkeys; i++)
+		appendStringInfo(buf, "t.%s = $%d AND ", columns[i], i + 1);
+
+	if (match)
+		appendStringInfo(buf, "t.%s <= $%d AND t.%s >= $%d FOR KEY SHARE)",
+						 columns[entry->nkeys], entry->nkeys + 1,
+						 columns[entry->nkeys + 1], entry->nkeys + 2);
+	else
+		appendStringInfo(buf, "t.%s < $%d AND t.%s > $%d)",
+						 columns[entry->nkeys], entry->nkeys + 2,
+						 columns[entry->nkeys + 1], entry->nkeys + 1);
+
+	if (match)
+		entry->old_row_match_plan = prepare_kept_plan(buf->data, entry->nkeys + 2, entry->uk_types);
+	else
+		entry->old_row_violation_plan = prepare_kept_plan(buf->data, entry->nkeys + 2, entry->uk_types);
+
+	return match ? entry->old_row_match_plan : entry->old_row_violation_plan;
+}
+
+/*
+ * Check a new or updated row of the referencing table.
+ */
+static void
+validate_foreign_key_new_row(ForeignKeyCacheEntry *entry, Relation rel,
+							 HeapTuple new_row)
+{
+	TupleDesc	tupdesc = RelationGetDescr(rel);
+	Datum	   *values;
+	bool		has_nulls = false;
+	bool		all_nulls = true;
+	int			i;
+
+	values = (Datum *) palloc(Max(entry->nkeys, 1) * sizeof(Datum));
+	for (i = 0; i < entry->nkeys; i++)
+	{
+		bool	is_null;
+
+		values[i] = heap_getattr(new_row, entry->fk_attnums[i], tupdesc, &is_null);
+		has_nulls = has_nulls || is_null;
+		all_nulls = all_nulls && is_null;
+	}
+
+	/*
+	 * If there are no values at all, all three types pass.
+	 *
+	 * Period columns are by definition NOT NULL so the FULL MATCH type is
+	 * only concerned with the non-period columns of the constraint.
+	 * SQL:2016 4.23.3.3
+	 */
+	if (all_nulls)
+		return;
+
+	if (has_nulls)
+	{
+		switch (entry->match_type)
+		{
+			case FKCONSTR_MATCH_SIMPLE:
+				return;
+			case FKCONSTR_MATCH_PARTIAL:
+				ereport(ERROR,
+						(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						 errmsg("partial not implemented")));
+				break;
+			case FKCONSTR_MATCH_FULL:
+				ereport(ERROR,
+						(errcode(ERRCODE_FOREIGN_KEY_VIOLATION),
+						 errmsg("foreign key violated (nulls in FULL)")));
+				break;
+		}
+	}
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "SPI_connect failed");
+
+	CountPeriodsStat(RelationGetRelid(rel), PERIODS_STAT_FK_CHECKS, 1);
+	if (execute_foreign_key_plan(GetNewRowPlan(entry), values, false))
+		ereport(ERROR,
+				(errcode(ERRCODE_FOREIGN_KEY_VIOLATION),
+				 errmsg("insert or update on table \"%s\" violates foreign key constraint \"%s\"",
+						DatumGetCString(DirectFunctionCall1(regclassout, ObjectIdGetDatum(entry->fk_relid))),
+						NameStr(entry->key_name))));
+
+	if (SPI_finish() != SPI_OK_FINISH)
+		elog(ERROR, "SPI_finish failed");
+}
+
+static int
+uk_period_cmp(ForeignKeyCacheEntry *entry, Datum a, Datum b)
+{
+	return DatumGetInt32(FunctionCall2Coll(&entry->uk_cmp_proc, entry->uk_collation, a, b));
+}
+
+/*
+ * Work out which parts of its period an update took away from a referenced
+ * row, as up to two periods in starts and ends.  Referencing rows can only
+ * have lost their coverage in those parts, so an update that keeps the key and
+ * only moves the period outwards (or doesn't touch it at all) has nothing to
+ * check.  If the key changed, the whole old period was taken away.
+ */
+static int
+get_removed_periods(ForeignKeyCacheEntry *entry, TupleDesc tupdesc,
+					Datum *old_values, HeapTuple new_row,
+					Datum *starts, Datum *ends)
+{
+	Datum	old_start = old_values[entry->nkeys];
+	Datum	old_end = old_values[entry->nkeys + 1];
+	Datum	new_start, new_end;
+	bool	is_null;
+	int		n = 0;
+	int		i;
+
+	for (i = 0; i < entry->nkeys; i++)
+	{
+		Form_pg_attribute	attr = TupleDescAttr(tupdesc, entry->uk_attnums[i] - 1);
+		Datum				value;
+
+		value = heap_getattr(new_row, entry->uk_attnums[i], tupdesc, &is_null);
+		if (is_null || !datumIsEqual(old_values[i], value, attr->attbyval, attr->attlen))
+		{
+			starts[0] = old_start;
+			ends[0] = old_end;
+			return 1;
+		}
+	}
+
+	/* Period columns are never null */
+	new_start = heap_getattr(new_row, entry->uk_attnums[entry->nkeys], tupdesc, &is_null);
+	new_end = heap_getattr(new_row, entry->uk_attnums[entry->nkeys + 1], tupdesc, &is_null);
+
+	/* Cut from the start... */
+	if (uk_period_cmp(entry, new_start, old_start) > 0)
+	{
+		starts[n] = old_start;
+		ends[n] = uk_period_cmp(entry, new_start, old_end) < 0 ? new_start : old_end;
+		n++;
+	}
+
+	/* ...and from the end */
+	if (uk_period_cmp(entry, new_end, old_end) < 0)
+	{
+		starts[n] = uk_period_cmp(entry, new_end, old_start) > 0 ? new_end : old_start;
+		ends[n] = old_end;
+		n++;
+	}
+
+	return n;
+}
+
+/*
+ * Check an updated or deleted row of the referenced table.  For an update,
+ * new_row is the new version of the row and only the parts of the period it
+ * took away are checked.
+ *
+ * If this is a NO ACTION update, we need to check if there is a new row that
+ * still satisfies the constraint, in which case there is no error.  The only
+ * difference between NO ACTION and RESTRICT otherwise is when the check is
+ * done, so that is handled by the trigger definition.
+ */
+static void
+validate_foreign_key_old_row(ForeignKeyCacheEntry *entry, Relation rel,
+							 HeapTuple old_row, HeapTuple new_row)
+{
+	TupleDesc	tupdesc = RelationGetDescr(rel);
+	Datum	   *values;
+	Datum		starts[2], ends[2];
+	int			nremoved = 1;
+	int			i;
+
+	values = (Datum *) palloc((entry->nkeys + 2) * sizeof(Datum));
+	for (i = 0; i < entry->nkeys + 2; i++)
+	{
+		bool	is_null;
+
+		values[i] = heap_getattr(old_row, entry->uk_attnums[i], tupdesc, &is_null);
+
+		/*
+		 * If the old row had nulls in the referenced columns then there was
+		 * no possible referencing row (until we implement PARTIAL) so we can
+		 * just stop here.
+		 */
+		if (is_null)
+			return;
+	}
+
+	if (new_row != NULL)
+	{
+		nremoved = get_removed_periods(entry, tupdesc, values, new_row, starts, ends);
+		if (nremoved == 0)
+			return;
+	}
+	else
+	{
+		starts[0] = values[entry->nkeys];
+		ends[0] = values[entry->nkeys + 1];
+	}
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "SPI_connect failed");
+
+	CountPeriodsStat(RelationGetRelid(rel), PERIODS_STAT_FK_CHECKS, 1);
+	for (i = 0; i < nremoved; i++)
+	{
+		values[entry->nkeys] = starts[i];
+		values[entry->nkeys + 1] = ends[i];
+
+		if (new_row != NULL && entry->update_no_action &&
+			execute_foreign_key_plan(GetOldRowPlan(entry, true), values, false))
+			continue;
+
+		if (execute_foreign_key_plan(GetOldRowPlan(entry, false), values, true))
+			ereport(ERROR,
+					(errcode(ERRCODE_FOREIGN_KEY_VIOLATION),
+					 errmsg("update or delete on table \"%s\" violates foreign key constraint \"%s\" on table \"%s\"",
+							DatumGetCString(DirectFunctionCall1(regclassout, ObjectIdGetDatum(entry->uk_relid))),
+							NameStr(entry->key_name),
+							DatumGetCString(DirectFunctionCall1(regclassout, ObjectIdGetDatum(entry->fk_relid))))));
+	}
+
+	if (SPI_finish() != SPI_OK_FINISH)
+		elog(ERROR, "SPI_finish failed");
+}
+
+/*
+ * All four foreign key triggers are AFTER ROW triggers that are given the name
+ * of the foreign key in our catalogs as their only argument.
+ */
+static ForeignKeyCacheEntry *
+check_foreign_key_trigger(FunctionCallInfo fcinfo, const char *funcname)
+{
+	TriggerData	   *trigdata = castNode(TriggerData, fcinfo->context);
+
+	/*
+	 * Make sure this is being called as an AFTER ROW trigger.  Note:
+	 * translatable error strings are shared with ri_triggers.c, so resist the
+	 * temptation to fold the function name into them.
+	 */
+	if (!CALLED_AS_TRIGGER(fcinfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+				 errmsg("function \"%s\" was not called by trigger manager",
+						funcname)));
+
+	if (!TRIGGER_FIRED_AFTER(trigdata->tg_event) ||
+		!TRIGGER_FIRED_FOR_ROW(trigdata->tg_event))
+		ereport(ERROR,
+				(errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+				 errmsg("function \"%s\" must be fired AFTER ROW",
+						funcname)));
+
+	if (trigdata->tg_trigger->tgnargs != 1)
+		ereport(ERROR,
+				(errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+				 errmsg("function \"%s\" must be given the name of a foreign key",
+						funcname)));
+
+	return GetForeignKeyCacheEntry(trigdata->tg_trigger->tgargs[0]);
+}
+
+/*
+ * This function is called when a new row is inserted into a table containing
+ * foreign keys with periods.  It checks to verify that the referenced table
+ * contains the proper data to satisfy the foreign key constraint.
+ */
+static Datum
+fk_insert_check_internal(PG_FUNCTION_ARGS)
+{
+	TriggerData	   *trigdata = castNode(TriggerData, fcinfo->context);
+	ForeignKeyCacheEntry *entry;
+
+	entry = check_foreign_key_trigger(fcinfo, "fk_insert_check");
+	validate_foreign_key_new_row(entry, trigdata->tg_relation, trigdata->tg_trigtuple);
+
+	return PointerGetDatum(NULL);
+}
+
+Datum
+fk_insert_check(PG_FUNCTION_ARGS)
+{
+	return CallTimedTrigger(fk_insert_check_internal, fcinfo, PERIODS_STAT_FK_TRIGGER);
+}
+
+/*
+ * This function is called when a table containing foreign keys with periods is
+ * updated.  It checks to verify that the referenced table contains the proper
+ * data to satisfy the foreign key constraint.
+ */
+static Datum
+fk_update_check_internal(PG_FUNCTION_ARGS)
+{
+	TriggerData	   *trigdata = castNode(TriggerData, fcinfo->context);
+	ForeignKeyCacheEntry *entry;
+
+	entry = check_foreign_key_trigger(fcinfo, "fk_update_check");
+	validate_foreign_key_new_row(entry, trigdata->tg_relation, trigdata->tg_newtuple);
+
+	return PointerGetDatum(NULL);
+}
+
+Datum
+fk_update_check(PG_FUNCTION_ARGS)
+{
+	return CallTimedTrigger(fk_update_check_internal, fcinfo, PERIODS_STAT_FK_TRIGGER);
+}
+
+/*
+ * This function is called when a table referenced by foreign keys with periods
+ * is updated.  It checks to verify that the referenced table still contains the
+ * proper data to satisfy the foreign key constraint.
+ */
+static Datum
+uk_update_check_internal(PG_FUNCTION_ARGS)
+{
+	TriggerData	   *trigdata = castNode(TriggerData, fcinfo->context);
+	ForeignKeyCacheEntry *entry;
+
+	entry = check_foreign_key_trigger(fcinfo, "uk_update_check");
+	validate_foreign_key_old_row(entry, trigdata->tg_relation, trigdata->tg_trigtuple, trigdata->tg_newtuple);
+
+	return PointerGetDatum(NULL);
+}
+
+Datum
+uk_update_check(PG_FUNCTION_ARGS)
+{
+	return CallTimedTrigger(uk_update_check_internal, fcinfo, PERIODS_STAT_UK_TRIGGER);
+}
+
+/*
+ * This function is called when a table referenced by foreign keys with periods
+ * is deleted from.  It checks to verify that the referenced table still
+ * contains the proper data to satisfy the foreign key constraint.
+ */
+static Datum
+uk_delete_check_internal(PG_FUNCTION_ARGS)
+{
+	TriggerData	   *trigdata = castNode(TriggerData, fcinfo->context);
+	ForeignKeyCacheEntry *entry;
+
+	entry = check_foreign_key_trigger(fcinfo, "uk_delete_check");
+	validate_foreign_key_old_row(entry, trigdata->tg_relation, trigdata->tg_trigtuple, NULL);
+
+	return PointerGetDatum(NULL);
+}
+
+Datum
+uk_delete_check(PG_FUNCTION_ARGS)
+{
+	return CallTimedTrigger(uk_delete_check_internal, fcinfo, PERIODS_STAT_UK_TRIGGER);
+}
+
+#if (PG_VERSION_NUM >= 100000)
+/*
+ * The plan for checking all of the new rows of a statement at once, in the
+ * transition tables named by the trigger.  For an UPDATE, only the rows whose
+ * key or period changed are checked.
+ *
+ * This is the same check as GetNewRowPlan() but as a single anti-join: the
+ * new rows are joined to the referenced rows that overlap them, and the ones
+ * that are covered without any gaps are taken away.  What is left are the
+ * violations, of which we only need one.
+ */
+static SPIPlanPtr
+GetStatementPlan(ForeignKeyCacheEntry *entry, Trigger *trigger, bool is_update)
+{
+	StringInfo	buf;
+	const char *fs, *fe, *us, *ue;
+	int			i;
+
+	if (!is_update && entry->insert_statement_plan != NULL)
+		return entry->insert_statement_plan;
+	if (is_update && entry->update_statement_plan != NULL)
+		return entry->update_statement_plan;
+
+	fs = entry->fk_columns[entry->nkeys];
+	fe = entry->fk_columns[entry->nkeys + 1];
+	us = entry->uk_columns[entry->nkeys];
+	ue = entry->uk_columns[entry->nkeys + 1];
+
+	buf = makeStringInfo();
+
+	/*
+	 * The new rows.  Rows with nulls in the key can't match anything, which
+	 * is fine for MATCH SIMPLE, and the others will report them for us.
+	 */
+	appendStringInfoString(buf, "WITH n AS (SELECT DISTINCT ");
+	for (i = 0; i < entry->nkeys + 2; i++)
+		appendStringInfo(buf, "%sn.%s", i > 0 ? ", " : "", entry->fk_columns[i]);
+	appendStringInfo(buf, " FROM %s AS n WHERE ", quote_identifier(trigger->tgnewtable));
+	for (i = 0; i < entry->nkeys; i++)
+	{
+		if (entry->match_type == FKCONSTR_MATCH_SIMPLE)
+			appendStringInfo(buf, "%sn.%s IS NOT NULL", i > 0 ? " AND " : "", entry->fk_columns[i]);
+		else
+			appendStringInfo(buf, "%sn.%s IS NOT NULL", i > 0 ? " OR " : "", entry->fk_columns[i]);
+	}
+	if (is_update)
+	{
+		appendStringInfoString(buf, " EXCEPT SELECT ");
+		for (i = 0; i < entry->nkeys + 2; i++)
+			appendStringInfo(buf, "%so.%s", i > 0 ? ", " : "", entry->fk_columns[i]);
+		appendStringInfo(buf, " FROM %s AS o", quote_identifier(trigger->tgoldtable));
+	}
+	appendStringInfoString(buf, "), ");
+
+	/* The referenced rows that overlap them */
+	appendStringInfoString(buf, "u AS (SELECT ");
+	for (i = 0; i < entry->nkeys + 2; i++)
+		appendStringInfo(buf, "n.%s, ", entry->fk_columns[i]);
+	appendStringInfo(buf,
+		"uk.%s AS uk_start_value, uk.%s AS uk_end_value "
+		"FROM n JOIN %s AS uk ON ",
+		us, ue, entry->uk_table_name);
+	for (i = 0; i < entry->nkeys; i++)
+		appendStringInfo(buf, "uk.%s = n.%s AND ", entry->uk_columns[i], entry->fk_columns[i]);
+	appendStringInfo(buf,
+		"uk.%s <= n.%s AND uk.%s >= n.%s "
+		"FOR KEY SHARE OF uk), ",
+		us, fe, ue, fs);
+
+	/* The new rows that are covered */
+	appendStringInfoString(buf, "g AS (SELECT ");
+	for (i = 0; i < entry->nkeys + 2; i++)
+		appendStringInfo(buf, "%su.%s", i > 0 ? ", " : "", entry->fk_columns[i]);
+	appendStringInfoString(buf, " FROM u GROUP BY ");
+	for (i = 0; i < entry->nkeys + 2; i++)
+		appendStringInfo(buf, "%su.%s", i > 0 ? ", " : "", entry->fk_columns[i]);
+	appendStringInfo(buf,
+		" HAVING periods.covers(u.uk_start_value, u.uk_end_value, u.%s, u.%s "
+		"ORDER BY u.uk_start_value)) ",
+		fs, fe);
+
+	/* And the ones that aren't */
+	appendStringInfoString(buf, "SELECT ");
+	for (i = 0; i < entry->nkeys + 2; i++)
+		appendStringInfo(buf, "%sn.%s", i > 0 ? ", " : "", entry->fk_columns[i]);
+	appendStringInfoString(buf, " FROM n WHERE NOT EXISTS (SELECT FROM g WHERE ");
+	for (i = 0; i < entry->nkeys + 2; i++)
+		appendStringInfo(buf, "%sg.%s = n.%s", i > 0 ? " AND " : "",
+						 entry->fk_columns[i], entry->fk_columns[i]);
+	appendStringInfoString(buf, ") LIMIT 1");
+
+	if (is_update)
+		entry->update_statement_plan = prepare_kept_plan(buf->data, 0, NULL);
+	else
+		entry->insert_statement_plan = prepare_kept_plan(buf->data, 0, NULL);
+
+	return is_update ? entry->update_statement_plan : entry->insert_statement_plan;
+}
+#endif
+
+/*
+ * The statement level version of fk_insert_check() and fk_update_check(), for
+ * foreign keys that asked for it in add_foreign_key().  It is fired AFTER
+ * INSERT or AFTER UPDATE with transition tables, and checks all of the new
+ * rows in one query.
+ */
+static Datum
+fk_statement_check_internal(PG_FUNCTION_ARGS)
+{
+	TriggerData	   *trigdata = castNode(TriggerData, fcinfo->context);
+	const char	   *funcname = "fk_statement_check";
+#if (PG_VERSION_NUM >= 100000)
+	ForeignKeyCacheEntry *entry;
+	SPITupleTable  *tuptable;
+	HeapTuple		tuple;
+	StringInfo		keys;
+	StringInfo		values;
+	bool			has_nulls = false;
+	int				ret;
+	int				i;
+#endif
+
+	/*
+	 * Make sure this is being called as an AFTER STATEMENT trigger.  Note:
+	 * translatable error strings are shared with ri_triggers.c, so resist the
+	 * temptation to fold the function name into them.
+	 */
+	if (!CALLED_AS_TRIGGER(fcinfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+				 errmsg("function \"%s\" was not called by trigger manager",
+						funcname)));
+
+	if (!TRIGGER_FIRED_AFTER(trigdata->tg_event) ||
+		!TRIGGER_FIRED_FOR_STATEMENT(trigdata->tg_event))
 		ereport(ERROR,
-				(errcode(ERRCODE_INVALID_ROW_VERSION),
-				 errmsg("invalid row version"),
-				 errdetail("The row being updated or deleted was created after this transaction started."),
-				 errhint("The transaction might succeed if retried.")));
+				(errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+				 errmsg("function \"%s\" must be fired AFTER STATEMENT",
+						funcname)));
+
+	if (!TRIGGER_FIRED_BY_INSERT(trigdata->tg_event) &&
+		!TRIGGER_FIRED_BY_UPDATE(trigdata->tg_event))
+		ereport(ERROR,
+				(errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+				 errmsg("function \"%s\" must be fired for INSERT or UPDATE",
+						funcname)));
+
+	if (trigdata->tg_trigger->tgnargs != 1)
+		ereport(ERROR,
+				(errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+				 errmsg("function \"%s\" must be given the name of a foreign key",
+						funcname)));
+
+#if (PG_VERSION_NUM < 100000)
+	ereport(ERROR,
+			(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+			 errmsg("function \"%s\" requires transition tables", funcname)));
+#else
+	if (trigdata->tg_trigger->tgnewtable == NULL ||
+		(TRIGGER_FIRED_BY_UPDATE(trigdata->tg_event) &&
+		 trigdata->tg_trigger->tgoldtable == NULL))
+		ereport(ERROR,
+				(errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+				 errmsg("function \"%s\" must be fired with transition tables",
+						funcname)));
+
+	entry = GetForeignKeyCacheEntry(trigdata->tg_trigger->tgargs[0]);
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "SPI_connect failed");
+
+	/* Make the transition tables visible to our query */
+	ret = SPI_register_trigger_data(trigdata);
+	if (ret != SPI_OK_TD_REGISTER)
+		elog(ERROR, "SPI_register_trigger_data returned %s", SPI_result_code_string(ret));
+
+	CountPeriodsStat(RelationGetRelid(trigdata->tg_relation), PERIODS_STAT_FK_CHECKS, 1);
+	ret = SPI_execute_plan(GetStatementPlan(entry, trigdata->tg_trigger,
+											TRIGGER_FIRED_BY_UPDATE(trigdata->tg_event)),
+						   NULL, NULL, false, 1);
+	if (ret != SPI_OK_SELECT)
+		elog(ERROR, "SPI_execute returned %s", SPI_result_code_string(ret));
+
+	if (SPI_processed > 0)
+	{
+		/* Report the row we found the same way the core foreign keys do */
+		tuptable = SPI_tuptable;
+		tuple = tuptable->vals[0];
+		keys = makeStringInfo();
+		values = makeStringInfo();
+		for (i = 0; i < entry->nkeys + 2; i++)
+		{
+			char   *value = SPI_getvalue(tuple, tuptable->tupdesc, i + 1);
+
+			if (value == NULL)
+				has_nulls = true;
+
+			appendStringInfo(keys, "%s%s", i > 0 ? ", " : "", entry->fk_columns[i]);
+			appendStringInfo(values, "%s%s", i > 0 ? ", " : "", value ? value : "null");
+		}
+
+		if (has_nulls && entry->match_type == FKCONSTR_MATCH_PARTIAL)
+			ereport(ERROR,
+					(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+					 errmsg("partial not implemented")));
+
+		if (has_nulls)
+			ereport(ERROR,
+					(errcode(ERRCODE_FOREIGN_KEY_VIOLATION),
+					 errmsg("foreign key violated (nulls in FULL)"),
+					 errdetail("Key (%s)=(%s) has nulls.", keys->data, values->data)));
+
+		ereport(ERROR,
+				(errcode(ERRCODE_FOREIGN_KEY_VIOLATION),
+				 errmsg("insert or update on table \"%s\" violates foreign key constraint \"%s\"",
+						DatumGetCString(DirectFunctionCall1(regclassout, ObjectIdGetDatum(entry->fk_relid))),
+						NameStr(entry->key_name)),
+				 errdetail("Key (%s)=(%s) is not present in table \"%s\".",
+						   keys->data, values->data,
+						   DatumGetCString(DirectFunctionCall1(regclassout, ObjectIdGetDatum(entry->uk_relid))))));
+	}
+
+	if (SPI_finish() != SPI_OK_FINISH)
+		elog(ERROR, "SPI_finish failed");
+#endif
+
+	return PointerGetDatum(NULL);
+}
+
+Datum
+fk_statement_check(PG_FUNCTION_ARGS)
+{
+	return CallTimedTrigger(fk_statement_check_internal, fcinfo, PERIODS_STAT_FK_TRIGGER);
+}
+
+/*
+ * periods.covers(start, end, target_start, target_end ORDER BY start) is an
+ * aggregate that tells if the periods it is given, sorted by their start,
+ * cover the target period without any gaps.  This is what the foreign keys
+ * use to check that the referenced rows cover a referencing row.
+ *
+ * The periods are merged as they come, so all we keep is how far they reach.
+ * Once there is a gap or the target is covered, the rest of the periods are
+ * ignored.  The values are compared with the default btree operator class of
+ * their type, like the ORDER BY does.
+ */
+typedef struct CoversState
+{
+	FmgrInfo   *cmp_proc;
+	Oid			collation;
+	int16		typlen;
+	bool		typbyval;
+	Datum		target_start;	/* the same for every row */
+	Datum		target_end;
+	Datum		reached;		/* how far the periods so far reach */
+	bool		started;		/* have we merged a period yet? */
+	bool		done;			/* is the result known yet? */
+	bool		result;
+} CoversState;
+
+static int
+covers_cmp(CoversState *state, Datum a, Datum b)
+{
+	return DatumGetInt32(FunctionCall2Coll(state->cmp_proc, state->collation, a, b));
+}
+
+Datum
+covers_transfn(PG_FUNCTION_ARGS)
+{
+	MemoryContext	aggcontext;
+	MemoryContext	oldcontext;
+	CoversState	   *state;
+	Datum			start, end;
+
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "covers_transfn called in non-aggregate context");
+
+	if (PG_ARGISNULL(0))
+	{
+		Oid				typeid = get_fn_expr_argtype(fcinfo->flinfo, 1);
+		TypeCacheEntry *typentry;
+
+		if (PG_ARGISNULL(3) || PG_ARGISNULL(4))
+			ereport(ERROR,
+					(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+					 errmsg("the period to cover must not be null")));
+
+		typentry = lookup_type_cache(typeid, TYPECACHE_CMP_PROC_FINFO);
+		if (!OidIsValid(typentry->cmp_proc_finfo.fn_oid))
+			ereport(ERROR,
+					(errcode(ERRCODE_UNDEFINED_FUNCTION),
+					 errmsg("could not identify a comparison function for type %s",
+							format_type_be(typeid))));
+
+		oldcontext = MemoryContextSwitchTo(aggcontext);
+		state = (CoversState *) palloc0(sizeof(CoversState));
+		state->cmp_proc = &typentry->cmp_proc_finfo;
+		state->collation = PG_GET_COLLATION();
+		state->typlen = typentry->typlen;
+		state->typbyval = typentry->typbyval;
+		state->target_start = datumCopy(PG_GETARG_DATUM(3), state->typbyval, state->typlen);
+		state->target_end = datumCopy(PG_GETARG_DATUM(4), state->typbyval, state->typlen);
+		MemoryContextSwitchTo(oldcontext);
+	}
+	else
+		state = (CoversState *) PG_GETARG_POINTER(0);
+
+	/* Null periods don't cover anything */
+	if (state->done || PG_ARGISNULL(1) || PG_ARGISNULL(2))
+		PG_RETURN_POINTER(state);
+
+	start = PG_GETARG_DATUM(1);
+	end = PG_GETARG_DATUM(2);
+
+	/* Periods that end before the target starts don't help */
+	if (covers_cmp(state, end, state->target_start) < 0)
+		PG_RETURN_POINTER(state);
+
+	/* Is there a gap before this period? */
+	if (covers_cmp(state, start, state->started ? state->reached : state->target_start) > 0)
+	{
+		state->done = true;
+		state->result = false;
+		PG_RETURN_POINTER(state);
+	}
+
+	if (!state->started || covers_cmp(state, end, state->reached) > 0)
+	{
+		if (state->started && !state->typbyval)
+			pfree(DatumGetPointer(state->reached));
+
+		oldcontext = MemoryContextSwitchTo(aggcontext);
+		state->reached = datumCopy(end, state->typbyval, state->typlen);
+		MemoryContextSwitchTo(oldcontext);
+		state->started = true;
+	}
+
+	if (covers_cmp(state, state->reached, state->target_end) >= 0)
+	{
+		state->done = true;
+		state->result = true;
+	}
+
+	PG_RETURN_POINTER(state);
+}
+
+Datum
+covers_finalfn(PG_FUNCTION_ARGS)
+{
+	CoversState	   *state;
+
+	/* No periods at all */
+	if (PG_ARGISNULL(0))
+		PG_RETURN_BOOL(false);
+
+	state = (CoversState *) PG_GETARG_POINTER(0);
+
+	PG_RETURN_BOOL(state->done && state->result);
+}
+
+/*
+ * Set up a set-returning function to return all of its rows at once in a
+ * tuplestore.
+ */
+static Tuplestorestate *
+begin_materialized_srf(FunctionCallInfo fcinfo, TupleDesc *tupdesc)
+{
+	ReturnSetInfo	   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	Tuplestorestate	   *tupstore;
+	MemoryContext		oldcontext;
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	if (get_call_result_type(fcinfo, NULL, tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	*tupdesc = CreateTupleDescCopy(*tupdesc);
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = *tupdesc;
+	MemoryContextSwitchTo(oldcontext);
+
+	return tupstore;
+}
+
+/*
+ * periods.normalize(start_values, end_values) returns the fewest periods that
+ * cover the same values as the periods made from the two arrays, in order.
+ * Periods that overlap or meet are merged, and null or empty periods are left
+ * out.  Once the periods are sorted, they are merged in a single pass.
+ */
+typedef struct NormalizeSortContext
+{
+	FmgrInfo   *cmp_proc;
+	Oid			collation;
+	Datum	   *starts;
+} NormalizeSortContext;
+
+static int
+normalize_sort_cmp(const void *a, const void *b, void *arg)
+{
+	NormalizeSortContext *cxt = (NormalizeSortContext *) arg;
+
+	return DatumGetInt32(FunctionCall2Coll(cxt->cmp_proc, cxt->collation,
+										   cxt->starts[*(const int *) a],
+										   cxt->starts[*(const int *) b]));
+}
+
+Datum
+normalize_periods(PG_FUNCTION_ARGS)
+{
+	ArrayType		   *start_array = PG_GETARG_ARRAYTYPE_P(0);
+	ArrayType		   *end_array = PG_GETARG_ARRAYTYPE_P(1);
+	Oid					typeid = ARR_ELEMTYPE(start_array);
+	TypeCacheEntry	   *typentry;
+	NormalizeSortContext cxt;
+	Tuplestorestate	   *tupstore;
+	TupleDesc			tupdesc;
+	Datum			   *starts, *ends;
+	bool			   *start_nulls, *end_nulls;
+	int					nstarts, nends;
+	int				   *order;
+	int					norder = 0;
+	Datum				values[2] = {0, 0};
+	bool				nulls[2] = {false, false};
+	int					i;
+
+	tupstore = begin_materialized_srf(fcinfo, &tupdesc);
+
+	typentry = lookup_type_cache(typeid, TYPECACHE_CMP_PROC_FINFO);
+	if (!OidIsValid(typentry->cmp_proc_finfo.fn_oid))
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_FUNCTION),
+				 errmsg("could not identify a comparison function for type %s",
+						format_type_be(typeid))));
+
+	deconstruct_array(start_array, typeid, typentry->typlen, typentry->typbyval,
+					  typentry->typalign, &starts, &start_nulls, &nstarts);
+	deconstruct_array(end_array, typeid, typentry->typlen, typentry->typbyval,
+					  typentry->typalign, &ends, &end_nulls, &nends);
+
+	if (nstarts != nends)
+		ereport(ERROR,
+				(errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+				 errmsg("there must be as many start values as end values")));
+
+	cxt.cmp_proc = &typentry->cmp_proc_finfo;
+	cxt.collation = PG_GET_COLLATION();
+	cxt.starts = starts;
+
+	/* Sort the periods that are worth keeping by their start */
+	order = (int *) palloc(Max(nstarts, 1) * sizeof(int));
+	for (i = 0; i < nstarts; i++)
+	{
+		if (start_nulls[i] || end_nulls[i])
+			continue;
+		if (DatumGetInt32(FunctionCall2Coll(cxt.cmp_proc, cxt.collation, starts[i], ends[i])) >= 0)
+			continue;
+		order[norder++] = i;
+	}
+	qsort_arg(order, norder, sizeof(int), normalize_sort_cmp, &cxt);
+
+	for (i = 0; i < norder; i++)
+	{
+		Datum	start = starts[order[i]];
+		Datum	end = ends[order[i]];
+
+		if (i > 0)
+		{
+			/* Does it overlap or meet the period being merged? */
+			if (DatumGetInt32(FunctionCall2Coll(cxt.cmp_proc, cxt.collation, start, values[1])) <= 0)
+			{
+				if (DatumGetInt32(FunctionCall2Coll(cxt.cmp_proc, cxt.collation, end, values[1])) > 0)
+					values[1] = end;
+				continue;
+			}
+
+			tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+		}
+
+		values[0] = start;
+		values[1] = end;
+	}
+
+	if (norder > 0)
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+
+	return (Datum) 0;
+}
+
+/*
+ * Delete the oldest rows of a table's history, up to batch_size of them, that
+ * ended before the given time.  This is the workhorse of
+ * periods.purge_history().
+ *
+ * Nobody is allowed to delete from a history table, not even its owner, so we
+ * do the deleting ourselves after checking that the caller owns the table the
+ * history belongs to, which is the same rule that applies to dropping SYSTEM
+ * VERSIONING and purging the history that way.  This function is therefore
+ * not SECURITY DEFINER, and the rows are looked up with the privileges of the
+ * caller.
+ *
+ * The rows are found in order of the end of SYSTEM_TIME so that an index on
+ * that column, which is what partitions and the *__as_of() functions want
+ * anyway, keeps each batch cheap no matter how much history there is.
+ */
+Datum
+purge_history_batch(PG_FUNCTION_ARGS)
+{
+	Oid				relid = PG_GETARG_OID(0);
+	Datum			older_than = PG_GETARG_DATUM(1);
+	int32			batch_size = PG_GETARG_INT32(2);
+	Relation		rel;
+	Relation		history_rel;
+	Relation		leaf_rel = NULL;
+	SystemTimeCacheEntry *entry;
+	Oid				history_relid;
+	NameData		end_name;
+	StringInfo		buf;
+	Oid				argtypes[2] = {TIMESTAMPTZOID, INT8OID};
+	Datum			values[2];
+	SPITupleTable  *tuptable;
+#if (PG_VERSION_NUM >= 120000)
+	Snapshot		snapshot = GetActiveSnapshot();
+#endif
+	uint64			i;
+	int64			deleted = 0;
+	int				ret;
+
+	if (batch_size <= 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("batch size must be greater than zero")));
+
+	rel = table_open(relid, AccessShareLock);
+
+#if (PG_VERSION_NUM >= 160000)
+	if (!object_ownercheck(RelationRelationId, relid, GetUserId()))
+#else
+	if (!pg_class_ownercheck(relid, GetUserId()))
+#endif
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("must be owner of table %s",
+						RelationGetRelationName(rel))));
+
+	/* The cache entry can go away once we start running queries */
+	entry = GetSystemTimeCacheEntry(rel);
+	history_relid = entry->history_relid;
+	namestrcpy(&end_name, NameStr(entry->end_name));
+
+	if (!OidIsValid(history_relid))
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("table \"%s\" does not have SYSTEM VERSIONING",
+						RelationGetRelationName(rel))));
+
+	history_rel = table_open(history_relid, RowExclusiveLock);
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "SPI_connect failed");
+
+	buf = makeStringInfo();
+	appendStringInfo(buf, "SELECT tableoid, ctid FROM %s WHERE %s < $1 ORDER BY %s LIMIT $2",
+			quote_qualified_identifier(SPI_getnspname(history_rel),
+									   SPI_getrelname(history_rel)),
+			quote_identifier(NameStr(end_name)),
+			quote_identifier(NameStr(end_name)));
+
+	values[0] = older_than;
+	values[1] = Int64GetDatum((int64) batch_size);
+	ret = SPI_execute_with_args(buf->data, 2, argtypes, values, NULL, false, 0);
+	if (ret != SPI_OK_SELECT)
+		elog(ERROR, "SPI_execute returned %s", SPI_result_code_string(ret));
+
+	/*
+	 * The rows can be in any partition of the history table, so keep the last
+	 * one we deleted from open since they tend to come in runs.
+	 */
+	tuptable = SPI_tuptable;
+	for (i = 0; i < SPI_processed; i++)
+	{
+		HeapTuple	tuple = tuptable->vals[i];
+		bool		is_null;
+		Oid			tableoid;
+		ItemPointer	tid;
+
+		tableoid = DatumGetObjectId(SPI_getbinval(tuple, tuptable->tupdesc, 1, &is_null));
+		tid = (ItemPointer) DatumGetPointer(SPI_getbinval(tuple, tuptable->tupdesc, 2, &is_null));
+
+		if (leaf_rel == NULL || RelationGetRelid(leaf_rel) != tableoid)
+		{
+			if (leaf_rel != NULL && leaf_rel != history_rel)
+				table_close(leaf_rel, NoLock);
+
+			if (tableoid == history_relid)
+				leaf_rel = history_rel;
+			else
+				leaf_rel = table_open(tableoid, RowExclusiveLock);
+		}
+
+#if (PG_VERSION_NUM >= 120000)
+		simple_table_tuple_delete(leaf_rel, tid, snapshot);
+#else
+		simple_heap_delete(leaf_rel, tid);
+#endif
+		deleted++;
+	}
+
+	if (SPI_finish() != SPI_OK_FINISH)
+		elog(ERROR, "SPI_finish failed");
+
+	if (leaf_rel != NULL && leaf_rel != history_rel)
+		table_close(leaf_rel, NoLock);
+	table_close(history_rel, NoLock);
+	table_close(rel, NoLock);
+
+	PG_RETURN_INT64(deleted);
+}
+
+/*
+ * Set the end of SYSTEM_TIME of a history row to the end of the run of
+ * versions it starts, for coalesce_history().  Nobody is allowed to update the
+ * history, so this is done as the owner of that function.
+ */
+static void
+extend_history_row(SPIPlanPtr plan, Oid owner, Relation history_rel,
+				   Oid tableoid, ItemPointer tid, Datum end)
+{
+	Datum	values[3];
+	Oid		save_userid;
+	int		save_sec_context;
+	int		ret;
+
+	values[0] = ObjectIdGetDatum(tableoid);
+	values[1] = PointerGetDatum(tid);
+	values[2] = end;
+
+	GetUserIdAndSecContext(&save_userid, &save_sec_context);
+	SetUserIdAndSecContext(owner,
+						   save_sec_context |
+						   SECURITY_LOCAL_USERID_CHANGE |
+						   SECURITY_RESTRICTED_OPERATION);
+	ret = SPI_execute_plan(plan, values, NULL, false, 0);
+	SetUserIdAndSecContext(save_userid, save_sec_context);
+
+	if (ret != SPI_OK_UPDATE)
+		elog(ERROR, "SPI_execute returned %s", SPI_result_code_string(ret));
+	if (SPI_processed != 1)
+		elog(ERROR, "could not find row (%u,%u) in history table \"%s\"",
+			 ItemPointerGetBlockNumber(tid),
+			 ItemPointerGetOffsetNumber(tid),
+			 RelationGetRelationName(history_rel));
+}
+
+/*
+ * Merge the runs of versions in a table's history that ended before the given
+ * time where each version starts when the one before it ended and is otherwise
+ * identical to it, byte for byte.  The first version of each run gets the end
+ * of the last one and the others are deleted.  This is the workhorse of
+ * periods.coalesce_history(), which gives us the columns to find the versions
+ * of a row by.
+ *
+ * The ownership check and the deleting are the same as in
+ * purge_history_batch().  Extending the first version of a run is an UPDATE
+ * that has to go through the executor for the indexes and partitions of the
+ * history table, so we run just that as the owner of this function, like the
+ * triggers that write the history do.
+ *
+ * The runs are found in one pass over the history, and the batches only bound
+ * how many are merged before we check whether we should stop.
+ */
+Datum
+coalesce_history(PG_FUNCTION_ARGS)
+{
+	Oid				relid;
+	Datum			before;
+	Datum		   *key_names;
+	int				nkeys;
+	int32			batch_size;
+	int32			max_batches;
+	Relation		rel;
+	Relation		history_rel;
+	Relation		leaf_rel = NULL;
+	SystemTimeCacheEntry *entry;
+	Oid				history_relid;
+	Oid				period_type;
+	NameData		start_name;
+	NameData		end_name;
+	TupleDesc		history_tupdesc;
+	StringInfo		keys;
+	StringInfo		columns;
+	StringInfo		buf;
+	char		   *history_name;
+	Oid				argtypes[3];
+	SPIPlanPtr		update_plan;
+	Portal			portal;
+	HeapTuple		proctup;
+	Oid				function_owner;
+#if (PG_VERSION_NUM >= 120000)
+	Snapshot		snapshot = GetActiveSnapshot();
+#endif
+	bool			in_run = false;
+	Oid				run_tableoid = InvalidOid;
+	ItemPointerData	run_tid;
+	Datum			run_end = (Datum) 0;
+	int16			typlen;
+	bool			typbyval;
+	int32			runs = 0;
+	int32			batches = 0;
+	bool			done = false;
+	int64			removed = 0;
+	int				i;
+
+	if (PG_ARGISNULL(0) || PG_ARGISNULL(1) || PG_ARGISNULL(2) || PG_ARGISNULL(3))
+		PG_RETURN_NULL();
+
+	relid = PG_GETARG_OID(0);
+	before = PG_GETARG_DATUM(1);
+	deconstruct_array(PG_GETARG_ARRAYTYPE_P(2), NAMEOID, NAMEDATALEN, false, 'c',
+					  &key_names, NULL, &nkeys);
+	batch_size = PG_GETARG_INT32(3);
+	max_batches = PG_ARGISNULL(4) ? -1 : PG_GETARG_INT32(4);
+
+	if (max_batches == 0)
+		PG_RETURN_INT64(0);
+
+	ItemPointerSetInvalid(&run_tid);
+
+	if (batch_size <= 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("batch size must be greater than zero")));
+
+	if (nkeys == 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("no key columns specified")));
+
+	rel = table_open(relid, AccessShareLock);
+
+#if (PG_VERSION_NUM >= 160000)
+	if (!object_ownercheck(RelationRelationId, relid, GetUserId()))
+#else
+	if (!pg_class_ownercheck(relid, GetUserId()))
+#endif
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("must be owner of table %s",
+						RelationGetRelationName(rel))));
+
+	/* The cache entry can go away once we start running queries */
+	entry = GetSystemTimeCacheEntry(rel);
+	history_relid = entry->history_relid;
+	period_type = entry->typeid;
+	namestrcpy(&start_name, NameStr(entry->start_name));
+	namestrcpy(&end_name, NameStr(entry->end_name));
+
+	if (!OidIsValid(history_relid))
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("table \"%s\" does not have SYSTEM VERSIONING",
+						RelationGetRelationName(rel))));
+
+	history_rel = table_open(history_relid, RowExclusiveLock);
+	history_tupdesc = RelationGetDescr(history_rel);
+	get_typlenbyval(period_type, &typlen, &typbyval);
+
+	proctup = SearchSysCache1(PROCOID, ObjectIdGetDatum(fcinfo->flinfo->fn_oid));
+	if (!HeapTupleIsValid(proctup))
+		elog(ERROR, "cache lookup failed for function %u", fcinfo->flinfo->fn_oid);
+	function_owner = ((Form_pg_proc) GETSTRUCT(proctup))->proowner;
+	ReleaseSysCache(proctup);
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "SPI_connect failed");
+
+	history_name = quote_qualified_identifier(SPI_getnspname(history_rel),
+											  SPI_getrelname(history_rel));
+
+	keys = makeStringInfo();
+	for (i = 0; i < nkeys; i++)
+		appendStringInfo(keys, "%s%s", i > 0 ? ", " : "",
+						 quote_identifier(NameStr(*DatumGetName(key_names[i]))));
+
+	/* Everything but SYSTEM_TIME has to be the same */
+	columns = makeStringInfo();
+	for (i = 0; i < history_tupdesc->natts; i++)
+	{
+		Form_pg_attribute	att = TupleDescAttr(history_tupdesc, i);
+
+		if (att->attisdropped ||
+			namestrcmp(&att->attname, NameStr(start_name)) == 0 ||
+			namestrcmp(&att->attname, NameStr(end_name)) == 0)
+			continue;
+
+		appendStringInfo(columns, "%s%s", columns->len > 0 ? ", " : "",
+						 quote_identifier(NameStr(att->attname)));
+	}
+
+	/*
+	 * Only return the versions that are part of a run, in order, and whether
+	 * each one continues the one before it.
+	 */
+	buf = makeStringInfo();
+	appendStringInfo(buf,
+		"SELECT tableoid, ctid, %3$s, continues "
+		"FROM ("
+		"    SELECT tableoid, ctid, %1$s, %2$s, %3$s, continues, "
+		"           pg_catalog.lead(continues) OVER w AS continued "
+		"    FROM ("
+		"        SELECT tableoid, ctid, %1$s, %2$s, %3$s, "
+		"               COALESCE(pg_catalog.lag(%3$s) OVER w = %2$s "
+		"                        AND pg_catalog.lag(ROW(%4$s)) OVER w *= ROW(%4$s), false) AS continues "
+		"        FROM %5$s "
+		"        WHERE %3$s <= $1 "
+		"        WINDOW w AS (PARTITION BY %1$s ORDER BY %2$s)"
+		"    ) AS h "
+		"    WINDOW w AS (PARTITION BY %1$s ORDER BY %2$s)"
+		") AS h "
+		"WHERE continues OR continued "
+		"ORDER BY %1$s, %2$s",
+		keys->data,
+		quote_identifier(NameStr(start_name)),
+		quote_identifier(NameStr(end_name)),
+		columns->data,
+		history_name);
+
+	argtypes[0] = TIMESTAMPTZOID;
+	portal = SPI_cursor_open_with_args(NULL, buf->data, 1, argtypes, &before,
+									   NULL, true, 0);
+	if (portal == NULL)
+		elog(ERROR, "SPI_cursor_open returned %s", SPI_result_code_string(SPI_result));
+
+	resetStringInfo(buf);
+	appendStringInfo(buf,
+		"UPDATE %s SET %s = $3 "
+		"WHERE tableoid OPERATOR(pg_catalog.=) $1 AND ctid OPERATOR(pg_catalog.=) $2",
+		history_name,
+		quote_identifier(NameStr(end_name)));
+
+	argtypes[0] = OIDOID;
+	argtypes[1] = TIDOID;
+	argtypes[2] = period_type;
+	update_plan = SPI_prepare(buf->data, 3, argtypes);
+	if (update_plan == NULL)
+		elog(ERROR, "SPI_prepare returned %s for %s",
+			 SPI_result_code_string(SPI_result), buf->data);
+
+	while (!done)
+	{
+		SPITupleTable  *tuptable;
+		uint64			nrows;
+		uint64			j;
+
+		SPI_cursor_fetch(portal, true, batch_size);
+		tuptable = SPI_tuptable;
+		nrows = SPI_processed;
+		if (nrows == 0)
+			break;
+
+		for (j = 0; j < nrows; j++)
+		{
+			HeapTuple	tuple = tuptable->vals[j];
+			bool		is_null;
+			Oid			tableoid;
+			ItemPointer	tid;
+
+			tableoid = DatumGetObjectId(SPI_getbinval(tuple, tuptable->tupdesc, 1, &is_null));
+			tid = (ItemPointer) DatumGetPointer(SPI_getbinval(tuple, tuptable->tupdesc, 2, &is_null));
+
+			if (DatumGetBool(SPI_getbinval(tuple, tuptable->tupdesc, 4, &is_null)))
+			{
+				if (leaf_rel == NULL || RelationGetRelid(leaf_rel) != tableoid)
+				{
+					if (leaf_rel != NULL && leaf_rel != history_rel)
+						table_close(leaf_rel, NoLock);
+
+					if (tableoid == history_relid)
+						leaf_rel = history_rel;
+					else
+						leaf_rel = table_open(tableoid, RowExclusiveLock);
+				}
+
+#if (PG_VERSION_NUM >= 120000)
+				simple_table_tuple_delete(leaf_rel, tid, snapshot);
+#else
+				simple_heap_delete(leaf_rel, tid);
+#endif
+				removed++;
+
+				run_end = datumCopy(SPI_getbinval(tuple, tuptable->tupdesc, 3, &is_null),
+									typbyval, typlen);
+				continue;
+			}
+
+			/* Anything else starts a new run, so finish the one we were in */
+			if (in_run)
+			{
+				extend_history_row(update_plan, function_owner, history_rel,
+								   run_tableoid, &run_tid, run_end);
+				in_run = false;
+
+				if (++runs == batch_size)
+				{
+					runs = 0;
+					if (++batches == max_batches)
+					{
+						done = true;
+						break;
+					}
+				}
+			}
+
+			in_run = true;
+			run_tableoid = tableoid;
+			ItemPointerCopy(tid, &run_tid);
+		}
+
+		SPI_freetuptable(tuptable);
+	}
+
+	if (in_run)
+		extend_history_row(update_plan, function_owner, history_rel,
+						   run_tableoid, &run_tid, run_end);
+
+	SPI_cursor_close(portal);
+
+	if (SPI_finish() != SPI_OK_FINISH)
+		elog(ERROR, "SPI_finish failed");
+
+	if (leaf_rel != NULL && leaf_rel != history_rel)
+		table_close(leaf_rel, NoLock);
+	table_close(history_rel, NoLock);
+	table_close(rel, NoLock);
+
+	PG_RETURN_INT64(removed);
+}
+
+#if (PG_VERSION_NUM >= 120000)
+/*
+ * Find a GiST index on the range made from the given start and end columns,
+ * the way add_unique_key() and add_system_versioning() make them, and return
+ * a copy of its expression.  The Vars in it are for the first range table
+ * entry, so the caller needs to replace them.
+ */
+static FuncExpr *
+GetPeriodRangeIndexExpr(Oid relid, AttrNumber start_num, AttrNumber end_num)
+{
+	Relation	rel;
+	List	   *indexoids;
+	ListCell   *lc;
+	FuncExpr   *result = NULL;
+
+	/* The planner already has the table locked */
+	rel = table_open(relid, NoLock);
+	indexoids = RelationGetIndexList(rel);
+
+	foreach(lc, indexoids)
+	{
+		Relation	index = index_open(lfirst_oid(lc), AccessShareLock);
+		ListCell   *lc2;
+
+		if (index->rd_rel->relam == GIST_AM_OID &&
+			index->rd_index->indisvalid &&
+			RelationGetIndexPredicate(index) == NIL)
+		{
+			foreach(lc2, RelationGetIndexExpressions(index))
+			{
+				FuncExpr   *expr = (FuncExpr *) lfirst(lc2);
+				Node	   *start_arg;
+				Node	   *end_arg;
+
+				if (!IsA(expr, FuncExpr) ||
+					!type_is_range(expr->funcresulttype) ||
+					list_length(expr->args) < 2 ||
+					list_length(expr->args) > 3)
+					continue;
+
+				start_arg = linitial(expr->args);
+				end_arg = lsecond(expr->args);
+				if (!IsA(start_arg, Var) || ((Var *) start_arg)->varattno != start_num ||
+					!IsA(end_arg, Var) || ((Var *) end_arg)->varattno != end_num)
+					continue;
+
+				/* The bounds must be the default ones, like the periods' */
+				if (list_length(expr->args) == 3)
+				{
+					Const  *bounds = (Const *) lthird(expr->args);
+
+					if (!IsA(bounds, Const) || bounds->constisnull ||
+						strcmp(TextDatumGetCString(bounds->constvalue), "[)") != 0)
+						continue;
+				}
+
+				result = copyObject(expr);
+				break;
+			}
+		}
+
+		index_close(index, NoLock);
+
+		if (result != NULL)
+			break;
+	}
+
+	list_free(indexoids);
+	table_close(rel, NoLock);
+
+	return result;
+}
+
+/*
+ * Are these the columns of a period on this table, or on the table this is
+ * the history table of?  Either way, the start is known to be before the end
+ * on every row so the ranges made from them are never empty.
+ */
+static bool
+IsPeriodColumns(Oid relid, AttrNumber start_num, AttrNumber end_num)
+{
+	int			ret;
+	Datum		values[3];
+	bool		result;
+
+	const char *sql =
+		"SELECT FROM periods.periods AS p "
+		"WHERE (p.start_column_name, p.end_column_name) = ($2, $3) "
+		"  AND (p.table_name = $1 "
+		"       OR p.table_name IN (SELECT sv.table_name "
+		"                           FROM periods.system_versioning AS sv "
+		"                           WHERE sv.history_table_name = $1))";
+	static SPIPlanPtr qplan = NULL;
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "SPI_connect failed");
+
+	/* Cache the plan if we haven't already */
+	if (qplan == NULL)
+	{
+		Oid	types[3] = {REGCLASSOID, NAMEOID, NAMEOID};
+
+		qplan = SPI_prepare(sql, 3, types);
+		if (qplan == NULL)
+			elog(ERROR, "SPI_prepare returned %s for %s",
+				 SPI_result_code_string(SPI_result), sql);
+
+		ret = SPI_keepplan(qplan);
+		if (ret != 0)
+			elog(ERROR, "SPI_keepplan returned %s", SPI_result_code_string(ret));
+	}
+
+	values[0] = ObjectIdGetDatum(relid);
+	values[1] = DirectFunctionCall1(namein, CStringGetDatum(get_attname(relid, start_num, false)));
+	values[2] = DirectFunctionCall1(namein, CStringGetDatum(get_attname(relid, end_num, false)));
+	ret = SPI_execute_plan(qplan, values, NULL, true, 1);
+	if (ret != SPI_OK_SELECT)
+		elog(ERROR, "SPI_execute returned %s", SPI_result_code_string(ret));
+
+	result = SPI_processed > 0;
+
+	if (SPI_finish() != SPI_OK_FINISH)
+		elog(ERROR, "SPI_finish failed");
+
+	return result;
+}
+#endif
+
+#if (PG_VERSION_NUM >= 120000)
+/*
+ * Make a "var IS NOT NULL" test for predicate_support.
+ */
+static Expr *
+MakeNotNullTest(Var *var)
+{
+	NullTest   *ntest = makeNode(NullTest);
+
+	ntest->arg = (Expr *) copyObject(var);
+	ntest->nulltesttype = IS_NOT_NULL;
+	ntest->argisrow = false;
+	ntest->location = -1;
+
+	return (Expr *) ntest;
+}
+#endif
+
+/*
+ * Planner support for the predicate functions (PostgreSQL 12 and later).
+ *
+ * The predicates are SQL functions that get inlined into comparisons of the
+ * start and end columns, which is what btree indexes on those columns want,
+ * but the GiST indexes behind unique keys are on a range made from the two
+ * columns and can't be used for that.  So when the first two arguments are
+ * the columns of a period with such an index, and the other period is a valid
+ * constant one, we replace the call with the equivalent range operator on the
+ * index's expression.  The planner can then use the index, and estimate the
+ * condition with the statistics ANALYZE keeps for it.  Otherwise we do nothing
+ * and the function is inlined as usual.
+ *
+ * The immediately_* predicates have no range operator that means the same
+ * thing, and they are a simple equality anyway.
+ */
+Datum
+predicate_support(PG_FUNCTION_ARGS)
+{
+#if (PG_VERSION_NUM >= 120000)
+	Node	   *rawreq = (Node *) PG_GETARG_POINTER(0);
+	SupportRequestSimplify *req;
+	FuncExpr   *fcall;
+	char	   *funcname;
+	const char *opname;
+	Node	   *start_arg;
+	Node	   *end_arg;
+	Var		   *start_var;
+	Var		   *end_var;
+	RangeTblEntry *rte;
+	FuncExpr   *range;
+	Node	   *other;
+	Oid			opno;
+	Expr	   *opclause;
+	Expr	   *result;
+
+	if (!IsA(rawreq, SupportRequestSimplify))
+		PG_RETURN_POINTER(NULL);
+
+	req = (SupportRequestSimplify *) rawreq;
+	fcall = req->fcall;
+
+	/* We need to look at the query's range table */
+	if (req->root == NULL)
+		PG_RETURN_POINTER(NULL);
+
+	funcname = get_func_name(fcall->funcid);
+	if (funcname == NULL)
+		PG_RETURN_POINTER(NULL);
+
+	if (list_length(fcall->args) == 3 && strcmp(funcname, "contains") == 0)
+		opname = "@>";
+	else if (list_length(fcall->args) != 4)
+		PG_RETURN_POINTER(NULL);
+	else if (strcmp(funcname, "contains") == 0)
+		opname = "@>";
+	else if (strcmp(funcname, "equals") == 0)
+		opname = "=";
+	else if (strcmp(funcname, "overlaps") == 0)
+		opname = "&&";
+	else if (strcmp(funcname, "precedes") == 0)
+		opname = "<<";
+	else if (strcmp(funcname, "succeeds") == 0)
+		opname = ">>";
+	else
+		PG_RETURN_POINTER(NULL);
+
+	/* The first period must be two columns of the same table */
+	start_arg = linitial(fcall->args);
+	end_arg = lsecond(fcall->args);
+	if (!IsA(start_arg, Var) || !IsA(end_arg, Var))
+		PG_RETURN_POINTER(NULL);
+
+	start_var = (Var *) start_arg;
+	end_var = (Var *) end_arg;
+	if (start_var->varlevelsup != 0 || end_var->varlevelsup != 0 ||
+		start_var->varno != end_var->varno ||
+		start_var->varattno <= 0 || end_var->varattno <= 0)
+		PG_RETURN_POINTER(NULL);
+
+	rte = rt_fetch(start_var->varno, req->root->parse->rtable);
+	if (rte->rtekind != RTE_RELATION)
+		PG_RETURN_POINTER(NULL);
 
 	/*
-	 * If this table does not have SYSTEM VERSIONING, there is nothing else to
-	 * be done.
+	 * The other period must make a non-empty range, or the range operators
+	 * wouldn't give the same answer as the comparisons.  The constructor would
+	 * even fail if it were backwards, so we can only do this for constants.
 	 */
-	history_id = GetHistoryTable(rel);
-	if (OidIsValid(history_id))
+	if (list_length(fcall->args) == 4)
 	{
-		Relation	history_rel;
-		TupleDesc	history_tupledesc;
-		HeapTuple	history_tuple;
-		int16		history_end_num;
-		TupleConversionMap   *map;
-		Datum	   *values;
-		bool	   *nulls;
+		Const		   *start_const = (Const *) lthird(fcall->args);
+		Const		   *end_const = (Const *) lfourth(fcall->args);
+		TypeCacheEntry *typentry;
 
-		/* Open the history table for inserting */
-		history_rel = table_open(history_id, RowExclusiveLock);
-		history_tupledesc = RelationGetDescr(history_rel);
-		history_end_num = SPI_fnumber(history_tupledesc, end_name);
+		if (!IsA(start_const, Const) || start_const->constisnull ||
+			!IsA(end_const, Const) || end_const->constisnull)
+			PG_RETURN_POINTER(NULL);
 
-		/*
-		 * We may have to convert the tuple structure between the table and the
-		 * history table.
-		 *
-		 * See https://github.com/xocolatl/periods/issues/5
-		 */
-#if (PG_VERSION_NUM < 130000)
-		map = convert_tuples_by_name(tupledesc, history_tupledesc, gettext_noop("could not convert row type"));
+		typentry = lookup_type_cache(start_const->consttype, TYPECACHE_CMP_PROC_FINFO);
+		if (!OidIsValid(typentry->cmp_proc_finfo.fn_oid))
+			PG_RETURN_POINTER(NULL);
+
+		if (DatumGetInt32(FunctionCall2Coll(&typentry->cmp_proc_finfo,
+											fcall->inputcollid,
+											start_const->constvalue,
+											end_const->constvalue)) >= 0)
+			PG_RETURN_POINTER(NULL);
+	}
+
+	range = GetPeriodRangeIndexExpr(rte->relid, start_var->varattno, end_var->varattno);
+	if (range == NULL)
+		PG_RETURN_POINTER(NULL);
+
+	if (!IsPeriodColumns(rte->relid, start_var->varattno, end_var->varattno))
+		PG_RETURN_POINTER(NULL);
+
+	/* Make the index expression about our table, and the other period like it */
+	if (list_length(fcall->args) == 4)
+	{
+		FuncExpr   *other_range = copyObject(range);
+
+		linitial(other_range->args) = copyObject(lthird(fcall->args));
+		lsecond(other_range->args) = copyObject(lfourth(fcall->args));
+		other = (Node *) other_range;
+	}
+	else
+		other = copyObject(lthird(fcall->args));
+
+	linitial(range->args) = copyObject(start_var);
+	lsecond(range->args) = copyObject(end_var);
+
+	opno = OpernameGetOprid(list_make2(makeString("pg_catalog"), makeString((char *) opname)),
+							ANYRANGEOID,
+							list_length(fcall->args) == 4 ? ANYRANGEOID : ANYELEMENTOID);
+	if (!OidIsValid(opno))
+		PG_RETURN_POINTER(NULL);
+
+	opclause = make_opclause(opno, BOOLOID, false, (Expr *) range, (Expr *) other,
+							 InvalidOid, InvalidOid);
+	set_opfuncid((OpExpr *) opclause);
+
+	/*
+	 * The range constructors aren't strict: a null bound makes the range
+	 * unbounded on that side instead of making it null.  The comparisons we
+	 * replace are strict, and the planner relies on that to reduce outer joins,
+	 * so we require both columns to be present, which it also understands.
+	 */
+	result = make_andclause(list_make3(MakeNotNullTest(start_var),
+									   MakeNotNullTest(end_var),
+									   opclause));
+
+	/* Our result is not simplified any further, so fold the other range now */
+	PG_RETURN_POINTER(eval_const_expressions(req->root, (Node *) result));
 #else
-		map = convert_tuples_by_name(tupledesc, history_tupledesc);
+	PG_RETURN_POINTER(NULL);
+#endif
+}
+
+/*
+ * Invalidate the relcache entry of the table named in a row of one of our
+ * catalogs.  The table might already be gone if we're being called because it
+ * was dropped, in which case it has been invalidated already.
+ */
+static void
+InvalidateCatalogRow(Relation rel, HeapTuple tuple)
+{
+	TupleDesc	tupdesc = RelationGetDescr(rel);
+	int			attnum;
+	Datum		dat;
+	bool		is_null;
+	Oid			relid;
+
+	attnum = SPI_fnumber(tupdesc, "table_name");
+	if (attnum <= 0)
+		elog(ERROR, "column \"table_name\" not found on table \"%s\"",
+			 RelationGetRelationName(rel));
+
+	dat = heap_getattr(tuple, attnum, tupdesc, &is_null);
+	if (is_null)
+		return;
+
+	relid = DatumGetObjectId(dat);
+	if (SearchSysCacheExists1(RELOID, ObjectIdGetDatum(relid)))
+		CacheInvalidateRelcacheByRelid(relid);
+}
+
+/*
+ * Our catalogs have this trigger on them so that the caches kept by the other
+ * triggers in this file, in this backend and all the others, get rebuilt when
+ * something changes.  Going through the relcache means the invalidation is
+ * only sent to other backends when the transaction commits.
+ */
+Datum
+invalidate_cache(PG_FUNCTION_ARGS)
+{
+	TriggerData	   *trigdata = castNode(TriggerData, fcinfo->context);
+	const char	   *funcname = "invalidate_cache";
+	Relation		rel;
+
+	/*
+	 * Make sure this is being called as an AFTER ROW trigger.  Note:
+	 * translatable error strings are shared with ri_triggers.c, so resist the
+	 * temptation to fold the function name into them.
+	 */
+	if (!CALLED_AS_TRIGGER(fcinfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+				 errmsg("function \"%s\" was not called by trigger manager",
+						funcname)));
+
+	if (!TRIGGER_FIRED_AFTER(trigdata->tg_event) ||
+		!TRIGGER_FIRED_FOR_ROW(trigdata->tg_event))
+		ereport(ERROR,
+				(errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+				 errmsg("function \"%s\" must be fired AFTER ROW",
+						funcname)));
+
+	rel = trigdata->tg_relation;
+
+	InvalidateCatalogRow(rel, trigdata->tg_trigtuple);
+	if (TRIGGER_FIRED_BY_UPDATE(trigdata->tg_event))
+		InvalidateCatalogRow(rel, trigdata->tg_newtuple);
+
+	return PointerGetDatum(NULL);
+}
+
+/*
+ * periods._object_relation(classid, objid) returns the table that an object
+ * reported by an event trigger belongs to: the table or view itself, the
+ * table of an index, or the table of a trigger or constraint.  Anything else
+ * gives null.  This lets the event triggers tell cheaply whether a command
+ * touched any of our tables before they look through our catalogs.
+ */
+Datum
+object_relation(PG_FUNCTION_ARGS)
+{
+	Oid		classid = PG_GETARG_OID(0);
+	Oid		objid = PG_GETARG_OID(1);
+	Oid		result = InvalidOid;
+
+	if (classid == RelationRelationId)
+	{
+		char	relkind = get_rel_relkind(objid);
+
+		if (relkind == RELKIND_INDEX
+#if (PG_VERSION_NUM >= 110000)
+			|| relkind == RELKIND_PARTITIONED_INDEX
 #endif
-		if (map != NULL)
+			)
+			result = IndexGetRelation(objid, true);
+		else if (relkind != '\0')
+			result = objid;
+	}
+	else if (classid == ConstraintRelationId)
+	{
+		HeapTuple	tuple;
+
+		tuple = SearchSysCache1(CONSTROID, ObjectIdGetDatum(objid));
+		if (HeapTupleIsValid(tuple))
 		{
-#if (PG_VERSION_NUM < 120000)
-			history_tuple = do_convert_tuple(old_row, map);
+			result = ((Form_pg_constraint) GETSTRUCT(tuple))->conrelid;
+			ReleaseSysCache(tuple);
+		}
+	}
+	else if (classid == TriggerRelationId)
+	{
+		Relation	rel;
+		HeapTuple	tuple;
+
+		/* There is no syscache for triggers by oid */
+		rel = table_open(TriggerRelationId, AccessShareLock);
+#if (PG_VERSION_NUM >= 120000)
+		tuple = get_catalog_object_by_oid(rel, Anum_pg_trigger_oid, objid);
 #else
-			history_tuple = execute_attr_map_tuple(old_row, map);
+		tuple = get_catalog_object_by_oid(rel, objid);
 #endif
-			free_conversion_map(map);
-		}
-		else
+		if (HeapTupleIsValid(tuple))
+			result = ((Form_pg_trigger) GETSTRUCT(tuple))->tgrelid;
+		table_close(rel, AccessShareLock);
+	}
+
+	if (!OidIsValid(result))
+		PG_RETURN_NULL();
+
+	PG_RETURN_OID(result);
+}
+
+/*
+ * Shared memory for the statistics kept by the triggers, see the top of this
+ * file.
+ */
+#if (PG_VERSION_NUM >= 150000)
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+static Size
+PeriodsStatShmemSize(void)
+{
+	return add_size(MAXALIGN(sizeof(PeriodsStatState)),
+					hash_estimate_size(periods_stat_max, sizeof(PeriodsStatEntry)));
+}
+
+static void
+periods_shmem_request(void)
+{
+#if (PG_VERSION_NUM >= 150000)
+	if (prev_shmem_request_hook)
+		prev_shmem_request_hook();
+#endif
+
+	RequestAddinShmemSpace(PeriodsStatShmemSize());
+#if (PG_VERSION_NUM >= 90600)
+	RequestNamedLWLockTranche("periods", 1);
+#else
+	RequestAddinLWLocks(1);
+#endif
+}
+
+static void
+periods_shmem_startup(void)
+{
+	HASHCTL		ctl;
+	bool		found;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	PeriodsStatShared = ShmemInitStruct("periods", sizeof(PeriodsStatState), &found);
+	if (!found)
+	{
+#if (PG_VERSION_NUM >= 90600)
+		PeriodsStatShared->lock = &(GetNamedLWLockTranche("periods"))->lock;
+#else
+		PeriodsStatShared->lock = LWLockAssign();
+#endif
+	}
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(PeriodsStatKey);
+	ctl.entrysize = sizeof(PeriodsStatEntry);
+	PeriodsStatHash = ShmemInitHash("periods stat hash",
+									periods_stat_max, periods_stat_max,
+									&ctl, HASH_ELEM | HASH_BLOBS);
+
+	LWLockRelease(AddinShmemInitLock);
+}
+
+void
+_PG_init(void)
+{
+	/* Statistics are only kept if we can have shared memory */
+	if (!process_shared_preload_libraries_in_progress)
+		return;
+
+	DefineCustomIntVariable("periods.stat_max",
+							"Sets the maximum number of tables tracked in periods.stat_tables.",
+							NULL,
+							&periods_stat_max,
+							1000,
+							100,
+							INT_MAX / 2,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+#if (PG_VERSION_NUM >= 150000)
+	MarkGUCPrefixReserved("periods");
+
+	prev_shmem_request_hook = shmem_request_hook;
+	shmem_request_hook = periods_shmem_request;
+#else
+	EmitWarningsOnPlaceholders("periods");
+
+	periods_shmem_request();
+#endif
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = periods_shmem_startup;
+}
+
+static void
+CheckPeriodsStatAvailable(void)
+{
+	if (PeriodsStatHash == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("periods must be loaded via \"shared_preload_libraries\" to keep statistics")));
+}
+
+/*
+ * The statistics of the tables of the current database, for the
+ * periods.stat_tables view.  What this backend has counted in the current
+ * transaction is not included.
+ */
+Datum
+stat_tables(PG_FUNCTION_ARGS)
+{
+	TupleDesc			tupdesc;
+	Tuplestorestate	   *tupstore;
+	HASH_SEQ_STATUS		status;
+	PeriodsStatEntry   *entry;
+
+	CheckPeriodsStatAvailable();
+
+	tupstore = begin_materialized_srf(fcinfo, &tupdesc);
+
+	LWLockAcquire(PeriodsStatShared->lock, LW_SHARED);
+
+	hash_seq_init(&status, PeriodsStatHash);
+	while ((entry = (PeriodsStatEntry *) hash_seq_search(&status)) != NULL)
+	{
+		Datum				values[1 + PERIODS_STAT_NCOUNTERS + 2 * PERIODS_STAT_NTIMERS];
+		bool				nulls[1 + PERIODS_STAT_NCOUNTERS + 2 * PERIODS_STAT_NTIMERS];
+		PeriodsStatCounts	counts;
+		int					i, n = 0;
+
+		if (entry->key.dbid != MyDatabaseId)
+			continue;
+
+		SpinLockAcquire(&entry->mutex);
+		counts = entry->counts;
+		SpinLockRelease(&entry->mutex);
+
+		memset(nulls, 0, sizeof(nulls));
+		values[n++] = ObjectIdGetDatum(entry->key.relid);
+		for (i = 0; i < PERIODS_STAT_NCOUNTERS; i++)
+			values[n++] = Int64GetDatum(counts.counters[i]);
+		for (i = 0; i < PERIODS_STAT_NTIMERS; i++)
 		{
-			history_tuple = old_row;
-
-			/*
-			 * Use the main table's tupledesc if there is no map so that
-			 * missing attributes are filled in.  This corrects for bug #16242
-			 * which was found by this very problem.
-			 */
-			history_tupledesc = tupledesc;
+			values[n++] = Int64GetDatum(counts.calls[i]);
+			values[n++] = Float8GetDatum(counts.time[i]);
 		}
 
-		/* Build the new tuple for the history table */
-		values = (Datum *) palloc(history_tupledesc->natts * sizeof(Datum));
-		nulls = (bool *) palloc(history_tupledesc->natts * sizeof(bool));
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	LWLockRelease(PeriodsStatShared->lock);
+
+	return (Datum) 0;
+}
+
+/*
+ * Forget the statistics of a table of the current database, or of all the
+ * tables of all databases if none is given.
+ */
+Datum
+stat_tables_reset(PG_FUNCTION_ARGS)
+{
+	HASH_SEQ_STATUS		status;
+	PeriodsStatEntry   *entry;
 
-		/* Modify the historical ROW END on the fly */
-		heap_deform_tuple(history_tuple, history_tupledesc, values, nulls);
-		values[history_end_num-1] = GetRowStart(typeid);
-		nulls[history_end_num-1] = false;
-		history_tuple = heap_form_tuple(history_tupledesc, values, nulls);
+	CheckPeriodsStatAvailable();
 
-		pfree(values);
-		pfree(nulls);
+	LWLockAcquire(PeriodsStatShared->lock, LW_EXCLUSIVE);
 
-		/* INSERT the row */
-		insert_into_history(history_rel, history_tuple);
+	if (PG_ARGISNULL(0))
+	{
+		hash_seq_init(&status, PeriodsStatHash);
+		while ((entry = (PeriodsStatEntry *) hash_seq_search(&status)) != NULL)
+			hash_search(PeriodsStatHash, &entry->key, HASH_REMOVE, NULL);
+	}
+	else
+	{
+		PeriodsStatKey	key;
 
-		/* Keep the lock until end of transaction */
-		table_close(history_rel, NoLock);
+		key.dbid = MyDatabaseId;
+		key.relid = PG_GETARG_OID(0);
+		hash_search(PeriodsStatHash, &key, HASH_REMOVE, NULL);
 	}
 
-	return PointerGetDatum(NULL);
+	LWLockRelease(PeriodsStatShared->lock);
+
+	PG_RETURN_VOID();
 }
@@ -0,0 +1,32 @@
+# A transaction that started after ours can archive rows and commit before
+# our next statement.  Asking for the present must still find the version we
+# can see, which is now in the history table.
+
+setup
+{
+    SET client_min_messages TO warning;
+    CREATE EXTENSION IF NOT EXISTS btree_gist;
+    CREATE EXTENSION IF NOT EXISTS periods;
+    CREATE TABLE iso (id integer PRIMARY KEY, val text);
+    SELECT periods.add_system_time_period('iso');
+    SELECT periods.add_system_versioning('iso');
+    INSERT INTO iso (id, val) VALUES (1, 'before');
+}
+
+teardown
+{
+    SELECT periods.drop_system_versioning('iso', drop_behavior => 'CASCADE', purge => true);
+    DROP TABLE iso;
+    DROP EXTENSION periods;
+}
+
+session s1
+setup       { BEGIN ISOLATION LEVEL READ COMMITTED; }
+step s1_start   { SELECT val FROM iso; }
+step s1_as_of   { SELECT val FROM iso__as_of(now()); }
+step s1_commit  { COMMIT; }
+
+session s2
+step s2_update  { UPDATE iso SET val = 'after'; }
+
+permutation s1_start s2_update s1_as_of s1_commit
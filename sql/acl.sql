@@ -217,6 +217,17 @@ DELETE FROM retention_history;
 SELECT periods.add_system_versioning('retention');
 COMMIT;
 
+-- the owner can purge the history without suspending SYSTEM VERSIONING
+UPDATE retention SET value = 3;
+UPDATE retention SET value = 4;
+SET ROLE TO periods_acl_3;
+SELECT periods.purge_history('retention', 'infinity'); -- fail
+SET ROLE TO periods_acl_2;
+SELECT periods.purge_history('retention', 'infinity'); -- fail
+SET ROLE TO periods_acl_1;
+SELECT periods.purge_history('retention', 'infinity', batch_size => 1);
+SELECT count(*) FROM retention_history;
+
 -- superuser can do anything
 RESET ROLE;
 DELETE FROM retention_history;
@@ -224,6 +235,59 @@ DELETE FROM retention_history;
 SELECT periods.drop_system_versioning('retention', drop_behavior => 'CASCADE', purge => true);
 DROP TABLE retention CASCADE;
 
+-- the owner can also merge the versions that didn't change anything
+CREATE TABLE coalescing (id integer PRIMARY KEY, value integer);
+ALTER TABLE coalescing OWNER TO periods_acl_1;
+GRANT ALL ON TABLE coalescing TO periods_acl_2;
+SELECT periods.add_system_time_period('coalescing');
+SELECT periods.add_system_versioning('coalescing');
+
+INSERT INTO coalescing (id, value) VALUES (1, 1);
+UPDATE coalescing SET value = 1;
+UPDATE coalescing SET value = 1;
+UPDATE coalescing SET value = 2;
+
+SET ROLE TO periods_acl_2;
+SELECT periods.coalesce_history('coalescing', 'infinity'); -- fail
+SET ROLE TO periods_acl_1;
+SELECT periods.coalesce_history('coalescing', 'infinity', batch_size => 1);
+SELECT h.value, h.system_time_end = c.system_time_start AS ends_at_current
+FROM coalescing_history AS h, coalescing AS c;
+RESET ROLE;
+
+SELECT periods.drop_system_versioning('coalescing', drop_behavior => 'CASCADE', purge => true);
+DROP TABLE coalescing CASCADE;
+
+-- and rewrite the history in the order of SYSTEM_TIME, keeping everything else
+CREATE TABLE compacting (id integer PRIMARY KEY, value integer);
+ALTER TABLE compacting OWNER TO periods_acl_1;
+GRANT ALL ON TABLE compacting TO periods_acl_2;
+SELECT periods.add_system_time_period('compacting');
+SELECT periods.add_system_versioning('compacting');
+
+INSERT INTO compacting (id, value) VALUES (2, 1), (1, 1);
+UPDATE compacting SET value = 2;
+UPDATE compacting SET value = 3;
+SELECT h.id, h.value FROM compacting_history AS h ORDER BY h.ctid;
+CREATE TEMPORARY TABLE compacting_before AS
+    SELECT c.oid, c.relowner, c.relacl FROM pg_class AS c WHERE c.relname = 'compacting_history';
+
+SET ROLE TO periods_acl_2;
+CALL periods.compact_history('compacting'); -- fail
+SET ROLE TO periods_acl_1;
+CALL periods.compact_history('compacting');
+RESET ROLE;
+SELECT h.id, h.value FROM compacting_history AS h ORDER BY h.ctid;
+SELECT c.oid = b.oid AS same_table,
+       c.relowner = b.relowner AS same_owner,
+       c.relacl::text IS NOT DISTINCT FROM b.relacl::text AS same_privileges,
+       EXISTS (SELECT FROM periods.system_versioning AS sv WHERE sv.history_table_name = c.oid) AS registered
+FROM pg_class AS c, compacting_before AS b
+WHERE c.relname = 'compacting_history';
+
+SELECT periods.drop_system_versioning('compacting', drop_behavior => 'CASCADE', purge => true);
+DROP TABLE compacting CASCADE;
+
 /* Clean up */
 
 DROP ROLE periods_acl_1;
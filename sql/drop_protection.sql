@@ -65,6 +65,7 @@ DROP FUNCTION dp__as_of(timestamp with time zone);
 DROP FUNCTION dp__between(timestamp with time zone,timestamp with time zone);
 DROP FUNCTION dp__between_symmetric(timestamp with time zone,timestamp with time zone);
 DROP FUNCTION dp__from_to(timestamp with time zone,timestamp with time zone);
+DROP FUNCTION dp__as_of_series(timestamp with time zone[]);
 SELECT periods.drop_system_versioning('dp', purge => true);
 
 DROP TABLE dp;
@@ -51,5 +51,20 @@ UPDATE excl SET flop = 'flop';
 SELECT value, null_value, flap, flop FROM excl;
 SELECT value, null_value, flap, flop FROM excl_history ORDER BY system_time_start;
 
+/* Changing them again must be noticed right away */
+SELECT periods.set_system_time_period_excluded_columns('excl', ARRAY['flap']);
+UPDATE excl SET flop = 'flip';
+SELECT value, null_value, flap, flop FROM excl_history ORDER BY system_time_start;
+
+/* Updates that don't change anything can be left out of the history */
+SELECT periods.set_system_time_period_excluded_columns('excl', '{}', skip_unchanged => true);
+SELECT system_time_start AS before_noop FROM excl \gset
+UPDATE excl SET value = value, flap = flap;
+SELECT system_time_start = :'before_noop' AS unchanged FROM excl;
+SELECT value, null_value, flap, flop FROM excl_history ORDER BY system_time_start;
+UPDATE excl SET flap = 'off';
+SELECT system_time_start = :'before_noop' AS unchanged FROM excl;
+SELECT value, null_value, flap, flop FROM excl_history ORDER BY system_time_start;
+
 SELECT periods.drop_system_versioning('excl', drop_behavior => 'CASCADE', purge => true);
 DROP TABLE excl;
@@ -44,6 +44,11 @@ TABLE pricing ORDER BY min_quantity;
 -- UPDATE portion of multiple rows
 UPDATE pricing__for_portion_of_quantities SET min_quantity = 5, max_quantity = 15, price = 90;
 TABLE pricing ORDER BY min_quantity;
+-- UPDATE different columns of single rows, including to NULL
+UPDATE pricing__for_portion_of_quantities SET min_quantity = 12, max_quantity = 18, product = 'Bauble' WHERE id2 = 1;
+UPDATE pricing__for_portion_of_quantities SET min_quantity = 16, max_quantity = 18, price = 85 WHERE id2 = 4;
+UPDATE pricing__for_portion_of_quantities SET product = NULL WHERE id2 = 2;
+TABLE pricing ORDER BY min_quantity;
 -- If we drop the period (without CASCADE) then the FOR PORTION views should be
 -- dropped, too.
 SELECT periods.drop_period('pricing', 'quantities');
@@ -87,3 +92,21 @@ TABLE bt ORDER BY s, e;
 
 SELECT periods.drop_for_portion_view('bt', 'p');
 DROP TABLE bt;
+
+/* The same without a view, and DELETE too */
+CREATE TABLE prices (id integer, product text, s integer, e integer, price numeric,
+                     PRIMARY KEY (id, s));
+SELECT periods.add_period('prices', 'p', 's', 'e');
+SELECT periods.add_unique_key('prices', ARRAY['id'], 'p', key_name => 'prices_id_p');
+INSERT INTO prices (id, product, s, e, price)
+VALUES (1, 'Trinket', 1, 20, 200), (2, 'Bauble', 5, 10, 50), (3, 'Gizmo', 1, 20, 10);
+SELECT periods.update_for_portion_of('prices', 'p', 3, 8, 'price = price + 1', 'product <> ''Gizmo''');
+TABLE prices ORDER BY id, s;
+SELECT periods.delete_for_portion_of('prices', 'p', 15, 30);
+TABLE prices ORDER BY id, s;
+SELECT periods.delete_for_portion_of('prices', 'p', 4, 6, 'id = 1');
+TABLE prices ORDER BY id, s;
+-- the portion is compared as the type of the period, whatever the type of the arguments
+SELECT periods.delete_for_portion_of('prices', 'p', text '9', text '10', 'id = 2');
+TABLE prices ORDER BY id, s;
+DROP TABLE prices;
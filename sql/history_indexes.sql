@@ -0,0 +1,56 @@
+SELECT setting::integer < 90600 AS pre_96
+FROM pg_settings WHERE name = 'server_version_num';
+
+/* Run tests as unprivileged user */
+SET ROLE TO periods_unprivileged_user;
+
+/* History tables can be indexed for the functions */
+
+CREATE TABLE hidx_gist (id integer PRIMARY KEY, value text);
+SELECT periods.add_system_time_period('hidx_gist');
+SELECT periods.add_system_versioning('hidx_gist', index_strategy => 'gist');
+
+CREATE TABLE hidx_brin (id integer PRIMARY KEY, value text);
+SELECT periods.add_system_time_period('hidx_brin');
+SELECT periods.add_system_versioning('hidx_brin', index_strategy => 'brin');
+
+CREATE TABLE hidx_btree (id integer PRIMARY KEY, value text);
+SELECT periods.add_system_time_period('hidx_btree');
+SELECT periods.add_system_versioning('hidx_btree', index_strategy => 'btree');
+
+-- We call this query several times, so make it a view for easier maintenance
+CREATE VIEW show_history_indexes AS
+    SELECT hi.table_name, hi.index_strategy, hi.index_name, am.amname,
+           (SELECT string_agg(pg_catalog.pg_get_indexdef(i.indexrelid, k, true), ', ' ORDER BY k)
+            FROM generate_series(1, i.indnatts) AS k) AS index_columns
+    FROM periods.history_indexes AS hi
+    JOIN pg_index AS i ON i.indexrelid = hi.index_name
+    JOIN pg_class AS c ON c.oid = i.indexrelid
+    JOIN pg_am AS am ON am.oid = c.relam;
+TABLE show_history_indexes ORDER BY table_name::text;
+
+/* The functions compare the range of the period so that the GiST index is used */
+SELECT p.prosrc
+FROM pg_proc AS p
+WHERE p.proname LIKE 'hidx\_gist\_\_%'
+ORDER BY p.proname;
+
+INSERT INTO hidx_gist (id, value) VALUES (1, 'one');
+UPDATE hidx_gist SET value = 'uno';
+SELECT id, value FROM hidx_gist__from_to('-infinity', 'infinity') ORDER BY value;
+SELECT id, value FROM hidx_gist__between_symmetric('infinity', '-infinity') ORDER BY value;
+
+/* The indexes are protected, and found again when SYSTEM VERSIONING is resumed */
+DROP INDEX hidx_brin_history_brin_idx; -- fail
+SELECT periods.drop_system_versioning('hidx_btree');
+TABLE show_history_indexes ORDER BY table_name::text;
+SELECT periods.add_system_versioning('hidx_btree', index_strategy => 'btree');
+TABLE show_history_indexes ORDER BY table_name::text;
+SELECT count(*) FROM pg_index AS i WHERE i.indrelid = 'hidx_btree_history'::regclass;
+
+DROP VIEW show_history_indexes;
+SELECT periods.drop_system_versioning('hidx_gist', drop_behavior => 'CASCADE', purge => true);
+SELECT periods.drop_system_versioning('hidx_brin', drop_behavior => 'CASCADE', purge => true);
+SELECT periods.drop_system_versioning('hidx_btree', drop_behavior => 'CASCADE', purge => true);
+TABLE periods.history_indexes;
+DROP TABLE hidx_gist, hidx_brin, hidx_btree;
@@ -1,7 +1,7 @@
 /* Once support for 9.5 has passed, use CASCADE */
 CREATE EXTENSION IF NOT EXISTS btree_gist;
 /* Once support for 9.6 has passed, just create the extension */
-CREATE EXTENSION periods VERSION '1.2';
+CREATE EXTENSION periods VERSION '1.3';
 
 SELECT extversion
 FROM pg_extension
@@ -0,0 +1,103 @@
+SELECT setting::integer < 110000 AS pre_11
+FROM pg_settings WHERE name = 'server_version_num';
+
+/* Run tests as unprivileged user */
+SET ROLE TO periods_unprivileged_user;
+
+/* History tables partitioned on the end of SYSTEM_TIME */
+
+CREATE TABLE parth (id integer PRIMARY KEY, value text);
+SELECT periods.add_system_time_period('parth');
+SELECT periods.add_system_versioning('parth', partition_interval => '0 days'); -- fail
+SELECT periods.add_system_versioning('parth', partition_interval => '1 year', partition_premake => 2);
+SELECT table_name, partition_interval, premake, partitioned_until > now() + interval '2 years' AS made_ahead
+FROM periods.history_partitioning;
+SELECT c.relname, c.relkind, (SELECT count(*) FROM pg_inherits AS i WHERE i.inhparent = c.oid) AS partitions
+FROM pg_class AS c
+WHERE c.relname = 'parth_history';
+
+/* The old rows go in the partition for when they were archived */
+INSERT INTO parth (id, value) VALUES (1, 'one');
+UPDATE parth SET value = 'uno';
+DELETE FROM parth;
+SELECT h.id, h.value, h.tableoid::regclass::text = 'parth_history_default' AS in_default
+FROM parth_history AS h
+ORDER BY h.system_time_start;
+
+/* Nothing new is needed yet */
+SELECT periods.maintain_history_partitions('parth');
+
+/* Purging drops the partitions that are entirely too old */
+SET client_min_messages TO warning;
+SELECT periods.purge_history('parth', now() + interval '1 year');
+RESET client_min_messages;
+SELECT count(*) AS partitions
+FROM pg_inherits AS i
+JOIN pg_class AS c ON c.oid = i.inhparent
+WHERE c.relname = 'parth_history';
+SELECT count(*) FROM parth_history;
+
+SELECT periods.drop_system_versioning('parth', drop_behavior => 'CASCADE', purge => true);
+TABLE periods.history_partitioning;
+DROP TABLE parth;
+
+/* Only the owner of a table can make the partitions of its history */
+RESET ROLE;
+CREATE TABLE parth_other (id integer PRIMARY KEY);
+SET ROLE TO periods_unprivileged_user;
+SELECT periods.maintain_history_partitions('parth_other'); -- fail
+RESET ROLE;
+DROP TABLE parth_other;
+SET ROLE TO periods_unprivileged_user;
+
+/* Partitions made late take the rows that went into the default partition */
+CREATE TABLE parthl (id integer PRIMARY KEY, value text);
+SELECT periods.add_system_time_period('parthl');
+CREATE TABLE parthl_history (LIKE parthl)
+    PARTITION BY RANGE (system_time_end);
+CREATE TABLE parthl_history_2000
+    PARTITION OF parthl_history
+    FOR VALUES FROM ('2000-01-01') TO ('2001-01-01');
+CREATE TABLE parthl_history_default
+    PARTITION OF parthl_history DEFAULT;
+INSERT INTO parthl_history
+VALUES (1, 'late', '2000-06-01', '2010-01-01'),
+       (2, 'early', '1999-01-01', '1999-06-01');
+SELECT periods.add_system_versioning('parthl', partition_interval => '1 year', partition_premake => 0);
+SELECT h.id, h.value, h.tableoid::regclass::text = 'parthl_history_default' AS in_default
+FROM parthl_history AS h
+ORDER BY h.id;
+SELECT periods.drop_system_versioning('parthl', drop_behavior => 'CASCADE', purge => true);
+DROP TABLE IF EXISTS parthl_history;
+DROP TABLE parthl;
+
+/* Compacting rewrites each partition in the order of the end of SYSTEM_TIME */
+CREATE TABLE parthc (id integer PRIMARY KEY, value text);
+SELECT periods.add_system_time_period('parthc');
+CREATE TABLE parthc_history (LIKE parthc)
+    PARTITION BY RANGE (system_time_end);
+CREATE TABLE parthc_history_2000
+    PARTITION OF parthc_history
+    FOR VALUES FROM ('2000-01-01') TO ('2001-01-01');
+CREATE TABLE parthc_history_2001
+    PARTITION OF parthc_history
+    FOR VALUES FROM ('2001-01-01') TO ('2002-01-01');
+INSERT INTO parthc_history
+VALUES (2, 'b', '1999-01-01', '2000-06-01'),
+       (1, 'b', '1999-01-01', '2000-06-01'),
+       (1, 'a', '1998-01-01', '2000-03-01'),
+       (2, 'd', '2000-06-01', '2001-09-01'),
+       (1, 'c', '2000-06-01', '2001-02-01');
+SELECT periods.add_system_versioning('parthc');
+SELECT h.tableoid::regclass AS partition, h.id, h.value
+FROM parthc_history AS h
+ORDER BY h.tableoid::regclass::text, h.ctid;
+CALL periods.compact_history('parthc');
+SELECT h.tableoid::regclass AS partition, h.id, h.value
+FROM parthc_history AS h
+ORDER BY h.tableoid::regclass::text, h.ctid;
+CALL periods.compact_history('parthc', partition_name => 'parthc_history_2001');
+CALL periods.compact_history('parthc', partition_name => 'parthc'); -- fail
+SELECT periods.drop_system_versioning('parthc', drop_behavior => 'CASCADE', purge => true);
+DROP TABLE IF EXISTS parthc_history;
+DROP TABLE parthc;
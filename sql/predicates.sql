@@ -1,3 +1,7 @@
+SELECT setting::integer < 120000 AS pre_12,
+       setting::integer < 170000 AS pre_17
+FROM pg_settings WHERE name = 'server_version_num';
+
 /* Run tests as unprivileged user */
 SET ROLE TO periods_unprivileged_user;
 
@@ -83,3 +87,53 @@ SELECT * FROM preds WHERE periods.immediately_succeeds(s, e, 125, 175);
 SELECT * FROM preds WHERE periods.immediately_succeeds(s, e, 0, 300);
 
 DROP TABLE preds;
+
+/* With a GiST index on the period, they use it instead (PostgreSQL 12 and later) */
+
+CREATE TABLE preds_uk (id integer, s integer, e integer);
+SELECT periods.add_period('preds_uk', 'p', 's', 'e');
+SELECT periods.add_unique_key('preds_uk', ARRAY['id'], 'p', key_name => 'preds_uk_id_p');
+
+INSERT INTO preds_uk (id, s, e) VALUES (1, 100, 200);
+ANALYZE preds_uk;
+
+EXPLAIN (COSTS OFF) SELECT * FROM preds_uk WHERE periods.contains(s, e, 100);
+EXPLAIN (COSTS OFF) SELECT * FROM preds_uk WHERE periods.contains(s, e, 100, 200);
+EXPLAIN (COSTS OFF) SELECT * FROM preds_uk WHERE periods.equals(s, e, 100, 200);
+EXPLAIN (COSTS OFF) SELECT * FROM preds_uk WHERE periods.overlaps(s, e, 100, 200);
+EXPLAIN (COSTS OFF) SELECT * FROM preds_uk WHERE periods.precedes(s, e, 100, 200);
+EXPLAIN (COSTS OFF) SELECT * FROM preds_uk WHERE periods.succeeds(s, e, 100, 200);
+EXPLAIN (COSTS OFF) SELECT * FROM preds_uk WHERE periods.immediately_precedes(s, e, 100, 200);
+-- an empty or backwards period can't be made into a range
+EXPLAIN (COSTS OFF) SELECT * FROM preds_uk WHERE periods.overlaps(s, e, 200, 100);
+
+SELECT * FROM preds_uk WHERE periods.contains(s, e, 199);
+SELECT * FROM preds_uk WHERE periods.contains(s, e, 200);
+SELECT * FROM preds_uk WHERE periods.overlaps(s, e, 150, 250);
+SELECT * FROM preds_uk WHERE periods.overlaps(s, e, 200, 250);
+SELECT * FROM preds_uk WHERE periods.precedes(s, e, 200, 250);
+SELECT * FROM preds_uk WHERE periods.succeeds(s, e, 0, 100);
+-- the rows an outer join makes up for a missing period are in no period
+SELECT r.id, u.s, u.e FROM (VALUES (1), (2)) AS r (id) LEFT JOIN preds_uk AS u ON u.id = r.id WHERE periods.overlaps(u.s, u.e, 150, 250);
+SELECT r.id, periods.overlaps(u.s, u.e, 150, 250) FROM (VALUES (1), (2)) AS r (id) LEFT JOIN preds_uk AS u ON u.id = r.id ORDER BY r.id;
+
+DROP TABLE preds_uk;
+
+/* Coverage of a period by several periods */
+
+SELECT periods.covers(s, e, 100, 200 ORDER BY s) FROM (VALUES (100, 150), (150, 200)) AS v (s, e);
+SELECT periods.covers(s, e, 100, 200 ORDER BY s) FROM (VALUES (0, 120), (110, 160), (150, 300)) AS v (s, e);
+SELECT periods.covers(s, e, 100, 200 ORDER BY s) FROM (VALUES (100, 150), (160, 200)) AS v (s, e); -- gap
+SELECT periods.covers(s, e, 100, 200 ORDER BY s) FROM (VALUES (110, 200)) AS v (s, e); -- starts late
+SELECT periods.covers(s, e, 100, 200 ORDER BY s) FROM (VALUES (100, 190)) AS v (s, e); -- ends early
+SELECT periods.covers(s, e, 100, 200 ORDER BY s) FROM (VALUES (0, 50), (50, 100), (100, 200)) AS v (s, e);
+SELECT periods.covers(s, e, 100, 200 ORDER BY s) FROM (VALUES (100, 150), (NULL, 160), (150, 200)) AS v (s, e);
+SELECT periods.covers(s, e, 100, 200 ORDER BY s) FROM (VALUES (100, 200)) AS v (s, e) WHERE false; -- no rows
+SELECT periods.covers(s, e, 100, NULL ORDER BY s) FROM (VALUES (100, 200)) AS v (s, e); -- fails
+
+/* Merging periods that overlap or meet */
+
+SELECT * FROM periods.normalize(ARRAY[300, 100, 150, 500, 400, 10], ARRAY[400, 160, 200, 600, 450, 10]);
+SELECT * FROM periods.normalize(ARRAY[date '2000-01-01', '1999-01-01', NULL], ARRAY[date '2001-01-01', '2000-06-01', '2000-01-01']);
+SELECT * FROM periods.normalize('{}'::integer[], '{}'::integer[]);
+SELECT * FROM periods.normalize(ARRAY[1, 2], ARRAY[3]); -- fails
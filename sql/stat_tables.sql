@@ -0,0 +1,11 @@
+/*
+ * The statistics are only kept when the library is in
+ * shared_preload_libraries, which is not the case for these tests.
+ */
+SELECT * FROM periods.stat_tables;
+SELECT periods.stat_tables_reset();
+
+/* Only superusers can reset them */
+SET ROLE TO periods_unprivileged_user;
+SELECT periods.stat_tables_reset();
+RESET ROLE;
@@ -0,0 +1,32 @@
+SELECT setting::integer < 100000 AS pre_10
+FROM pg_settings WHERE name = 'server_version_num';
+
+/* Run tests as unprivileged user */
+SET ROLE TO periods_unprivileged_user;
+
+/* Foreign keys checked once per statement */
+
+CREATE TABLE uk (id integer, s integer, e integer, CONSTRAINT uk_pkey PRIMARY KEY (id, s, e));
+SELECT periods.add_period('uk', 'p', 's', 'e');
+SELECT periods.add_unique_key('uk', ARRAY['id'], 'p', key_name => 'uk_id_p', unique_constraint => 'uk_pkey');
+INSERT INTO uk (id, s, e) VALUES (100, 1, 3), (100, 3, 4), (100, 4, 10);
+INSERT INTO uk (id, s, e) VALUES (200, 1, 3), (200, 3, 4), (200, 5, 10);
+
+CREATE TABLE fk (id integer PRIMARY KEY, uk_id integer, s integer, e integer);
+SELECT periods.add_period('fk', 'q', 's', 'e');
+SELECT periods.add_foreign_key('fk', ARRAY['uk_id'], 'q', 'uk_id_p', key_name => 'fk_uk_id_q', statement_level => true);
+SELECT key_name, fk_insert_trigger, fk_update_trigger FROM periods.foreign_keys;
+
+-- INSERT
+INSERT INTO fk (id, uk_id, s, e) SELECT g, 100, 1 + g % 8, 2 + g % 8 FROM generate_series(1, 1000) AS g; -- success
+INSERT INTO fk (id, uk_id, s, e) VALUES (1001, 100, 2, 5), (1002, 200, 2, 6), (1003, 100, 5, 7); -- fail
+INSERT INTO fk (id, uk_id, s, e) VALUES (1001, NULL, 2, 5); -- success
+SELECT count(*) FROM fk;
+-- UPDATE
+UPDATE fk SET e = 20 WHERE id = 1; -- fail
+UPDATE fk SET s = 1 WHERE id <= 10; -- success
+-- The referenced side is checked the same way as before
+DELETE FROM uk WHERE (id, s, e) = (100, 3, 4); -- fail
+
+DROP TABLE fk;
+DROP TABLE uk;
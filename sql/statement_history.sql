@@ -0,0 +1,43 @@
+SELECT setting::integer < 100000 AS pre_10
+FROM pg_settings WHERE name = 'server_version_num';
+
+/* Run tests as unprivileged user */
+SET ROLE TO periods_unprivileged_user;
+
+/* SYSTEM VERSIONING with the history written once per statement */
+
+CREATE TABLE stmt (id integer PRIMARY KEY, val text, flap boolean);
+SELECT periods.add_system_time_period('stmt', excluded_column_names => ARRAY['flap']);
+CREATE TABLE stmt_history (LIKE stmt);
+SELECT periods.add_system_versioning('stmt', statement_level => true);
+SELECT table_name, history_update_trigger, history_delete_trigger FROM periods.system_versioning;
+
+/* Enough rows to need more than one batch */
+INSERT INTO stmt (id, val, flap) SELECT g, 'hello', false FROM generate_series(1, 1500) AS g;
+UPDATE stmt SET val = 'world' WHERE id <= 1200;
+SELECT val, count(*) FROM stmt_history GROUP BY val ORDER BY val;
+
+/* Only excluded columns changed, so no history */
+UPDATE stmt SET flap = true;
+SELECT val, count(*) FROM stmt_history GROUP BY val ORDER BY val;
+
+DELETE FROM stmt WHERE id > 1000;
+SELECT val, count(*) FROM stmt_history GROUP BY val ORDER BY val;
+
+/* Rows created in the same transaction don't go to the history */
+BEGIN;
+INSERT INTO stmt (id, val) VALUES (2000, 'hello');
+UPDATE stmt SET val = 'world' WHERE id = 2000;
+DELETE FROM stmt WHERE id = 2000;
+COMMIT;
+SELECT count(*) FROM stmt_history;
+
+/* The triggers are protected and followed */
+DROP TRIGGER stmt_system_time_write_history_update ON stmt; -- fails
+ALTER TRIGGER stmt_system_time_write_history_delete ON stmt RENAME TO stmt_history_delete;
+SELECT table_name, history_update_trigger, history_delete_trigger FROM periods.system_versioning;
+
+SELECT periods.drop_system_versioning('stmt');
+SELECT tgname FROM pg_trigger WHERE tgrelid = 'stmt'::regclass ORDER BY tgname;
+DROP TABLE stmt;
+DROP TABLE stmt_history;
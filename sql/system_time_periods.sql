@@ -26,6 +26,12 @@ SELECT periods.add_system_time_period('sysver_ts', 'start_ts', 'end_ts');
 TABLE periods.periods;
 INSERT INTO sysver_ts DEFAULT VALUES;
 SELECT val, start_ts = :'xts' AS start_ts_eq, end_ts FROM sysver_ts;
+
+/* The ROW START follows a change of time zone in the middle of a transaction */
+SET LOCAL TimeZone = 'UTC';
+INSERT INTO sysver_ts (val) VALUES ('utc');
+SELECT val, start_ts = transaction_timestamp()::timestamp AS start_ts_eq FROM sysver_ts WHERE val = 'utc';
+RESET TimeZone;
 DROP TABLE sysver_ts;
 
 /* SYSTEM_TIME with timestamp with time zone */
@@ -92,3 +98,25 @@ SELECT periods.add_foreign_key('no_unique_ref', ARRAY['system_time_start'], 'q',
 SELECT periods.add_foreign_key('no_unique_ref', ARRAY['system_time_end'], 'q', 'no_unique_col1_p'); -- passes
 SELECT periods.add_system_time_period('no_unique_ref'); -- fails
 DROP TABLE no_unique, no_unique_ref;
+
+/* Loading a table without the row triggers */
+
+CREATE TABLE sysver_load (id integer, val text);
+SELECT periods.add_system_time_period('sysver_load');
+BEGIN;
+SELECT periods.load_versioned('sysver_load', $$SELECT g, 'row ' || g FROM generate_series(1, 3) AS g$$);
+SELECT periods.load_versioned('sysver_load', $$VALUES ('just a value')$$, ARRAY['val']);
+SELECT id, val, system_time_start = transaction_timestamp() AS start_eq, system_time_end FROM sysver_load ORDER BY id, val;
+COMMIT;
+SELECT t.tgname, t.tgenabled FROM pg_trigger AS t WHERE t.tgrelid = 'sysver_load'::regclass ORDER BY t.tgname;
+SELECT periods.load_versioned('sysver_load', 'SELECT 1, 2', ARRAY['val', 'system_time_end']); -- fails
+DROP TABLE sysver_load;
+
+/* By default, the columns the database fills in are not loaded */
+CREATE TABLE sysver_load_gen (id serial PRIMARY KEY, val text);
+SELECT periods.add_system_time_period('sysver_load_gen');
+SELECT periods.add_system_versioning('sysver_load_gen');
+SELECT periods.load_versioned('sysver_load_gen', $$VALUES ('one'), ('two')$$);
+SELECT id, val FROM sysver_load_gen ORDER BY id;
+SELECT periods.drop_system_versioning('sysver_load_gen', drop_behavior => 'CASCADE', purge => true);
+DROP TABLE sysver_load_gen;
@@ -69,6 +69,10 @@ SELECT val FROM sysver__between(:'ts2', :'ts1') ORDER BY system_time_start;
 SELECT val FROM sysver__between_symmetric(:'ts1', :'ts2') ORDER BY system_time_start;
 SELECT val FROM sysver__between_symmetric(:'ts2', :'ts1') ORDER BY system_time_start;
 
+SELECT instant = :'ts1' AS at_ts1, (version).val
+FROM sysver__as_of_series(ARRAY[:'ts2', :'ts1', :'ts2', NULL]::timestamp with time zone[])
+ORDER BY instant;
+
 /* Ensure functions are inlined */
 
 SET TimeZone = 'UTC';
@@ -99,6 +103,45 @@ DELETE FROM sysver;
 COMMIT;
 SELECT val FROM sysver_with_history; --empty
 
+/* History written from subtransactions */
+INSERT INTO sysver (val) VALUES ('hello');
+BEGIN;
+SAVEPOINT s1;
+UPDATE sysver SET val = 'rolled back';
+ROLLBACK TO SAVEPOINT s1;
+SAVEPOINT s2;
+UPDATE sysver SET val = 'world';
+RELEASE SAVEPOINT s2;
+COMMIT;
+DO $$
+BEGIN
+    UPDATE sysver SET val = 'again';
+EXCEPTION WHEN OTHERS THEN
+    RAISE;
+END;
+$$;
+SELECT val FROM sysver_with_history ORDER BY system_time_start;
+TRUNCATE sysver;
+
+/* Changes between two times */
+CREATE TABLE sysver_changes (id integer PRIMARY KEY, val text);
+SELECT periods.add_system_time_period('sysver_changes');
+SELECT periods.add_system_versioning('sysver_changes');
+SELECT transaction_timestamp() AS tc1 \gset
+INSERT INTO sysver_changes (id, val) VALUES (1, 'a'), (2, 'b');
+UPDATE sysver_changes SET val = 'c' WHERE id = 1;
+DELETE FROM sysver_changes WHERE id = 2;
+SELECT transaction_timestamp() AS tc2 \gset
+SELECT change_type, key, old_row->>'val' AS old_val, new_row->>'val' AS new_val
+FROM periods.changes_between('sysver_changes', :'tc1', :'tc2');
+SELECT change_time AS page_time, key AS page_key
+FROM periods.changes_between('sysver_changes', :'tc1', :'tc2', max_rows => 2)
+OFFSET 1 \gset
+SELECT change_type, key
+FROM periods.changes_between('sysver_changes', :'tc1', :'tc2', after_time => :'page_time', after_key => :'page_key');
+SELECT periods.drop_system_versioning('sysver_changes', purge => true);
+DROP TABLE sysver_changes;
+
 -- We can't drop the the table without first dropping SYSTEM VERSIONING because
 -- Postgres will complain about dependant objects (our view functions) before
 -- we get a chance to clean them up.
@@ -38,9 +38,44 @@ UPDATE fk SET e = 20 WHERE id = 1; -- fail
 UPDATE fk SET e = 6 WHERE id = 1; -- success
 UPDATE uk SET s = 2 WHERE (id, s, e) = (100, 1, 3); -- fail
 UPDATE uk SET s = 0 WHERE (id, s, e) = (100, 1, 3); -- success
+-- only the part of the period that an update takes away is checked
+UPDATE uk SET e = 20 WHERE (id, s, e) = (100, 4, 10); -- success
+UPDATE uk SET e = 10 WHERE (id, s, e) = (100, 4, 20); -- success
+UPDATE uk SET e = 9 WHERE (id, s, e) = (100, 4, 10); -- fail
 -- DELETE
 DELETE FROM uk WHERE (id, s, e) = (100, 3, 4); -- fail
 DELETE FROM uk WHERE (id, s, e) = (200, 3, 5); -- success
+-- a referencing row that only partly overlaps the deleted period depends on it
+INSERT INTO fk VALUES (3, 200, 2, 4); -- success
+DELETE FROM uk WHERE (id, s, e) = (200, 1, 3); -- fail
+DELETE FROM fk WHERE id = 3;
+
+-- The key columns can have the same names on both sides
+CREATE TABLE fk2 (id integer, s integer, e integer);
+SELECT periods.add_period('fk2', 'q', 's', 'e');
+SELECT periods.add_foreign_key('fk2', ARRAY['id'], 'q', 'uk_id_p', key_name => 'fk2_id_q');
+INSERT INTO fk2 VALUES (200, 1, 4); -- success
+INSERT INTO fk2 VALUES (300, 1, 4); -- fail
+INSERT INTO fk2 VALUES (200, 4, 6); -- fail
+DROP TABLE fk2;
+
+-- Foreign keys can be added without checking the existing rows, which can then
+-- be validated in chunks
+CREATE TABLE fk3 (id integer, s integer, e integer);
+SELECT periods.add_period('fk3', 'q', 's', 'e');
+INSERT INTO fk3 VALUES (100, 0, 2), (100, 1, 10), (200, 1, 4), (200, 6, 8), (300, 1, 4), (NULL, 0, 20);
+SELECT periods.add_foreign_key('fk3', ARRAY['id'], 'q', 'uk_id_p', key_name => 'fk3_id_q', not_valid => true);
+TABLE periods.foreign_key_validations;
+INSERT INTO fk3 VALUES (300, 2, 3); -- fail
+SELECT periods.validate_foreign_key('fk3_id_q', chunk_size => 2, max_chunks => 1);
+TABLE periods.foreign_key_validations;
+SELECT periods.validate_foreign_key('fk3_id_q', chunk_size => 2); -- fail
+TABLE periods.foreign_key_validations;
+DELETE FROM fk3 WHERE id = 300;
+SELECT periods.validate_foreign_key('fk3_id_q', chunk_size => 2);
+TABLE periods.foreign_key_validations;
+SELECT periods.validate_foreign_key('fk3_id_q');
+DROP TABLE fk3;
 
 DROP TABLE fk;
 DROP TABLE uk;